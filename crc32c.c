@@ -0,0 +1,245 @@
+/*******************************************************************************
+* xmount Copyright (c) 2008-2012 by Gillen Daniel <gillen.dan@pinguin.lu>      *
+*                                                                              *
+* xmount is a small tool to "fuse mount" various image formats and enable      *
+* virtual write access.                                                        *
+*                                                                              *
+* This program is free software: you can redistribute it and/or modify it      *
+* under the terms of the GNU General Public License as published by the Free   *
+* Software Foundation, either version 3 of the License, or (at your option)    *
+* any later version.                                                           *
+*                                                                              *
+* This program is distributed in the hope that it will be useful, but WITHOUT  *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or        *
+* FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for     *
+* more details.                                                                *
+*                                                                              *
+* You should have received a copy of the GNU General Public License along with *
+* this program. If not, see <http://www.gnu.org/licenses/>.                    *
+*******************************************************************************/
+
+#include "crc32c.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+  #define CRC32C_WITH_SSE42
+  #include <nmmintrin.h>
+#endif
+
+// Reversed Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78
+
+// Lookup tables for slicing-by-8
+static uint32_t Crc32cTable[8][256];
+// Table of x^(2^n) modulo polynomial used to process runs of zeros
+static uint32_t Crc32cX2nTable[32];
+// Function doing the actual work on the inverted crc
+static uint32_t (*pCrc32cUpdate)(uint32_t crc,
+                                 const unsigned char *p,
+                                 size_t size)=NULL;
+
+/*
+ * Crc32cUpdateSw:
+ *   Portable slicing-by-8 implementation
+ *
+ * Params:
+ *   crc: Current inverted crc
+ *   p: Data
+ *   size: Size of data
+ *
+ * Returns:
+ *   Updated inverted crc
+ */
+static uint32_t Crc32cUpdateSw(uint32_t crc,
+                               const unsigned char *p,
+                               size_t size)
+{
+  while(size!=0 && ((uintptr_t)p & 7)!=0) {
+    crc=Crc32cTable[0][(crc^*p++) & 0xFF]^(crc>>8);
+    size--;
+  }
+  while(size>=8) {
+    crc^=(uint32_t)p[0] | ((uint32_t)p[1]<<8) |
+         ((uint32_t)p[2]<<16) | ((uint32_t)p[3]<<24);
+    crc=Crc32cTable[7][crc & 0xFF]^
+        Crc32cTable[6][(crc>>8) & 0xFF]^
+        Crc32cTable[5][(crc>>16) & 0xFF]^
+        Crc32cTable[4][crc>>24]^
+        Crc32cTable[3][p[4]]^
+        Crc32cTable[2][p[5]]^
+        Crc32cTable[1][p[6]]^
+        Crc32cTable[0][p[7]];
+    p+=8;
+    size-=8;
+  }
+  while(size!=0) {
+    crc=Crc32cTable[0][(crc^*p++) & 0xFF]^(crc>>8);
+    size--;
+  }
+  return crc;
+}
+
+#ifdef CRC32C_WITH_SSE42
+/*
+ * Crc32cUpdateHw:
+ *   Implementation using the SSE4.2 crc32 instruction
+ *
+ * Params:
+ *   crc: Current inverted crc
+ *   p: Data
+ *   size: Size of data
+ *
+ * Returns:
+ *   Updated inverted crc
+ */
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cUpdateHw(uint32_t crc,
+                               const unsigned char *p,
+                               size_t size)
+{
+  uint64_t crc64;
+
+  while(size!=0 && ((uintptr_t)p & 7)!=0) {
+    crc=_mm_crc32_u8(crc,*p++);
+    size--;
+  }
+  crc64=crc;
+  while(size>=8) {
+    crc64=_mm_crc32_u64(crc64,*(const uint64_t*)p);
+    p+=8;
+    size-=8;
+  }
+  crc=(uint32_t)crc64;
+  while(size!=0) {
+    crc=_mm_crc32_u8(crc,*p++);
+    size--;
+  }
+  return crc;
+}
+#endif
+
+/*
+ * Crc32cMultModP:
+ *   Multiply a and b modulo the polynomial
+ *
+ * Params:
+ *   a: First factor (Must not be 0)
+ *   b: Second factor
+ *
+ * Returns:
+ *   Product
+ */
+static uint32_t Crc32cMultModP(uint32_t a, uint32_t b) {
+  uint32_t m=(uint32_t)1<<31;
+  uint32_t p=0;
+
+  while(1) {
+    if(a & m) {
+      p^=b;
+      if((a & (m-1))==0) break;
+    }
+    m>>=1;
+    b=(b & 1) ? (b>>1)^CRC32C_POLY : b>>1;
+  }
+  return p;
+}
+
+/*
+ * Crc32cShift:
+ *   Feed size zero bytes into a crc without inversion
+ *
+ * Params:
+ *   crc: Crc without inversion
+ *   size: Amount of zero bytes
+ *
+ * Returns:
+ *   Updated crc
+ */
+static uint32_t Crc32cShift(uint32_t crc, uint64_t size) {
+  uint32_t p=(uint32_t)1<<31;
+  unsigned int k=3;
+
+  while(size!=0) {
+    if(size & 1) p=Crc32cMultModP(Crc32cX2nTable[k & 31],p);
+    size>>=1;
+    k++;
+  }
+  return Crc32cMultModP(p,crc);
+}
+
+void Crc32cInit() {
+  uint32_t crc;
+  int i,j;
+
+  // Build slicing-by-8 tables
+  for(i=0;i<256;i++) {
+    crc=i;
+    for(j=0;j<8;j++) crc=(crc & 1) ? (crc>>1)^CRC32C_POLY : crc>>1;
+    Crc32cTable[0][i]=crc;
+  }
+  for(i=0;i<256;i++) {
+    crc=Crc32cTable[0][i];
+    for(j=1;j<8;j++) {
+      crc=Crc32cTable[0][crc & 0xFF]^(crc>>8);
+      Crc32cTable[j][i]=crc;
+    }
+  }
+
+  // Build table of x^(2^n)
+  Crc32cX2nTable[0]=(uint32_t)1<<30;
+  for(i=1;i<32;i++) {
+    Crc32cX2nTable[i]=Crc32cMultModP(Crc32cX2nTable[i-1],
+                                     Crc32cX2nTable[i-1]);
+  }
+
+  // Choose fastest implementation
+  pCrc32cUpdate=Crc32cUpdateSw;
+#ifdef CRC32C_WITH_SSE42
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse4.2")) pCrc32cUpdate=Crc32cUpdateHw;
+#endif
+}
+
+uint32_t Crc32c(uint32_t crc, const void *pData, size_t size) {
+  return ~pCrc32cUpdate(~crc,(const unsigned char*)pData,size);
+}
+
+uint32_t Crc32cPatch(uint32_t crc,
+                     const void *pOld,
+                     const void *pNew,
+                     size_t size,
+                     uint64_t TrailingSize)
+{
+  const unsigned char *pO=(const unsigned char*)pOld;
+  const unsigned char *pN=(const unsigned char*)pNew;
+  unsigned char delta[4096];
+  uint32_t DeltaCrc=0;
+  size_t CurSize;
+  size_t i;
+
+  // CRCs are linear. The crc of the changed data equals the old crc xor the
+  // (non-inverted) crc of the difference, which is all zeros outside the
+  // changed bytes. Leading zeros don't change a non-inverted crc, trailing
+  // zeros are added by Crc32cShift.
+  while(size!=0) {
+    CurSize=size>sizeof(delta) ? sizeof(delta) : size;
+    for(i=0;i<CurSize;i++) delta[i]=pO[i]^pN[i];
+    DeltaCrc=pCrc32cUpdate(DeltaCrc,delta,CurSize);
+    pO+=CurSize;
+    pN+=CurSize;
+    size-=CurSize;
+  }
+  return crc^Crc32cShift(DeltaCrc,TrailingSize);
+}
+
+int Crc32cIsHwAccelerated() {
+#ifdef CRC32C_WITH_SSE42
+  return pCrc32cUpdate==Crc32cUpdateHw;
+#else
+  return 0;
+#endif
+}
+
+/*
+  ----- Change history -----
+  20261019: * Initial version.
+*/
@@ -0,0 +1,64 @@
+/*******************************************************************************
+* xmount Copyright (c) 2008-2012 by Gillen Daniel <gillen.dan@pinguin.lu>      *
+*                                                                              *
+* xmount is a small tool to "fuse mount" various image formats and enable      *
+* virtual write access.                                                        *
+*                                                                              *
+* This program is free software: you can redistribute it and/or modify it      *
+* under the terms of the GNU General Public License as published by the Free   *
+* Software Foundation, either version 3 of the License, or (at your option)    *
+* any later version.                                                           *
+*                                                                              *
+* This program is distributed in the hope that it will be useful, but WITHOUT  *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or        *
+* FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for     *
+* more details.                                                                *
+*                                                                              *
+* You should have received a copy of the GNU General Public License along with *
+* this program. If not, see <http://www.gnu.org/licenses/>.                    *
+*******************************************************************************/
+
+#ifndef crc32c_INCLUDED
+#define crc32c_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli polynomial) as used by iSCSI, ext4 and VHDX.
+ *
+ * Crc32cInit must be called once before any other function. It builds the
+ * lookup tables for the portable slicing-by-8 implementation and switches to
+ * the SSE4.2 crc32 instruction when the CPU supports it.
+ */
+void Crc32cInit();
+
+/*
+ * Calculate CRC32C of size bytes at pData. To calculate the checksum of data
+ * spread over multiple buffers, pass the result of the previous call as crc.
+ * The first call must use 0.
+ */
+uint32_t Crc32c(uint32_t crc, const void *pData, size_t size);
+
+/*
+ * Update the CRC32C crc of some data after size bytes inside it changed from
+ * pOld to pNew without having to process the unchanged data. TrailingSize is
+ * the amount of data following the changed bytes.
+ */
+uint32_t Crc32cPatch(uint32_t crc,
+                     const void *pOld,
+                     const void *pNew,
+                     size_t size,
+                     uint64_t TrailingSize);
+
+/*
+ * Returns 1 if the SSE4.2 implementation is used, 0 otherwise.
+ */
+int Crc32cIsHwAccelerated();
+
+#endif /* crc32c_INCLUDED */
+
+/*
+  ----- Change history -----
+  20261019: * Initial version.
+*/
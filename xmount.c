@@ -39,6 +39,12 @@
   #endif
 #endif
 
+#if defined(__linux__) && defined(__has_include)
+  #if __has_include(<linux/ublk_cmd.h>) && __has_include(<linux/io_uring.h>)
+    #define WITH_UBLK
+  #endif
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -48,10 +54,23 @@
 #include <sys/ioctl.h>
 #ifndef __APPLE__
   #include <linux/fs.h>
+  #include <sys/syscall.h>
 #endif
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#ifdef WITH_UBLK
+  #include <sys/mman.h>
+  #include <linux/io_uring.h>
+  #include <linux/ublk_cmd.h>
+#endif
 #ifdef HAVE_LIBEWF
   #include <libewf.h>
 #endif
@@ -66,6 +85,7 @@
 #endif
 #include "xmount.h"
 #include "md5.h"
+#include "crc32c.h"
 
 #if ( defined( HAVE_LIBEWF ) || defined( HAVE_LIBEWF_STATIC ) ) && !defined( LIBEWF_HANDLE )
   // libewf version 2 no longer defines LIBEWF_HANDLE
@@ -75,7 +95,14 @@
 // Struct that contains various runtime configuration options
 static TXMountConfData XMountConfData;
 // Handles for input image types
-static FILE *hDdFile=NULL;
+static pTDdSegment pDdSegments=NULL;
+static uint32_t DdSegmentCount=0;
+// Holes of sparse DD input files
+static pTDdHole pDdHoles=NULL;
+static uint32_t DdHoleCount=0;
+static char *pDdZeroBuf=NULL;
+// Let FUSE splice raw image data directly from DD input files
+static int SpliceDdSegments=FALSE;
 #ifdef WITH_LIBEWF
   #if defined( HAVE_LIBEWF_V2_API )
     static libewf_handle_t *hEwfFile=NULL;
@@ -88,25 +115,162 @@ static FILE *hDdFile=NULL;
 #endif
 // Pointer to virtual info file
 static char *pVirtualImageInfoFile=NULL;
+// Pointer to status of last command written to virtual control file
+static char *pVirtualControlFile=NULL;
 // Vars needed for VDI emulation
 static TVdiFileHeader *pVdiFileHeader=NULL;
 static uint32_t VdiFileHeaderSize=0;
-static char *pVdiBlockMap=NULL;
 static uint32_t VdiBlockMapSize=0;
 // Vars needed for VHD emulation
 static TVhdFileHeader *pVhdFileHeader=NULL;
+static TVhdDynHeader *pVhdDynHeader=NULL;
+static uint32_t VhdBatEntries=0;
+static uint32_t VhdBatSize=0;
+// Virtual QCOW2 file
+static TQcow2Header *pQcow2Header=NULL;
+static uint64_t Qcow2HeaderSize=0;
+static uint64_t Qcow2DataClusters=0;
+static uint64_t Qcow2L1Entries=0;
+static uint64_t Qcow2L1Off=0;
+static uint64_t Qcow2RefTableOff=0;
+static uint64_t Qcow2RefBlockOff=0;
+static uint64_t Qcow2RefBlocks=0;
+static uint64_t Qcow2L2Off=0;
+// Virtual VHDX file
+static TVhdxFileIdentifier *pVhdxFileIdentifier=NULL;
+static TVhdxHeader *pVhdxHeaders=NULL;
+static char *pVhdxRegionTable=NULL;
+static char *pVhdxMetadata=NULL;
+static uint64_t VhdxHeaderSize=0;
+static uint64_t VhdxBlockCount=0;
+static uint64_t VhdxChunkRatio=0;
+static uint64_t VhdxBatEntries=0;
 // Vars needed for VMDK emulation
-static char *pVirtualVmdkFile=NULL;
-static int VirtualVmdkFileSize=0;
-static char *pVirtualVmdkLockDir=NULL;
-static char *pVirtualVmdkLockDir2=NULL;
+static pTVirtImage pVmdkImage=NULL;
+static TVmdkSparseHeader *pVmdkHeader=NULL;
+static char *pVmdkDescriptor=NULL;
+static uint64_t VmdkHeaderSize=0;
+static uint64_t VmdkGrains=0;
+static uint64_t VmdkGrainTables=0;
+static uint64_t VmdkGdOff=0;
+static uint64_t VmdkGtOff=0;
 static char *pVirtualVmdkLockFileData=NULL;
 static int VirtualVmdkLockFileDataSize=0;
-static char *pVirtualVmdkLockFileName=NULL;
+// Vars needed for virtual partition files
+static pTPartition pPartitions=NULL;
+static uint32_t PartitionCount=0;
+// Virtual files and directories. The inode number of a file is its index + 1.
+static pTVirtFile pVirtFiles=NULL;
+static fuse_ino_t VirtFileCount=0;
+// FUSE connection used to invalidate cached data of virtual files
+#ifdef HAVE_LIBFUSE3
+static struct fuse_session *pFuseSession=NULL;
+#else
+static struct fuse_chan *pFuseChan=NULL;
+#endif
+static int FuseSingleThreaded=FALSE;
+// Queue of page cache ranges to drop. Sending invalidations may block until
+// the kernel wrote back dirty pages, which FUSE threads must be free to serve.
+static TInvalRequest InvalQueue[INVAL_QUEUE_SIZE];
+static uint32_t InvalQueueCount=0;
+static int InvalQueueOverflow=FALSE;
+static pthread_t InvalThread;
+static int InvalThreadRunning=FALSE;
+static int InvalThreadStop=FALSE;
+static pthread_mutex_t mutex_inval;
+static pthread_cond_t cond_inval;
 // Vars needed for virtual write access
 static FILE *hCacheFile=NULL;
+static uint64_t CacheFileWriteCount=0;
 static pTCacheFileHeader pCacheFileHeader=NULL;
 static pTCacheFileBlockIndex pCacheFileBlockIndex=NULL;
+static uint64_t CacheFileHeaderOff=0;
+// Vars needed for QCOW2 cache files
+static char *pQcow2CacheBackingFile=NULL;
+static uint64_t *pQcow2CacheL1=NULL;
+static uint32_t Qcow2CacheL1Size=0;
+static uint64_t Qcow2CacheL1Off=0;
+static uint64_t *pQcow2CacheRefTable=NULL;
+static uint64_t Qcow2CacheRefTableOff=0;
+static uint64_t Qcow2CacheRefBlocks=0;
+static uint64_t Qcow2CacheClusters=0;
+static int Qcow2CacheLocked=FALSE;
+static uint32_t *pCacheFileBlockCrcs=NULL;
+static uint8_t *pCacheFileBlockVerified=NULL;
+static char *pCacheBlockBuf=NULL;
+static pTCacheFileHeaderPage pCacheFileHeaderPages=NULL;
+// Vars needed for the input image read cache
+static FILE *hReadCacheFile=NULL;
+static pTReadCacheFileHeader pReadCacheFileHeader=NULL;
+static pTReadCacheFileSlot pReadCacheFileSlots=NULL;
+static uint8_t *pReadCacheSlotRef=NULL;
+static uint32_t *pReadCacheHashHead=NULL;
+static uint32_t *pReadCacheHashNext=NULL;
+static uint64_t ReadCacheHashMask=0;
+static uint64_t ReadCacheClockHand=0;
+static char *pReadCacheBlockBuf=NULL;
+// Vars needed for the memory cache
+static pTMemCacheEntry pMemCacheEntries=NULL;
+static uint32_t MemCacheEntryCount=0;
+static uint32_t *pMemCacheHashHead=NULL;
+static uint64_t MemCacheHashMask=0;
+static uint32_t MemCacheClockHand=0;
+static uint8_t *pMemCacheCounters=NULL;
+static uint64_t MemCacheCounterCount=0;
+static uint32_t MemCacheCounterShift=0;
+static uint64_t MemCacheCountedAccesses=0;
+static uint64_t MemCacheHits=0;
+static uint64_t MemCacheMisses=0;
+// Vars needed for staging
+static FILE *hStageFile=NULL;
+static FILE *hStageMapFile=NULL;
+static pTStageMapFileHeader pStageMapFileHeader=NULL;
+static uint8_t *pStageBitmap=NULL;
+static char *pStageBlockBuf=NULL;
+static uint64_t StageBlockCount=0;
+static uint64_t StagedBlocks=0;
+static uint64_t StageCursor=0;
+static uint64_t StageQueue[STAGE_QUEUE_SIZE];
+static uint32_t StageQueueHead=0;
+static uint32_t StageQueueLen=0;
+static uint64_t StagePending[STAGE_SYNC_BLOCKS];
+static uint32_t StagePendingCount=0;
+static pthread_t StageThread;
+static int StageThreadRunning=FALSE;
+static int StageThreadStop=FALSE;
+// Zero map
+static uint8_t *pZeroMap=NULL;
+// Emulate sparse output images (Only if zero map is present and read-only)
+static int SparseVirtImages=FALSE;
+static uint64_t ZeroMapBlockCount=0;
+static uint64_t ZeroMapKnownBlocks=0;
+static uint64_t ZeroMapZeroBlocks=0;
+static char *pZeroScanBuf=NULL;
+static pthread_t ZeroScanThread;
+static int ZeroScanThreadRunning=FALSE;
+static int ZeroScanThreadStop=FALSE;
+// NBD server
+static int NbdListenSocket=-1;
+static int NbdUnixSocket=FALSE;
+static volatile sig_atomic_t NbdServerStop=FALSE;
+static int NbdClientSockets[NBD_MAX_CONNECTIONS];
+static uint32_t NbdClientCount=0;
+static pthread_mutex_t mutex_nbd;
+static pthread_cond_t cond_nbd;
+#ifdef WITH_UBLK
+// ublk device
+static int hUblkCtrl=-1;
+static int hUblkChar=-1;
+static TUblkRing UblkCtrlRing;
+static pTUblkQueue pUblkQueues=NULL;
+static pTVirtFile pUblkExport=NULL;
+static uint32_t UblkQueuesReady=0;
+static int UblkQueueFailed=FALSE;
+static volatile sig_atomic_t UblkStop=FALSE;
+static int UblkDirectRead=FALSE;
+static pthread_mutex_t mutex_ublk;
+static pthread_cond_t cond_ublk;
+#endif
 // Mutexes to control concurrent read & write access
 static pthread_mutex_t mutex_image_rw;
 static pthread_mutex_t mutex_info_read;
@@ -177,7 +341,12 @@ static void PrintUsage(char *pProgramName) {
   printf("\nxmount v%s copyright (c) 2008-2012 by Gillen Daniel "
          "<gillen.dan@pinguin.lu>\n",PACKAGE_VERSION);
   printf("\nUsage:\n");
-  printf("  %s [[fopts] [mopts]] <ifile> [<ifile> [...]] <mntp>\n\n",pProgramName);
+  printf("  %s [[fopts] [mopts]] <ifile> [<ifile> [...]] <mntp>\n",pProgramName);
+  printf("  %s [mopts] --nbd <addr> <ifile> [<ifile> [...]]\n",pProgramName);
+#ifdef WITH_UBLK
+  printf("  %s [mopts] --ublk <queues> <ifile> [<ifile> [...]]\n",pProgramName);
+#endif
+  printf("\n");
   printf("Options:\n");
   printf("  fopts:\n");
   printf("    -d : Enable FUSE's and xmount's debug mode.\n");
@@ -185,12 +354,30 @@ static void PrintUsage(char *pProgramName) {
   printf("    -s : Run single threaded.\n");
   printf("    -o no_allow_other : Disable automatic addition of FUSE's allow_other option.\n");
   printf("    -o <fmopts> : Specify fuse mount options. Will also disable automatic\n");
-  printf("                  addition of FUSE's allow_other option!\n");
+  printf("                  addition of FUSE's allow_other option! Options of FUSE's\n");
+  printf("                  high-level library (e.g. kernel_cache) aren't supported.\n");
+#ifdef HAVE_LIBFUSE3
+  printf("    --clonefd : Let every FUSE thread use its own /dev/fuse file descriptor.\n");
+  printf("    --idlethreads <n> : Max. amount of idle FUSE threads to keep.\n");
+  printf("    --maxio <size> : Max. size of FUSE read and write requests in kB. Must be\n");
+  printf("                     a multiple of 4 between %u and %u kB.\n",
+         FUSE_MIN_MAX_IO,FUSE_MAX_MAX_IO);
+  printf("    --threads <n> : Max. amount of FUSE threads serving requests.\n");
+  printf("    --writeback : Let the kernel cache writes to virtual files (Needs\n");
+  printf("                  --cache).\n");
+#endif
   printf("    INFO: For VMDK emulation, you have to uncomment \"user_allow_other\" in\n");
   printf("          /etc/fuse.conf or run xmount as root.\n");
   printf("  mopts:\n");
+  printf("    --4kn : Emulate VHDX images with 4096 byte logical sectors (4Kn).\n");
+  printf("    --align <size> : Align data inside emulated VDI, QCOW2 and VMDK images to\n");
+  printf("                     <size> kB. Must be a power of two. Defaults to 1024 kB.\n");
   printf("    --cache <file> : Enable virtual write support and set cachefile to use.\n");
+  printf("    --cacheformat <fmt> : Format of cache file. <fmt> can be \"xmount\" or\n");
+  printf("                          \"qcow2\". Defaults to \"xmount\".\n");
 //  printf("    --debug : Enable xmount's debug mode.\n");
+  printf("    --direct : Let emulated VMDK files reference DD input files directly\n");
+  printf("               rather than serving their data (Read-only mounts only).\n");
   printf("    --in <itype> : Input image format. <itype> can be \"dd\"");
 #ifdef WITH_LIBEWF
   printf(", \"ewf\"");
@@ -200,9 +387,32 @@ static void PrintUsage(char *pProgramName) {
 #endif
   printf(".\n");
   printf("    --info : Print out some infos about used compiler and libraries.\n");
-  printf("    --out <otype> : Output image format. <otype> can be \"dd\", \"dmg\", \"vdi\", \"vhd\", \"vmdk(s)\".\n");
+  printf("    --memcache <size> : Keep frequently accessed image data in up to <size>\n");
+  printf("                        MB of RAM.\n");
+  printf("    --nbd <addr> : Serve virtual images via NBD instead of mounting them.\n");
+  printf("                   <addr> is a local TCP port, <host>:<port> or the path\n");
+  printf("                   of a unix socket.\n");
+  printf("    --out <otype> : Output image format. <otype> can be \"dd\", \"dmg\", \"qcow2\",\n");
+  printf("                    \"vdi\", \"vhd\", \"vhdx\", \"vmdk(s)\". Can be specified\n");
+  printf("                    multiple times to emulate several formats at once.\n");
   printf("    --owcache <file> : Same as --cache <file> but overwrites existing cache.\n");
+  printf("    --partitions : Expose every partition found in the input image's MBR or\n");
+  printf("                   GPT as separate raw file.\n");
+  printf("    --rcache <file> : Keep a persistent copy of decoded input image data in\n");
+  printf("                      <file> (Should be located on a fast local disk).\n");
+  printf("    --rcachesize <size> : Size of read cache in MB. Defaults to %u MB.\n",
+         READ_CACHE_DEFAULT_SIZE);
   printf("    --rw <file> : Same as --cache <file>.\n");
+  printf("    --sparse : Report blocks containing only zeros as holes (SEEK_HOLE,\n");
+  printf("               st_blocks, NBD block status) and emulate QCOW2, VDI, VHD,\n");
+  printf("               VHDX or VMDK images in which they are unallocated\n");
+  printf("               (Read-only mounts only).\n");
+  printf("    --stage <file> : Copy decoded input image to <file> in the background and\n");
+  printf("                     read already copied data from there.\n");
+#ifdef WITH_UBLK
+  printf("    --ublk <queues> : Expose first virtual image as ublk block device using\n");
+  printf("                      <queues> hardware queues instead of mounting it.\n");
+#endif
   printf("    --version : Same as --info.\n");
 #ifndef __APPLE__
   printf("    INFO: Input and output image type defaults to \"dd\" if not specified.\n");
@@ -219,6 +429,7 @@ static void PrintUsage(char *pProgramName) {
 #else
   printf("\n");
 #endif
+  printf("    Split DD images can be given as several files in the right order.\n");
   printf("  mntp:\n");
   printf("    Mount point where virtual files should be located.\n");
 }
@@ -269,6 +480,48 @@ static int CheckFuseAllowOther() {
   return TRUE;
 }
 
+/*
+ * AddVirtImage:
+ *   Add a virtual image to emulate
+ *
+ * Params:
+ *   type: Virtual image type
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int AddVirtImage(TVirtImageType type) {
+  pTVirtImage pImage;
+  uint32_t i;
+
+  for(i=0;i<XMountConfData.VirtImageCount;i++) {
+    pImage=&(XMountConfData.pVirtImages[i]);
+    if(pImage->Type==type) {
+      LOG_ERROR("Output image type specified more than once!\n")
+      return FALSE;
+    }
+    // VMDK and VMDKS would use the same virtual file
+    if((type==TVirtImageType_VMDK || type==TVirtImageType_VMDKS) &&
+       (pImage->Type==TVirtImageType_VMDK ||
+        pImage->Type==TVirtImageType_VMDKS))
+    {
+      LOG_ERROR("Output image types \"vmdk\" and \"vmdks\" can't be "
+                "combined!\n")
+      return FALSE;
+    }
+  }
+
+  XMountConfData.VirtImageCount++;
+  XMOUNT_REALLOC(XMountConfData.pVirtImages,
+                 pTVirtImage,
+                 XMountConfData.VirtImageCount*sizeof(TVirtImage))
+  pImage=&(XMountConfData.pVirtImages[XMountConfData.VirtImageCount-1]);
+  pImage->Type=type;
+  pImage->pPath=NULL;
+  pImage->Size=0;
+  return TRUE;
+}
+
 /*
  * ParseCmdLine:
  *   Parse command line options
@@ -280,7 +533,8 @@ static int CheckFuseAllowOther() {
  *   pppNargv: FUSE options are written to this array
  *   pFilenameCount: Number of input image files is written to this var
  *   pppFilenames: Input image filenames are written to this array
- *   ppMountpoint: Mountpoint is written to this var
+ *   ppMountpoint: Mountpoint is written to this var (Not set in NBD and ublk
+ *                 mode)
  *
  * Returns:
  *   "TRUE" on success, "FALSE" on error
@@ -293,6 +547,8 @@ static int ParseCmdLine(const int argc,
                         char ***pppFilenames,
                         char **ppMountpoint) {
   int i=1,files=0,opts=0,FuseMinusOControl=TRUE,FuseAllowOther=TRUE;
+  int LastFile;
+  TVirtImageType VirtImageType;
 
   // add argv[0] to pppNargv
   opts++;
@@ -398,33 +654,86 @@ static int ParseCmdLine(const int argc,
         if((argc+1)>i) {
           i++;
           if(strcmp(argv[i],"dd")==0) {
-            XMountConfData.VirtImageType=TVirtImageType_DD;
+            VirtImageType=TVirtImageType_DD;
             LOG_DEBUG("Setting virtual image type to DD\n")
           } else if(strcmp(argv[i],"dmg")==0) {
-            XMountConfData.VirtImageType=TVirtImageType_DMG;
+            VirtImageType=TVirtImageType_DMG;
             LOG_DEBUG("Setting virtual image type to DMG\n")
           } else if(strcmp(argv[i],"vdi")==0) {
-            XMountConfData.VirtImageType=TVirtImageType_VDI;
+            VirtImageType=TVirtImageType_VDI;
             LOG_DEBUG("Setting virtual image type to VDI\n")
           } else if(strcmp(argv[i],"vhd")==0) {
-            XMountConfData.VirtImageType=TVirtImageType_VHD;
+            VirtImageType=TVirtImageType_VHD;
             LOG_DEBUG("Setting virtual image type to VHD\n")
+          } else if(strcmp(argv[i],"vhdx")==0) {
+            VirtImageType=TVirtImageType_VHDX;
+            LOG_DEBUG("Setting virtual image type to VHDX\n")
+          } else if(strcmp(argv[i],"qcow2")==0) {
+            VirtImageType=TVirtImageType_QCOW2;
+            LOG_DEBUG("Setting virtual image type to QCOW2\n")
           } else if(strcmp(argv[i],"vmdk")==0) {
-            XMountConfData.VirtImageType=TVirtImageType_VMDK;
+            VirtImageType=TVirtImageType_VMDK;
             LOG_DEBUG("Setting virtual image type to VMDK\n")
           } else if(strcmp(argv[i],"vmdks")==0) {
-            XMountConfData.VirtImageType=TVirtImageType_VMDKS;
+            VirtImageType=TVirtImageType_VMDKS;
             LOG_DEBUG("Setting virtual image type to VMDKS\n")
           } else {
             LOG_ERROR("Unknown output image type \"%s\"!\n",argv[i])
             PrintUsage(argv[0]);
             exit(1);
           }
+          if(!AddVirtImage(VirtImageType)) {
+            PrintUsage(argv[0]);
+            exit(1);
+          }
         } else {
           LOG_ERROR("You must specify an output image type!\n");
           PrintUsage(argv[0]);
           exit(1);
         }
+      } else if(strcmp(argv[i],"--4kn")==0) {
+        // Emulate VHDX images with 4k logical sectors
+        XMountConfData.Vhdx4kn=TRUE;
+        LOG_DEBUG("Enabling 4k logical sectors for VHDX images\n")
+      } else if(strcmp(argv[i],"--align")==0) {
+        // Set data area alignment
+        // Next parameter must be alignment in kilobytes
+        if((argc+1)>i) {
+          i++;
+          XMountConfData.Alignment=strtoull(argv[i],NULL,10)*1024;
+          if(XMountConfData.Alignment==0 ||
+             XMountConfData.Alignment>MAX_DATA_ALIGNMENT ||
+             (XMountConfData.Alignment&(XMountConfData.Alignment-1))!=0)
+          {
+            LOG_ERROR("Invalid alignment \"%s\"!\n",argv[i])
+            PrintUsage(argv[0]);
+            exit(1);
+          }
+        } else {
+          LOG_ERROR("You must specify an alignment!\n")
+          PrintUsage(argv[0]);
+          exit(1);
+        }
+        LOG_DEBUG("Setting data alignment to %" PRIu64 " bytes\n",
+                  XMountConfData.Alignment)
+      } else if(strcmp(argv[i],"--memcache")==0) {
+        // Enable memory cache
+        // Next parameter must be size in megabytes
+        if((argc+1)>i) {
+          i++;
+          XMountConfData.MemCacheSize=strtoull(argv[i],NULL,10);
+          if(XMountConfData.MemCacheSize==0) {
+            LOG_ERROR("Invalid memory cache size \"%s\"!\n",argv[i])
+            PrintUsage(argv[0]);
+            exit(1);
+          }
+        } else {
+          LOG_ERROR("You must specify a memory cache size!\n")
+          PrintUsage(argv[0]);
+          exit(1);
+        }
+        LOG_DEBUG("Setting memory cache size to %" PRIu64 " MB\n",
+                  XMountConfData.MemCacheSize)
       } else if(strcmp(argv[i],"--owcache")==0) {
         // Enable writable access to mounted image and overwrite existing cache
         // Next parameter must be cache file to read/write changes from/to
@@ -440,6 +749,200 @@ static int ParseCmdLine(const int argc,
         }
         LOG_DEBUG("Enabling virtual write support overwriting cache file \"%s\"\n",
                   XMountConfData.pCacheFile)
+      } else if(strcmp(argv[i],"--partitions")==0) {
+        // Expose partitions as virtual files
+        XMountConfData.Partitions=TRUE;
+        LOG_DEBUG("Enabling virtual partition files\n")
+      } else if(strcmp(argv[i],"--rcache")==0) {
+        // Enable read cache for decoded input image data
+        // Next parameter must be read cache file
+        if((argc+1)>i) {
+          i++;
+          XMOUNT_STRSET(XMountConfData.pReadCacheFile,argv[i])
+        } else {
+          LOG_ERROR("You must specify a read cache file!\n")
+          PrintUsage(argv[0]);
+          exit(1);
+        }
+        LOG_DEBUG("Enabling read cache using file \"%s\"\n",
+                  XMountConfData.pReadCacheFile)
+      } else if(strcmp(argv[i],"--rcachesize")==0) {
+        // Set read cache size
+        // Next parameter must be size in megabytes
+        if((argc+1)>i) {
+          i++;
+          XMountConfData.ReadCacheSize=strtoull(argv[i],NULL,10);
+          if(XMountConfData.ReadCacheSize==0) {
+            LOG_ERROR("Invalid read cache size \"%s\"!\n",argv[i])
+            PrintUsage(argv[0]);
+            exit(1);
+          }
+        } else {
+          LOG_ERROR("You must specify a read cache size!\n")
+          PrintUsage(argv[0]);
+          exit(1);
+        }
+        LOG_DEBUG("Setting read cache size to %" PRIu64 " MB\n",
+                  XMountConfData.ReadCacheSize)
+      } else if(strcmp(argv[i],"--stage")==0) {
+        // Enable staging of input image to local storage
+        // Next parameter must be stage file
+        if((argc+1)>i) {
+          i++;
+          XMOUNT_STRSET(XMountConfData.pStageFile,argv[i])
+        } else {
+          LOG_ERROR("You must specify a stage file!\n")
+          PrintUsage(argv[0]);
+          exit(1);
+        }
+        LOG_DEBUG("Enabling staging of input image to file \"%s\"\n",
+                  XMountConfData.pStageFile)
+      } else if(strcmp(argv[i],"--cacheformat")==0) {
+        // Set cache file format
+        // Next parameter must be format name
+        if((argc+1)>i) {
+          i++;
+          if(strcmp(argv[i],"xmount")==0) {
+            XMountConfData.CacheFormat=TCacheFormat_XMOUNT;
+            LOG_DEBUG("Setting cache file format to xmount\n")
+          } else if(strcmp(argv[i],"qcow2")==0) {
+            XMountConfData.CacheFormat=TCacheFormat_QCOW2;
+            LOG_DEBUG("Setting cache file format to QCOW2\n")
+          } else {
+            LOG_ERROR("Unknown cache file format \"%s\" specified!\n",argv[i])
+            PrintUsage(argv[0]);
+            exit(1);
+          }
+        } else {
+          LOG_ERROR("You must specify a cache file format!\n")
+          PrintUsage(argv[0]);
+          exit(1);
+        }
+      } else if(strcmp(argv[i],"--direct")==0) {
+        // Reference input files from VMDK descriptor
+        XMountConfData.DirectVmdk=TRUE;
+        LOG_DEBUG("Enabling direct VMDK extents\n")
+      } else if(strcmp(argv[i],"--nbd")==0) {
+        // Serve via NBD instead of mounting
+        // Next parameter must be port or socket path
+        if((argc+1)>i) {
+          i++;
+          XMOUNT_STRSET(XMountConfData.pNbdAddress,argv[i])
+          LOG_DEBUG("Enabling NBD server on \"%s\"\n",
+                    XMountConfData.pNbdAddress)
+        } else {
+          LOG_ERROR("You must specify a NBD port or socket path!\n")
+          PrintUsage(argv[0]);
+          exit(1);
+        }
+      } else if(strcmp(argv[i],"--ublk")==0) {
+        // Expose first virtual image as ublk block device instead of mounting
+        // Next parameter must be amount of hardware queues
+#ifdef WITH_UBLK
+        if((argc+1)>i) {
+          i++;
+          XMountConfData.UblkQueues=strtoul(argv[i],NULL,10);
+          if(XMountConfData.UblkQueues==0 ||
+             XMountConfData.UblkQueues>UBLK_MAX_QUEUES)
+          {
+            LOG_ERROR("Invalid amount of ublk queues \"%s\" (Must be "
+                      "between 1 and %u)!\n",argv[i],UBLK_MAX_QUEUES)
+            PrintUsage(argv[0]);
+            exit(1);
+          }
+        } else {
+          LOG_ERROR("You must specify the amount of ublk queues!\n")
+          PrintUsage(argv[0]);
+          exit(1);
+        }
+        LOG_DEBUG("Enabling ublk device with %" PRIu32 " queues\n",
+                  XMountConfData.UblkQueues)
+#else
+        LOG_ERROR("This version of xmount was compiled without ublk "
+                  "support!\n")
+        exit(1);
+#endif
+      } else if(strcmp(argv[i],"--threads")==0 ||
+                strcmp(argv[i],"--idlethreads")==0)
+      {
+        // Limit amount of FUSE worker threads
+        // Next parameter must be amount of threads
+#ifdef HAVE_LIBFUSE3
+        if((argc+1)>i) {
+          i++;
+          if(atoi(argv[i])<=0) {
+            LOG_ERROR("Invalid amount of threads \"%s\"!\n",argv[i])
+            PrintUsage(argv[0]);
+            exit(1);
+          }
+          if(strcmp(argv[i-1],"--threads")==0) {
+            XMountConfData.FuseThreads=atoi(argv[i]);
+          } else XMountConfData.FuseIdleThreads=atoi(argv[i]);
+        } else {
+          LOG_ERROR("You must specify the amount of threads!\n")
+          PrintUsage(argv[0]);
+          exit(1);
+        }
+        LOG_DEBUG("Setting %s to %s\n",argv[i-1]+2,argv[i])
+#else
+        LOG_ERROR("This version of xmount was compiled without libfuse 3 "
+                  "support!\n")
+        exit(1);
+#endif
+      } else if(strcmp(argv[i],"--clonefd")==0) {
+        // Let every FUSE worker thread use its own /dev/fuse fd
+#ifdef HAVE_LIBFUSE3
+        XMountConfData.FuseCloneFd=TRUE;
+        LOG_DEBUG("Enabling cloned FUSE file descriptors\n")
+#else
+        LOG_ERROR("This version of xmount was compiled without libfuse 3 "
+                  "support!\n")
+        exit(1);
+#endif
+      } else if(strcmp(argv[i],"--maxio")==0) {
+        // Set max. size of FUSE read and write requests
+        // Next parameter must be size in kB
+#ifdef HAVE_LIBFUSE3
+        if((argc+1)>i) {
+          i++;
+          XMountConfData.FuseMaxIo=strtoul(argv[i],NULL,10);
+          if(XMountConfData.FuseMaxIo<FUSE_MIN_MAX_IO ||
+             XMountConfData.FuseMaxIo>FUSE_MAX_MAX_IO ||
+             XMountConfData.FuseMaxIo%4!=0)
+          {
+            LOG_ERROR("Invalid request size \"%s\" (Must be a multiple of 4 "
+                      "between %u and %u kB)!\n",argv[i],FUSE_MIN_MAX_IO,
+                      FUSE_MAX_MAX_IO)
+            PrintUsage(argv[0]);
+            exit(1);
+          }
+          XMountConfData.FuseMaxIo*=1024;
+        } else {
+          LOG_ERROR("You must specify the max. request size!\n")
+          PrintUsage(argv[0]);
+          exit(1);
+        }
+        LOG_DEBUG("Setting max. FUSE request size to %" PRIu32 " bytes\n",
+                  XMountConfData.FuseMaxIo)
+#else
+        LOG_ERROR("This version of xmount was compiled without libfuse 3 "
+                  "support!\n")
+        exit(1);
+#endif
+      } else if(strcmp(argv[i],"--writeback")==0) {
+        // Let the kernel cache writes to virtual files
+#ifdef HAVE_LIBFUSE3
+        XMountConfData.FuseWriteback=TRUE;
+        LOG_DEBUG("Enabling kernel writeback cache\n")
+#else
+        LOG_ERROR("This version of xmount was compiled without libfuse 3 "
+                  "support!\n")
+        exit(1);
+#endif
+      } else if(strcmp(argv[i],"--sparse")==0) {
+        // Report zero blocks as unallocated
+        XMountConfData.Sparse=TRUE;
+        LOG_DEBUG("Enabling sparse output image\n")
       } else if(strcmp(argv[i],"--version")==0 || strcmp(argv[i],"--info")==0) {
         printf("xmount v%s copyright (c) 2008-2012 by Gillen Daniel "
                "<gillen.dan@pinguin.lu>\n\n",PACKAGE_VERSION);
@@ -456,6 +959,16 @@ static int ParseCmdLine(const int argc,
         printf("  libaff support: YES (version %s)\n",af_version());
 #else
         printf("  libaff support: NO\n");
+#endif
+#ifdef WITH_UBLK
+        printf("  ublk support: YES\n");
+#else
+        printf("  ublk support: NO\n");
+#endif
+#ifdef HAVE_LIBFUSE3
+        printf("  libfuse 3 support: YES (version %s)\n",fuse_pkgversion());
+#else
+        printf("  libfuse 3 support: NO\n");
 #endif
         printf("\n");
         exit(0);
@@ -468,8 +981,17 @@ static int ParseCmdLine(const int argc,
     i++;
   }
   
-  // Parse input image filename(s)
-  while(i<(argc-1)) {
+  // Parse input image filename(s). There is no mountpoint in NBD and ublk
+  // mode.
+  if(XMountConfData.pNbdAddress!=NULL && XMountConfData.UblkQueues!=0) {
+    LOG_ERROR("--nbd and --ublk can't be used together!\n")
+    PrintUsage(argv[0]);
+    exit(1);
+  }
+  if(XMountConfData.pNbdAddress!=NULL || XMountConfData.UblkQueues!=0) {
+    LastFile=argc;
+  } else LastFile=argc-1;
+  while(i<LastFile) {
     files++;
     XMOUNT_REALLOC(*pppFilenames,char**,files*sizeof(char*))
     XMOUNT_STRSET((*pppFilenames)[files-1],argv[i])
@@ -483,15 +1005,17 @@ static int ParseCmdLine(const int argc,
   *pFilenameCount=files;
 
   // Extract mountpoint
-  if(i==(argc-1)) {
-    XMOUNT_STRSET(*ppMountpoint,argv[argc-1])
-    opts++;
-    XMOUNT_REALLOC(*pppNargv,char**,opts*sizeof(char*))
-    XMOUNT_STRSET((*pppNargv)[opts-1],*ppMountpoint)
-  } else {
-    LOG_ERROR("No mountpoint specified!\n")
-    PrintUsage(argv[0]);
-    exit(1);
+  if(XMountConfData.pNbdAddress==NULL && XMountConfData.UblkQueues==0) {
+    if(i==(argc-1)) {
+      XMOUNT_STRSET(*ppMountpoint,argv[argc-1])
+      opts++;
+      XMOUNT_REALLOC(*pppNargv,char**,opts*sizeof(char*))
+      XMOUNT_STRSET((*pppNargv)[opts-1],*ppMountpoint)
+    } else {
+      LOG_ERROR("No mountpoint specified!\n")
+      PrintUsage(argv[0]);
+      exit(1);
+    }
   }
 
   if(FuseMinusOControl==TRUE) {
@@ -525,6 +1049,8 @@ static int ParseCmdLine(const int argc,
  *   "TRUE" on success, "FALSE" on error
  */
 static int ExtractVirtFileNames(char *pOrigName) {
+  pTVirtImage pImage;
+  uint32_t i;
   char *tmp;
 
   // Truncate any leading path
@@ -535,76 +1061,134 @@ static int ExtractVirtFileNames(char *pOrigName) {
   tmp=strrchr(pOrigName,'.');
 
   // Set leading '/'
-  XMOUNT_STRSET(XMountConfData.pVirtualImagePath,"/")
   XMOUNT_STRSET(XMountConfData.pVirtualImageInfoPath,"/")
-  if(XMountConfData.VirtImageType==TVirtImageType_VMDK ||
-     XMountConfData.VirtImageType==TVirtImageType_VMDKS)
-  {
-    XMOUNT_STRSET(XMountConfData.pVirtualVmdkPath,"/")
-  }
+  XMOUNT_STRSET(XMountConfData.pVirtualControlPath,"/")
 
   // Copy filename
   if(tmp==NULL) {
     // Input image filename has no extension
-    XMOUNT_STRAPP(XMountConfData.pVirtualImagePath,pOrigName)
     XMOUNT_STRAPP(XMountConfData.pVirtualImageInfoPath,pOrigName)
-    if(XMountConfData.VirtImageType==TVirtImageType_VMDK ||
-       XMountConfData.VirtImageType==TVirtImageType_VMDKS)
-    {
-      XMOUNT_STRAPP(XMountConfData.pVirtualVmdkPath,pOrigName)
-    }
+    XMOUNT_STRAPP(XMountConfData.pVirtualControlPath,pOrigName)
     XMOUNT_STRAPP(XMountConfData.pVirtualImageInfoPath,".info")
+    XMOUNT_STRAPP(XMountConfData.pVirtualControlPath,".ctl")
   } else {
-    XMOUNT_STRNAPP(XMountConfData.pVirtualImagePath,pOrigName,
-                   strlen(pOrigName)-strlen(tmp))
     XMOUNT_STRNAPP(XMountConfData.pVirtualImageInfoPath,pOrigName,
                    strlen(pOrigName)-strlen(tmp))
-    if(XMountConfData.VirtImageType==TVirtImageType_VMDK ||
-       XMountConfData.VirtImageType==TVirtImageType_VMDKS)
-    {
-      XMOUNT_STRNAPP(XMountConfData.pVirtualVmdkPath,pOrigName,
-                     strlen(pOrigName)-strlen(tmp))
-    }
+    XMOUNT_STRNAPP(XMountConfData.pVirtualControlPath,pOrigName,
+                   strlen(pOrigName)-strlen(tmp))
     XMOUNT_STRAPP(XMountConfData.pVirtualImageInfoPath,".info")
+    XMOUNT_STRAPP(XMountConfData.pVirtualControlPath,".ctl")
   }
 
-  // Add virtual file extensions
-  switch(XMountConfData.VirtImageType) {
-    case TVirtImageType_DD:
-      XMOUNT_STRAPP(XMountConfData.pVirtualImagePath,".dd")
-      break;
-    case TVirtImageType_DMG:
-      XMOUNT_STRAPP(XMountConfData.pVirtualImagePath,".dmg")
-      break;
-    case TVirtImageType_VDI:
-      XMOUNT_STRAPP(XMountConfData.pVirtualImagePath,".vdi")
-      break;
-    case TVirtImageType_VHD:
-      XMOUNT_STRAPP(XMountConfData.pVirtualImagePath,".vhd")
-      break;
-    case TVirtImageType_VMDK:
-    case TVirtImageType_VMDKS:
-      XMOUNT_STRAPP(XMountConfData.pVirtualImagePath,".dd")
-      XMOUNT_STRAPP(XMountConfData.pVirtualVmdkPath,".vmdk")
-      break;
-    default:
-      LOG_ERROR("Unknown virtual image type!\n")
-      return FALSE;
+  for(i=0;i<XMountConfData.VirtImageCount;i++) {
+    pImage=&(XMountConfData.pVirtImages[i]);
+    XMOUNT_STRSET(pImage->pPath,"/")
+    if(tmp==NULL) {
+      XMOUNT_STRAPP(pImage->pPath,pOrigName)
+    } else {
+      XMOUNT_STRNAPP(pImage->pPath,pOrigName,strlen(pOrigName)-strlen(tmp))
+    }
+
+    // Add virtual file extensions
+    switch(pImage->Type) {
+      case TVirtImageType_DD:
+        XMOUNT_STRAPP(pImage->pPath,".dd")
+        break;
+      case TVirtImageType_DMG:
+        XMOUNT_STRAPP(pImage->pPath,".dmg")
+        break;
+      case TVirtImageType_VDI:
+        XMOUNT_STRAPP(pImage->pPath,".vdi")
+        break;
+      case TVirtImageType_VHD:
+        XMOUNT_STRAPP(pImage->pPath,".vhd")
+        break;
+      case TVirtImageType_QCOW2:
+        XMOUNT_STRAPP(pImage->pPath,".qcow2")
+        break;
+      case TVirtImageType_VHDX:
+        XMOUNT_STRAPP(pImage->pPath,".vhdx")
+        break;
+      case TVirtImageType_VMDK:
+      case TVirtImageType_VMDKS:
+        XMOUNT_STRAPP(pImage->pPath,".vmdk")
+        break;
+      default:
+        LOG_ERROR("Unknown virtual image type!\n")
+        return FALSE;
+    }
+
+    LOG_DEBUG("Set virtual image name to \"%s\"\n",pImage->pPath)
   }
 
-  LOG_DEBUG("Set virtual image name to \"%s\"\n",
-            XMountConfData.pVirtualImagePath)
   LOG_DEBUG("Set virtual image info name to \"%s\"\n",
             XMountConfData.pVirtualImageInfoPath)
-  if(XMountConfData.VirtImageType==TVirtImageType_VMDK ||
-     XMountConfData.VirtImageType==TVirtImageType_VMDKS)
-  {
-    LOG_DEBUG("Set virtual vmdk name to \"%s\"\n",
-              XMountConfData.pVirtualVmdkPath)
-  }
+  LOG_DEBUG("Set virtual control file name to \"%s\"\n",
+            XMountConfData.pVirtualControlPath)
   return TRUE;
 }
 
+/*
+ * FindVirtImageByType:
+ *   Find the virtual image of the given type
+ *
+ * Params:
+ *   type: Virtual image type
+ *
+ * Returns:
+ *   Pointer to virtual image or NULL if type isn't emulated
+ */
+static pTVirtImage FindVirtImageByType(TVirtImageType type) {
+  uint32_t i;
+
+  for(i=0;i<XMountConfData.VirtImageCount;i++) {
+    if(XMountConfData.pVirtImages[i].Type==type) {
+      return &(XMountConfData.pVirtImages[i]);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * GetVirtFile:
+ *   Get the virtual file or directory belonging to an inode number
+ *
+ * Params:
+ *   ino: Inode number
+ *
+ * Returns:
+ *   Pointer to virtual file or NULL if it doesn't exist
+ */
+static pTVirtFile GetVirtFile(fuse_ino_t ino) {
+  if(ino==0 || ino>VirtFileCount || pVirtFiles[ino-1].pName==NULL) return NULL;
+  return &(pVirtFiles[ino-1]);
+}
+
+/*
+ * FindVirtFile:
+ *   Find a virtual file or directory by its name
+ *
+ * Params:
+ *   parent: Inode number of directory containing the file
+ *   pName: Name of file
+ *
+ * Returns:
+ *   Inode number of file or "0" if it doesn't exist
+ */
+static fuse_ino_t FindVirtFile(fuse_ino_t parent, const char *pName) {
+  fuse_ino_t i;
+
+  for(i=0;i<VirtFileCount;i++) {
+    if(pVirtFiles[i].Parent==parent &&
+       pVirtFiles[i].pName!=NULL &&
+       strcmp(pVirtFiles[i].pName,pName)==0)
+    {
+      return i+1;
+    }
+  }
+  return 0;
+}
+
 /*
  * GetOrigImageSize:
  *   Get size of original image
@@ -629,12 +1213,10 @@ static int GetOrigImageSize(uint64_t *size) {
   // Now get size of original image
   switch(XMountConfData.OrigImageType) {
     case TOrigImageType_DD:
-      // Original image is a DD file. Seek to end to get size.
-      if(fseeko(hDdFile,0,SEEK_END)!=0) {
-        LOG_ERROR("Couldn't seek to end of image file!\n")
-        return FALSE;
-      }
-      *size=ftello(hDdFile);
+      // Original image is a DD file. Segment sizes were determined when
+      // opening them.
+      *size=pDdSegments[DdSegmentCount-1].Offset+
+        pDdSegments[DdSegmentCount-1].Size;
       break;
 #ifdef WITH_LIBEWF
     case TOrigImageType_EWF:
@@ -667,26 +1249,25 @@ static int GetOrigImageSize(uint64_t *size) {
 
 /*
  * GetVirtImageSize:
- *   Get size of the emulated image
+ *   Get size of an emulated image
  *
  * Params:
+ *   pImage: Virtual image
  *   size: Pointer to an uint64_t to which the size will be written to
  *
  * Returns:
  *   "TRUE" on success, "FALSE" on error
  */
-static int GetVirtImageSize(uint64_t *size) {
-  if(XMountConfData.VirtImageSize!=0) {
-    *size=XMountConfData.VirtImageSize;
+static int GetVirtImageSize(pTVirtImage pImage, uint64_t *size) {
+  if(pImage->Size!=0) {
+    *size=pImage->Size;
     return TRUE;
   }
 
-  switch(XMountConfData.VirtImageType) {
+  switch(pImage->Type) {
     case TVirtImageType_DD:
     case TVirtImageType_DMG:
-    case TVirtImageType_VMDK:
-    case TVirtImageType_VMDKS:
-      // Virtual image is a DD, DMG or VMDK file. Just return the size of the
+      // Virtual image is a DD or DMG file. Just return the size of the
       // original image
       if(!GetOrigImageSize(size)) {
         LOG_ERROR("Couldn't get size of input image!\n")
@@ -700,7 +1281,27 @@ static int GetVirtImageSize(uint64_t *size) {
         LOG_ERROR("Couldn't get size of input image!\n")
         return FALSE;
       }
-      (*size)+=(sizeof(TVdiFileHeader)+VdiBlockMapSize);
+      (*size)+=VdiFileHeaderSize;
+      break;
+    case TVirtImageType_QCOW2:
+      // Virtual image is a QCOW2 file. Get size of original image and add size
+      // of QCOW2 metadata.
+      if(!GetOrigImageSize(size)) {
+        LOG_ERROR("Couldn't get size of input image!\n")
+        return FALSE;
+      }
+      (*size)+=Qcow2HeaderSize;
+      break;
+    case TVirtImageType_VHDX:
+      // Virtual image is a VHDX file. Add size of VHDX structures to the size
+      // of all payload blocks.
+      *size=VhdxHeaderSize+(VhdxBlockCount*VHDX_BLOCK_SIZE);
+      break;
+    case TVirtImageType_VMDK:
+    case TVirtImageType_VMDKS:
+      // Virtual image is a sparse VMDK file. Add size of VMDK metadata to the
+      // size of all grains.
+      *size=VmdkHeaderSize+(VmdkGrains*VMDK_GRAIN_SIZE);
       break;
     case TVirtImageType_VHD:
       // Virtual image is a VHD file. Get size of original image and add size
@@ -709,64 +1310,198 @@ static int GetVirtImageSize(uint64_t *size) {
         LOG_ERROR("Couldn't get size of input image!\n")
         return FALSE;
       }
-      (*size)+=sizeof(TVhdFileHeader);
+      if(pVhdDynHeader!=NULL) {
+        // Dynamic VHD. Footer copy, dynamic disk header, BAT, all blocks
+        // including their bitmap and footer.
+        *size=sizeof(TVhdFileHeader)+sizeof(TVhdDynHeader)+VhdBatSize+
+          (((uint64_t)VhdBatEntries)*(VHD_DYN_BITMAP_SIZE+VHD_DYN_BLOCK_SIZE))+
+          sizeof(TVhdFileHeader);
+      } else (*size)+=sizeof(TVhdFileHeader);
       break;
     default:
       LOG_ERROR("Unsupported image type!\n")
       return FALSE;
   }
-  XMountConfData.VirtImageSize=*size;
+  pImage->Size=*size;
   return TRUE;
 }
 
 /*
- * GetOrigImageData:
- *   Read data from original image
+ * FindDdSegment:
+ *   Find the DD input file segment containing the given offset
  *
  * Params:
- *   buf: Pointer to buffer to write read data to (Must be preallocated!)
- *   offset: Offset at which data should be read
- *   size: Size of data which should be read (Size of buffer)
+ *   offset: Offset inside input image
  *
  * Returns:
- *   Number of read bytes on success or "-1" on error
+ *   Index of segment
  */
-static int GetOrigImageData(char *buf, off_t offset, size_t size) {
-  size_t ToRead=0;
-  uint64_t ImageSize=0;
+static uint32_t FindDdSegment(uint64_t offset) {
+  uint32_t lo=0;
+  uint32_t hi=DdSegmentCount;
+  uint32_t mid;
+
+  while(hi-lo>1) {
+    mid=(lo+hi)/2;
+    if(pDdSegments[mid].Offset<=offset) lo=mid;
+    else hi=mid;
+  }
+  return lo;
+}
 
-  // Make sure we aren't reading past EOF of image file
-  if(!GetOrigImageSize(&ImageSize)) {
-    LOG_ERROR("Couldn't get image size!\n")
-    return -1;
+/*
+ * FindDdHole:
+ *   Find the first hole of the DD input image ending behind the given offset
+ *
+ * Params:
+ *   offset: Offset inside input image
+ *
+ * Returns:
+ *   Index of hole or DdHoleCount if there is none
+ */
+static uint32_t FindDdHole(uint64_t offset) {
+  uint32_t lo=0;
+  uint32_t hi=DdHoleCount;
+  uint32_t mid;
+
+  while(lo<hi) {
+    mid=(lo+hi)/2;
+    if(pDdHoles[mid].Offset+pDdHoles[mid].Size<=offset) lo=mid+1;
+    else hi=mid;
   }
-  if(offset>=ImageSize) {
-    // Offset is beyond image size
-    LOG_DEBUG("Offset is beyond image size.\n")
-    return 0;
+  return lo;
+}
+
+/*
+ * GetDdHoleExtent:
+ *   Check if the DD input image has a hole at the given offset
+ *
+ * Params:
+ *   offset: Offset inside input image
+ *   length: Max. length of extent
+ *   pHole: Set to "TRUE" if extent is a hole, "FALSE" if it is data
+ *
+ * Returns:
+ *   Length of extent
+ */
+static uint64_t GetDdHoleExtent(uint64_t offset, uint64_t length, int *pHole) {
+  uint32_t i=FindDdHole(offset);
+  uint64_t end;
+
+  *pHole=FALSE;
+  if(i>=DdHoleCount) return length;
+  if(pDdHoles[i].Offset<=offset) {
+    *pHole=TRUE;
+    end=pDdHoles[i].Offset+pDdHoles[i].Size;
+    if(end-offset<length) return end-offset;
+    return length;
   }
-  if(offset+size>ImageSize) {
-    // Attempt to read data past EOF of image file
-    ToRead=ImageSize-offset;
-    LOG_DEBUG("Attempt to read data past EOF. Corrected size from %zd"
-              " to %zd.\n",size,ToRead)
-  } else ToRead=size;
+  if(pDdHoles[i].Offset-offset<length) return pDdHoles[i].Offset-offset;
+  return length;
+}
 
-  // Now read data from image file
-  switch(XMountConfData.OrigImageType) {
-    case TOrigImageType_DD:
-      // Original image is a DD file. Seek to offset and read ToRead bytes.
-      // TODO: Perhaps check whether it is cheaper to seek from current position
-      // to offset than seeking from beginning of the file
-      if(fseeko(hDdFile,offset,SEEK_SET)!=0) {
+/*
+ * IsDdHoleBlock:
+ *   Check if an input image block lies completely inside a hole of the DD
+ *   input files
+ *
+ * Params:
+ *   block: Input image block number
+ *
+ * Returns:
+ *   "TRUE" if block is a hole, "FALSE" otherwise
+ */
+static int IsDdHoleBlock(uint64_t block) {
+  uint64_t ImageSize;
+  uint64_t size=CACHE_BLOCK_SIZE;
+  int hole;
+
+  if(DdHoleCount==0 || !GetOrigImageSize(&ImageSize)) return FALSE;
+  if(block*CACHE_BLOCK_SIZE>=ImageSize) return FALSE;
+  if(ImageSize-(block*CACHE_BLOCK_SIZE)<size) {
+    size=ImageSize-(block*CACHE_BLOCK_SIZE);
+  }
+  return GetDdHoleExtent(block*CACHE_BLOCK_SIZE,size,&hole)==size && hole;
+}
+
+/*
+ * ReadDdSegments:
+ *   Read data from a (split) DD input image. Reads crossing a segment
+ *   boundary are split up. Holes of sparse segment files are filled with
+ *   zeros without reading them.
+ *
+ * Params:
+ *   buf: Pointer to buffer to write read data to (Must be preallocated!)
+ *   offset: Offset inside input image
+ *   ToRead: Size of data which should be read (Size of buffer)
+ *
+ * Returns:
+ *   Number of read bytes on success or "-1" on error
+ */
+static int ReadDdSegments(char *buf, off_t offset, size_t ToRead) {
+  uint32_t lo=FindDdSegment(offset);
+  size_t CurToRead;
+  size_t ReadBytes=0;
+  int hole;
+
+  while(ReadBytes<ToRead) {
+    if(lo>=DdSegmentCount) {
+      LOG_ERROR("Attempt to read beyond end of DD file!\n")
+      return -1;
+    }
+    CurToRead=ToRead-ReadBytes;
+    if(offset+CurToRead>pDdSegments[lo].Offset+pDdSegments[lo].Size) {
+      CurToRead=(pDdSegments[lo].Offset+pDdSegments[lo].Size)-offset;
+    }
+    if(CurToRead==0) {
+      lo++;
+      continue;
+    }
+    CurToRead=GetDdHoleExtent(offset,CurToRead,&hole);
+    if(hole) {
+      // No need to let the filesystem generate zeros
+      memset(buf+ReadBytes,0,CurToRead);
+    } else {
+      if(fseeko(pDdSegments[lo].hFile,
+                offset-pDdSegments[lo].Offset,
+                SEEK_SET)!=0)
+      {
         LOG_ERROR("Couldn't seek to offset %" PRIu64 "!\n",offset)
         return -1;
       }
-      if(fread(buf,ToRead,1,hDdFile)!=1) {
+      if(fread(buf+ReadBytes,CurToRead,1,pDdSegments[lo].hFile)!=1) {
         LOG_ERROR("Couldn't read %zd bytes from offset %" PRIu64
-                  "!\n",ToRead,offset)
+                  "!\n",CurToRead,offset)
         return -1;
       }
+    }
+    ReadBytes+=CurToRead;
+    offset+=CurToRead;
+    if(offset>=pDdSegments[lo].Offset+pDdSegments[lo].Size) lo++;
+  }
+  return ReadBytes;
+}
+
+/*
+ * ReadOrigImageData:
+ *   Read data from original image without any bounds checking or caching
+ *
+ * Params:
+ *   buf: Pointer to buffer to write read data to (Must be preallocated!)
+ *   offset: Offset at which data should be read
+ *   ToRead: Size of data which should be read (Size of buffer)
+ *
+ * Returns:
+ *   Number of read bytes on success or "-1" on error
+ */
+static int ReadOrigImageData(char *buf, off_t offset, size_t ToRead) {
+  // Read data from image file
+  switch(XMountConfData.OrigImageType) {
+    case TOrigImageType_DD:
+      // Original image is a DD file. Seek to offset and read ToRead bytes.
+      // TODO: Perhaps check whether it is cheaper to seek from current position
+      // to offset than seeking from beginning of the file
+      if(ReadDdSegments(buf,offset,ToRead)!=ToRead) return -1;
       LOG_DEBUG("Read %zd bytes at offset %" PRIu64 " from DD file\n",
                 ToRead,offset)
       break;
@@ -813,1374 +1548,8732 @@ static int GetOrigImageData(char *buf, off_t offset, size_t size) {
 }
 
 /*
- * GetVirtVmdkData:
- *   Read data from virtual VMDK file
+ * ReadCacheLookup:
+ *   Search the read cache for the slot holding the given input image block
  *
  * Params:
- *   buf: Pointer to buffer to write read data to (Must be preallocated!)
- *   offset: Offset at which data should be read
- *   size: Size of data which should be read (Size of buffer)
+ *   block: Input image block number
  *
  * Returns:
- *   Number of read bytes on success or "-1" on error
+ *   Slot number or READ_CACHE_NO_SLOT if block isn't cached
  */
- /*
-static int GetVirtualVmdkData(char *buf, off_t offset, size_t size) {
-  uint32_t len;
+static uint32_t ReadCacheLookup(uint64_t block) {
+  uint32_t slot=pReadCacheHashHead[block & ReadCacheHashMask];
 
-  len=strlen(pVirtualVmdkFile);
-  if(offset<len) {
-    if(offset+size>len) {
-      size=len-offset;
-      LOG_DEBUG("Attempt to read past EOF of virtual vmdk file\n")
-    }
-    if(XMountConfData.Writable==TRUE &&
-       pCacheFileHeader->VmdkFileCached==TRUE)
-    {
-      // VMDK file is cached. Read data from cache file
-      // TODO: Read data from cache file
-    } else {
-      // No write support or VMDK file not cached.
-      memcpy(buf,pVirtualVmdkFile+offset,size);
-      LOG_DEBUG("Read %" PRIu64 " bytes at offset %" PRIu64
-                " from virtual vmdk file\n",size,offset)
-    }
-  } else {
-    LOG_DEBUG("Attempt to read past EOF of virtual vmdk file\n");
-    return -1;
+  while(slot!=READ_CACHE_NO_SLOT) {
+    if(pReadCacheFileSlots[slot].Block==block) return slot;
+    slot=pReadCacheHashNext[slot];
   }
-  return size;
+  return READ_CACHE_NO_SLOT;
 }
-*/
 
 /*
- * GetVirtImageData:
- *   Read data from virtual image
+ * ReadCacheLinkSlot:
+ *   Add a slot to the read cache hash table
  *
  * Params:
- *   buf: Pointer to buffer to write read data to (Must be preallocated!)
- *   offset: Offset at which data should be read
- *   size: Size of data which should be read (Size of buffer)
+ *   slot: Slot number. Slot's block must already be set!
  *
  * Returns:
- *   Number of read bytes on success or "-1" on error
+ *   n/a
  */
-static int GetVirtImageData(char *buf, off_t offset, size_t size) {
-  uint32_t CurBlock=0;
-  uint64_t VirtImageSize;
-  uint64_t orig_image_size;
-  size_t ToRead=0;
-  size_t CurToRead=0;
-  off_t FileOff=offset;
-  off_t BlockOff=0;
-  size_t to_read_later=0;
+static void ReadCacheLinkSlot(uint32_t slot) {
+  uint64_t bucket=pReadCacheFileSlots[slot].Block & ReadCacheHashMask;
 
-  // Get virtual image size
-  if(!GetVirtImageSize(&VirtImageSize)) {
-    LOG_ERROR("Couldn't get virtual image size!\n")
-    return -1;
-  }
+  pReadCacheHashNext[slot]=pReadCacheHashHead[bucket];
+  pReadCacheHashHead[bucket]=slot;
+}
 
-  if(offset>=VirtImageSize) {
-    LOG_ERROR("Attempt to read beyond virtual image EOF!\n")
-    return -1;
+/*
+ * ReadCacheUnlinkSlot:
+ *   Remove a slot from the read cache hash table
+ *
+ * Params:
+ *   slot: Slot number
+ *
+ * Returns:
+ *   n/a
+ */
+static void ReadCacheUnlinkSlot(uint32_t slot) {
+  uint64_t bucket=pReadCacheFileSlots[slot].Block & ReadCacheHashMask;
+  uint32_t *pCur=&(pReadCacheHashHead[bucket]);
+
+  while(*pCur!=READ_CACHE_NO_SLOT) {
+    if(*pCur==slot) {
+      *pCur=pReadCacheHashNext[slot];
+      break;
+    }
+    pCur=&(pReadCacheHashNext[*pCur]);
   }
+  pReadCacheHashNext[slot]=READ_CACHE_NO_SLOT;
+}
 
-  if(offset+size>VirtImageSize) {
-    LOG_DEBUG("Attempt to read pas EOF of virtual image file\n")
-    size=VirtImageSize-offset;
+/*
+ * WriteReadCacheSlot:
+ *   Write a slot index entry to the read cache file
+ *
+ * Params:
+ *   slot: Slot number
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int WriteReadCacheSlot(uint32_t slot) {
+  if(fseeko(hReadCacheFile,
+            pReadCacheFileHeader->pSlotIndex+
+              (slot*sizeof(TReadCacheFileSlot)),
+            SEEK_SET)!=0)
+  {
+    LOG_ERROR("Couldn't seek to read cache slot index entry %" PRIu32 "!\n",
+              slot)
+    return FALSE;
   }
+  if(fwrite(&(pReadCacheFileSlots[slot]),
+            sizeof(TReadCacheFileSlot),
+            1,
+            hReadCacheFile)!=1)
+  {
+    LOG_ERROR("Couldn't update read cache slot index entry %" PRIu32 "!\n",
+              slot)
+    return FALSE;
+  }
+  return TRUE;
+}
 
-  ToRead=size;
+/*
+ * GetReadCacheVictim:
+ *   Choose the slot that will receive the next input image block. Free slots
+ *   are used first. Otherwise, the clock algorithm gives every recently
+ *   accessed slot a second chance before evicting it.
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   Slot number
+ */
+static uint32_t GetReadCacheVictim() {
+  uint32_t slot;
+
+  while(1) {
+    slot=ReadCacheClockHand;
+    ReadCacheClockHand=(ReadCacheClockHand+1)%
+                         pReadCacheFileHeader->SlotCount;
+    if(pReadCacheFileSlots[slot].Block==READ_CACHE_SLOT_FREE) return slot;
+    if(pReadCacheSlotRef[slot]==0) return slot;
+    pReadCacheSlotRef[slot]=0;
+  }
+}
 
-  if(!GetOrigImageSize(&orig_image_size)) {
-    LOG_ERROR("Couldn't get original image size!")
-    return 0;
+/*
+ * AddReadCacheBlock:
+ *   Save an input image block to the read cache. Failing to do so isn't fatal
+ *   and therefore only reported as a warning.
+ *
+ * Params:
+ *   block: Input image block number
+ *   pData: Block data
+ *   DataSize: Size of block data
+ *
+ * Returns:
+ *   n/a
+ */
+static void AddReadCacheBlock(uint64_t block, char *pData, uint64_t DataSize) {
+  uint64_t BlockSize=pReadCacheFileHeader->BlockSize;
+  uint32_t slot;
+
+  // Evict victim slot. It is marked free in the read cache file before its
+  // data is overwritten to never associate a block with foreign data.
+  slot=GetReadCacheVictim();
+  if(pReadCacheFileSlots[slot].Block!=READ_CACHE_SLOT_FREE) {
+    LOG_DEBUG("Evicting block %" PRIu64 " from read cache slot %" PRIu32
+              "\n",pReadCacheFileSlots[slot].Block,slot)
+    ReadCacheUnlinkSlot(slot);
+    pReadCacheFileSlots[slot].Block=READ_CACHE_SLOT_FREE;
+    if(!WriteReadCacheSlot(slot)) return;
   }
 
-  // Read virtual image type specific data preceeding original image data
-  switch(XMountConfData.VirtImageType) {
-    case TVirtImageType_DD:
-    case TVirtImageType_DMG:
-    case TVirtImageType_VMDK:
-    case TVirtImageType_VMDKS:
-      break;
-    case TVirtImageType_VDI:
-      if(FileOff<VdiFileHeaderSize) {
-        if(FileOff+ToRead>VdiFileHeaderSize) CurToRead=VdiFileHeaderSize-FileOff;
-        else CurToRead=ToRead;
-        if(XMountConfData.Writable==TRUE &&
-           pCacheFileHeader->VdiFileHeaderCached==TRUE)
-        {
-          // VDI header was already cached
-          if(fseeko(hCacheFile,
-                    pCacheFileHeader->pVdiFileHeader+FileOff,
-                    SEEK_SET)!=0)
-          {
-            LOG_ERROR("Couldn't seek to cached VDI header at offset %"
-                      PRIu64 "\n",pCacheFileHeader->pVdiFileHeader+FileOff)
-            return 0;
-          }
-          if(fread(buf,CurToRead,1,hCacheFile)!=1) {
-            LOG_ERROR("Couldn't read %zu bytes from cache file at offset %"
-                      PRIu64 "\n",CurToRead,
-                      pCacheFileHeader->pVdiFileHeader+FileOff)
-            return 0;
-          }
-          LOG_DEBUG("Read %zd bytes from cached VDI header at offset %"
-                    PRIu64 " at cache file offset %" PRIu64 "\n",
-                    CurToRead,FileOff,
-                    pCacheFileHeader->pVdiFileHeader+FileOff)
-        } else {
-          // VDI header isn't cached
-          memcpy(buf,((char*)pVdiFileHeader)+FileOff,CurToRead);
-          LOG_DEBUG("Read %zd bytes at offset %" PRIu64
-                    " from virtual VDI header\n",CurToRead,
-                    FileOff)
-        }
-        if(ToRead==CurToRead) return ToRead;
-        else {
-          // Adjust values to read from original image
-          ToRead-=CurToRead;
-          buf+=CurToRead;
-          FileOff=0;
-        }
-      } else FileOff-=VdiFileHeaderSize;
-      break;
-    case TVirtImageType_VHD:
-      // When emulating VHD, make sure the while loop below only reads data
-      // available in the original image. Any VHD footer data must be read
-      // afterwards.
-      if(FileOff>=orig_image_size) {
-        to_read_later=ToRead;
-        ToRead=0;
-      } else if((FileOff+ToRead)>orig_image_size) {
-        to_read_later=(FileOff+ToRead)-orig_image_size;
-        ToRead-=to_read_later;
-      }
-      break;
+  // Save block to read cache
+  if(fseeko(hReadCacheFile,
+            pReadCacheFileHeader->pSlotData+(slot*BlockSize),
+            SEEK_SET)!=0 ||
+     fwrite(pData,DataSize,1,hReadCacheFile)!=1)
+  {
+    LOG_WARNING("Couldn't write block %" PRIu64 " to read cache slot %"
+                PRIu32 "!\n",block,slot)
+    return;
+  }
+  fflush(hReadCacheFile);
+  pReadCacheFileSlots[slot].Block=block;
+  if(!WriteReadCacheSlot(slot)) {
+    pReadCacheFileSlots[slot].Block=READ_CACHE_SLOT_FREE;
+    return;
   }
+  fflush(hReadCacheFile);
+  ReadCacheLinkSlot(slot);
+  pReadCacheSlotRef[slot]=1;
+  LOG_DEBUG("Cached block %" PRIu64 " in read cache slot %" PRIu32 "\n",
+            block,slot)
+}
 
-  // Calculate block to read data from
-  CurBlock=FileOff/CACHE_BLOCK_SIZE;
-  BlockOff=FileOff%CACHE_BLOCK_SIZE;
-  
-  // Read image data
-  while(ToRead!=0) {
-    // Calculate how many bytes we have to read from this block
-    if(BlockOff+ToRead>CACHE_BLOCK_SIZE) {
-      CurToRead=CACHE_BLOCK_SIZE-BlockOff;
-    } else CurToRead=ToRead;
-    if(XMountConfData.Writable==TRUE &&
-       pCacheFileBlockIndex[CurBlock].Assigned==TRUE)
+/*
+ * IsZeroData:
+ *   Check whether a buffer only contains zeros
+ *
+ * Params:
+ *   pData: Data to check
+ *   size: Size of data
+ *
+ * Returns:
+ *   "TRUE" if all bytes are zero, "FALSE" otherwise
+ */
+static int IsZeroData(const char *pData, uint64_t size) {
+  if(size==0) return TRUE;
+  if(pData[0]!=0) return FALSE;
+  return memcmp(pData,pData+1,size-1)==0;
+}
+
+/*
+ * GetZeroMapState:
+ *   Get what is known about the content of an input image block
+ *
+ * Params:
+ *   block: Input image block number
+ *
+ * Returns:
+ *   ZERO_MAP_UNKNOWN, ZERO_MAP_ZERO or ZERO_MAP_DATA
+ */
+static uint8_t GetZeroMapState(uint64_t block) {
+  return (pZeroMap[block/4]>>((block%4)*2)) & 3;
+}
+
+/*
+ * SetZeroMapState:
+ *   Set state of a still unknown input image block. If a read cache file is
+ *   used, the zero map is saved there.
+ *
+ * Params:
+ *   block: Input image block number
+ *   state: ZERO_MAP_ZERO or ZERO_MAP_DATA
+ *
+ * Returns:
+ *   n/a
+ */
+static void SetZeroMapState(uint64_t block, uint8_t state) {
+  pZeroMap[block/4]|=state<<((block%4)*2);
+  if(state==ZERO_MAP_ZERO) ZeroMapZeroBlocks++;
+  ZeroMapKnownBlocks++;
+  if(hReadCacheFile!=NULL && pReadCacheFileHeader->pZeroMap!=0) {
+    if(fseeko(hReadCacheFile,
+              pReadCacheFileHeader->pZeroMap+(block/4),
+              SEEK_SET)!=0 ||
+       fwrite(&(pZeroMap[block/4]),1,1,hReadCacheFile)!=1)
     {
-      // Write support enabled and need to read altered data from cachefile
-      if(fseeko(hCacheFile,
-                pCacheFileBlockIndex[CurBlock].off_data+BlockOff,
-                SEEK_SET)!=0)
-      {
-        LOG_ERROR("Couldn't seek to offset %" PRIu64
-                  " in cache file\n")
-        return -1;
-      }
-      if(fread(buf,CurToRead,1,hCacheFile)!=1) {
-        LOG_ERROR("Couldn't read data from cache file!\n")
-        return -1;
-      }
-      LOG_DEBUG("Read %zd bytes at offset %" PRIu64
-                " from cache file\n",CurToRead,FileOff)
-    } else {
-      // No write support or data not cached
-      if(GetOrigImageData(buf,
-                          FileOff,
-                          CurToRead)!=CurToRead)
-      {
-        LOG_ERROR("Couldn't read data from input image!\n")
-        return -1;
-      }
-      LOG_DEBUG("Read %zd bytes at offset %" PRIu64
-                " from original image file\n",CurToRead,
-                FileOff)
+      LOG_WARNING("Couldn't save zero map to read cache file!\n")
     }
-    CurBlock++;
-    BlockOff=0;
-    buf+=CurToRead;
-    ToRead-=CurToRead;
-    FileOff+=CurToRead;
   }
+}
 
-  if(to_read_later!=0) {
-    // Read virtual image type specific data following original image data
-    switch(XMountConfData.VirtImageType) {
-      case TVirtImageType_DD:
-      case TVirtImageType_DMG:
-      case TVirtImageType_VMDK:
-      case TVirtImageType_VMDKS:
-      case TVirtImageType_VDI:
-        break;
-      case TVirtImageType_VHD:
-        // Micro$oft has choosen to use a footer rather then a header.
-        if(XMountConfData.Writable==TRUE &&
-           pCacheFileHeader->VhdFileHeaderCached==TRUE)
-        {
-          // VHD footer was already cached
-          if(fseeko(hCacheFile,
-                    pCacheFileHeader->pVhdFileHeader+(FileOff-orig_image_size),
-                    SEEK_SET)!=0)
-          {
-            LOG_ERROR("Couldn't seek to cached VHD footer at offset %"
-                      PRIu64 "\n",
-                      pCacheFileHeader->pVhdFileHeader+
-                        (FileOff-orig_image_size))
-            return 0;
-          }
-          if(fread(buf,to_read_later,1,hCacheFile)!=1) {
-            LOG_ERROR("Couldn't read %zu bytes from cache file at offset %"
-                      PRIu64 "\n",to_read_later,
-                      pCacheFileHeader->pVhdFileHeader+
-                        (FileOff-orig_image_size))
-            return 0;
-          }
-          LOG_DEBUG("Read %zd bytes from cached VHD footer at offset %"
-                    PRIu64 " at cache file offset %" PRIu64 "\n",
-                    to_read_later,(FileOff-orig_image_size),
-                    pCacheFileHeader->pVhdFileHeader+(FileOff-orig_image_size))
-        } else {
-          // VHD header isn't cached
-          memcpy(buf,
-                 ((char*)pVhdFileHeader)+(FileOff-orig_image_size),
-                 to_read_later);
-          LOG_DEBUG("Read %zd bytes at offset %" PRIu64
-                    " from virtual VHD header\n",
-                    to_read_later,
-                    (FileOff-orig_image_size))
-        }
-        break;
-    }
-  }
-
-  return size;
+/*
+ * ClassifyBlock:
+ *   Update zero map using the data of a whole input image block that has been
+ *   read anyway
+ *
+ * Params:
+ *   block: Input image block number
+ *   pData: Block data
+ *   size: Size of block data
+ *
+ * Returns:
+ *   n/a
+ */
+static void ClassifyBlock(uint64_t block, const char *pData, uint64_t size) {
+  if(pZeroMap==NULL || GetZeroMapState(block)!=ZERO_MAP_UNKNOWN) return;
+  if(IsZeroData(pData,size)) SetZeroMapState(block,ZERO_MAP_ZERO);
+  else SetZeroMapState(block,ZERO_MAP_DATA);
 }
 
 /*
- * SetVdiFileHeaderData:
- *   Write data to virtual VDI file header
+ * MarkDdHoleBlocks:
+ *   Mark all unknown blocks lying in holes of the DD input files as zero
+ *   blocks so they don't need to be scanned
  *
  * Params:
- *   buf: Buffer containing data to write
- *   offset: Offset of changes
- *   size: Amount of bytes to write
+ *   n/a
  *
  * Returns:
- *   Number of written bytes on success or "-1" on error
+ *   n/a
  */
-static int SetVdiFileHeaderData(char *buf,off_t offset,size_t size) {
-  if(offset+size>VdiFileHeaderSize) size=VdiFileHeaderSize-offset;
-  LOG_DEBUG("Need to cache %zu bytes at offset %" PRIu64
-            " from VDI header\n",size,offset)
-  if(pCacheFileHeader->VdiFileHeaderCached==1) {
-    // Header was already cached
-    if(fseeko(hCacheFile,
-              pCacheFileHeader->pVdiFileHeader+offset,
-              SEEK_SET)!=0)
-    {
-      LOG_ERROR("Couldn't seek to cached VDI header at address %"
-                PRIu64 "\n",pCacheFileHeader->pVdiFileHeader+offset)
-      return -1;
-    }
-    if(fwrite(buf,size,1,hCacheFile)!=1) {
-      LOG_ERROR("Couldn't write %zu bytes to cache file at offset %"
-                PRIu64 "\n",size,
-                pCacheFileHeader->pVdiFileHeader+offset)
-      return -1;
-    }
-    LOG_DEBUG("Wrote %zd bytes at offset %" PRIu64 " to cache file\n",
-              size,pCacheFileHeader->pVdiFileHeader+offset)
-  } else {
-    // Header wasn't already cached.
-    if(fseeko(hCacheFile,
-              0,
-              SEEK_END)!=0)
-    {
-      LOG_ERROR("Couldn't seek to end of cache file!")
-      return -1;
-    }
-    pCacheFileHeader->pVdiFileHeader=ftello(hCacheFile);
-    LOG_DEBUG("Caching whole VDI header\n")
-    if(offset>0) {
-      // Changes do not begin at offset 0, need to prepend with data from
-      // VDI header
-      if(fwrite((char*)pVdiFileHeader,offset,1,hCacheFile)!=1) {
-        LOG_ERROR("Error while writing %" PRIu64 " bytes "
-                  "to cache file at offset %" PRIu64 "!\n",
-                  offset,
-                  pCacheFileHeader->pVdiFileHeader);
-        return -1;
-      }
-      LOG_DEBUG("Prepended changed data with %" PRIu64
-                " bytes at cache file offset %" PRIu64 "\n",
-                offset,pCacheFileHeader->pVdiFileHeader)
-    }
-    // Cache changed data
-    if(fwrite(buf,size,1,hCacheFile)!=1) {
-      LOG_ERROR("Couldn't write %zu bytes to cache file at offset %"
-                PRIu64 "\n",size,
-                pCacheFileHeader->pVdiFileHeader+offset)
-      return -1;
-    }
-    LOG_DEBUG("Wrote %zu bytes of changed data to cache file offset %"
-              PRIu64 "\n",size,
-              pCacheFileHeader->pVdiFileHeader+offset)
-    if(offset+size!=VdiFileHeaderSize) {
-      // Need to append data from VDI header to cache whole data struct
-      if(fwrite(((char*)pVdiFileHeader)+offset+size,
-                VdiFileHeaderSize-(offset+size),
-                1,
-                hCacheFile)!=1)
-      {
-        LOG_ERROR("Couldn't write %zu bytes to cache file at offset %"
-                  PRIu64 "\n",VdiFileHeaderSize-(offset+size),
-                  (uint64_t)(pCacheFileHeader->pVdiFileHeader+offset+size))
-        return -1;
-      }
-      LOG_DEBUG("Appended %" PRIu32
-                " bytes to changed data at cache file offset %"
-                PRIu64 "\n",VdiFileHeaderSize-(offset+size),
-                pCacheFileHeader->pVdiFileHeader+offset+size)
-    }
-    // Mark header as cached and update header in cache file
-    pCacheFileHeader->VdiFileHeaderCached=1;
-    if(fseeko(hCacheFile,0,SEEK_SET)!=0) {
-      LOG_ERROR("Couldn't seek to offset 0 of cache file!\n")
-      return -1;
-    }
-    if(fwrite((char*)pCacheFileHeader,sizeof(TCacheFileHeader),1,hCacheFile)!=1) {
-      LOG_ERROR("Couldn't write changed cache file header!\n")
-      return -1;
+static void MarkDdHoleBlocks() {
+  uint64_t block;
+
+  for(block=0;DdHoleCount!=0 && block<ZeroMapBlockCount;block++) {
+    if(GetZeroMapState(block)==ZERO_MAP_UNKNOWN && IsDdHoleBlock(block)) {
+      SetZeroMapState(block,ZERO_MAP_ZERO);
     }
   }
-  // All important data has been written, now flush all buffers to make
-  // sure data is written to cache file
-  fflush(hCacheFile);
-#ifndef __APPLE__
-  ioctl(fileno(hCacheFile),BLKFLSBUF,0);
-#endif
-  return size;
 }
 
 /*
- * SetVhdFileHeaderData:
- *   Write data to virtual VHD file footer
+ * IsZeroBlock:
+ *   Check if a data area block is known to contain only zeros, either by the
+ *   zero map or because it is a hole of the DD input files. Blocks changed
+ *   through virtual write access never are.
  *
  * Params:
- *   buf: Buffer containing data to write
- *   offset: Offset of changes
- *   size: Amount of bytes to write
+ *   block: Data area block number
  *
  * Returns:
- *   Number of written bytes on success or "-1" on error
+ *   "TRUE" if block only contains zeros, "FALSE" if not or if unknown
  */
-static int SetVhdFileHeaderData(char *buf,off_t offset,size_t size) {
-  LOG_DEBUG("Need to cache %zu bytes at offset %" PRIu64
-            " from VHD footer\n",size,offset)
-  if(pCacheFileHeader->VhdFileHeaderCached==1) {
-    // Header has already been cached
-    if(fseeko(hCacheFile,
-              pCacheFileHeader->pVhdFileHeader+offset,
-              SEEK_SET)!=0)
-    {
-      LOG_ERROR("Couldn't seek to cached VHD header at address %"
-                PRIu64 "\n",pCacheFileHeader->pVhdFileHeader+offset)
-      return -1;
-    }
-    if(fwrite(buf,size,1,hCacheFile)!=1) {
-      LOG_ERROR("Couldn't write %zu bytes to cache file at offset %"
-                PRIu64 "\n",size,
-                pCacheFileHeader->pVhdFileHeader+offset)
-      return -1;
-    }
-    LOG_DEBUG("Wrote %zd bytes at offset %" PRIu64 " to cache file\n",
-              size,pCacheFileHeader->pVhdFileHeader+offset)
-  } else {
-    // Header hasn't been cached yet.
-    if(fseeko(hCacheFile,
-              0,
-              SEEK_END)!=0)
-    {
-      LOG_ERROR("Couldn't seek to end of cache file!")
-      return -1;
-    }
-    pCacheFileHeader->pVhdFileHeader=ftello(hCacheFile);
-    LOG_DEBUG("Caching whole VHD header\n")
-    if(offset>0) {
-      // Changes do not begin at offset 0, need to prepend with data from
-      // VHD header
-      if(fwrite((char*)pVhdFileHeader,offset,1,hCacheFile)!=1) {
-        LOG_ERROR("Error while writing %" PRIu64 " bytes "
-                  "to cache file at offset %" PRIu64 "!\n",
-                  offset,
-                  pCacheFileHeader->pVhdFileHeader);
-        return -1;
-      }
-      LOG_DEBUG("Prepended changed data with %" PRIu64
-                " bytes at cache file offset %" PRIu64 "\n",
-                offset,pCacheFileHeader->pVhdFileHeader)
-    }
-    // Cache changed data
-    if(fwrite(buf,size,1,hCacheFile)!=1) {
-      LOG_ERROR("Couldn't write %zu bytes to cache file at offset %"
-                PRIu64 "\n",size,
-                pCacheFileHeader->pVhdFileHeader+offset)
-      return -1;
-    }
-    LOG_DEBUG("Wrote %zu bytes of changed data to cache file offset %"
-              PRIu64 "\n",size,
-              pCacheFileHeader->pVhdFileHeader+offset)
-    if(offset+size!=sizeof(TVhdFileHeader)) {
-      // Need to append data from VHD header to cache whole data struct
-      if(fwrite(((char*)pVhdFileHeader)+offset+size,
-                sizeof(TVhdFileHeader)-(offset+size),
-                1,
-                hCacheFile)!=1)
-      {
-        LOG_ERROR("Couldn't write %zu bytes to cache file at offset %"
-                  PRIu64 "\n",sizeof(TVhdFileHeader)-(offset+size),
-                  (uint64_t)(pCacheFileHeader->pVhdFileHeader+offset+size))
-        return -1;
-      }
-      LOG_DEBUG("Appended %" PRIu32
-                " bytes to changed data at cache file offset %"
-                PRIu64 "\n",sizeof(TVhdFileHeader)-(offset+size),
-                pCacheFileHeader->pVhdFileHeader+offset+size)
-    }
-    // Mark header as cached and update header in cache file
-    pCacheFileHeader->VhdFileHeaderCached=1;
-    if(fseeko(hCacheFile,0,SEEK_SET)!=0) {
-      LOG_ERROR("Couldn't seek to offset 0 of cache file!\n")
-      return -1;
-    }
-    if(fwrite((char*)pCacheFileHeader,sizeof(TCacheFileHeader),1,hCacheFile)!=1) {
-      LOG_ERROR("Couldn't write changed cache file header!\n")
-      return -1;
-    }
-  }
-  // All important data has been written, now flush all buffers to make
-  // sure data is written to cache file
-  fflush(hCacheFile);
-#ifndef __APPLE__
-  ioctl(fileno(hCacheFile),BLKFLSBUF,0);
-#endif
-  return size;
+static int IsZeroBlock(uint64_t block) {
+  if(pZeroMap!=NULL && block<ZeroMapBlockCount) {
+    if(GetZeroMapState(block)!=ZERO_MAP_ZERO) return FALSE;
+  } else if(!IsDdHoleBlock(block)) return FALSE;
+  return !(XMountConfData.Writable==TRUE &&
+           pCacheFileBlockIndex[block].Assigned==TRUE);
 }
 
 /*
- * SetVirtImageData:
- *   Write data to virtual image
+ * GetReadCacheData:
+ *   Read data of a single input image block through the read cache. On a miss,
+ *   the whole block is read from the input image and added to the read cache.
  *
  * Params:
- *   buf: Buffer containing data to write
- *   offset: Offset to start writing at
- *   size: Size of data to be written
+ *   buf: Pointer to buffer to write read data to (Must be preallocated!)
+ *   block: Input image block to read data from
+ *   BlockOff: Offset inside block at which data should be read
+ *   size: Size of data which should be read (Must not cross block boundary!)
  *
  * Returns:
- *   Number of written bytes on success or "-1" on error
+ *   Number of read bytes on success or "-1" on error
  */
-static int SetVirtImageData(const char *buf, off_t offset, size_t size) {
-  uint64_t CurBlock=0;
-  uint64_t VirtImageSize;
-  uint64_t OrigImageSize;
-  size_t ToWrite=0;
-  size_t to_write_later=0;
-  size_t CurToWrite=0;
-  off_t FileOff=offset;
-  off_t BlockOff=0;
-  char *WriteBuf=(char*)buf;
-  char *buf2;
-  ssize_t ret;
+static int GetReadCacheData(char *buf,
+                            uint64_t block,
+                            off_t BlockOff,
+                            size_t size)
+{
+  uint64_t BlockSize=pReadCacheFileHeader->BlockSize;
+  uint64_t ImageSize=0;
+  uint64_t BlockDataSize;
+  uint32_t slot;
+
+  slot=ReadCacheLookup(block);
+  if(slot!=READ_CACHE_NO_SLOT) {
+    // Block is cached, read data from read cache file
+    if(fseeko(hReadCacheFile,
+              pReadCacheFileHeader->pSlotData+(slot*BlockSize)+BlockOff,
+              SEEK_SET)!=0 ||
+       fread(buf,size,1,hReadCacheFile)!=1)
+    {
+      LOG_ERROR("Couldn't read %zu bytes from read cache slot %" PRIu32
+                "!\n",size,slot)
+      return -1;
+    }
+    pReadCacheSlotRef[slot]=1;
+    LOG_DEBUG("Read %zu bytes of block %" PRIu64 " from read cache slot %"
+              PRIu32 "\n",size,block,slot)
+    return size;
+  }
 
-  // Get virtual image size
-  if(!GetVirtImageSize(&VirtImageSize)) {
-    LOG_ERROR("Couldn't get virtual image size!\n")
+  // Block isn't cached. Read whole block from input image
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
     return -1;
   }
-
-  if(offset>=VirtImageSize) {
-    LOG_ERROR("Attempt to write beyond EOF of virtual image file!\n")
+  if((block+1)*BlockSize>ImageSize) BlockDataSize=ImageSize-(block*BlockSize);
+  else BlockDataSize=BlockSize;
+  if(ReadOrigImageData(pReadCacheBlockBuf,
+                       block*BlockSize,
+                       BlockDataSize)!=BlockDataSize)
+  {
+    LOG_ERROR("Couldn't read block %" PRIu64 " from input image!\n",block)
     return -1;
   }
+  memcpy(buf,pReadCacheBlockBuf+BlockOff,size);
 
-  if(offset+size>VirtImageSize) {
-    LOG_DEBUG("Attempt to write past EOF of virtual image file\n")
-    size=VirtImageSize-offset;
+  ClassifyBlock(block,pReadCacheBlockBuf,BlockDataSize);
+  AddReadCacheBlock(block,pReadCacheBlockBuf,BlockDataSize);
+
+  return size;
+}
+
+/*
+ * IsBlockStaged:
+ *   Check whether an input image block has already been copied to the stage
+ *   file
+ *
+ * Params:
+ *   block: Input image block number
+ *
+ * Returns:
+ *   "TRUE" if block is staged, "FALSE" otherwise
+ */
+static int IsBlockStaged(uint64_t block) {
+  return (pStageBitmap[block/8]>>(block%8)) & 1;
+}
+
+/*
+ * IsBlockStagePending:
+ *   Check whether an input image block has been written to the stage file
+ *   but not synced and marked as staged yet (See SyncStagedBlocks)
+ *
+ * Params:
+ *   block: Input image block number
+ *
+ * Returns:
+ *   "TRUE" if block is pending, "FALSE" otherwise
+ */
+static int IsBlockStagePending(uint64_t block) {
+  uint32_t i;
+
+  for(i=0;i<StagePendingCount;i++) {
+    if(StagePending[i]==block) return TRUE;
   }
+  return FALSE;
+}
 
-  ToWrite=size;
+/*
+ * QueueStageBlock:
+ *   Ask the stage thread to copy the given block next. When the queue is full,
+ *   the oldest request is dropped as it will be reached by the sequential scan
+ *   anyway.
+ *
+ * Params:
+ *   block: Input image block number
+ *
+ * Returns:
+ *   n/a
+ */
+static void QueueStageBlock(uint64_t block) {
+  uint32_t i;
 
-  // Get original image size
-  if(!GetOrigImageSize(&OrigImageSize)) {
-    LOG_ERROR("Couldn't get original image size!\n")
+  if(IsBlockStaged(block) || IsBlockStagePending(block)) return;
+  for(i=0;i<StageQueueLen;i++) {
+    if(StageQueue[(StageQueueHead+i)%STAGE_QUEUE_SIZE]==block) return;
+  }
+  if(StageQueueLen==STAGE_QUEUE_SIZE) {
+    StageQueueHead=(StageQueueHead+1)%STAGE_QUEUE_SIZE;
+    StageQueueLen--;
+  }
+  StageQueue[(StageQueueHead+StageQueueLen)%STAGE_QUEUE_SIZE]=block;
+  StageQueueLen++;
+}
+
+/*
+ * GetNextStageBlock:
+ *   Get next block to be copied to the stage file. Queued demand reads are
+ *   served first, afterwards the input image is scanned sequentially.
+ *
+ * Params:
+ *   pBlock: Pointer to an uint64_t which will receive the block number
+ *
+ * Returns:
+ *   "TRUE" if there is a block left to stage, "FALSE" otherwise
+ */
+static int GetNextStageBlock(uint64_t *pBlock) {
+  while(StageQueueLen!=0) {
+    *pBlock=StageQueue[StageQueueHead];
+    StageQueueHead=(StageQueueHead+1)%STAGE_QUEUE_SIZE;
+    StageQueueLen--;
+    if(!IsBlockStaged(*pBlock) && !IsBlockStagePending(*pBlock)) return TRUE;
+  }
+  while(StageCursor<StageBlockCount &&
+        (IsBlockStaged(StageCursor) || IsBlockStagePending(StageCursor)))
+  {
+    StageCursor++;
+  }
+  if(StageCursor==StageBlockCount) return FALSE;
+  *pBlock=StageCursor;
+  return TRUE;
+}
+
+/*
+ * GetStagedData:
+ *   Read data of a staged input image block from the stage file
+ *
+ * Params:
+ *   buf: Pointer to buffer to write read data to (Must be preallocated!)
+ *   block: Input image block to read data from
+ *   BlockOff: Offset inside block at which data should be read
+ *   size: Size of data which should be read (Must not cross block boundary!)
+ *
+ * Returns:
+ *   Number of read bytes on success or "-1" on error
+ */
+static int GetStagedData(char *buf,
+                         uint64_t block,
+                         off_t BlockOff,
+                         size_t size)
+{
+  if(fseeko(hStageFile,(block*CACHE_BLOCK_SIZE)+BlockOff,SEEK_SET)!=0 ||
+     fread(buf,size,1,hStageFile)!=1)
+  {
+    LOG_ERROR("Couldn't read %zu bytes of block %" PRIu64
+              " from stage file!\n",size,block)
     return -1;
   }
+  LOG_DEBUG("Read %zu bytes of block %" PRIu64 " from stage file\n",
+            size,block)
+  return size;
+}
 
-  // Cache virtual image type specific data preceeding original image data
-  switch(XMountConfData.VirtImageType) {
-    case TVirtImageType_DD:
-    case TVirtImageType_DMG:
-    case TVirtImageType_VMDK:
-    case TVirtImageType_VMDKS:
+/*
+ * StageBlock:
+ *   Copy an input image block to the stage file and add it to the blocks
+ *   waiting to be synced and marked as staged (See SyncStagedBlocks). Blocks
+ *   only containing zeros aren't written as the stage file is created sparse.
+ *
+ * Params:
+ *   block: Input image block number
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int StageBlock(uint64_t block) {
+  uint64_t ImageSize=0;
+  uint64_t BlockDataSize;
+
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return FALSE;
+  }
+  if((block+1)*CACHE_BLOCK_SIZE>ImageSize) {
+    BlockDataSize=ImageSize-(block*CACHE_BLOCK_SIZE);
+  } else BlockDataSize=CACHE_BLOCK_SIZE;
+
+  // Prefer already decoded data from read cache but don't let the sequential
+  // scan replace read cache content
+  if(hReadCacheFile!=NULL && ReadCacheLookup(block)!=READ_CACHE_NO_SLOT) {
+    if(GetReadCacheData(pStageBlockBuf,block,0,BlockDataSize)!=BlockDataSize) {
+      return FALSE;
+    }
+  } else if(ReadOrigImageData(pStageBlockBuf,
+                              block*CACHE_BLOCK_SIZE,
+                              BlockDataSize)!=BlockDataSize)
+  {
+    LOG_ERROR("Couldn't read block %" PRIu64 " from input image!\n",block)
+    return FALSE;
+  }
+
+  ClassifyBlock(block,pStageBlockBuf,BlockDataSize);
+  if(!IsZeroData(pStageBlockBuf,BlockDataSize)) {
+    if(fseeko(hStageFile,block*CACHE_BLOCK_SIZE,SEEK_SET)!=0 ||
+       fwrite(pStageBlockBuf,BlockDataSize,1,hStageFile)!=1)
+    {
+      LOG_ERROR("Couldn't write block %" PRIu64 " to stage file!\n",block)
+      return FALSE;
+    }
+    if(fflush(hStageFile)!=0) {
+      LOG_ERROR("Couldn't write block %" PRIu64 " to stage file!\n",block)
+      return FALSE;
+    }
+  }
+
+  StagePending[StagePendingCount++]=block;
+  return TRUE;
+}
+
+/*
+ * SyncStagedBlocks:
+ *   Sync the stage file and mark all pending blocks as staged afterwards. A
+ *   crash thus never leaves a block marked as staged in the stage map file
+ *   whose data didn't hit the disk. Must be called without holding the image
+ *   mutex, which is only taken to update the bitmap.
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int SyncStagedBlocks() {
+  uint64_t block;
+  uint32_t i;
+  int ret=TRUE;
+
+  // Only the stage thread writes to the stage file and the pending blocks, so
+  // the slow part can run while FUSE requests are served
+  if(StagePendingCount==0) return TRUE;
+  if(fdatasync(fileno(hStageFile))!=0) {
+    LOG_ERROR("Couldn't sync stage file!\n")
+    ret=FALSE;
+  }
+
+  pthread_mutex_lock(&mutex_image_rw);
+  for(i=0;ret && i<StagePendingCount;i++) {
+    block=StagePending[i];
+    pStageBitmap[block/8]|=1<<(block%8);
+    if(fseeko(hStageMapFile,
+              pStageMapFileHeader->pBitmap+(block/8),
+              SEEK_SET)!=0 ||
+       fwrite(&(pStageBitmap[block/8]),1,1,hStageMapFile)!=1)
+    {
+      LOG_ERROR("Couldn't update stage map file!\n")
+      ret=FALSE;
       break;
-    case TVirtImageType_VDI:
-      if(FileOff<VdiFileHeaderSize) {
-        ret=SetVdiFileHeaderData(WriteBuf,FileOff,ToWrite);
-        if(ret==-1) {
-          LOG_ERROR("Couldn't write data to virtual VDI file header!\n")
-          return -1;
-        }
-        if(ret==ToWrite) return ToWrite;
-        else {
-          ToWrite-=ret;
-          WriteBuf+=ret;
-          FileOff=0;
-        }
-      } else FileOff-=VdiFileHeaderSize;
+    }
+    StagedBlocks++;
+    LOG_DEBUG("Staged block %" PRIu64 " (%" PRIu64 "/%" PRIu64 ")\n",
+              block,StagedBlocks,StageBlockCount)
+  }
+  fflush(hStageMapFile);
+  StagePendingCount=0;
+  pthread_mutex_unlock(&mutex_image_rw);
+  return ret;
+}
+
+/*
+ * StageImage:
+ *   Stage thread copying the input image to the stage file block by block.
+ *   The image mutex is only held while copying a single block so that FUSE
+ *   requests are served in between. Copied blocks are synced in batches of
+ *   STAGE_SYNC_BLOCKS or every STAGE_SYNC_INTERVAL seconds.
+ *
+ * Params:
+ *   p: Unused
+ *
+ * Returns:
+ *   NULL
+ */
+static void *StageImage(void *p) {
+  uint64_t block;
+  time_t SyncTime=time(NULL);
+  int sync;
+
+  while(1) {
+    pthread_mutex_lock(&mutex_image_rw);
+    if(StageThreadStop || !GetNextStageBlock(&block)) {
+      pthread_mutex_unlock(&mutex_image_rw);
       break;
-    case TVirtImageType_VHD:
-      // When emulating VHD, make sure the while loop below only writes data
-      // available in the original image. Any VHD footer data must be written
-      // afterwards.
-      if(FileOff>=OrigImageSize) {
-        to_write_later=ToWrite;
-        ToWrite=0;
-      } else if((FileOff+ToWrite)>OrigImageSize) {
-        to_write_later=(FileOff+ToWrite)-OrigImageSize;
-        ToWrite-=to_write_later;
+    }
+    if(!StageBlock(block)) {
+      LOG_ERROR("Staging of input image aborted!\n")
+      pthread_mutex_unlock(&mutex_image_rw);
+      break;
+    }
+    pthread_mutex_unlock(&mutex_image_rw);
+    sync=(StagePendingCount==STAGE_SYNC_BLOCKS ||
+          time(NULL)-SyncTime>=STAGE_SYNC_INTERVAL);
+    if(sync) {
+      if(!SyncStagedBlocks()) {
+        LOG_ERROR("Staging of input image aborted!\n")
+        break;
+      }
+      SyncTime=time(NULL);
+    } else sched_yield();
+  }
+  // Mark blocks copied since the last sync as staged as well
+  SyncStagedBlocks();
+  if(StagedBlocks==StageBlockCount) {
+    LOG_DEBUG("Input image staged completely\n")
+  }
+  return NULL;
+}
+
+/*
+ * ScanZeroBlocks:
+ *   Zero map thread reading all input image blocks not classified yet. The
+ *   image mutex is only held while checking a single block.
+ *
+ * Params:
+ *   p: Unused
+ *
+ * Returns:
+ *   NULL
+ */
+static void *ScanZeroBlocks(void *p) {
+  uint64_t ImageSize=0;
+  uint64_t BlockDataSize;
+  uint64_t block;
+  int ret;
+
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return NULL;
+  }
+  for(block=0;block<ZeroMapBlockCount;block++) {
+    pthread_mutex_lock(&mutex_image_rw);
+    if(ZeroScanThreadStop) {
+      pthread_mutex_unlock(&mutex_image_rw);
+      break;
+    }
+    if(GetZeroMapState(block)!=ZERO_MAP_UNKNOWN) {
+      pthread_mutex_unlock(&mutex_image_rw);
+      continue;
+    }
+    if((block+1)*CACHE_BLOCK_SIZE>ImageSize) {
+      BlockDataSize=ImageSize-(block*CACHE_BLOCK_SIZE);
+    } else BlockDataSize=CACHE_BLOCK_SIZE;
+    // Blocks not staged yet are classified by the stage thread. Otherwise
+    // prefer already decoded data but don't replace read cache content.
+    if(hStageFile!=NULL) {
+      if(!IsBlockStaged(block)) {
+        pthread_mutex_unlock(&mutex_image_rw);
+        continue;
       }
+      ret=GetStagedData(pZeroScanBuf,block,0,BlockDataSize);
+    } else if(hReadCacheFile!=NULL &&
+              ReadCacheLookup(block)!=READ_CACHE_NO_SLOT)
+    {
+      ret=GetReadCacheData(pZeroScanBuf,block,0,BlockDataSize);
+    } else {
+      ret=ReadOrigImageData(pZeroScanBuf,
+                            block*CACHE_BLOCK_SIZE,
+                            BlockDataSize);
+    }
+    if(ret!=BlockDataSize) {
+      LOG_ERROR("Couldn't read block %" PRIu64 " from input image. "
+                "Zero map scan aborted!\n",block)
+      pthread_mutex_unlock(&mutex_image_rw);
       break;
+    }
+    ClassifyBlock(block,pZeroScanBuf,BlockDataSize);
+    pthread_mutex_unlock(&mutex_image_rw);
+    sched_yield();
   }
+  LOG_DEBUG("Zero map scan finished. %" PRIu64 " of %" PRIu64
+            " blocks contain only zeros\n",ZeroMapZeroBlocks,ZeroMapBlockCount)
+  return NULL;
+}
 
-  // Calculate block to write data to
-  CurBlock=FileOff/CACHE_BLOCK_SIZE;
-  BlockOff=FileOff%CACHE_BLOCK_SIZE;
-  
-  while(ToWrite!=0) {
-    // Calculate how many bytes we have to write to this block
-    if(BlockOff+ToWrite>CACHE_BLOCK_SIZE) {
-      CurToWrite=CACHE_BLOCK_SIZE-BlockOff;
-    } else CurToWrite=ToWrite;
-    if(pCacheFileBlockIndex[CurBlock].Assigned==1) {
-      // Block was already cached
-      // Seek to data offset in cache file
-      if(fseeko(hCacheFile,
-             pCacheFileBlockIndex[CurBlock].off_data+BlockOff,
-             SEEK_SET)!=0)
-      {
-        LOG_ERROR("Couldn't seek to cached block at address %" PRIu64 "\n",
-                  pCacheFileBlockIndex[CurBlock].off_data+BlockOff)
+/*
+ * GetOrigImageData:
+ *   Read data from original image
+ *
+ * Params:
+ *   buf: Pointer to buffer to write read data to (Must be preallocated!)
+ *   offset: Offset at which data should be read
+ *   size: Size of data which should be read (Size of buffer)
+ *
+ * Returns:
+ *   Number of read bytes on success or "-1" on error
+ */
+static int GetOrigImageData(char *buf, off_t offset, size_t size) {
+  size_t ToRead=0;
+  size_t CurToRead=0;
+  uint64_t ImageSize=0;
+  uint64_t CurBlock=0;
+  off_t BlockOff=0;
+
+  // Make sure we aren't reading past EOF of image file
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get image size!\n")
+    return -1;
+  }
+  if(offset>=ImageSize) {
+    // Offset is beyond image size
+    LOG_DEBUG("Offset is beyond image size.\n")
+    return 0;
+  }
+  if(offset+size>ImageSize) {
+    // Attempt to read data past EOF of image file
+    ToRead=ImageSize-offset;
+    LOG_DEBUG("Attempt to read data past EOF. Corrected size from %zd"
+              " to %zd.\n",size,ToRead)
+  } else ToRead=size;
+
+  // Without read cache and staging, read data directly from input image
+  if(hReadCacheFile==NULL && hStageFile==NULL) {
+    return ReadOrigImageData(buf,offset,ToRead);
+  }
+
+  // Read data block by block from stage file or through the read cache
+  size=ToRead;
+  CurBlock=offset/CACHE_BLOCK_SIZE;
+  BlockOff=offset%CACHE_BLOCK_SIZE;
+  while(ToRead!=0) {
+    if(BlockOff+ToRead>CACHE_BLOCK_SIZE) {
+      CurToRead=CACHE_BLOCK_SIZE-BlockOff;
+    } else CurToRead=ToRead;
+    if(hStageFile!=NULL && IsBlockStaged(CurBlock)) {
+      if(GetStagedData(buf,CurBlock,BlockOff,CurToRead)!=CurToRead) {
         return -1;
       }
-      if(fwrite(WriteBuf,CurToWrite,1,hCacheFile)!=1) {
-        LOG_ERROR("Error while writing %zu bytes "
-                  "to cache file at offset %" PRIu64 "!\n",
-                  CurToWrite,
-                  pCacheFileBlockIndex[CurBlock].off_data+BlockOff);
+    } else {
+      // Let the stage thread copy this block next
+      if(hStageFile!=NULL) QueueStageBlock(CurBlock);
+      if(hReadCacheFile!=NULL) {
+        if(GetReadCacheData(buf,CurBlock,BlockOff,CurToRead)!=CurToRead) {
+          return -1;
+        }
+      } else if(ReadOrigImageData(buf,
+                                  (CurBlock*CACHE_BLOCK_SIZE)+BlockOff,
+                                  CurToRead)!=CurToRead)
+      {
         return -1;
       }
-      LOG_DEBUG("Wrote %zd bytes at offset %" PRIu64
-                " to cache file\n",CurToWrite,
-                pCacheFileBlockIndex[CurBlock].off_data+BlockOff)
-    } else {
-      // Uncached block. Need to cache entire new block
-      // Seek to end of cache file to append new cache block
-      fseeko(hCacheFile,0,SEEK_END);
-      pCacheFileBlockIndex[CurBlock].off_data=ftello(hCacheFile);
-      if(BlockOff!=0) {
-        // Changed data does not begin at block boundry. Need to prepend
+    }
+    CurBlock++;
+    BlockOff=0;
+    buf+=CurToRead;
+    ToRead-=CurToRead;
+  }
+  return size;
+}
+
+/*
+ * ReportCorruptCacheBlock:
+ *   Log a cache block failing its integrity check and add a note to the
+ *   virtual image info file
+ *
+ * Params:
+ *   block: Cache block number
+ *
+ * Returns:
+ *   n/a
+ */
+static void ReportCorruptCacheBlock(uint64_t block) {
+  char buf[200];
+
+  LOG_ERROR("Cache block %" PRIu64 " failed CRC32C integrity check!\n",
+            block)
+  sprintf(buf,
+          "WARNING: Cache block %" PRIu64 " (Offset %" PRIu64
+          ") failed CRC32C integrity check!\n",
+          block,
+          block*CACHE_BLOCK_SIZE);
+  if(pVirtualImageInfoFile!=NULL) {
+    pthread_mutex_lock(&mutex_info_read);
+    XMOUNT_STRAPP(pVirtualImageInfoFile,buf)
+    pthread_mutex_unlock(&mutex_info_read);
+  }
+}
+
+/*
+ * VerifyCacheFileBlock:
+ *   Read a whole cache block into pCacheBlockBuf and check it against its
+ *   CRC32C checksum. Every block is only checked once per mount.
+ *
+ * Params:
+ *   block: Cache block number
+ *
+ * Returns:
+ *   "TRUE" if block is valid, "FALSE" on error or checksum mismatch
+ */
+static int VerifyCacheFileBlock(uint64_t block) {
+  if(pCacheFileBlockVerified[block]==CACHE_BLOCK_CORRUPT) {
+    LOG_ERROR("Refusing to read corrupt cache block %" PRIu64 "!\n",block)
+    return FALSE;
+  }
+  if(fseeko(hCacheFile,pCacheFileBlockIndex[block].off_data,SEEK_SET)!=0 ||
+     fread(pCacheBlockBuf,CACHE_BLOCK_SIZE,1,hCacheFile)!=1)
+  {
+    LOG_ERROR("Couldn't read cache block %" PRIu64 " from cache file!\n",
+              block)
+    return FALSE;
+  }
+  if(Crc32c(0,pCacheBlockBuf,CACHE_BLOCK_SIZE)!=pCacheFileBlockCrcs[block]) {
+    pCacheFileBlockVerified[block]=CACHE_BLOCK_CORRUPT;
+    ReportCorruptCacheBlock(block);
+    return FALSE;
+  }
+  pCacheFileBlockVerified[block]=CACHE_BLOCK_VERIFIED;
+  LOG_DEBUG("Verified cache block %" PRIu64 "\n",block)
+  return TRUE;
+}
+
+/*
+ * WriteCacheFileBlockCrc:
+ *   Write checksum of a cache block to the cache file
+ *
+ * Params:
+ *   block: Cache block number
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int WriteCacheFileBlockCrc(uint64_t block) {
+  if(pCacheFileHeader->BlockCrcsPresent!=TRUE) return TRUE;
+  if(fseeko(hCacheFile,
+            pCacheFileHeader->pBlockCrcs+(block*sizeof(uint32_t)),
+            SEEK_SET)!=0 ||
+     fwrite(&(pCacheFileBlockCrcs[block]),sizeof(uint32_t),1,hCacheFile)!=1)
+  {
+    LOG_ERROR("Couldn't update checksum of cache block %" PRIu64 "!\n",block)
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/*
+ * GetDataAreaData:
+ *   Read data of a single data area block from the cache file if it has been
+ *   changed or from the input image otherwise
+ *
+ * Params:
+ *   buf: Pointer to buffer to write read data to (Must be preallocated!)
+ *   block: Data area block to read data from
+ *   BlockOff: Offset inside block at which data should be read
+ *   size: Size of data which should be read (Must not cross block boundary!)
+ *
+ * Returns:
+ *   Number of read bytes on success or "-1" on error
+ */
+static int GetDataAreaData(char *buf,
+                           uint64_t block,
+                           off_t BlockOff,
+                           size_t size)
+{
+  off_t FileOff=(block*CACHE_BLOCK_SIZE)+BlockOff;
+
+  if(XMountConfData.Writable==TRUE &&
+     pCacheFileBlockIndex[block].Assigned==TRUE &&
+     pCacheFileBlockVerified[block]!=CACHE_BLOCK_VERIFIED)
+  {
+    // Block is read from cache file for the first time. Check its integrity
+    // and serve data from the verified copy.
+    if(!VerifyCacheFileBlock(block)) return -1;
+    memcpy(buf,pCacheBlockBuf+BlockOff,size);
+    LOG_DEBUG("Read %zd bytes at offset %" PRIu64
+              " from cache file\n",size,FileOff)
+  } else if(XMountConfData.Writable==TRUE &&
+            pCacheFileBlockIndex[block].Assigned==TRUE)
+  {
+    // Write support enabled and need to read altered data from cachefile
+    if(fseeko(hCacheFile,
+              pCacheFileBlockIndex[block].off_data+BlockOff,
+              SEEK_SET)!=0)
+    {
+      LOG_ERROR("Couldn't seek to offset %" PRIu64
+                " in cache file\n",
+                pCacheFileBlockIndex[block].off_data+BlockOff)
+      return -1;
+    }
+    if(fread(buf,size,1,hCacheFile)!=1) {
+      LOG_ERROR("Couldn't read data from cache file!\n")
+      return -1;
+    }
+    LOG_DEBUG("Read %zd bytes at offset %" PRIu64
+              " from cache file\n",size,FileOff)
+  } else {
+    // No write support or data not cached
+    if(GetOrigImageData(buf,
+                        FileOff,
+                        size)!=size)
+    {
+      LOG_ERROR("Couldn't read data from input image!\n")
+      return -1;
+    }
+    LOG_DEBUG("Read %zd bytes at offset %" PRIu64
+              " from original image file\n",size,
+              FileOff)
+  }
+  return size;
+}
+
+/*
+ * MemCacheLookup:
+ *   Search the memory cache for the entry holding the given data area block
+ *
+ * Params:
+ *   block: Data area block number
+ *
+ * Returns:
+ *   Entry number or MEM_CACHE_NO_ENTRY if block isn't cached
+ */
+static uint32_t MemCacheLookup(uint64_t block) {
+  uint32_t entry=pMemCacheHashHead[block & MemCacheHashMask];
+
+  while(entry!=MEM_CACHE_NO_ENTRY) {
+    if(pMemCacheEntries[entry].Block==block) return entry;
+    entry=pMemCacheEntries[entry].Next;
+  }
+  return MEM_CACHE_NO_ENTRY;
+}
+
+/*
+ * MemCacheUnlinkEntry:
+ *   Remove an entry from the memory cache hash table
+ *
+ * Params:
+ *   entry: Entry number
+ *
+ * Returns:
+ *   n/a
+ */
+static void MemCacheUnlinkEntry(uint32_t entry) {
+  uint64_t bucket=pMemCacheEntries[entry].Block & MemCacheHashMask;
+  uint32_t *pCur=&(pMemCacheHashHead[bucket]);
+
+  while(*pCur!=MEM_CACHE_NO_ENTRY) {
+    if(*pCur==entry) {
+      *pCur=pMemCacheEntries[entry].Next;
+      break;
+    }
+    pCur=&(pMemCacheEntries[*pCur].Next);
+  }
+  pMemCacheEntries[entry].Next=MEM_CACHE_NO_ENTRY;
+}
+
+/*
+ * MemCacheCountAccess:
+ *   Count an access to a data area block not held by the memory cache. All
+ *   counters are halved from time to time so that only recent accesses count.
+ *
+ * Params:
+ *   block: Data area block number
+ *
+ * Returns:
+ *   Recent access count of block
+ */
+static uint8_t MemCacheCountAccess(uint64_t block) {
+  uint8_t *pCounter;
+  uint64_t i;
+
+  pCounter=&(pMemCacheCounters[(block*0x9E3779B97F4A7C15ULL)>>
+                               MemCacheCounterShift]);
+  if(*pCounter<MEM_CACHE_COUNTER_MAX) (*pCounter)++;
+  if(++MemCacheCountedAccesses>=MemCacheCounterCount) {
+    // Age all counters
+    for(i=0;i<MemCacheCounterCount;i++) pMemCacheCounters[i]>>=1;
+    MemCacheCountedAccesses=0;
+  }
+  return *pCounter;
+}
+
+/*
+ * DemoteMemCacheEntry:
+ *   Hand a block evicted from the memory cache down to the read cache if it
+ *   holds unchanged input image data the read cache doesn't hold anymore
+ *
+ * Params:
+ *   entry: Entry number
+ *
+ * Returns:
+ *   n/a
+ */
+static void DemoteMemCacheEntry(uint32_t entry) {
+  uint64_t block=pMemCacheEntries[entry].Block;
+
+  if(hReadCacheFile==NULL) return;
+  if(XMountConfData.Writable==TRUE &&
+     pCacheFileBlockIndex[block].Assigned==TRUE)
+  {
+    // Changed blocks are kept in the cache file anyway
+    return;
+  }
+  if(ReadCacheLookup(block)!=READ_CACHE_NO_SLOT) return;
+  LOG_DEBUG("Demoting block %" PRIu64 " to read cache\n",block)
+  AddReadCacheBlock(block,
+                    pMemCacheEntries[entry].pData,
+                    pMemCacheEntries[entry].DataSize);
+}
+
+/*
+ * GetMemCacheVictim:
+ *   Choose the entry that will receive the next promoted block. Unused entries
+ *   are used first. Otherwise, the clock hand decrements the access count of
+ *   every entry it passes and evicts the first one having none left.
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   Entry number
+ */
+static uint32_t GetMemCacheVictim() {
+  uint32_t entry;
+
+  while(1) {
+    entry=MemCacheClockHand;
+    MemCacheClockHand=(MemCacheClockHand+1)%MemCacheEntryCount;
+    if(pMemCacheEntries[entry].Block==READ_CACHE_SLOT_FREE) break;
+    if(pMemCacheEntries[entry].Hits==0) {
+      DemoteMemCacheEntry(entry);
+      MemCacheUnlinkEntry(entry);
+      pMemCacheEntries[entry].Block=READ_CACHE_SLOT_FREE;
+      break;
+    }
+    pMemCacheEntries[entry].Hits--;
+  }
+  if(pMemCacheEntries[entry].pData==NULL) {
+    // Entry data is allocated on first use
+    XMOUNT_MALLOC(pMemCacheEntries[entry].pData,
+                  char*,
+                  CACHE_BLOCK_SIZE*sizeof(char))
+  }
+  return entry;
+}
+
+/*
+ * GetMemCacheData:
+ *   Read data of a single data area block through the memory cache. Blocks
+ *   are promoted into the memory cache once they have been accessed often
+ *   enough. Until then, data is read from the lower tiers directly.
+ *
+ * Params:
+ *   buf: Pointer to buffer to write read data to (Must be preallocated!)
+ *   block: Data area block to read data from
+ *   BlockOff: Offset inside block at which data should be read
+ *   size: Size of data which should be read (Must not cross block boundary!)
+ *
+ * Returns:
+ *   Number of read bytes on success or "-1" on error
+ */
+static int GetMemCacheData(char *buf,
+                           uint64_t block,
+                           off_t BlockOff,
+                           size_t size)
+{
+  uint64_t ImageSize=0;
+  uint64_t BlockDataSize;
+  uint32_t entry;
+
+  entry=MemCacheLookup(block);
+  if(entry!=MEM_CACHE_NO_ENTRY) {
+    // Block is cached, serve data from memory
+    memcpy(buf,pMemCacheEntries[entry].pData+BlockOff,size);
+    if(pMemCacheEntries[entry].Hits<MEM_CACHE_MAX_HITS) {
+      pMemCacheEntries[entry].Hits++;
+    }
+    MemCacheHits++;
+    LOG_DEBUG("Read %zu bytes of block %" PRIu64 " from memory cache\n",
+              size,block)
+    return size;
+  }
+  MemCacheMisses++;
+
+  if(MemCacheCountAccess(block)<MEM_CACHE_PROMOTE_HITS) {
+    // Block isn't hot enough to be promoted yet
+    return GetDataAreaData(buf,block,BlockOff,size);
+  }
+
+  // Promote whole block into memory cache
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return -1;
+  }
+  if((block+1)*CACHE_BLOCK_SIZE>ImageSize) {
+    BlockDataSize=ImageSize-(block*CACHE_BLOCK_SIZE);
+  } else BlockDataSize=CACHE_BLOCK_SIZE;
+  entry=GetMemCacheVictim();
+  if(GetDataAreaData(pMemCacheEntries[entry].pData,
+                     block,
+                     0,
+                     BlockDataSize)!=BlockDataSize)
+  {
+    return -1;
+  }
+  pMemCacheEntries[entry].Block=block;
+  pMemCacheEntries[entry].DataSize=BlockDataSize;
+  pMemCacheEntries[entry].Hits=1;
+  pMemCacheEntries[entry].Next=pMemCacheHashHead[block & MemCacheHashMask];
+  pMemCacheHashHead[block & MemCacheHashMask]=entry;
+  LOG_DEBUG("Promoted block %" PRIu64 " to memory cache entry %" PRIu32 "\n",
+            block,entry)
+
+  memcpy(buf,pMemCacheEntries[entry].pData+BlockOff,size);
+  return size;
+}
+
+/*
+ * UpdateMemCacheData:
+ *   Apply data written to the virtual image to the memory cache
+ *
+ * Params:
+ *   buf: Buffer containing written data
+ *   block: Data area block the data was written to
+ *   BlockOff: Offset inside block at which data was written
+ *   size: Size of written data (Must not cross block boundary!)
+ *
+ * Returns:
+ *   n/a
+ */
+static void UpdateMemCacheData(const char *buf,
+                               uint64_t block,
+                               off_t BlockOff,
+                               size_t size)
+{
+  uint32_t entry;
+
+  if(MemCacheEntryCount==0) return;
+  entry=MemCacheLookup(block);
+  if(entry==MEM_CACHE_NO_ENTRY) return;
+  memcpy(pMemCacheEntries[entry].pData+BlockOff,buf,size);
+}
+
+
+/*
+ * FindHeaderPage:
+ *   Search the header page index for a cached virtual image header page
+ *
+ * Params:
+ *   type: Virtual image type the page belongs to
+ *   page: Page number
+ *   pFound: Set to "TRUE" if page was found, "FALSE" otherwise
+ *
+ * Returns:
+ *   Position of page in header page index or position where it should be
+ *   inserted if it wasn't found
+ */
+static uint64_t FindHeaderPage(uint32_t type, uint64_t page, int *pFound) {
+  uint64_t lo=0;
+  uint64_t hi=0;
+  uint64_t mid;
+  pTCacheFileHeaderPage pCur;
+
+  *pFound=FALSE;
+  if(!XMountConfData.Writable) return 0;
+  hi=pCacheFileHeader->HeaderPageCount;
+  while(lo<hi) {
+    mid=lo+(hi-lo)/2;
+    pCur=&(pCacheFileHeaderPages[mid]);
+    if(pCur->VirtImageType==type && pCur->Page==page) {
+      *pFound=TRUE;
+      return mid;
+    }
+    if(pCur->VirtImageType<type ||
+       (pCur->VirtImageType==type && pCur->Page<page))
+    {
+      lo=mid+1;
+    } else hi=mid;
+  }
+  return lo;
+}
+
+/*
+ * WriteCacheFileHeader:
+ *   Write the in-memory cache file header back to the cache file
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int WriteCacheFileHeader() {
+  if(fseeko(hCacheFile,CacheFileHeaderOff,SEEK_SET)!=0 ||
+     fwrite(pCacheFileHeader,sizeof(TCacheFileHeader),1,hCacheFile)!=1)
+  {
+    LOG_ERROR("Couldn't write changed cache file header!\n")
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/*
+ * SetCacheFileDirty:
+ *   Mark the cache file as dirty before the first cache block is changed.
+ *   Cache block data and checksums are written separately, so a crash may
+ *   leave them out of sync (See RepairCacheFileCrcs). The mark is synced to
+ *   disk before any block data is written.
+ *
+ * Params:
+ *   dirty: "TRUE" to mark the cache file dirty, "FALSE" to mark it clean
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int SetCacheFileDirty(int dirty) {
+  if(pCacheFileHeader==NULL ||
+     pCacheFileHeader->BlockCrcsPresent!=TRUE ||
+     pCacheFileHeader->CacheFileDirty==dirty)
+  {
+    return TRUE;
+  }
+  // When marking clean, all block data and checksums must be on disk first
+  if(fflush(hCacheFile)!=0 || fdatasync(fileno(hCacheFile))!=0) {
+    LOG_ERROR("Couldn't sync cache file!\n")
+    return FALSE;
+  }
+  pCacheFileHeader->CacheFileDirty=dirty;
+  if(!WriteCacheFileHeader() ||
+     fflush(hCacheFile)!=0 ||
+     fdatasync(fileno(hCacheFile))!=0)
+  {
+    LOG_ERROR("Couldn't mark cache file as %s!\n",dirty ? "dirty" : "clean")
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/*
+ * WriteZeroQcow2CacheCluster:
+ *   Fill a QCOW2 cache file cluster with zeros
+ *
+ * Params:
+ *   off: Offset of cluster
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int WriteZeroQcow2CacheCluster(uint64_t off) {
+  char *pZero;
+  int ret=TRUE;
+
+  pZero=(char*)calloc(1,QCOW2_CACHE_CLUSTER_SIZE);
+  if(pZero==NULL) {
+    LOG_ERROR("Couldn't allocate memory!\n")
+    return FALSE;
+  }
+  if(fseeko(hCacheFile,off,SEEK_SET)!=0 ||
+     fwrite(pZero,QCOW2_CACHE_CLUSTER_SIZE,1,hCacheFile)!=1)
+  {
+    LOG_ERROR("Couldn't write cluster at offset %" PRIu64
+              " of cache file!\n",off)
+    ret=FALSE;
+  }
+  free(pZero);
+  return ret;
+}
+
+/*
+ * SetQcow2CacheRefcount:
+ *   Mark a QCOW2 cache file cluster as used. Its refcount block must exist.
+ *
+ * Params:
+ *   cluster: Cluster number
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int SetQcow2CacheRefcount(uint64_t cluster) {
+  uint64_t RefBlock=cluster/QCOW2_CACHE_REFCOUNT_ENTRIES;
+  uint16_t refcount=htobe16(1);
+
+  if(RefBlock>=Qcow2CacheRefBlocks ||
+     fseeko(hCacheFile,
+            pQcow2CacheRefTable[RefBlock]+
+              ((cluster%QCOW2_CACHE_REFCOUNT_ENTRIES)*sizeof(uint16_t)),
+            SEEK_SET)!=0 ||
+     fwrite(&refcount,sizeof(uint16_t),1,hCacheFile)!=1)
+  {
+    LOG_ERROR("Couldn't update refcount of cache file cluster %" PRIu64 "!\n",
+              cluster)
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/*
+ * LockQcow2CacheByte:
+ *   Test or take a read lock on a single byte of the QCOW2 cache file the same
+ *   way QEMU does (Open file description locks if supported, POSIX locks
+ *   otherwise).
+ *
+ * Params:
+ *   off: Byte to lock
+ *   test: If "TRUE", only check whether another process holds a lock on it
+ *
+ * Returns:
+ *   "TRUE" if the byte isn't locked by another process or has been locked,
+ *   "FALSE" otherwise
+ */
+static int LockQcow2CacheByte(off_t off, int test) {
+  struct flock lock;
+  int fd=fileno(hCacheFile);
+
+  memset(&lock,0,sizeof(struct flock));
+  lock.l_type=test ? F_WRLCK : F_RDLCK;
+  lock.l_whence=SEEK_SET;
+  lock.l_start=off;
+  lock.l_len=1;
+#ifdef F_OFD_SETLK
+  if(fcntl(fd,test ? F_OFD_GETLK : F_OFD_SETLK,&lock)==0) {
+    return !test || lock.l_type==F_UNLCK;
+  }
+  if(errno!=EINVAL) return FALSE;
+  // Kernel doesn't support open file description locks
+#endif
+  if(fcntl(fd,test ? F_GETLK : F_SETLK,&lock)!=0) return FALSE;
+  return !test || lock.l_type==F_UNLCK;
+}
+
+/*
+ * LockQcow2CacheFile:
+ *   Keep QEMU from writing to the QCOW2 cache file once xmount did, as both
+ *   would allocate the same clusters at its end. QEMU locks byte
+ *   QCOW2_LOCK_PERM_WRITE while it may write to an image and byte
+ *   QCOW2_LOCK_SHARED_WRITE while nobody else may. xmount takes the same
+ *   locks on its first write, after which QEMU refuses to open the cache file
+ *   for writing until it is unmounted.
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" if QEMU is using the cache file
+ */
+static int LockQcow2CacheFile() {
+  if(XMountConfData.CacheFormat!=TCacheFormat_QCOW2 || Qcow2CacheLocked) {
+    return TRUE;
+  }
+  if(!LockQcow2CacheByte(QCOW2_LOCK_PERM_WRITE,TRUE) ||
+     !LockQcow2CacheByte(QCOW2_LOCK_SHARED_WRITE,TRUE) ||
+     !LockQcow2CacheByte(QCOW2_LOCK_PERM_WRITE,FALSE) ||
+     !LockQcow2CacheByte(QCOW2_LOCK_SHARED_WRITE,FALSE))
+  {
+    LOG_ERROR("QCOW2 cache file is in use by QEMU. Refusing to write!\n")
+    return FALSE;
+  }
+  Qcow2CacheLocked=TRUE;
+  return TRUE;
+}
+
+/*
+ * AllocCacheFileSpace:
+ *   Reserve space at the end of the cache file. In QCOW2 cache files, whole
+ *   clusters are reserved and marked as used, adding refcount blocks as
+ *   needed.
+ *
+ * Params:
+ *   size: Amount of bytes needed
+ *   pOff: Offset of reserved space is written to this var
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int AllocCacheFileSpace(uint64_t size, uint64_t *pOff) {
+  uint64_t clusters;
+  uint64_t RefBlockOff;
+  uint64_t entry;
+  uint64_t i;
+
+  if(XMountConfData.CacheFormat!=TCacheFormat_QCOW2) {
+    if(fseeko(hCacheFile,0,SEEK_END)!=0) {
+      LOG_ERROR("Couldn't seek to end of cache file!\n")
+      return FALSE;
+    }
+    *pOff=ftello(hCacheFile);
+    return TRUE;
+  }
+
+  clusters=(size+QCOW2_CACHE_CLUSTER_SIZE-1)/QCOW2_CACHE_CLUSTER_SIZE;
+  // Refcount blocks are added in front of the clusters they have to cover
+  while(Qcow2CacheClusters+clusters+1>
+          Qcow2CacheRefBlocks*QCOW2_CACHE_REFCOUNT_ENTRIES)
+  {
+    if(Qcow2CacheRefBlocks>=QCOW2_CACHE_REFTABLE_ENTRIES) {
+      LOG_ERROR("QCOW2 cache file is full!\n")
+      return FALSE;
+    }
+    RefBlockOff=Qcow2CacheClusters*QCOW2_CACHE_CLUSTER_SIZE;
+    if(!WriteZeroQcow2CacheCluster(RefBlockOff)) return FALSE;
+    Qcow2CacheClusters++;
+    pQcow2CacheRefTable[Qcow2CacheRefBlocks]=RefBlockOff;
+    entry=htobe64(RefBlockOff);
+    if(fseeko(hCacheFile,
+              Qcow2CacheRefTableOff+(Qcow2CacheRefBlocks*sizeof(uint64_t)),
+              SEEK_SET)!=0 ||
+       fwrite(&entry,sizeof(uint64_t),1,hCacheFile)!=1)
+    {
+      LOG_ERROR("Couldn't update refcount table of cache file!\n")
+      return FALSE;
+    }
+    Qcow2CacheRefBlocks++;
+    if(!SetQcow2CacheRefcount(RefBlockOff/QCOW2_CACHE_CLUSTER_SIZE)) {
+      return FALSE;
+    }
+    LOG_DEBUG("Added refcount block at cache file offset %" PRIu64 "\n",
+              RefBlockOff)
+  }
+
+  *pOff=Qcow2CacheClusters*QCOW2_CACHE_CLUSTER_SIZE;
+  for(i=0;i<clusters;i++) {
+    if(!SetQcow2CacheRefcount(Qcow2CacheClusters+i)) return FALSE;
+  }
+  Qcow2CacheClusters+=clusters;
+  return TRUE;
+}
+
+/*
+ * WriteCacheFileBlockIndex:
+ *   Write the block index entry of a newly assigned cache block to the cache
+ *   file. QCOW2 cache files keep their block index in L2 tables.
+ *
+ * Params:
+ *   block: Cache block number
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int WriteCacheFileBlockIndex(uint64_t block) {
+  uint64_t L1Idx=block/QCOW2_CACHE_L2_ENTRIES;
+  uint64_t entry;
+
+  if(XMountConfData.CacheFormat!=TCacheFormat_QCOW2) {
+    if(fseeko(hCacheFile,
+              sizeof(TCacheFileHeader)+(block*sizeof(TCacheFileBlockIndex)),
+              SEEK_SET)!=0 ||
+       fwrite(&(pCacheFileBlockIndex[block]),
+              sizeof(TCacheFileBlockIndex),
+              1,
+              hCacheFile)!=1)
+    {
+      LOG_ERROR("Couldn't update cache file block index!\n")
+      return FALSE;
+    }
+    return TRUE;
+  }
+
+  if(pQcow2CacheL1[L1Idx]==0) {
+    // L2 table was dropped by another QCOW2 implementation, add a new one
+    if(!AllocCacheFileSpace(QCOW2_CACHE_CLUSTER_SIZE,&(pQcow2CacheL1[L1Idx])) ||
+       !WriteZeroQcow2CacheCluster(pQcow2CacheL1[L1Idx]))
+    {
+      return FALSE;
+    }
+    fflush(hCacheFile);
+    entry=htobe64(pQcow2CacheL1[L1Idx] | QCOW2_OFLAG_COPIED);
+    if(fseeko(hCacheFile,
+              Qcow2CacheL1Off+(L1Idx*sizeof(uint64_t)),
+              SEEK_SET)!=0 ||
+       fwrite(&entry,sizeof(uint64_t),1,hCacheFile)!=1)
+    {
+      LOG_ERROR("Couldn't update L1 table of cache file!\n")
+      return FALSE;
+    }
+  }
+  entry=htobe64(pCacheFileBlockIndex[block].off_data | QCOW2_OFLAG_COPIED);
+  if(fseeko(hCacheFile,
+            pQcow2CacheL1[L1Idx]+
+              ((block%QCOW2_CACHE_L2_ENTRIES)*sizeof(uint64_t)),
+            SEEK_SET)!=0 ||
+     fwrite(&entry,sizeof(uint64_t),1,hCacheFile)!=1)
+  {
+    LOG_ERROR("Couldn't update L2 table of cache file!\n")
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/*
+ * AddHeaderPage:
+ *   Append a changed virtual image header page to the cache file and add it
+ *   to the header page index. As this only happens for the few header pages
+ *   a guest changes, the whole index is simply rewritten at the end of the
+ *   cache file every time.
+ *
+ * Params:
+ *   type: Virtual image type the page belongs to
+ *   page: Page number
+ *   pData: Page data (HEADER_PAGE_SIZE bytes)
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int AddHeaderPage(uint32_t type, uint64_t page, const char *pData) {
+  uint64_t pos;
+  uint64_t count=pCacheFileHeader->HeaderPageCount;
+  uint64_t IndexOff;
+  uint64_t DataOff;
+  int found;
+
+  pos=FindHeaderPage(type,page,&found);
+  if(found) return TRUE;
+
+  // Insert new entry into index
+  XMOUNT_REALLOC(pCacheFileHeaderPages,
+                 pTCacheFileHeaderPage,
+                 (count+1)*sizeof(TCacheFileHeaderPage))
+  memmove(&(pCacheFileHeaderPages[pos+1]),
+          &(pCacheFileHeaderPages[pos]),
+          (count-pos)*sizeof(TCacheFileHeaderPage));
+  pCacheFileHeaderPages[pos].VirtImageType=type;
+  pCacheFileHeaderPages[pos].Page=page;
+
+  // Append page data followed by new index
+  if(!AllocCacheFileSpace(HEADER_PAGE_SIZE+
+                            ((count+1)*sizeof(TCacheFileHeaderPage)),
+                          &DataOff) ||
+     fseeko(hCacheFile,DataOff,SEEK_SET)!=0)
+  {
+    LOG_ERROR("Couldn't seek to end of cache file!\n")
+    return FALSE;
+  }
+  pCacheFileHeaderPages[pos].off_data=DataOff;
+  IndexOff=pCacheFileHeaderPages[pos].off_data+HEADER_PAGE_SIZE;
+  if(fwrite(pData,HEADER_PAGE_SIZE,1,hCacheFile)!=1 ||
+     fwrite(pCacheFileHeaderPages,
+            (count+1)*sizeof(TCacheFileHeaderPage),
+            1,
+            hCacheFile)!=1)
+  {
+    LOG_ERROR("Couldn't write header page to cache file!\n")
+    return FALSE;
+  }
+  fflush(hCacheFile);
+
+  // Index must be completely written before the header points to it
+  pCacheFileHeader->pHeaderPageIndex=IndexOff;
+  pCacheFileHeader->HeaderPageCount=count+1;
+  if(!WriteCacheFileHeader()) return FALSE;
+  fflush(hCacheFile);
+  LOG_DEBUG("Cached header page %" PRIu64 " at cache file offset %" PRIu64
+            "\n",page,pCacheFileHeaderPages[pos].off_data)
+  return TRUE;
+}
+
+/*
+ * GenerateVdiFileHeaderData:
+ *   Generate data of the virtual VDI file header. As the VDI file's data is
+ *   laid out like the input image, the block map is an identity mapping and
+ *   its entries are calculated instead of being kept in memory.
+ *
+ * Params:
+ *   buf: Pointer to buffer to write data to (Must be preallocated!)
+ *   offset: Offset inside VDI header
+ *   size: Amount of bytes to generate (Must not exceed VDI header)
+ *
+ * Returns:
+ *   n/a
+ */
+static void GenerateVdiFileHeaderData(char *buf, off_t offset, size_t size) {
+  size_t CurSize;
+  uint64_t MapOff;
+  uint32_t entry;
+
+  // Header structure
+  if(offset<sizeof(TVdiFileHeader)) {
+    CurSize=sizeof(TVdiFileHeader)-offset;
+    if(CurSize>size) CurSize=size;
+    memcpy(buf,((char*)pVdiFileHeader)+offset,CurSize);
+    buf+=CurSize;
+    offset+=CurSize;
+    size-=CurSize;
+  }
+
+  // Block map. Data blocks are always at their identity position, blocks
+  // known to contain only zeros are reported as unallocated if requested.
+  while(size!=0) {
+    MapOff=offset-sizeof(TVdiFileHeader);
+    if(MapOff>=VdiBlockMapSize) {
+      // Padding up to the aligned data area
+      memset(buf,0,size);
+      break;
+    }
+    entry=(uint32_t)(MapOff/sizeof(uint32_t));
+    if(SparseVirtImages && GetZeroMapState(entry)==ZERO_MAP_ZERO) {
+      entry=VDI_IMAGE_BLOCK_ZERO;
+    }
+    entry=htole32(entry);
+    CurSize=sizeof(uint32_t)-(MapOff%sizeof(uint32_t));
+    if(CurSize>size) CurSize=size;
+    memcpy(buf,((char*)&entry)+(MapOff%sizeof(uint32_t)),CurSize);
+    buf+=CurSize;
+    offset+=CurSize;
+    size-=CurSize;
+  }
+}
+
+/*
+ * IsQcow2ClusterAllocated:
+ *   Check whether a QCOW2 data cluster has to be reported as allocated. Only
+ *   clusters known to contain only zeros are unallocated.
+ *
+ * Params:
+ *   cluster: Data cluster number
+ *
+ * Returns:
+ *   "TRUE" if cluster is allocated, "FALSE" otherwise
+ */
+static int IsQcow2ClusterAllocated(uint64_t cluster) {
+  if(cluster>=Qcow2DataClusters) return FALSE;
+  if(!SparseVirtImages) return TRUE;
+  return GetZeroMapState((cluster*QCOW2_CLUSTER_SIZE)/CACHE_BLOCK_SIZE)!=
+    ZERO_MAP_ZERO;
+}
+
+/*
+ * IsQcow2L2TablePresent:
+ *   Check whether a QCOW2 L2 table is referenced by the L1 table. L2 tables
+ *   only mapping unallocated clusters are left out.
+ *
+ * Params:
+ *   table: L2 table number
+ *
+ * Returns:
+ *   "TRUE" if table is present, "FALSE" otherwise
+ */
+static int IsQcow2L2TablePresent(uint64_t table) {
+  uint64_t cluster=table*QCOW2_L2_ENTRIES;
+  uint64_t LastCluster=cluster+QCOW2_L2_ENTRIES;
+
+  if(table>=Qcow2L1Entries) return FALSE;
+  if(!SparseVirtImages) return TRUE;
+  if(LastCluster>Qcow2DataClusters) LastCluster=Qcow2DataClusters;
+  // All clusters of a zero map block share its state
+  while(cluster<LastCluster) {
+    if(IsQcow2ClusterAllocated(cluster)) return TRUE;
+    cluster+=CACHE_BLOCK_SIZE/QCOW2_CLUSTER_SIZE;
+  }
+  return FALSE;
+}
+
+/*
+ * GetQcow2Refcount:
+ *   Get reference count of a QCOW2 file cluster
+ *
+ * Params:
+ *   cluster: File cluster number
+ *
+ * Returns:
+ *   Reference count (0 or 1)
+ */
+static uint16_t GetQcow2Refcount(uint64_t cluster) {
+  uint64_t L2Cluster=Qcow2L2Off/QCOW2_CLUSTER_SIZE;
+  uint64_t DataCluster=Qcow2HeaderSize/QCOW2_CLUSTER_SIZE;
+
+  // Header, L1 table, refcount table and refcount blocks are always used
+  if(cluster<L2Cluster) return 1;
+  if(cluster<DataCluster) return IsQcow2L2TablePresent(cluster-L2Cluster);
+  return IsQcow2ClusterAllocated(cluster-DataCluster);
+}
+
+/*
+ * GenerateQcow2HeaderData:
+ *   Generate data of the virtual QCOW2 metadata preceding the data clusters.
+ *   As data clusters are laid out like the input image, all tables are
+ *   calculated instead of being kept in memory.
+ *
+ * Params:
+ *   buf: Pointer to buffer to write data to (Must be preallocated!)
+ *   offset: Offset inside QCOW2 metadata
+ *   size: Amount of bytes to generate (Must not exceed QCOW2 metadata)
+ *
+ * Returns:
+ *   n/a
+ */
+static void GenerateQcow2HeaderData(char *buf, off_t offset, size_t size) {
+  uint64_t entry;
+  uint16_t refcount;
+  uint64_t idx;
+  size_t EntryOff;
+  size_t CurSize;
+
+  while(size!=0) {
+    if(offset<sizeof(TQcow2Header)) {
+      // Header structure
+      CurSize=sizeof(TQcow2Header)-offset;
+      if(CurSize>size) CurSize=size;
+      memcpy(buf,((char*)pQcow2Header)+offset,CurSize);
+    } else if(offset>=Qcow2L1Off &&
+              offset<Qcow2L1Off+(Qcow2L1Entries*sizeof(uint64_t)))
+    {
+      // L1 table
+      idx=(offset-Qcow2L1Off)/sizeof(uint64_t);
+      EntryOff=(offset-Qcow2L1Off)%sizeof(uint64_t);
+      if(IsQcow2L2TablePresent(idx)) {
+        entry=htobe64((Qcow2L2Off+(idx*QCOW2_CLUSTER_SIZE)) |
+                      QCOW2_OFLAG_COPIED);
+      } else entry=0;
+      CurSize=sizeof(uint64_t)-EntryOff;
+      if(CurSize>size) CurSize=size;
+      memcpy(buf,((char*)&entry)+EntryOff,CurSize);
+    } else if(offset>=Qcow2RefTableOff &&
+              offset<Qcow2RefTableOff+(Qcow2RefBlocks*sizeof(uint64_t)))
+    {
+      // Refcount table
+      idx=(offset-Qcow2RefTableOff)/sizeof(uint64_t);
+      EntryOff=(offset-Qcow2RefTableOff)%sizeof(uint64_t);
+      entry=htobe64(Qcow2RefBlockOff+(idx*QCOW2_CLUSTER_SIZE));
+      CurSize=sizeof(uint64_t)-EntryOff;
+      if(CurSize>size) CurSize=size;
+      memcpy(buf,((char*)&entry)+EntryOff,CurSize);
+    } else if(offset>=Qcow2RefBlockOff && offset<Qcow2L2Off) {
+      // Refcount blocks
+      idx=(offset-Qcow2RefBlockOff)/sizeof(uint16_t);
+      EntryOff=(offset-Qcow2RefBlockOff)%sizeof(uint16_t);
+      refcount=htobe16(GetQcow2Refcount(idx));
+      CurSize=sizeof(uint16_t)-EntryOff;
+      if(CurSize>size) CurSize=size;
+      memcpy(buf,((char*)&refcount)+EntryOff,CurSize);
+    } else if(offset>=Qcow2L2Off) {
+      // L2 tables
+      idx=(offset-Qcow2L2Off)/sizeof(uint64_t);
+      EntryOff=(offset-Qcow2L2Off)%sizeof(uint64_t);
+      if(IsQcow2ClusterAllocated(idx)) {
+        entry=htobe64((Qcow2HeaderSize+(idx*QCOW2_CLUSTER_SIZE)) |
+                      QCOW2_OFLAG_COPIED);
+      } else entry=0;
+      CurSize=sizeof(uint64_t)-EntryOff;
+      if(CurSize>size) CurSize=size;
+      memcpy(buf,((char*)&entry)+EntryOff,CurSize);
+    } else {
+      // Unused space up to the next table
+      if(offset<Qcow2L1Off) CurSize=Qcow2L1Off-offset;
+      else if(offset<Qcow2RefTableOff) CurSize=Qcow2RefTableOff-offset;
+      else CurSize=Qcow2RefBlockOff-offset;
+      if(CurSize>size) CurSize=size;
+      memset(buf,0,CurSize);
+    }
+    buf+=CurSize;
+    offset+=CurSize;
+    size-=CurSize;
+  }
+}
+
+/*
+ * IsVhdxBlockAllocated:
+ *   Check whether a VHDX payload block has to be reported as present. Only
+ *   blocks known to contain only zeros are reported as zero blocks.
+ *
+ * Params:
+ *   block: Payload block number
+ *
+ * Returns:
+ *   "TRUE" if block is present, "FALSE" otherwise
+ */
+static int IsVhdxBlockAllocated(uint64_t block) {
+  uint64_t ZeroBlock=block*(VHDX_BLOCK_SIZE/CACHE_BLOCK_SIZE);
+  uint64_t i;
+
+  if(!SparseVirtImages) return TRUE;
+  for(i=0;i<VHDX_BLOCK_SIZE/CACHE_BLOCK_SIZE;i++) {
+    if(ZeroBlock+i<ZeroMapBlockCount &&
+       GetZeroMapState(ZeroBlock+i)!=ZERO_MAP_ZERO)
+    {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/*
+ * GetVhdxBatEntry:
+ *   Calculate a VHDX BAT entry. After every VhdxChunkRatio payload block
+ *   entries, the BAT contains a sector bitmap block entry which is never
+ *   present as differencing images aren't emulated.
+ *
+ * Params:
+ *   entry: BAT entry number
+ *
+ * Returns:
+ *   BAT entry (little-endian)
+ */
+static uint64_t GetVhdxBatEntry(uint64_t entry) {
+  uint64_t block;
+
+  if(entry>=VhdxBatEntries || (entry+1)%(VhdxChunkRatio+1)==0) return 0;
+  block=entry-(entry/(VhdxChunkRatio+1));
+  if(!IsVhdxBlockAllocated(block)) return htole64(VHDX_PAYLOAD_BLOCK_ZERO);
+  // Payload blocks keep the position of their data in the input image
+  return htole64(VHDX_PAYLOAD_BLOCK_FULLY_PRESENT |
+                 (VhdxHeaderSize+(block*VHDX_BLOCK_SIZE)));
+}
+
+/*
+ * GenerateVhdxHeaderData:
+ *   Generate data of the virtual VHDX structures preceding the payload
+ *   blocks. Apart from the BAT, all structures are built by
+ *   InitVirtVhdxHeader. BAT entries are calculated when needed.
+ *
+ * Params:
+ *   buf: Pointer to buffer to write data to (Must be preallocated!)
+ *   offset: Offset inside VHDX structures
+ *   size: Amount of bytes to generate (Must not exceed VHDX structures)
+ *
+ * Returns:
+ *   n/a
+ */
+static void GenerateVhdxHeaderData(char *buf, off_t offset, size_t size) {
+  const char *pData;
+  uint64_t DataSize;
+  uint64_t RegionOff;
+  uint64_t RegionEnd;
+  uint64_t entry;
+  size_t CurSize;
+  size_t CurDataSize;
+
+  while(size!=0) {
+    pData=NULL;
+    DataSize=0;
+    if(offset<VHDX_HEADER1_OFFSET) {
+      RegionOff=0;
+      RegionEnd=VHDX_HEADER1_OFFSET;
+      pData=(char*)pVhdxFileIdentifier;
+      DataSize=sizeof(TVhdxFileIdentifier);
+    } else if(offset<VHDX_HEADER2_OFFSET) {
+      RegionOff=VHDX_HEADER1_OFFSET;
+      RegionEnd=VHDX_HEADER2_OFFSET;
+      pData=(char*)&(pVhdxHeaders[0]);
+      DataSize=sizeof(TVhdxHeader);
+    } else if(offset<VHDX_REGION_TABLE1_OFFSET) {
+      RegionOff=VHDX_HEADER2_OFFSET;
+      RegionEnd=VHDX_REGION_TABLE1_OFFSET;
+      pData=(char*)&(pVhdxHeaders[1]);
+      DataSize=sizeof(TVhdxHeader);
+    } else if(offset<VHDX_REGION_TABLE2_OFFSET) {
+      RegionOff=VHDX_REGION_TABLE1_OFFSET;
+      RegionEnd=VHDX_REGION_TABLE2_OFFSET;
+      pData=pVhdxRegionTable;
+      DataSize=VHDX_REGION_TABLE_SIZE;
+    } else if(offset<VHDX_REGION_TABLE2_OFFSET+VHDX_REGION_TABLE_SIZE) {
+      RegionOff=VHDX_REGION_TABLE2_OFFSET;
+      RegionEnd=VHDX_REGION_TABLE2_OFFSET+VHDX_REGION_TABLE_SIZE;
+      pData=pVhdxRegionTable;
+      DataSize=VHDX_REGION_TABLE_SIZE;
+    } else if(offset<VHDX_METADATA_OFFSET) {
+      // Reserved space and empty log
+      RegionOff=VHDX_REGION_TABLE2_OFFSET+VHDX_REGION_TABLE_SIZE;
+      RegionEnd=VHDX_METADATA_OFFSET;
+    } else if(offset<VHDX_BAT_OFFSET) {
+      RegionOff=VHDX_METADATA_OFFSET;
+      RegionEnd=VHDX_BAT_OFFSET;
+      pData=pVhdxMetadata;
+      DataSize=VHDX_METADATA_ITEMS_OFFSET+sizeof(TVhdxMetadataItems);
+    } else {
+      // BAT
+      RegionOff=offset-((offset-VHDX_BAT_OFFSET)%sizeof(uint64_t));
+      RegionEnd=RegionOff+sizeof(uint64_t);
+      entry=GetVhdxBatEntry((RegionOff-VHDX_BAT_OFFSET)/sizeof(uint64_t));
+      pData=(char*)&entry;
+      DataSize=sizeof(uint64_t);
+    }
+    CurSize=RegionEnd-offset;
+    if(CurSize>size) CurSize=size;
+    if(offset-RegionOff<DataSize) {
+      CurDataSize=DataSize-(offset-RegionOff);
+      if(CurDataSize>CurSize) CurDataSize=CurSize;
+      memcpy(buf,pData+(offset-RegionOff),CurDataSize);
+    } else CurDataSize=0;
+    memset(buf+CurDataSize,0,CurSize-CurDataSize);
+    buf+=CurSize;
+    offset+=CurSize;
+    size-=CurSize;
+  }
+}
+
+/*
+ * IsVmdkGrainAllocated:
+ *   Check whether a VMDK grain has to be reported as allocated. Only grains
+ *   known to contain only zeros are unallocated.
+ *
+ * Params:
+ *   grain: Grain number
+ *
+ * Returns:
+ *   "TRUE" if grain is allocated, "FALSE" otherwise
+ */
+static int IsVmdkGrainAllocated(uint64_t grain) {
+  if(grain>=VmdkGrains) return FALSE;
+  if(!SparseVirtImages) return TRUE;
+  return GetZeroMapState((grain*VMDK_GRAIN_SIZE)/CACHE_BLOCK_SIZE)!=
+    ZERO_MAP_ZERO;
+}
+
+/*
+ * IsVmdkGrainTablePresent:
+ *   Check whether a VMDK grain table is referenced by the grain directory.
+ *   Grain tables only mapping unallocated grains are left out.
+ *
+ * Params:
+ *   table: Grain table number
+ *
+ * Returns:
+ *   "TRUE" if table is present, "FALSE" otherwise
+ */
+static int IsVmdkGrainTablePresent(uint64_t table) {
+  uint64_t grain=table*VMDK_GTES_PER_GT;
+  uint64_t LastGrain=grain+VMDK_GTES_PER_GT;
+
+  if(table>=VmdkGrainTables) return FALSE;
+  if(!SparseVirtImages) return TRUE;
+  if(LastGrain>VmdkGrains) LastGrain=VmdkGrains;
+  // All grains of a zero map block share its state
+  while(grain<LastGrain) {
+    if(IsVmdkGrainAllocated(grain)) return TRUE;
+    grain+=CACHE_BLOCK_SIZE/VMDK_GRAIN_SIZE;
+  }
+  return FALSE;
+}
+
+/*
+ * GenerateVmdkHeaderData:
+ *   Generate data of the virtual VMDK metadata preceding the grains. Header
+ *   and embedded descriptor are built by InitVirtVmdkHeader. Grain directory
+ *   and grain table entries are calculated when needed.
+ *
+ * Params:
+ *   buf: Pointer to buffer to write data to (Must be preallocated!)
+ *   offset: Offset inside VMDK metadata
+ *   size: Amount of bytes to generate (Must not exceed VMDK metadata)
+ *
+ * Returns:
+ *   n/a
+ */
+static void GenerateVmdkHeaderData(char *buf, off_t offset, size_t size) {
+  const char *pData;
+  uint64_t DataSize;
+  uint64_t RegionOff;
+  uint64_t RegionEnd;
+  uint64_t GdEnd=VmdkGdOff+(VmdkGrainTables*sizeof(uint32_t));
+  uint64_t GtEnd=VmdkGtOff+(VmdkGrainTables*VMDK_GT_SIZE);
+  uint64_t idx;
+  uint32_t entry;
+  size_t CurSize;
+  size_t CurDataSize;
+
+  if(pVmdkHeader==NULL) {
+    // Descriptor referencing the input image directly
+    memcpy(buf,pVmdkDescriptor+offset,size);
+    return;
+  }
+
+  while(size!=0) {
+    pData=NULL;
+    DataSize=0;
+    if(offset<VMDK_SECTOR_SIZE) {
+      RegionOff=0;
+      RegionEnd=VMDK_SECTOR_SIZE;
+      pData=(char*)pVmdkHeader;
+      DataSize=sizeof(TVmdkSparseHeader);
+    } else if(offset<VmdkGdOff) {
+      // Embedded descriptor
+      RegionOff=VMDK_SECTOR_SIZE;
+      RegionEnd=VmdkGdOff;
+      pData=pVmdkDescriptor;
+      DataSize=strlen(pVmdkDescriptor);
+    } else if(offset<GdEnd) {
+      // Grain directory
+      idx=(offset-VmdkGdOff)/sizeof(uint32_t);
+      RegionOff=VmdkGdOff+(idx*sizeof(uint32_t));
+      RegionEnd=RegionOff+sizeof(uint32_t);
+      if(IsVmdkGrainTablePresent(idx)) {
+        entry=htole32((uint32_t)((VmdkGtOff+(idx*VMDK_GT_SIZE))/
+                                 VMDK_SECTOR_SIZE));
+      } else entry=0;
+      pData=(char*)&entry;
+      DataSize=sizeof(uint32_t);
+    } else if(offset<VmdkGtOff) {
+      // Padding up to the next sector
+      RegionOff=GdEnd;
+      RegionEnd=VmdkGtOff;
+    } else if(offset<GtEnd) {
+      // Grain tables. Grains keep the position of their data in the input
+      // image.
+      idx=(offset-VmdkGtOff)/sizeof(uint32_t);
+      RegionOff=VmdkGtOff+(idx*sizeof(uint32_t));
+      RegionEnd=RegionOff+sizeof(uint32_t);
+      if(IsVmdkGrainAllocated(idx)) {
+        entry=htole32((uint32_t)((VmdkHeaderSize/VMDK_SECTOR_SIZE)+
+                                 (idx*VMDK_GRAIN_SECTORS)));
+      } else entry=0;
+      pData=(char*)&entry;
+      DataSize=sizeof(uint32_t);
+    } else {
+      // Padding up to the first grain
+      RegionOff=GtEnd;
+      RegionEnd=VmdkHeaderSize;
+    }
+    CurSize=RegionEnd-offset;
+    if(CurSize>size) CurSize=size;
+    if(offset-RegionOff<DataSize) {
+      CurDataSize=DataSize-(offset-RegionOff);
+      if(CurDataSize>CurSize) CurDataSize=CurSize;
+      memcpy(buf,pData+(offset-RegionOff),CurDataSize);
+    } else CurDataSize=0;
+    memset(buf+CurDataSize,0,CurSize-CurDataSize);
+    buf+=CurSize;
+    offset+=CurSize;
+    size-=CurSize;
+  }
+}
+
+/*
+ * GenerateHeaderData:
+ *   Generate data of a virtual image header
+ *
+ * Params:
+ *   type: Virtual image type
+ *   buf: Pointer to buffer to write data to (Must be preallocated!)
+ *   offset: Offset inside header
+ *   size: Amount of bytes to generate (Must not exceed header)
+ *
+ * Returns:
+ *   n/a
+ */
+static void GenerateHeaderData(uint32_t type,
+                               char *buf,
+                               off_t offset,
+                               size_t size)
+{
+  switch(type) {
+    case TVirtImageType_VDI:
+      GenerateVdiFileHeaderData(buf,offset,size);
+      break;
+    case TVirtImageType_QCOW2:
+      GenerateQcow2HeaderData(buf,offset,size);
+      break;
+    case TVirtImageType_VHDX:
+      GenerateVhdxHeaderData(buf,offset,size);
+      break;
+    case TVirtImageType_VMDK:
+    case TVirtImageType_VMDKS:
+      GenerateVmdkHeaderData(buf,offset,size);
+      break;
+  }
+}
+
+/*
+ * GetHeaderPages:
+ *   Read data from a virtual image header. Changed header pages are read from
+ *   the cache file, all others are generated.
+ *
+ * Params:
+ *   type: Virtual image type
+ *   buf: Pointer to buffer to write read data to (Must be preallocated!)
+ *   offset: Offset inside header
+ *   size: Amount of bytes to read (Must not exceed header)
+ *
+ * Returns:
+ *   Number of read bytes on success or "-1" on error
+ */
+static int GetHeaderPages(uint32_t type, char *buf, off_t offset, size_t size) {
+  uint64_t page;
+  uint64_t pos;
+  off_t PageOff;
+  size_t CurSize;
+  size_t ToRead=size;
+  int found;
+
+  while(ToRead!=0) {
+    page=offset/HEADER_PAGE_SIZE;
+    PageOff=offset%HEADER_PAGE_SIZE;
+    CurSize=HEADER_PAGE_SIZE-PageOff;
+    if(CurSize>ToRead) CurSize=ToRead;
+    pos=FindHeaderPage(type,page,&found);
+    if(found) {
+      // Page has been changed
+      if(fseeko(hCacheFile,
+                pCacheFileHeaderPages[pos].off_data+PageOff,
+                SEEK_SET)!=0 ||
+         fread(buf,CurSize,1,hCacheFile)!=1)
+      {
+        LOG_ERROR("Couldn't read cached header page %" PRIu64 "!\n",page)
+        return -1;
+      }
+    } else GenerateHeaderData(type,buf,offset,CurSize);
+    buf+=CurSize;
+    offset+=CurSize;
+    ToRead-=CurSize;
+  }
+  return size;
+}
+
+/*
+ * SetHeaderPages:
+ *   Write data to a virtual image header. Only header pages that are actually
+ *   changed are cached.
+ *
+ * Params:
+ *   type: Virtual image type
+ *   buf: Buffer containing data to write
+ *   offset: Offset of changes
+ *   size: Amount of bytes to write (Must not exceed header)
+ *   HeaderSize: Size of the whole header
+ *
+ * Returns:
+ *   Number of written bytes on success or "-1" on error
+ */
+static int SetHeaderPages(uint32_t type,
+                          const char *buf,
+                          off_t offset,
+                          size_t size,
+                          uint64_t HeaderSize)
+{
+  char *pPage=NULL;
+  uint64_t page;
+  uint64_t pos;
+  uint64_t PageStart;
+  off_t PageOff;
+  size_t CurSize;
+  size_t ToWrite=size;
+  int found;
+
+  while(ToWrite!=0) {
+    page=offset/HEADER_PAGE_SIZE;
+    PageOff=offset%HEADER_PAGE_SIZE;
+    CurSize=HEADER_PAGE_SIZE-PageOff;
+    if(CurSize>ToWrite) CurSize=ToWrite;
+    pos=FindHeaderPage(type,page,&found);
+    if(found) {
+      // Page was already cached
+      if(fseeko(hCacheFile,
+                pCacheFileHeaderPages[pos].off_data+PageOff,
+                SEEK_SET)!=0 ||
+         fwrite(buf,CurSize,1,hCacheFile)!=1)
+      {
+        LOG_ERROR("Couldn't write %zu bytes to cached header page %"
+                  PRIu64 "!\n",CurSize,page)
+        free(pPage);
+        return -1;
+      }
+    } else {
+      // Cache whole page
+      if(pPage==NULL) XMOUNT_MALLOC(pPage,char*,HEADER_PAGE_SIZE)
+      memset(pPage,0,HEADER_PAGE_SIZE);
+      PageStart=page*HEADER_PAGE_SIZE;
+      if(PageStart+HEADER_PAGE_SIZE>HeaderSize) {
+        GenerateHeaderData(type,pPage,PageStart,HeaderSize-PageStart);
+      } else GenerateHeaderData(type,pPage,PageStart,HEADER_PAGE_SIZE);
+      memcpy(pPage+PageOff,buf,CurSize);
+      if(!AddHeaderPage(type,page,pPage)) {
+        free(pPage);
+        return -1;
+      }
+    }
+    buf+=CurSize;
+    offset+=CurSize;
+    ToWrite-=CurSize;
+  }
+  free(pPage);
+  return size;
+}
+
+/*
+ * GetVdiFileHeaderData:
+ *   Read data from virtual VDI file header
+ *
+ * Params:
+ *   buf: Pointer to buffer to write read data to (Must be preallocated!)
+ *   offset: Offset inside VDI header
+ *   size: Amount of bytes to read (Must not exceed VDI header)
+ *
+ * Returns:
+ *   Number of read bytes on success or "-1" on error
+ */
+static int GetVdiFileHeaderData(char *buf, off_t offset, size_t size) {
+  if(XMountConfData.Writable==TRUE &&
+     pCacheFileHeader->VdiFileHeaderCached==TRUE)
+  {
+    // Whole VDI header was cached by an older xmount version
+    if(fseeko(hCacheFile,
+              pCacheFileHeader->pVdiFileHeader+offset,
+              SEEK_SET)!=0)
+    {
+      LOG_ERROR("Couldn't seek to cached VDI header at offset %"
+                PRIu64 "\n",pCacheFileHeader->pVdiFileHeader+offset)
+      return -1;
+    }
+    if(fread(buf,size,1,hCacheFile)!=1) {
+      LOG_ERROR("Couldn't read %zu bytes from cache file at offset %"
+                PRIu64 "\n",size,
+                pCacheFileHeader->pVdiFileHeader+offset)
+      return -1;
+    }
+    LOG_DEBUG("Read %zd bytes from cached VDI header at offset %"
+              PRIu64 " at cache file offset %" PRIu64 "\n",
+              size,offset,
+              pCacheFileHeader->pVdiFileHeader+offset)
+    return size;
+  }
+
+  if(GetHeaderPages(TVirtImageType_VDI,buf,offset,size)!=size) return -1;
+  LOG_DEBUG("Read %zd bytes at offset %" PRIu64 " from virtual VDI header\n",
+            size,offset)
+  return size;
+}
+
+/*
+ * ReadDataArea:
+ *   Read data from data area. Data is read through the memory cache if
+ *   enabled.
+ *
+ * Params:
+ *   buf: Pointer to buffer to write read data to (Must be preallocated!)
+ *   offset: Offset inside data area at which data should be read
+ *   size: Size of data which should be read (Must not exceed input image!)
+ *
+ * Returns:
+ *   Number of read bytes on success or "-1" on error
+ */
+static int ReadDataArea(char *buf, off_t offset, size_t size) {
+  uint64_t CurBlock=offset/CACHE_BLOCK_SIZE;
+  off_t BlockOff=offset%CACHE_BLOCK_SIZE;
+  size_t ToRead=size;
+  size_t CurToRead=0;
+
+  while(ToRead!=0) {
+    // Calculate how many bytes we have to read from this block
+    if(BlockOff+ToRead>CACHE_BLOCK_SIZE) {
+      CurToRead=CACHE_BLOCK_SIZE-BlockOff;
+    } else CurToRead=ToRead;
+    if(MemCacheEntryCount!=0) {
+      // Read data through memory cache
+      if(GetMemCacheData(buf,CurBlock,BlockOff,CurToRead)!=CurToRead) {
+        LOG_ERROR("Couldn't read data from memory cache!\n")
+        return -1;
+      }
+    } else if(GetDataAreaData(buf,CurBlock,BlockOff,CurToRead)!=CurToRead) {
+      return -1;
+    }
+    CurBlock++;
+    BlockOff=0;
+    buf+=CurToRead;
+    ToRead-=CurToRead;
+  }
+  return size;
+}
+
+/*
+ * IsVhdBlockAllocated:
+ *   Check whether a dynamic VHD block has to be reported as allocated. Only
+ *   blocks known to contain only zeros are unallocated.
+ *
+ * Params:
+ *   block: VHD block number
+ *
+ * Returns:
+ *   "TRUE" if block is allocated, "FALSE" otherwise
+ */
+static int IsVhdBlockAllocated(uint64_t block) {
+  uint64_t ZeroBlock=block*(VHD_DYN_BLOCK_SIZE/CACHE_BLOCK_SIZE);
+  uint64_t i;
+
+  for(i=0;i<VHD_DYN_BLOCK_SIZE/CACHE_BLOCK_SIZE;i++) {
+    if(ZeroBlock+i<ZeroMapBlockCount &&
+       GetZeroMapState(ZeroBlock+i)!=ZERO_MAP_ZERO)
+    {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/*
+ * GetVhdDynData:
+ *   Read data from virtual dynamic VHD file. Everything besides the block
+ *   data is generated on the fly.
+ *
+ * Params:
+ *   buf: Pointer to buffer to write read data to (Must be preallocated!)
+ *   offset: Offset at which data should be read
+ *   size: Size of data which should be read (Must not exceed virtual image!)
+ *
+ * Returns:
+ *   Number of read bytes on success or "-1" on error
+ */
+static int GetVhdDynData(char *buf, off_t offset, size_t size) {
+  uint64_t BatOff=sizeof(TVhdFileHeader)+sizeof(TVhdDynHeader);
+  uint64_t DataOff=BatOff+VhdBatSize;
+  uint64_t BlocksEnd=DataOff+
+    (((uint64_t)VhdBatEntries)*(VHD_DYN_BITMAP_SIZE+VHD_DYN_BLOCK_SIZE));
+  uint64_t OrigImageSize;
+  uint64_t block;
+  uint64_t pos;
+  uint32_t entry;
+  size_t ToRead=size;
+  size_t CurToRead;
+  size_t CurDataSize;
+
+  if(!GetOrigImageSize(&OrigImageSize)) {
+    LOG_ERROR("Couldn't get original image size!\n")
+    return -1;
+  }
+
+  while(ToRead!=0) {
+    if(offset<sizeof(TVhdFileHeader)) {
+      // Footer copy
+      CurToRead=sizeof(TVhdFileHeader)-offset;
+      if(CurToRead>ToRead) CurToRead=ToRead;
+      memcpy(buf,((char*)pVhdFileHeader)+offset,CurToRead);
+    } else if(offset<BatOff) {
+      // Dynamic disk header
+      pos=offset-sizeof(TVhdFileHeader);
+      CurToRead=sizeof(TVhdDynHeader)-pos;
+      if(CurToRead>ToRead) CurToRead=ToRead;
+      memcpy(buf,((char*)pVhdDynHeader)+pos,CurToRead);
+    } else if(offset<DataOff) {
+      // BAT. Allocated blocks stay at the position matching their data in the
+      // input image.
+      pos=offset-BatOff;
+      CurToRead=sizeof(uint32_t)-(pos%sizeof(uint32_t));
+      if(CurToRead>ToRead) CurToRead=ToRead;
+      block=pos/sizeof(uint32_t);
+      if(block<VhdBatEntries && IsVhdBlockAllocated(block)) {
+        entry=htobe32((uint32_t)((DataOff+(block*(VHD_DYN_BITMAP_SIZE+
+                                                  VHD_DYN_BLOCK_SIZE)))/512));
+      } else entry=VHD_DYN_BAT_UNUSED;
+      memcpy(buf,((char*)&entry)+(pos%sizeof(uint32_t)),CurToRead);
+    } else if(offset<BlocksEnd) {
+      // Block bitmap or data
+      block=(offset-DataOff)/(VHD_DYN_BITMAP_SIZE+VHD_DYN_BLOCK_SIZE);
+      pos=(offset-DataOff)%(VHD_DYN_BITMAP_SIZE+VHD_DYN_BLOCK_SIZE);
+      if(pos<VHD_DYN_BITMAP_SIZE) {
+        // All sectors of allocated blocks are present
+        CurToRead=VHD_DYN_BITMAP_SIZE-pos;
+        if(CurToRead>ToRead) CurToRead=ToRead;
+        memset(buf,IsVhdBlockAllocated(block) ? 0xFF : 0x00,CurToRead);
+      } else {
+        // Data past the end of the input image reads as zeros
+        pos=(block*VHD_DYN_BLOCK_SIZE)+(pos-VHD_DYN_BITMAP_SIZE);
+        CurToRead=VHD_DYN_BLOCK_SIZE-(pos%VHD_DYN_BLOCK_SIZE);
+        if(CurToRead>ToRead) CurToRead=ToRead;
+        if(pos>=OrigImageSize) CurDataSize=0;
+        else if(pos+CurToRead>OrigImageSize) CurDataSize=OrigImageSize-pos;
+        else CurDataSize=CurToRead;
+        if(CurDataSize!=0 && ReadDataArea(buf,pos,CurDataSize)!=CurDataSize) {
+          return -1;
+        }
+        memset(buf+CurDataSize,0,CurToRead-CurDataSize);
+      }
+    } else {
+      // Footer
+      pos=offset-BlocksEnd;
+      CurToRead=sizeof(TVhdFileHeader)-pos;
+      if(CurToRead>ToRead) CurToRead=ToRead;
+      memcpy(buf,((char*)pVhdFileHeader)+pos,CurToRead);
+    }
+    buf+=CurToRead;
+    offset+=CurToRead;
+    ToRead-=CurToRead;
+  }
+  return size;
+}
+
+/*
+ * GetVirtImageData:
+ *   Read data from virtual image
+ *
+ * Params:
+ *   pImage: Virtual image
+ *   buf: Pointer to buffer to write read data to (Must be preallocated!)
+ *   offset: Offset at which data should be read
+ *   size: Size of data which should be read (Size of buffer)
+ *
+ * Returns:
+ *   Number of read bytes on success or "-1" on error
+ */
+static int GetVirtImageData(pTVirtImage pImage,
+                            char *buf,
+                            off_t offset,
+                            size_t size)
+{
+  uint64_t VirtImageSize;
+  uint64_t orig_image_size;
+  size_t ToRead=0;
+  size_t CurToRead=0;
+  off_t FileOff=offset;
+  size_t to_read_later=0;
+
+  // Get virtual image size
+  if(!GetVirtImageSize(pImage,&VirtImageSize)) {
+    LOG_ERROR("Couldn't get virtual image size!\n")
+    return -1;
+  }
+
+  if(offset>=VirtImageSize) {
+    LOG_ERROR("Attempt to read beyond virtual image EOF!\n")
+    return -1;
+  }
+
+  if(offset+size>VirtImageSize) {
+    LOG_DEBUG("Attempt to read pas EOF of virtual image file\n")
+    size=VirtImageSize-offset;
+  }
+
+  ToRead=size;
+
+  if(!GetOrigImageSize(&orig_image_size)) {
+    LOG_ERROR("Couldn't get original image size!")
+    return 0;
+  }
+
+  // Read virtual image type specific data preceeding original image data
+  switch(pImage->Type) {
+    case TVirtImageType_DD:
+    case TVirtImageType_DMG:
+      break;
+    case TVirtImageType_VDI:
+      if(FileOff<VdiFileHeaderSize) {
+        if(FileOff+ToRead>VdiFileHeaderSize) CurToRead=VdiFileHeaderSize-FileOff;
+        else CurToRead=ToRead;
+        if(GetVdiFileHeaderData(buf,FileOff,CurToRead)!=CurToRead) {
+          LOG_ERROR("Couldn't read data from virtual VDI file header!\n")
+          return 0;
+        }
+        if(ToRead==CurToRead) return ToRead;
+        else {
+          // Adjust values to read from original image
+          ToRead-=CurToRead;
+          buf+=CurToRead;
+          FileOff=0;
+        }
+      } else FileOff-=VdiFileHeaderSize;
+      break;
+    case TVirtImageType_QCOW2:
+      if(FileOff<Qcow2HeaderSize) {
+        if(FileOff+ToRead>Qcow2HeaderSize) CurToRead=Qcow2HeaderSize-FileOff;
+        else CurToRead=ToRead;
+        if(GetHeaderPages(TVirtImageType_QCOW2,
+                          buf,
+                          FileOff,
+                          CurToRead)!=CurToRead)
+        {
+          LOG_ERROR("Couldn't read data from virtual QCOW2 metadata!\n")
+          return -1;
+        }
+        if(ToRead==CurToRead) return ToRead;
+        else {
+          // Adjust values to read from original image
+          ToRead-=CurToRead;
+          buf+=CurToRead;
+          FileOff=0;
+        }
+      } else FileOff-=Qcow2HeaderSize;
+      break;
+    case TVirtImageType_VHDX:
+      if(FileOff<VhdxHeaderSize) {
+        if(FileOff+ToRead>VhdxHeaderSize) CurToRead=VhdxHeaderSize-FileOff;
+        else CurToRead=ToRead;
+        if(GetHeaderPages(TVirtImageType_VHDX,
+                          buf,
+                          FileOff,
+                          CurToRead)!=CurToRead)
+        {
+          LOG_ERROR("Couldn't read data from virtual VHDX structures!\n")
+          return -1;
+        }
+        if(ToRead==CurToRead) return ToRead;
+        else {
+          // Adjust values to read from original image
+          ToRead-=CurToRead;
+          buf+=CurToRead;
+          FileOff=0;
+        }
+      } else FileOff-=VhdxHeaderSize;
+      // The last payload block is padded with zeros which must be read
+      // afterwards
+      if(FileOff>=orig_image_size) {
+        to_read_later=ToRead;
+        ToRead=0;
+      } else if((FileOff+ToRead)>orig_image_size) {
+        to_read_later=(FileOff+ToRead)-orig_image_size;
+        ToRead-=to_read_later;
+      }
+      break;
+    case TVirtImageType_VMDK:
+    case TVirtImageType_VMDKS:
+      if(FileOff<VmdkHeaderSize) {
+        if(FileOff+ToRead>VmdkHeaderSize) CurToRead=VmdkHeaderSize-FileOff;
+        else CurToRead=ToRead;
+        if(GetHeaderPages(pImage->Type,
+                          buf,
+                          FileOff,
+                          CurToRead)!=CurToRead)
+        {
+          LOG_ERROR("Couldn't read data from virtual VMDK metadata!\n")
+          return -1;
+        }
+        if(ToRead==CurToRead) return ToRead;
+        else {
+          // Adjust values to read from original image
+          ToRead-=CurToRead;
+          buf+=CurToRead;
+          FileOff=0;
+        }
+      } else FileOff-=VmdkHeaderSize;
+      // The last grain is padded with zeros which must be read afterwards
+      if(FileOff>=orig_image_size) {
+        to_read_later=ToRead;
+        ToRead=0;
+      } else if((FileOff+ToRead)>orig_image_size) {
+        to_read_later=(FileOff+ToRead)-orig_image_size;
+        ToRead-=to_read_later;
+      }
+      break;
+    case TVirtImageType_VHD:
+      if(pVhdDynHeader!=NULL) return GetVhdDynData(buf,FileOff,ToRead);
+      // When emulating VHD, make sure the while loop below only reads data
+      // available in the original image. Any VHD footer data must be read
+      // afterwards.
+      if(FileOff>=orig_image_size) {
+        to_read_later=ToRead;
+        ToRead=0;
+      } else if((FileOff+ToRead)>orig_image_size) {
+        to_read_later=(FileOff+ToRead)-orig_image_size;
+        ToRead-=to_read_later;
+      }
+      break;
+  }
+
+  // Read image data
+  if(ToRead!=0) {
+    if(ReadDataArea(buf,FileOff,ToRead)!=ToRead) return -1;
+    buf+=ToRead;
+    FileOff+=ToRead;
+  }
+
+  if(to_read_later!=0) {
+    // Read virtual image type specific data following original image data
+    switch(pImage->Type) {
+      case TVirtImageType_DD:
+      case TVirtImageType_DMG:
+      case TVirtImageType_VDI:
+      case TVirtImageType_QCOW2:
+        break;
+      case TVirtImageType_VHDX:
+      case TVirtImageType_VMDK:
+      case TVirtImageType_VMDKS:
+        memset(buf,0,to_read_later);
+        break;
+      case TVirtImageType_VHD:
+        // Micro$oft has choosen to use a footer rather then a header.
+        if(XMountConfData.Writable==TRUE &&
+           pCacheFileHeader->VhdFileHeaderCached==TRUE)
+        {
+          // VHD footer was already cached
+          if(fseeko(hCacheFile,
+                    pCacheFileHeader->pVhdFileHeader+(FileOff-orig_image_size),
+                    SEEK_SET)!=0)
+          {
+            LOG_ERROR("Couldn't seek to cached VHD footer at offset %"
+                      PRIu64 "\n",
+                      pCacheFileHeader->pVhdFileHeader+
+                        (FileOff-orig_image_size))
+            return 0;
+          }
+          if(fread(buf,to_read_later,1,hCacheFile)!=1) {
+            LOG_ERROR("Couldn't read %zu bytes from cache file at offset %"
+                      PRIu64 "\n",to_read_later,
+                      pCacheFileHeader->pVhdFileHeader+
+                        (FileOff-orig_image_size))
+            return 0;
+          }
+          LOG_DEBUG("Read %zd bytes from cached VHD footer at offset %"
+                    PRIu64 " at cache file offset %" PRIu64 "\n",
+                    to_read_later,(FileOff-orig_image_size),
+                    pCacheFileHeader->pVhdFileHeader+(FileOff-orig_image_size))
+        } else {
+          // VHD header isn't cached
+          memcpy(buf,
+                 ((char*)pVhdFileHeader)+(FileOff-orig_image_size),
+                 to_read_later);
+          LOG_DEBUG("Read %zd bytes at offset %" PRIu64
+                    " from virtual VHD header\n",
+                    to_read_later,
+                    (FileOff-orig_image_size))
+        }
+        break;
+    }
+  }
+
+  return size;
+}
+
+/*
+ * SetVdiFileHeaderData:
+ *   Write data to virtual VDI file header
+ *
+ * Params:
+ *   buf: Buffer containing data to write
+ *   offset: Offset of changes
+ *   size: Amount of bytes to write
+ *
+ * Returns:
+ *   Number of written bytes on success or "-1" on error
+ */
+static int SetVdiFileHeaderData(char *buf,off_t offset,size_t size) {
+  if(offset+size>VdiFileHeaderSize) size=VdiFileHeaderSize-offset;
+  LOG_DEBUG("Need to cache %zu bytes at offset %" PRIu64
+            " from VDI header\n",size,offset)
+  if(pCacheFileHeader->VdiFileHeaderCached==1) {
+    // Whole header was cached by an older xmount version
+    if(fseeko(hCacheFile,
+              pCacheFileHeader->pVdiFileHeader+offset,
+              SEEK_SET)!=0)
+    {
+      LOG_ERROR("Couldn't seek to cached VDI header at address %"
+                PRIu64 "\n",pCacheFileHeader->pVdiFileHeader+offset)
+      return -1;
+    }
+    if(fwrite(buf,size,1,hCacheFile)!=1) {
+      LOG_ERROR("Couldn't write %zu bytes to cache file at offset %"
+                PRIu64 "\n",size,
+                pCacheFileHeader->pVdiFileHeader+offset)
+      return -1;
+    }
+    LOG_DEBUG("Wrote %zd bytes at offset %" PRIu64 " to cache file\n",
+              size,pCacheFileHeader->pVdiFileHeader+offset)
+  } else if(SetHeaderPages(TVirtImageType_VDI,
+                            buf,
+                            offset,
+                            size,
+                            VdiFileHeaderSize)!=size)
+  {
+    return -1;
+  }
+  // All important data has been written, now flush all buffers to make
+  // sure data is written to cache file
+  fflush(hCacheFile);
+#ifndef __APPLE__
+  ioctl(fileno(hCacheFile),BLKFLSBUF,0);
+#endif
+  return size;
+}
+
+/*
+ * SetVhdFileHeaderData:
+ *   Write data to virtual VHD file footer
+ *
+ * Params:
+ *   buf: Buffer containing data to write
+ *   offset: Offset of changes
+ *   size: Amount of bytes to write
+ *
+ * Returns:
+ *   Number of written bytes on success or "-1" on error
+ */
+static int SetVhdFileHeaderData(char *buf,off_t offset,size_t size) {
+  uint64_t HeaderOff;
+
+  LOG_DEBUG("Need to cache %zu bytes at offset %" PRIu64
+            " from VHD footer\n",size,offset)
+  if(pCacheFileHeader->VhdFileHeaderCached==1) {
+    // Header has already been cached
+    if(fseeko(hCacheFile,
+              pCacheFileHeader->pVhdFileHeader+offset,
+              SEEK_SET)!=0)
+    {
+      LOG_ERROR("Couldn't seek to cached VHD header at address %"
+                PRIu64 "\n",pCacheFileHeader->pVhdFileHeader+offset)
+      return -1;
+    }
+    if(fwrite(buf,size,1,hCacheFile)!=1) {
+      LOG_ERROR("Couldn't write %zu bytes to cache file at offset %"
+                PRIu64 "\n",size,
+                pCacheFileHeader->pVhdFileHeader+offset)
+      return -1;
+    }
+    LOG_DEBUG("Wrote %zd bytes at offset %" PRIu64 " to cache file\n",
+              size,pCacheFileHeader->pVhdFileHeader+offset)
+  } else {
+    // Header hasn't been cached yet.
+    if(!AllocCacheFileSpace(sizeof(TVhdFileHeader),&HeaderOff) ||
+       fseeko(hCacheFile,HeaderOff,SEEK_SET)!=0)
+    {
+      LOG_ERROR("Couldn't seek to end of cache file!")
+      return -1;
+    }
+    pCacheFileHeader->pVhdFileHeader=HeaderOff;
+    LOG_DEBUG("Caching whole VHD header\n")
+    if(offset>0) {
+      // Changes do not begin at offset 0, need to prepend with data from
+      // VHD header
+      if(fwrite((char*)pVhdFileHeader,offset,1,hCacheFile)!=1) {
+        LOG_ERROR("Error while writing %" PRIu64 " bytes "
+                  "to cache file at offset %" PRIu64 "!\n",
+                  offset,
+                  pCacheFileHeader->pVhdFileHeader);
+        return -1;
+      }
+      LOG_DEBUG("Prepended changed data with %" PRIu64
+                " bytes at cache file offset %" PRIu64 "\n",
+                offset,pCacheFileHeader->pVhdFileHeader)
+    }
+    // Cache changed data
+    if(fwrite(buf,size,1,hCacheFile)!=1) {
+      LOG_ERROR("Couldn't write %zu bytes to cache file at offset %"
+                PRIu64 "\n",size,
+                pCacheFileHeader->pVhdFileHeader+offset)
+      return -1;
+    }
+    LOG_DEBUG("Wrote %zu bytes of changed data to cache file offset %"
+              PRIu64 "\n",size,
+              pCacheFileHeader->pVhdFileHeader+offset)
+    if(offset+size!=sizeof(TVhdFileHeader)) {
+      // Need to append data from VHD header to cache whole data struct
+      if(fwrite(((char*)pVhdFileHeader)+offset+size,
+                sizeof(TVhdFileHeader)-(offset+size),
+                1,
+                hCacheFile)!=1)
+      {
+        LOG_ERROR("Couldn't write %zu bytes to cache file at offset %"
+                  PRIu64 "\n",sizeof(TVhdFileHeader)-(offset+size),
+                  (uint64_t)(pCacheFileHeader->pVhdFileHeader+offset+size))
+        return -1;
+      }
+      LOG_DEBUG("Appended %" PRIu32
+                " bytes to changed data at cache file offset %"
+                PRIu64 "\n",sizeof(TVhdFileHeader)-(offset+size),
+                pCacheFileHeader->pVhdFileHeader+offset+size)
+    }
+    // Mark header as cached and update header in cache file
+    pCacheFileHeader->VhdFileHeaderCached=1;
+    if(!WriteCacheFileHeader()) return -1;
+  }
+  // All important data has been written, now flush all buffers to make
+  // sure data is written to cache file
+  fflush(hCacheFile);
+#ifndef __APPLE__
+  ioctl(fileno(hCacheFile),BLKFLSBUF,0);
+#endif
+  return size;
+}
+
+/*
+ * WriteDataArea:
+ *   Write data to the virtual image's data area. Changed data is written to
+ *   the cache file in blocks of CACHE_BLOCK_SIZE bytes.
+ *
+ * Params:
+ *   buf: Buffer containing data to write
+ *   offset: Offset inside data area
+ *   size: Size of data to be written (Must not exceed input image)
+ *
+ * Returns:
+ *   Number of written bytes on success or "-1" on error
+ */
+static int WriteDataArea(const char *buf, off_t offset, size_t size) {
+  uint64_t OrigImageSize;
+  uint64_t CurBlock=0;
+  off_t BlockOff=0;
+  off_t FileOff=offset;
+  size_t ToWrite=size;
+  size_t CurToWrite=0;
+  char *WriteBuf=(char*)buf;
+  char *buf2;
+  uint64_t BlockDataOff;
+
+  // Get original image size
+  if(!GetOrigImageSize(&OrigImageSize)) {
+    LOG_ERROR("Couldn't get original image size!\n")
+    return -1;
+  }
+
+  // Calculate first block to write data to
+  CurBlock=FileOff/CACHE_BLOCK_SIZE;
+  BlockOff=FileOff%CACHE_BLOCK_SIZE;
+
+  // Cache block data and checksums are about to get out of sync
+  if(!SetCacheFileDirty(TRUE)) return -1;
+  
+  while(ToWrite!=0) {
+    // Calculate how many bytes we have to write to this block
+    if(BlockOff+ToWrite>CACHE_BLOCK_SIZE) {
+      CurToWrite=CACHE_BLOCK_SIZE-BlockOff;
+    } else CurToWrite=ToWrite;
+    if(pCacheFileBlockIndex[CurBlock].Assigned==1) {
+      // Block was already cached
+      // Seek to data offset in cache file
+      if(fseeko(hCacheFile,
+             pCacheFileBlockIndex[CurBlock].off_data+BlockOff,
+             SEEK_SET)!=0)
+      {
+        LOG_ERROR("Couldn't seek to cached block at address %" PRIu64 "\n",
+                  pCacheFileBlockIndex[CurBlock].off_data+BlockOff)
+        return -1;
+      }
+      // Old data is needed to update the block's checksum
+      if(fread(pCacheBlockBuf,CurToWrite,1,hCacheFile)!=1 ||
+         fseeko(hCacheFile,
+                pCacheFileBlockIndex[CurBlock].off_data+BlockOff,
+                SEEK_SET)!=0)
+      {
+        LOG_ERROR("Couldn't read cached block at address %" PRIu64 "\n",
+                  pCacheFileBlockIndex[CurBlock].off_data+BlockOff)
+        return -1;
+      }
+      if(fwrite(WriteBuf,CurToWrite,1,hCacheFile)!=1) {
+        LOG_ERROR("Error while writing %zu bytes "
+                  "to cache file at offset %" PRIu64 "!\n",
+                  CurToWrite,
+                  pCacheFileBlockIndex[CurBlock].off_data+BlockOff);
+        return -1;
+      }
+      LOG_DEBUG("Wrote %zd bytes at offset %" PRIu64
+                " to cache file\n",CurToWrite,
+                pCacheFileBlockIndex[CurBlock].off_data+BlockOff)
+      pCacheFileBlockCrcs[CurBlock]=
+        Crc32cPatch(pCacheFileBlockCrcs[CurBlock],
+                    pCacheBlockBuf,
+                    WriteBuf,
+                    CurToWrite,
+                    CACHE_BLOCK_SIZE-(BlockOff+CurToWrite));
+      if(!WriteCacheFileBlockCrc(CurBlock)) return -1;
+    } else {
+      // Uncached block. Need to cache entire new block
+      // Seek to end of cache file to append new cache block
+      if(!AllocCacheFileSpace(CACHE_BLOCK_SIZE,&BlockDataOff) ||
+         fseeko(hCacheFile,BlockDataOff,SEEK_SET)!=0)
+      {
+        LOG_ERROR("Couldn't append new block to cache file!\n")
+        return -1;
+      }
+      pCacheFileBlockIndex[CurBlock].off_data=BlockDataOff;
+      pCacheFileBlockCrcs[CurBlock]=0;
+      if(BlockOff!=0) {
+        // Changed data does not begin at block boundry. Need to prepend
         // with data from virtual image file
         XMOUNT_MALLOC(buf2,char*,BlockOff*sizeof(char))
         if(GetOrigImageData(buf2,FileOff-BlockOff,BlockOff)!=BlockOff) {
           LOG_ERROR("Couldn't read data from original image file!\n")
           return -1;
         }
-        if(fwrite(buf2,BlockOff,1,hCacheFile)!=1) {
-          LOG_ERROR("Couldn't writing %" PRIu64 " bytes "
-                    "to cache file at offset %" PRIu64 "!\n",
-                    BlockOff,
-                    pCacheFileBlockIndex[CurBlock].off_data);
-          return -1;
+        if(fwrite(buf2,BlockOff,1,hCacheFile)!=1) {
+          LOG_ERROR("Couldn't writing %" PRIu64 " bytes "
+                    "to cache file at offset %" PRIu64 "!\n",
+                    BlockOff,
+                    pCacheFileBlockIndex[CurBlock].off_data);
+          return -1;
+        }
+        LOG_DEBUG("Prepended changed data with %" PRIu64
+                  " bytes from virtual image file at offset %" PRIu64
+                  "\n",BlockOff,FileOff-BlockOff)
+        pCacheFileBlockCrcs[CurBlock]=Crc32c(0,buf2,BlockOff);
+        free(buf2);
+      }
+      if(fwrite(WriteBuf,CurToWrite,1,hCacheFile)!=1) {
+        LOG_ERROR("Error while writing %zd bytes "
+                  "to cache file at offset %" PRIu64 "!\n",
+                  CurToWrite,
+                  pCacheFileBlockIndex[CurBlock].off_data+BlockOff);
+        return -1;
+      }
+      pCacheFileBlockCrcs[CurBlock]=Crc32c(pCacheFileBlockCrcs[CurBlock],
+                                           WriteBuf,
+                                           CurToWrite);
+      if(BlockOff+CurToWrite!=CACHE_BLOCK_SIZE) {
+        // Changed data does not end at block boundry. Need to append
+        // with data from virtual image file
+        XMOUNT_MALLOC(buf2,char*,(CACHE_BLOCK_SIZE-
+                                 (BlockOff+CurToWrite))*sizeof(char))
+        memset(buf2,0,CACHE_BLOCK_SIZE-(BlockOff+CurToWrite));
+        if((FileOff-BlockOff)+CACHE_BLOCK_SIZE>OrigImageSize) {
+          // Original image is smaller than full cache block
+          if(GetOrigImageData(buf2,
+               FileOff+CurToWrite,
+               OrigImageSize-(FileOff+CurToWrite))!=
+             OrigImageSize-(FileOff+CurToWrite))
+          {
+            LOG_ERROR("Couldn't read data from virtual image file!\n")
+            return -1;
+          }
+        } else {
+          if(GetOrigImageData(buf2,
+               FileOff+CurToWrite,
+               CACHE_BLOCK_SIZE-(BlockOff+CurToWrite))!=
+             CACHE_BLOCK_SIZE-(BlockOff+CurToWrite))
+          {
+            LOG_ERROR("Couldn't read data from virtual image file!\n")
+            return -1;
+          }
+        }
+        if(fwrite(buf2,
+                  CACHE_BLOCK_SIZE-(BlockOff+CurToWrite),
+                  1,
+                  hCacheFile)!=1)
+        {
+          LOG_ERROR("Error while writing %zd bytes "
+                    "to cache file at offset %" PRIu64 "!\n",
+                    CACHE_BLOCK_SIZE-(BlockOff+CurToWrite),
+                    pCacheFileBlockIndex[CurBlock].off_data+
+                      BlockOff+CurToWrite);
+          return -1;
+        }
+        pCacheFileBlockCrcs[CurBlock]=
+          Crc32c(pCacheFileBlockCrcs[CurBlock],
+                 buf2,
+                 CACHE_BLOCK_SIZE-(BlockOff+CurToWrite));
+        free(buf2);
+      }
+      // All important data for this cache block has been written,
+      // flush all buffers and mark cache block as assigned
+      fflush(hCacheFile);
+#ifndef __APPLE__
+      ioctl(fileno(hCacheFile),BLKFLSBUF,0);
+#endif
+      // Checksum must be written before block gets assigned
+      if(!WriteCacheFileBlockCrc(CurBlock)) return -1;
+      pCacheFileBlockVerified[CurBlock]=CACHE_BLOCK_VERIFIED;
+      pCacheFileBlockIndex[CurBlock].Assigned=1;
+      // Update cache block index entry in cache file
+      if(!WriteCacheFileBlockIndex(CurBlock)) return -1;
+      LOG_DEBUG("Updated cache file block index: Number=%" PRIu64
+                ", Data offset=%" PRIu64 "\n",CurBlock,
+                pCacheFileBlockIndex[CurBlock].off_data);
+    }
+    // Flush buffers
+    fflush(hCacheFile);
+#ifndef __APPLE__
+    ioctl(fileno(hCacheFile),BLKFLSBUF,0);
+#endif
+    // Keep memory cache in sync
+    UpdateMemCacheData(WriteBuf,CurBlock,BlockOff,CurToWrite);
+    BlockOff=0;
+    CurBlock++;
+    WriteBuf+=CurToWrite;
+    ToWrite-=CurToWrite;
+    FileOff+=CurToWrite;
+  }
+
+  return size;
+}
+
+/*
+ * SetVirtImageData:
+ *   Write data to virtual image
+ *
+ * Params:
+ *   pImage: Virtual image
+ *   buf: Buffer containing data to write
+ *   offset: Offset to start writing at
+ *   size: Size of data to be written
+ *
+ * Returns:
+ *   Number of written bytes on success or "-1" on error
+ */
+static int SetVirtImageData(pTVirtImage pImage,
+                            const char *buf,
+                            off_t offset,
+                            size_t size)
+{
+  uint64_t VirtImageSize;
+  uint64_t OrigImageSize;
+  size_t ToWrite=0;
+  size_t to_write_later=0;
+  size_t CurToWrite=0;
+  off_t FileOff=offset;
+  char *WriteBuf=(char*)buf;
+  ssize_t ret;
+
+  // Get virtual image size
+  if(!GetVirtImageSize(pImage,&VirtImageSize)) {
+    LOG_ERROR("Couldn't get virtual image size!\n")
+    return -1;
+  }
+
+  if(offset>=VirtImageSize) {
+    LOG_ERROR("Attempt to write beyond EOF of virtual image file!\n")
+    return -1;
+  }
+
+  if(offset+size>VirtImageSize) {
+    LOG_DEBUG("Attempt to write past EOF of virtual image file\n")
+    size=VirtImageSize-offset;
+  }
+
+  ToWrite=size;
+
+  // Get original image size
+  if(!GetOrigImageSize(&OrigImageSize)) {
+    LOG_ERROR("Couldn't get original image size!\n")
+    return -1;
+  }
+
+  // Cache virtual image type specific data preceeding original image data
+  switch(pImage->Type) {
+    case TVirtImageType_DD:
+    case TVirtImageType_DMG:
+      break;
+    case TVirtImageType_VDI:
+      if(FileOff<VdiFileHeaderSize) {
+        ret=SetVdiFileHeaderData(WriteBuf,FileOff,ToWrite);
+        if(ret==-1) {
+          LOG_ERROR("Couldn't write data to virtual VDI file header!\n")
+          return -1;
+        }
+        if(ret==ToWrite) return ToWrite;
+        else {
+          ToWrite-=ret;
+          WriteBuf+=ret;
+          FileOff=0;
+        }
+      } else FileOff-=VdiFileHeaderSize;
+      break;
+    case TVirtImageType_QCOW2:
+      if(FileOff<Qcow2HeaderSize) {
+        if(FileOff+ToWrite>Qcow2HeaderSize) CurToWrite=Qcow2HeaderSize-FileOff;
+        else CurToWrite=ToWrite;
+        if(SetHeaderPages(TVirtImageType_QCOW2,
+                          WriteBuf,
+                          FileOff,
+                          CurToWrite,
+                          Qcow2HeaderSize)!=CurToWrite)
+        {
+          LOG_ERROR("Couldn't write data to virtual QCOW2 metadata!\n")
+          return -1;
+        }
+        if(ToWrite==CurToWrite) return ToWrite;
+        else {
+          ToWrite-=CurToWrite;
+          WriteBuf+=CurToWrite;
+          FileOff=0;
+        }
+      } else FileOff-=Qcow2HeaderSize;
+      break;
+    case TVirtImageType_VHDX:
+      if(FileOff<VhdxHeaderSize) {
+        if(FileOff+ToWrite>VhdxHeaderSize) CurToWrite=VhdxHeaderSize-FileOff;
+        else CurToWrite=ToWrite;
+        if(SetHeaderPages(TVirtImageType_VHDX,
+                          WriteBuf,
+                          FileOff,
+                          CurToWrite,
+                          VhdxHeaderSize)!=CurToWrite)
+        {
+          LOG_ERROR("Couldn't write data to virtual VHDX structures!\n")
+          return -1;
+        }
+        if(ToWrite==CurToWrite) return ToWrite;
+        else {
+          ToWrite-=CurToWrite;
+          WriteBuf+=CurToWrite;
+          FileOff=0;
+        }
+      } else FileOff-=VhdxHeaderSize;
+      // Padding of the last payload block lies outside the virtual disk and
+      // is never used
+      if(FileOff>=OrigImageSize) {
+        to_write_later=ToWrite;
+        ToWrite=0;
+      } else if((FileOff+ToWrite)>OrigImageSize) {
+        to_write_later=(FileOff+ToWrite)-OrigImageSize;
+        ToWrite-=to_write_later;
+      }
+      break;
+    case TVirtImageType_VMDK:
+    case TVirtImageType_VMDKS:
+      if(FileOff<VmdkHeaderSize) {
+        if(FileOff+ToWrite>VmdkHeaderSize) CurToWrite=VmdkHeaderSize-FileOff;
+        else CurToWrite=ToWrite;
+        if(SetHeaderPages(pImage->Type,
+                          WriteBuf,
+                          FileOff,
+                          CurToWrite,
+                          VmdkHeaderSize)!=CurToWrite)
+        {
+          LOG_ERROR("Couldn't write data to virtual VMDK metadata!\n")
+          return -1;
+        }
+        if(ToWrite==CurToWrite) return ToWrite;
+        else {
+          ToWrite-=CurToWrite;
+          WriteBuf+=CurToWrite;
+          FileOff=0;
+        }
+      } else FileOff-=VmdkHeaderSize;
+      // Padding of the last grain lies outside the virtual disk and is never
+      // used
+      if(FileOff>=OrigImageSize) {
+        to_write_later=ToWrite;
+        ToWrite=0;
+      } else if((FileOff+ToWrite)>OrigImageSize) {
+        to_write_later=(FileOff+ToWrite)-OrigImageSize;
+        ToWrite-=to_write_later;
+      }
+      break;
+    case TVirtImageType_VHD:
+      // When emulating VHD, make sure the while loop below only writes data
+      // available in the original image. Any VHD footer data must be written
+      // afterwards.
+      if(FileOff>=OrigImageSize) {
+        to_write_later=ToWrite;
+        ToWrite=0;
+      } else if((FileOff+ToWrite)>OrigImageSize) {
+        to_write_later=(FileOff+ToWrite)-OrigImageSize;
+        ToWrite-=to_write_later;
+      }
+      break;
+  }
+
+  // Write image data
+  if(ToWrite!=0) {
+    if(WriteDataArea(WriteBuf,FileOff,ToWrite)!=ToWrite) return -1;
+    WriteBuf+=ToWrite;
+    FileOff+=ToWrite;
+  }
+
+  if(to_write_later!=0) {
+    // Cache virtual image type specific data preceeding original image data
+    switch(pImage->Type) {
+      case TVirtImageType_DD:
+      case TVirtImageType_DMG:
+      case TVirtImageType_VDI:
+      case TVirtImageType_QCOW2:
+        break;
+      case TVirtImageType_VHDX:
+        LOG_DEBUG("Ignoring %zu bytes written to VHDX payload block padding\n",
+                  to_write_later)
+        break;
+      case TVirtImageType_VMDK:
+      case TVirtImageType_VMDKS:
+        LOG_DEBUG("Ignoring %zu bytes written to VMDK grain padding\n",
+                  to_write_later)
+        break;
+      case TVirtImageType_VHD:
+        // Micro$oft has choosen to use a footer rather then a header.
+        ret=SetVhdFileHeaderData(WriteBuf,FileOff-OrigImageSize,to_write_later);
+        if(ret==-1) {
+          LOG_ERROR("Couldn't write data to virtual VHD file footer!\n")
+          return -1;
+        }
+        break;
+    }
+  }
+
+  return size;
+}
+
+/*
+ * GetVirtFileAccess:
+ *   FUSE access implementation
+ *
+ * Params:
+ *   path: Path of file to get attributes from
+ *   perm: Requested permissisons
+ *
+ * Returns:
+ *   "0" on success, negated error code on error
+ */
+/*
+static int GetVirtFileAccess(const char *path, int perm) {
+  // TODO: Implement propper file permission handling
+  // http://www.cs.cf.ac.uk/Dave/C/node20.html
+  // Values for the second argument to access.
+  // These may be OR'd together.
+  //#define	R_OK	4		// Test for read permission.
+  //#define	W_OK	2		// Test for write permission.
+  //#define	X_OK	1		// Test for execute permission.
+  //#define	F_OK	0		// Test for existence.
+  return 0;
+}
+*/
+
+/*
+ * CopyFileRange:
+ *   Copy a range of data from one file to another. copy_file_range is used if
+ *   possible so the kernel can copy the data without passing it through
+ *   xmount or share data extents on reflink-capable filesystems.
+ *
+ * Params:
+ *   SrcFd: Source file descriptor
+ *   SrcOff: Offset of data in source file
+ *   DstFd: Destination file descriptor
+ *   DstOff: Offset of data in destination file
+ *   size: Size of data to copy
+ *   ppBuf: Buffer used for read/write fallback. Allocated if NULL, must be
+ *          freed by caller.
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int CopyFileRange(int SrcFd,
+                         off_t SrcOff,
+                         int DstFd,
+                         off_t DstOff,
+                         uint64_t size,
+                         char **ppBuf)
+{
+  ssize_t ret;
+  int UseCopyRange=TRUE;
+
+  while(size>0) {
+#if !defined(__APPLE__) && defined(__NR_copy_file_range)
+    if(UseCopyRange) {
+      int64_t InOff=SrcOff;
+      int64_t OutOff=DstOff;
+      ret=syscall(__NR_copy_file_range,
+                  SrcFd,
+                  &InOff,
+                  DstFd,
+                  &OutOff,
+                  (size_t)size,
+                  0);
+      if(ret>0) {
+        SrcOff+=ret;
+        DstOff+=ret;
+        size-=ret;
+        continue;
+      }
+      if(ret==0 || errno==ENOSYS || errno==EXDEV || errno==EINVAL ||
+         errno==EOPNOTSUPP)
+      {
+        LOG_DEBUG("copy_file_range not usable. Falling back to read/write\n")
+        UseCopyRange=FALSE;
+      } else {
+        LOG_ERROR("copy_file_range failed: %s!\n",strerror(errno))
+        return FALSE;
+      }
+    }
+#else
+    UseCopyRange=FALSE;
+#endif
+    if(*ppBuf==NULL) XMOUNT_MALLOC(*ppBuf,char*,CACHE_BLOCK_SIZE*sizeof(char))
+    ret=pread(SrcFd,
+              *ppBuf,
+              size>CACHE_BLOCK_SIZE ? CACHE_BLOCK_SIZE : (size_t)size,
+              SrcOff);
+    if(ret<=0 || pwrite(DstFd,*ppBuf,ret,DstOff)!=ret) {
+      LOG_ERROR("Couldn't copy data at offset %" PRIu64 "!\n",
+                (uint64_t)SrcOff)
+      return FALSE;
+    }
+    SrcOff+=ret;
+    DstOff+=ret;
+    size-=ret;
+  }
+  return TRUE;
+}
+
+/*
+ * CopyFileData:
+ *   Copy data of a file to another file. Unless the target filesystem is able
+ *   to share data extents with the source file (reflink), only data regions
+ *   are copied so holes are preserved.
+ *
+ * Params:
+ *   SrcFd: Source file descriptor
+ *   DstFd: Destination file descriptor (Must be empty)
+ *   size: Size of source file
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int CopyFileData(int SrcFd, int DstFd, uint64_t size) {
+  off_t DataStart=0;
+  off_t DataEnd=0;
+  char *pBuf=NULL;
+
+#if !defined(__APPLE__) && defined(FICLONE)
+  // Try to clone file extents first. This is done in constant time on
+  // reflink-capable filesystems like XFS or btrfs.
+  if(ioctl(DstFd,FICLONE,SrcFd)==0) {
+    LOG_DEBUG("Cloned file extents using FICLONE\n")
+    return TRUE;
+  }
+  LOG_DEBUG("FICLONE not supported (%s). Copying data\n",strerror(errno))
+#endif
+
+  while((uint64_t)DataEnd<size) {
+#ifdef SEEK_DATA
+    // Search next data region
+    DataStart=lseek(SrcFd,DataEnd,SEEK_DATA);
+    if(DataStart==-1) {
+      if(errno==ENXIO) break;
+      // Filesystem doesn't support searching for data
+      DataStart=DataEnd;
+      DataEnd=size;
+    } else {
+      DataEnd=lseek(SrcFd,DataStart,SEEK_HOLE);
+      if(DataEnd==-1) DataEnd=size;
+    }
+#else
+    DataStart=0;
+    DataEnd=size;
+#endif
+
+    // Copy data region
+    if(!CopyFileRange(SrcFd,
+                      DataStart,
+                      DstFd,
+                      DataStart,
+                      DataEnd-DataStart,
+                      &pBuf))
+    {
+      free(pBuf);
+      return FALSE;
+    }
+  }
+  free(pBuf);
+
+  // Make sure trailing holes are part of the copy
+  if(ftruncate(DstFd,size)!=0) {
+    LOG_ERROR("Couldn't set size of copy!\n")
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/*
+ * SnapshotCacheFile:
+ *   Save a consistent copy of the cache file while the image stays mounted.
+ *   The cache file is cloned with writes blocked on filesystems supporting
+ *   reflinks, which is instant. Otherwise, it is copied without blocking
+ *   writes and the copy is only kept if nothing was written meanwhile. After
+ *   SNAPSHOT_COPY_ATTEMPTS failed attempts, writes are blocked for the copy.
+ *
+ * Params:
+ *   pSnapshotFile: File to create
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int SnapshotCacheFile(const char *pSnapshotFile) {
+  struct timespec StartTime,EndTime;
+  uint64_t BlockedTime=0;
+  uint64_t CacheFileSize=0;
+  uint64_t WriteCount;
+  uint32_t clean=FALSE;
+  int attempt;
+  int DstFd;
+  int done=FALSE;
+  int ret=TRUE;
+
+  if(!XMountConfData.Writable) {
+    LOG_ERROR("Snapshots are only possible when a cache file is used!\n")
+    return FALSE;
+  }
+
+  // Never overwrite existing files. The copy may contain sensitive data.
+  DstFd=open(pSnapshotFile,O_WRONLY | O_CREAT | O_EXCL,0600);
+  if(DstFd==-1) {
+    LOG_ERROR("Couldn't create snapshot file \"%s\": %s!\n",
+              pSnapshotFile,
+              strerror(errno))
+    return FALSE;
+  }
+
+  for(attempt=1;ret && !done;attempt++) {
+    // Flush pending data and remember state of cache file
+    pthread_mutex_lock(&mutex_image_rw);
+    clock_gettime(CLOCK_MONOTONIC,&StartTime);
+    fflush(hCacheFile);
+    if(fseeko(hCacheFile,0,SEEK_END)!=0) {
+      LOG_ERROR("Couldn't seek to end of cache file!\n")
+      ret=FALSE;
+    } else {
+      CacheFileSize=ftello(hCacheFile);
+      WriteCount=CacheFileWriteCount;
+      if(attempt==SNAPSHOT_COPY_ATTEMPTS) {
+        // Cache file keeps changing. Copy it with writes blocked.
+        LOG_DEBUG("Blocking writes while copying cache file\n")
+        ret=(ftruncate(DstFd,0)==0) &&
+            CopyFileData(fileno(hCacheFile),DstFd,CacheFileSize);
+        done=TRUE;
+      }
+#if !defined(__APPLE__) && defined(FICLONE)
+      else if(attempt==1 && ioctl(DstFd,FICLONE,fileno(hCacheFile))==0) {
+        done=TRUE;
+      }
+#endif
+    }
+    clock_gettime(CLOCK_MONOTONIC,&EndTime);
+    BlockedTime+=(EndTime.tv_sec-StartTime.tv_sec)*1000000+
+                 (EndTime.tv_nsec-StartTime.tv_nsec)/1000;
+    pthread_mutex_unlock(&mutex_image_rw);
+    if(!ret || done) break;
+
+    // Copy without blocking writes. Only consistent if no write happened.
+    ret=(ftruncate(DstFd,0)==0) &&
+        CopyFileData(fileno(hCacheFile),DstFd,CacheFileSize);
+    if(!ret) break;
+    pthread_mutex_lock(&mutex_image_rw);
+    done=(WriteCount==CacheFileWriteCount);
+    pthread_mutex_unlock(&mutex_image_rw);
+    if(!done) {
+      LOG_DEBUG("Cache file changed while copying it. Retrying\n")
+    }
+  }
+
+  if(ret && pCacheFileHeader!=NULL &&
+     pCacheFileHeader->BlockCrcsPresent==TRUE &&
+     pCacheFileHeader->CacheFileDirty==TRUE)
+  {
+    // No write was in progress while copying, so all block checksums of the
+    // copy are up to date. Mark it clean (See SetCacheFileDirty).
+    if(pwrite(DstFd,
+              &clean,
+              sizeof(uint32_t),
+              CacheFileHeaderOff+offsetof(TCacheFileHeader,CacheFileDirty))!=
+       sizeof(uint32_t))
+    {
+      LOG_ERROR("Couldn't update snapshot file header!\n")
+      ret=FALSE;
+    }
+  }
+  if(ret && fsync(DstFd)!=0) {
+    LOG_ERROR("Couldn't sync snapshot file!\n")
+    ret=FALSE;
+  }
+  close(DstFd);
+  if(!ret) {
+    unlink(pSnapshotFile);
+    return FALSE;
+  }
+  LOG_DEBUG("Saved cache file snapshot to \"%s\". Writes were blocked for "
+            "%" PRIu64 " us\n",
+            pSnapshotFile,
+            BlockedTime)
+  return TRUE;
+}
+
+/*
+ * NotifyInvalInode:
+ *   Tell the kernel to drop part of a virtual file from its page cache
+ *
+ * Params:
+ *   ino: Inode number of virtual file
+ *   offset: Offset of range to drop
+ *   size: Size of range to drop ("0" up to the end of the file)
+ *
+ * Returns:
+ *   "0" on success, negated error code on error
+ */
+static int NotifyInvalInode(fuse_ino_t ino, off_t offset, off_t size) {
+#ifdef HAVE_LIBFUSE3
+  return fuse_lowlevel_notify_inval_inode(pFuseSession,ino,offset,size);
+#else
+  return fuse_lowlevel_notify_inval_inode(pFuseChan,ino,offset,size);
+#endif
+}
+
+/*
+ * FlushVirtFilePages:
+ *   Make the kernel pass writes it cached because of --writeback to xmount.
+ *   Invalidating the page cache of a virtual file writes back its dirty
+ *   pages first, which sends write requests to other FUSE threads.
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int FlushVirtFilePages() {
+#ifdef HAVE_LIBFUSE3
+  fuse_ino_t i;
+  int ret;
+
+  if(!XMountConfData.FuseWriteback || pFuseSession==NULL) return TRUE;
+  if(FuseSingleThreaded) {
+    // Nobody would serve the write requests
+    LOG_ERROR("Can't flush writes cached by the kernel when running single "
+              "threaded!\n")
+    return FALSE;
+  }
+  for(i=0;i<VirtFileCount;i++) {
+    if(pVirtFiles[i].pName==NULL ||
+       (pVirtFiles[i].pImage==NULL && pVirtFiles[i].pPartition==NULL))
+    {
+      continue;
+    }
+    // Files the kernel doesn't know yet return ENOENT
+    ret=NotifyInvalInode(i+1,0,0);
+    if(ret!=0 && ret!=-ENOENT) {
+      LOG_ERROR("Couldn't flush writes cached by the kernel: %s!\n",
+                strerror(-ret))
+      return FALSE;
+    }
+  }
+#endif
+  return TRUE;
+}
+
+/*
+ * ExportVirtImage:
+ *   Save the current content of the virtual DD image to a new file without
+ *   passing it through FUSE. Data of DD input files and changed blocks of the
+ *   cache file is copied by the kernel (See CopyFileRange). Blocks known to
+ *   contain only zeros are left as holes. Writes cached by the kernel are
+ *   flushed first (See FlushVirtFilePages).
+ *
+ * Params:
+ *   pExportFile: File to create
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int ExportVirtImage(const char *pExportFile) {
+  uint64_t ImageSize;
+  uint64_t block;
+  uint64_t BlockSize;
+  uint64_t off;
+  uint64_t len;
+  uint64_t CurSize;
+  uint32_t seg;
+  char *pBuf;
+  int DstFd;
+  int hole;
+  int ret=TRUE;
+
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return FALSE;
+  }
+
+  if(!FlushVirtFilePages()) return FALSE;
+
+  // Never overwrite existing files. The copy may contain sensitive data.
+  DstFd=open(pExportFile,O_WRONLY | O_CREAT | O_EXCL,0600);
+  if(DstFd==-1) {
+    LOG_ERROR("Couldn't create export file \"%s\": %s!\n",
+              pExportFile,
+              strerror(errno))
+    return FALSE;
+  }
+  if(ftruncate(DstFd,ImageSize)!=0) {
+    LOG_ERROR("Couldn't set size of export file!\n")
+    close(DstFd);
+    unlink(pExportFile);
+    return FALSE;
+  }
+
+  XMOUNT_MALLOC(pBuf,char*,CACHE_BLOCK_SIZE*sizeof(char))
+  for(block=0;ret && block*CACHE_BLOCK_SIZE<ImageSize;block++) {
+    off=block*CACHE_BLOCK_SIZE;
+    if(ImageSize-off>CACHE_BLOCK_SIZE) BlockSize=CACHE_BLOCK_SIZE;
+    else BlockSize=ImageSize-off;
+    // Only lock a single block at once so the image stays usable
+    pthread_mutex_lock(&mutex_image_rw);
+    if(IsZeroBlock(block)) {
+      // Leave a hole
+    } else if(XMountConfData.Writable==TRUE &&
+              pCacheFileBlockIndex[block].Assigned==TRUE)
+    {
+      if(pCacheFileBlockVerified[block]==CACHE_BLOCK_VERIFIED) {
+        fflush(hCacheFile);
+        ret=CopyFileRange(fileno(hCacheFile),
+                          pCacheFileBlockIndex[block].off_data,
+                          DstFd,
+                          off,
+                          BlockSize,
+                          &pBuf);
+      } else if(GetDataAreaData(pBuf,block,0,BlockSize)!=BlockSize ||
+                pwrite(DstFd,pBuf,BlockSize,off)!=BlockSize)
+      {
+        // Block must be verified first
+        ret=FALSE;
+      }
+    } else if(XMountConfData.OrigImageType==TOrigImageType_DD) {
+      // Copy data of every touched input file segment, skipping holes
+      len=BlockSize;
+      seg=FindDdSegment(off);
+      while(ret && len>0) {
+        CurSize=pDdSegments[seg].Offset+pDdSegments[seg].Size-off;
+        if(CurSize>len) CurSize=len;
+        CurSize=GetDdHoleExtent(off,CurSize,&hole);
+        if(!hole) {
+          ret=CopyFileRange(fileno(pDdSegments[seg].hFile),
+                            off-pDdSegments[seg].Offset,
+                            DstFd,
+                            off,
+                            CurSize,
+                            &pBuf);
+        }
+        off+=CurSize;
+        len-=CurSize;
+        if(off>=pDdSegments[seg].Offset+pDdSegments[seg].Size) seg++;
+      }
+    } else if(GetOrigImageData(pBuf,off,BlockSize)!=BlockSize) {
+      ret=FALSE;
+    } else if(!IsZeroData(pBuf,BlockSize) &&
+              pwrite(DstFd,pBuf,BlockSize,off)!=BlockSize)
+    {
+      ret=FALSE;
+    }
+    pthread_mutex_unlock(&mutex_image_rw);
+  }
+  free(pBuf);
+
+  if(ret && fsync(DstFd)!=0) {
+    LOG_ERROR("Couldn't sync export file!\n")
+    ret=FALSE;
+  }
+  close(DstFd);
+  if(!ret) {
+    LOG_ERROR("Couldn't export virtual image to \"%s\"!\n",pExportFile)
+    unlink(pExportFile);
+    return FALSE;
+  }
+  LOG_DEBUG("Exported virtual image to \"%s\"\n",pExportFile)
+  return TRUE;
+}
+
+/*
+ * SetControlFileStatus:
+ *   Set text returned when reading the virtual control file
+ *
+ * Params:
+ *   pStatus: Status text
+ *
+ * Returns:
+ *   n/a
+ */
+static void SetControlFileStatus(const char *pStatus) {
+  pthread_mutex_lock(&mutex_info_read);
+  free(pVirtualControlFile);
+  XMOUNT_STRSET(pVirtualControlFile,pStatus)
+  pthread_mutex_unlock(&mutex_info_read);
+}
+
+/*
+ * ExecControlCommand:
+ *   Execute a command written to the virtual control file. Supported commands
+ *   are:
+ *     snapshot <file> : Save a copy of the cache file to <file>
+ *     export <file> : Save a copy of the virtual DD image to <file>
+ *   File names must be absolute as xmount's working directory is "/" once it
+ *   runs in the background.
+ *
+ * Params:
+ *   buf: Command
+ *   size: Size of command
+ *
+ * Returns:
+ *   "0" on success, negated error code on error
+ */
+static int ExecControlCommand(const char *buf, size_t size) {
+  char *pCmd=NULL;
+  char *pArg;
+
+  // Make a null-terminated copy without trailing line breaks
+  XMOUNT_STRNSET(pCmd,buf,size)
+  while(size>0 && (pCmd[size-1]=='\n' || pCmd[size-1]=='\r')) {
+    pCmd[--size]='\0';
+  }
+  pArg=strchr(pCmd,' ');
+  if(pArg!=NULL) *(pArg++)='\0';
+
+  LOG_DEBUG("Executing control command \"%s\"\n",pCmd)
+  if(pArg!=NULL && *pArg!='\0' && *pArg!='/') {
+    LOG_ERROR("Control command \"%s\" needs an absolute path!\n",pCmd)
+    SetControlFileStatus("ERROR path must be absolute\n");
+    free(pCmd);
+    return -EINVAL;
+  }
+  if(strcmp(pCmd,"snapshot")==0 && pArg!=NULL && *pArg!='\0') {
+    if(!SnapshotCacheFile(pArg)) {
+      SetControlFileStatus("ERROR snapshot\n");
+      free(pCmd);
+      return -EIO;
+    }
+    SetControlFileStatus("OK snapshot\n");
+  } else if(strcmp(pCmd,"export")==0 && pArg!=NULL && *pArg!='\0') {
+    if(!ExportVirtImage(pArg)) {
+      SetControlFileStatus("ERROR export\n");
+      free(pCmd);
+      return -EIO;
+    }
+    SetControlFileStatus("OK export\n");
+  } else {
+    LOG_ERROR("Unknown control command \"%s\"!\n",pCmd)
+    SetControlFileStatus("ERROR unknown command\n");
+    free(pCmd);
+    return -EINVAL;
+  }
+  free(pCmd);
+  return 0;
+}
+
+/*
+ * GetVirtImageFileSize:
+ *   Get size of a virtual image file
+ *
+ * Params:
+ *   pFile: Virtual file
+ *   pSize: Size is written to this var
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int GetVirtImageFileSize(pTVirtFile pFile, uint64_t *pSize) {
+  return GetVirtImageSize(pFile->pImage,pSize);
+}
+
+/*
+ * ReadVirtImageFile:
+ *   Read data from a virtual image file
+ *
+ * Params:
+ *   pFile: Virtual file
+ *   buf: Buffer where read data is written to
+ *   size: Number of bytes to read
+ *   offset: Offset to start reading at
+ *
+ * Returns:
+ *   Read bytes on success, negated error code on error
+ */
+static int ReadVirtImageFile(pTVirtFile pFile,
+                             char *buf,
+                             size_t size,
+                             off_t offset)
+{
+  uint64_t len;
+
+  // Wait for other threads to end reading/writing data
+  pthread_mutex_lock(&mutex_image_rw);
+
+  // Get virtual image file size
+  if(!GetVirtImageSize(pFile->pImage,&len)) {
+    LOG_ERROR("Couldn't get virtual image size!\n")
+    pthread_mutex_unlock(&mutex_image_rw);
+    return 0;
+  }
+  if(offset<len) {
+    if(offset+size>len) size=len-offset;
+    if(GetVirtImageData(pFile->pImage,buf,offset,size)!=size) {
+      LOG_ERROR("Couldn't read data from virtual image file!\n")
+      pthread_mutex_unlock(&mutex_image_rw);
+      return -EIO;
+    }
+  } else {
+    LOG_DEBUG("Attempt to read past EOF of virtual image file\n");
+    pthread_mutex_unlock(&mutex_image_rw);
+    return 0;
+  }
+
+  // Allow other threads to read/write data again
+  pthread_mutex_unlock(&mutex_image_rw);
+  return size;
+}
+
+/*
+ * WriteVirtImageFile:
+ *   Write data to a virtual image file
+ *
+ * Params:
+ *   pFile: Virtual file
+ *   buf: Buffer containing data to write
+ *   size: Number of bytes to write
+ *   offset: Offset to start writing at
+ *
+ * Returns:
+ *   Written bytes on success, negated error code on error
+ */
+static int WriteVirtImageFile(pTVirtFile pFile,
+                              const char *buf,
+                              size_t size,
+                              off_t offset)
+{
+  uint64_t len;
+
+  // Wait for other threads to end reading/writing data
+  pthread_mutex_lock(&mutex_image_rw);
+
+  // Get virtual image file size
+  if(!GetVirtImageSize(pFile->pImage,&len)) {
+    LOG_ERROR("Couldn't get virtual image size!\n")
+    pthread_mutex_unlock(&mutex_image_rw);
+    return 0;
+  }
+  if(offset<len) {
+    if(offset+size>len) size=len-offset;
+    if(!LockQcow2CacheFile()) {
+      pthread_mutex_unlock(&mutex_image_rw);
+      return -EBUSY;
+    }
+    CacheFileWriteCount++;
+    if(SetVirtImageData(pFile->pImage,buf,offset,size)!=size) {
+      LOG_ERROR("Couldn't write data to virtual image file!\n")
+      pthread_mutex_unlock(&mutex_image_rw);
+      return 0;
+    }
+  } else {
+    LOG_DEBUG("Attempt to write past EOF of virtual image file\n")
+    pthread_mutex_unlock(&mutex_image_rw);
+    return 0;
+  }
+
+  // Allow other threads to read/write data again
+  pthread_mutex_unlock(&mutex_image_rw);
+  return size;
+}
+
+/*
+ * GetPartitionFileSize:
+ *   Get size of a virtual partition file
+ *
+ * Params:
+ *   pFile: Virtual file
+ *   pSize: Size is written to this var
+ *
+ * Returns:
+ *   "TRUE"
+ */
+static int GetPartitionFileSize(pTVirtFile pFile, uint64_t *pSize) {
+  *pSize=pFile->pPartition->Size;
+  return TRUE;
+}
+
+/*
+ * ReadPartitionFile:
+ *   Read data from a virtual partition file. Partition data maps directly to
+ *   the data area.
+ *
+ * Params:
+ *   pFile: Virtual file
+ *   buf: Buffer where read data is written to
+ *   size: Number of bytes to read
+ *   offset: Offset to start reading at
+ *
+ * Returns:
+ *   Read bytes on success, negated error code on error
+ */
+static int ReadPartitionFile(pTVirtFile pFile,
+                             char *buf,
+                             size_t size,
+                             off_t offset)
+{
+  pTPartition pPartition=pFile->pPartition;
+
+  if(offset>=pPartition->Size) {
+    LOG_DEBUG("Attempt to read past EOF of virtual partition file\n");
+    return 0;
+  }
+  if(offset+size>pPartition->Size) size=pPartition->Size-offset;
+  pthread_mutex_lock(&mutex_image_rw);
+  if(ReadDataArea(buf,pPartition->Offset+offset,size)!=size) {
+    LOG_ERROR("Couldn't read data from virtual partition file!\n")
+    pthread_mutex_unlock(&mutex_image_rw);
+    return -EIO;
+  }
+  pPartition->ReadCount++;
+  pPartition->ReadBytes+=size;
+  pthread_mutex_unlock(&mutex_image_rw);
+  return size;
+}
+
+/*
+ * WritePartitionFile:
+ *   Write data to a virtual partition file
+ *
+ * Params:
+ *   pFile: Virtual file
+ *   buf: Buffer containing data to write
+ *   size: Number of bytes to write
+ *   offset: Offset to start writing at
+ *
+ * Returns:
+ *   Written bytes on success, negated error code on error
+ */
+static int WritePartitionFile(pTVirtFile pFile,
+                              const char *buf,
+                              size_t size,
+                              off_t offset)
+{
+  pTPartition pPartition=pFile->pPartition;
+
+  if(offset>=pPartition->Size) {
+    LOG_DEBUG("Attempt to write past EOF of virtual partition file\n")
+    return 0;
+  }
+  if(offset+size>pPartition->Size) size=pPartition->Size-offset;
+  pthread_mutex_lock(&mutex_image_rw);
+  if(!LockQcow2CacheFile()) {
+    pthread_mutex_unlock(&mutex_image_rw);
+    return -EBUSY;
+  }
+  CacheFileWriteCount++;
+  if(WriteDataArea(buf,pPartition->Offset+offset,size)!=size) {
+    LOG_ERROR("Couldn't write data to virtual partition file!\n")
+    pthread_mutex_unlock(&mutex_image_rw);
+    return 0;
+  }
+  pthread_mutex_unlock(&mutex_image_rw);
+  return size;
+}
+
+/*
+ * GetInfoFileSize:
+ *   Get size of the virtual image info file
+ *
+ * Params:
+ *   pFile: Virtual file
+ *   pSize: Size is written to this var
+ *
+ * Returns:
+ *   "TRUE"
+ */
+static int GetInfoFileSize(pTVirtFile pFile, uint64_t *pSize) {
+  if(pVirtualImageInfoFile!=NULL) *pSize=strlen(pVirtualImageInfoFile);
+  else *pSize=0;
+  return TRUE;
+}
+
+/*
+ * ReadInfoFile:
+ *   Read data from the virtual image info file
+ *
+ * Params:
+ *   pFile: Virtual file
+ *   buf: Buffer where read data is written to
+ *   size: Number of bytes to read
+ *   offset: Offset to start reading at
+ *
+ * Returns:
+ *   Read bytes on success, negated error code on error
+ */
+static int ReadInfoFile(pTVirtFile pFile,
+                        char *buf,
+                        size_t size,
+                        off_t offset)
+{
+  uint64_t len=strlen(pVirtualImageInfoFile);
+
+  if(offset<len) {
+    if(offset+size>len) {
+      size=len-offset;
+      LOG_DEBUG("Attempt to read past EOF of virtual image info file\n")
+    }
+    pthread_mutex_lock(&mutex_info_read);
+    memcpy(buf,pVirtualImageInfoFile+offset,size);
+    pthread_mutex_unlock(&mutex_info_read);
+    LOG_DEBUG("Read %" PRIu64 " bytes at offset %" PRIu64
+              " from virtual image info file\n",size,offset)
+  } else {
+    LOG_DEBUG("Attempt to read past EOF of virtual info file\n");
+    return 0;
+  }
+  return size;
+}
+
+/*
+ * GetControlFileSize:
+ *   Get size of the virtual control file, which is the size of the last
+ *   command's status
+ *
+ * Params:
+ *   pFile: Virtual file
+ *   pSize: Size is written to this var
+ *
+ * Returns:
+ *   "TRUE"
+ */
+static int GetControlFileSize(pTVirtFile pFile, uint64_t *pSize) {
+  pthread_mutex_lock(&mutex_info_read);
+  if(pVirtualControlFile!=NULL) *pSize=strlen(pVirtualControlFile);
+  else *pSize=0;
+  pthread_mutex_unlock(&mutex_info_read);
+  return TRUE;
+}
+
+/*
+ * ReadControlFile:
+ *   Read status of last control command
+ *
+ * Params:
+ *   pFile: Virtual file
+ *   buf: Buffer where read data is written to
+ *   size: Number of bytes to read
+ *   offset: Offset to start reading at
+ *
+ * Returns:
+ *   Read bytes on success, negated error code on error
+ */
+static int ReadControlFile(pTVirtFile pFile,
+                           char *buf,
+                           size_t size,
+                           off_t offset)
+{
+  uint64_t len;
+
+  pthread_mutex_lock(&mutex_info_read);
+  len=(pVirtualControlFile!=NULL) ? strlen(pVirtualControlFile) : 0;
+  if(offset<len) {
+    if(offset+size>len) size=len-offset;
+    memcpy(buf,pVirtualControlFile+offset,size);
+    pthread_mutex_unlock(&mutex_info_read);
+  } else {
+    pthread_mutex_unlock(&mutex_info_read);
+    return 0;
+  }
+  return size;
+}
+
+/*
+ * WriteControlFile:
+ *   Execute a control command. Every write is a single command.
+ *
+ * Params:
+ *   pFile: Virtual file
+ *   buf: Buffer containing command
+ *   size: Size of command
+ *   offset: Ignored
+ *
+ * Returns:
+ *   Written bytes on success, negated error code on error
+ */
+static int WriteControlFile(pTVirtFile pFile,
+                            const char *buf,
+                            size_t size,
+                            off_t offset)
+{
+  int ret;
+
+  ret=ExecControlCommand(buf,size);
+  if(ret!=0) return ret;
+  return size;
+}
+
+/*
+ * GetVmdkLockFileSize:
+ *   Get size of VmWare's virtual lock file
+ *
+ * Params:
+ *   pFile: Virtual file
+ *   pSize: Size is written to this var
+ *
+ * Returns:
+ *   "TRUE"
+ */
+static int GetVmdkLockFileSize(pTVirtFile pFile, uint64_t *pSize) {
+  *pSize=VirtualVmdkLockFileDataSize;
+  return TRUE;
+}
+
+/*
+ * ReadVmdkLockFile:
+ *   Read data from VmWare's virtual lock file
+ *
+ * Params:
+ *   pFile: Virtual file
+ *   buf: Buffer where read data is written to
+ *   size: Number of bytes to read
+ *   offset: Offset to start reading at
+ *
+ * Returns:
+ *   Read bytes on success, negated error code on error
+ */
+static int ReadVmdkLockFile(pTVirtFile pFile,
+                            char *buf,
+                            size_t size,
+                            off_t offset)
+{
+  uint64_t len=VirtualVmdkLockFileDataSize;
+
+  if(offset<len) {
+    if(offset+size>len) {
+      LOG_DEBUG("Attempt to read past EOF of virtual vmdk lock file\n")
+      LOG_DEBUG("Adjusting read size from %u to %u\n",size,len-offset)
+      size=len-offset;
+    }
+    pthread_mutex_lock(&mutex_image_rw);
+    memcpy(buf,pVirtualVmdkLockFileData+offset,size);
+    pthread_mutex_unlock(&mutex_image_rw);
+    LOG_DEBUG("Read %" PRIu64 " bytes at offset %" PRIu64
+              " from virtual vmdk lock file\n",size,offset)
+  } else {
+    LOG_DEBUG("Attempt to read past EOF of virtual vmdk lock file\n");
+    return 0;
+  }
+  return size;
+}
+
+/*
+ * WriteVmdkLockFile:
+ *   Write data to VmWare's virtual lock file
+ *
+ * Params:
+ *   pFile: Virtual file
+ *   buf: Buffer containing data to write
+ *   size: Number of bytes to write
+ *   offset: Offset to start writing at
+ *
+ * Returns:
+ *   Written bytes on success, negated error code on error
+ */
+static int WriteVmdkLockFile(pTVirtFile pFile,
+                             const char *buf,
+                             size_t size,
+                             off_t offset)
+{
+  pthread_mutex_lock(&mutex_image_rw);
+  if((offset+size)>VirtualVmdkLockFileDataSize) {
+    // Enlarge or create buffer if needed
+    if(VirtualVmdkLockFileDataSize==0) {
+      VirtualVmdkLockFileDataSize=offset+size;
+      XMOUNT_MALLOC(pVirtualVmdkLockFileData,char*,
+                    VirtualVmdkLockFileDataSize*sizeof(char))
+    } else {
+      VirtualVmdkLockFileDataSize=offset+size;
+      XMOUNT_REALLOC(pVirtualVmdkLockFileData,char*,
+                     VirtualVmdkLockFileDataSize*sizeof(char))
+    }
+  }
+  // Copy data to buffer
+  memcpy(pVirtualVmdkLockFileData+offset,buf,size);
+  pthread_mutex_unlock(&mutex_image_rw);
+  return size;
+}
+
+/*
+ * Data access functions of the different kinds of virtual files
+ */
+static const TVirtFileOps VirtImageFileOps = {
+  .GetSize=GetVirtImageFileSize,
+  .Read=ReadVirtImageFile,
+  .Write=WriteVirtImageFile
+};
+static const TVirtFileOps PartitionFileOps = {
+  .GetSize=GetPartitionFileSize,
+  .Read=ReadPartitionFile,
+  .Write=WritePartitionFile
+};
+static const TVirtFileOps InfoFileOps = {
+  .GetSize=GetInfoFileSize,
+  .Read=ReadInfoFile,
+  .Write=NULL
+};
+static const TVirtFileOps ControlFileOps = {
+  .GetSize=GetControlFileSize,
+  .Read=ReadControlFile,
+  .Write=WriteControlFile
+};
+static const TVirtFileOps VmdkLockFileOps = {
+  .GetSize=GetVmdkLockFileSize,
+  .Read=ReadVmdkLockFile,
+  .Write=WriteVmdkLockFile
+};
+
+/*
+ * GetVirtImageDataOffset:
+ *   Get offset of the data area inside a virtual image file. Dynamic VHDs and
+ *   direct VMDK descriptors don't contain it contiguously (See
+ *   GetVirtFileDataArea).
+ *
+ * Params:
+ *   pImage: Virtual image
+ *
+ * Returns:
+ *   Offset of data area
+ */
+static uint64_t GetVirtImageDataOffset(pTVirtImage pImage) {
+  switch(pImage->Type) {
+    case TVirtImageType_VDI:
+      return VdiFileHeaderSize;
+    case TVirtImageType_QCOW2:
+      return Qcow2HeaderSize;
+    case TVirtImageType_VHDX:
+      return VhdxHeaderSize;
+    case TVirtImageType_VMDK:
+    case TVirtImageType_VMDKS:
+      return VmdkHeaderSize;
+    default:
+      return 0;
+  }
+}
+
+/*
+ * GetVirtFileDataArea:
+ *   Find out which part of the data area a virtual image or partition file
+ *   contains and where
+ *
+ * Params:
+ *   pFile: Virtual file
+ *   pFileOff: Offset of data inside virtual file is written to this var
+ *   pAreaOff: Offset of data inside data area is written to this var
+ *   pSize: Size of data is written to this var
+ *
+ * Returns:
+ *   "TRUE" if the file contains data area data, "FALSE" otherwise
+ */
+static int GetVirtFileDataArea(pTVirtFile pFile,
+                               uint64_t *pFileOff,
+                               uint64_t *pAreaOff,
+                               uint64_t *pSize)
+{
+  pTVirtImage pImage=pFile->pImage;
+
+  if(pFile->pPartition!=NULL) {
+    *pFileOff=0;
+    *pAreaOff=pFile->pPartition->Offset;
+    *pSize=pFile->pPartition->Size;
+    return TRUE;
+  }
+  if(pImage==NULL) return FALSE;
+  if(pImage->Type==TVirtImageType_VHD && pVhdDynHeader!=NULL) return FALSE;
+  if(XMountConfData.DirectVmdk &&
+     (pImage->Type==TVirtImageType_VMDK || pImage->Type==TVirtImageType_VMDKS))
+  {
+    return FALSE;
+  }
+  *pFileOff=GetVirtImageDataOffset(pImage);
+  *pAreaOff=0;
+  return GetOrigImageSize(pSize);
+}
+
+/*
+ * GetVirtFileExtent:
+ *   Get allocation state of a virtual file starting at the given offset. Parts
+ *   of the data area whose blocks are known to contain only zeros are holes
+ *   (See IsZeroBlock). Everything else is data.
+ *
+ * Params:
+ *   pFile: Virtual file
+ *   offset: Offset inside virtual file
+ *   length: Max. length of extent
+ *   pZero: Set to "TRUE" if extent is a hole, "FALSE" if it is data
+ *
+ * Returns:
+ *   Length of extent
+ */
+static uint64_t GetVirtFileExtent(pTVirtFile pFile,
+                                  uint64_t offset,
+                                  uint64_t length,
+                                  int *pZero)
+{
+  uint64_t DataStart;
+  uint64_t AreaOff;
+  uint64_t DataSize;
+  uint64_t start,cur,end;
+  int zero;
+
+  *pZero=FALSE;
+  if((pZeroMap==NULL && DdHoleCount==0) ||
+     !GetVirtFileDataArea(pFile,&DataStart,&AreaOff,&DataSize))
+  {
+    return length;
+  }
+
+  if(offset<DataStart) {
+    // Virtual image metadata
+    if(DataStart-offset<length) return DataStart-offset;
+    return length;
+  }
+  if(offset-DataStart>=DataSize) return length;
+  start=AreaOff+(offset-DataStart);
+  end=start+length;
+  if(end>AreaOff+DataSize) end=AreaOff+DataSize;
+
+  // Merge consecutive blocks of the same kind
+  pthread_mutex_lock(&mutex_image_rw);
+  zero=IsZeroBlock(start/CACHE_BLOCK_SIZE);
+  cur=(start/CACHE_BLOCK_SIZE+1)*CACHE_BLOCK_SIZE;
+  while(cur<end && IsZeroBlock(cur/CACHE_BLOCK_SIZE)==zero) {
+    cur+=CACHE_BLOCK_SIZE;
+  }
+  pthread_mutex_unlock(&mutex_image_rw);
+  if(cur>end) cur=end;
+  *pZero=zero;
+  return cur-start;
+}
+
+/*
+ * StatVirtFile:
+ *   Get attributes of a virtual file or directory
+ *
+ * Params:
+ *   ino: Inode number of file
+ *   stbuf: Pointer to stat structure to save attributes to
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" if the file doesn't exist
+ */
+static int StatVirtFile(fuse_ino_t ino, struct stat *stbuf) {
+  pTVirtFile pFile=GetVirtFile(ino);
+  uint64_t size;
+  uint64_t off=0;
+  uint64_t len;
+  int zero;
+
+  memset(stbuf,0,sizeof(struct stat));
+  if(pFile==NULL) return FALSE;
+  stbuf->st_ino=ino;
+  stbuf->st_mode=pFile->Mode;
+  if(S_ISDIR(pFile->Mode)) {
+    stbuf->st_nlink=2;
+  } else {
+    stbuf->st_nlink=1;
+    if(!pFile->pOps->GetSize(pFile,&size)) {
+      LOG_ERROR("Couldn't get size of virtual file \"%s\"!\n",pFile->pName)
+      return FALSE;
+    }
+    stbuf->st_size=size;
+    stbuf->st_blocks=size/512;
+    if(size%512!=0) stbuf->st_blocks++;
+    // Don't count holes of the data area. VHD files must seem to be fully
+    // allocated (not sparse file). Without this, Windows won't attach them!
+    if(pFile->pImage==NULL || pFile->pImage->Type!=TVirtImageType_VHD) {
+      while(off<size) {
+        len=GetVirtFileExtent(pFile,off,size-off,&zero);
+        if(zero) stbuf->st_blocks-=len/512;
+        off+=len;
+      }
+    }
+  }
+  // Set uid and gid of all files to uid and gid of current process
+  stbuf->st_uid=getuid();
+  stbuf->st_gid=getgid();
+  return TRUE;
+}
+
+/*
+ * GetVirtFileTimeout:
+ *   Get the amount of seconds the kernel may cache the attributes of a virtual
+ *   file
+ *
+ * Params:
+ *   ino: Inode number of file
+ *
+ * Returns:
+ *   Timeout in seconds
+ */
+static double GetVirtFileTimeout(fuse_ino_t ino) {
+  pTVirtFile pFile=GetVirtFile(ino);
+
+  if(pFile==NULL) return VIRT_FILE_TIMEOUT;
+  if(pFile->pImage!=NULL || pFile->pPartition!=NULL) {
+    // Allocated blocks change while zero map is incomplete or data is written
+    if(pZeroMap!=NULL && ZeroMapKnownBlocks<ZeroMapBlockCount) {
+      return VIRT_FILE_TIMEOUT;
+    }
+    if((pZeroMap!=NULL || DdHoleCount!=0) && XMountConfData.Writable==TRUE) {
+      return VIRT_FILE_TIMEOUT;
+    }
+    return VIRT_FILE_STATIC_TIMEOUT;
+  }
+  if(S_ISDIR(pFile->Mode)) return VIRT_FILE_STATIC_TIMEOUT;
+  return VIRT_FILE_TIMEOUT;
+}
+
+/*
+ * ReplyVirtFileEntry:
+ *   Reply to a FUSE request with the directory entry of a virtual file
+ *
+ * Params:
+ *   req: FUSE request
+ *   ino: Inode number of file
+ *
+ * Returns:
+ *   n/a
+ */
+static void ReplyVirtFileEntry(fuse_req_t req, fuse_ino_t ino) {
+  struct fuse_entry_param entry;
+
+  memset(&entry,0,sizeof(struct fuse_entry_param));
+  if(!StatVirtFile(ino,&(entry.attr))) {
+    fuse_reply_err(req,ENOENT);
+    return;
+  }
+  entry.ino=ino;
+  entry.attr_timeout=GetVirtFileTimeout(ino);
+  entry.entry_timeout=VIRT_FILE_STATIC_TIMEOUT;
+  fuse_reply_entry(req,&entry);
+}
+
+/*
+ * LookupVirtFile:
+ *   FUSE lookup implementation
+ *
+ * Params:
+ *   req: FUSE request
+ *   parent: Inode number of directory to search in
+ *   name: Name of file to look up
+ *
+ * Returns:
+ *   n/a
+ */
+static void LookupVirtFile(fuse_req_t req,
+                           fuse_ino_t parent,
+                           const char *name)
+{
+  fuse_ino_t ino=FindVirtFile(parent,name);
+
+  if(ino==0) {
+    fuse_reply_err(req,ENOENT);
+    return;
+  }
+  ReplyVirtFileEntry(req,ino);
+}
+
+/*
+ * GetVirtFileAttr:
+ *   FUSE getattr implementation
+ *
+ * Params:
+ *   req: FUSE request
+ *   ino: Inode number of file to get attributes from
+ *   fi: Unused
+ *
+ * Returns:
+ *   n/a
+ */
+static void GetVirtFileAttr(fuse_req_t req,
+                            fuse_ino_t ino,
+                            struct fuse_file_info *fi)
+{
+  struct stat FileStat;
+
+  (void)fi;
+
+  if(!StatVirtFile(ino,&FileStat)) {
+    fuse_reply_err(req,ENOENT);
+    return;
+  }
+  fuse_reply_attr(req,&FileStat,GetVirtFileTimeout(ino));
+}
+
+/*
+ * SetVirtFileAttr:
+ *   FUSE setattr implementation. Only changing the size of the virtual control
+ *   file is supported, which is needed to allow opening it with O_TRUNC (e.g.
+ *   by shell redirections). Changed timestamps are accepted but ignored.
+ *
+ * Params:
+ *   req: FUSE request
+ *   ino: Inode number of file to change
+ *   attr: New attributes
+ *   to_set: Attributes to change (FUSE_SET_ATTR_*)
+ *   fi: Unused
+ *
+ * Returns:
+ *   n/a
+ */
+static void SetVirtFileAttr(fuse_req_t req,
+                            fuse_ino_t ino,
+                            struct stat *attr,
+                            int to_set,
+                            struct fuse_file_info *fi)
+{
+  pTVirtFile pFile=GetVirtFile(ino);
+
+  if(pFile==NULL) {
+    fuse_reply_err(req,ENOENT);
+    return;
+  }
+  if((to_set & FUSE_SET_ATTR_SIZE) && ino!=VIRT_FILE_INO_CONTROL) {
+    LOG_DEBUG("Attempt to truncate file \"%s\"\n",pFile->pName)
+    fuse_reply_err(req,EPERM);
+    return;
+  }
+  // Timestamps aren't stored, but accept them. Opening a file with O_TRUNC
+  // (e.g. "echo ... > file.ctl") sets the mtime together with the size and
+  // with writeback caching, the kernel flushes timestamps after writes.
+  to_set&=~(FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+            FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW);
+#ifdef FUSE_SET_ATTR_CTIME
+  to_set&=~FUSE_SET_ATTR_CTIME;
+#endif
+  if((to_set & ~FUSE_SET_ATTR_SIZE)!=0) {
+    fuse_reply_err(req,ENOSYS);
+    return;
+  }
+  GetVirtFileAttr(req,ino,fi);
+}
+
+/*
+ * CreateVirtDir:
+ *   FUSE mkdir implementation
+ *
+ * Params:
+ *   req: FUSE request
+ *   parent: Inode number of parent directory
+ *   name: Directory name
+ *   mode: Directory permissions
+ *
+ * Returns:
+ *   n/a
+ */
+static void CreateVirtDir(fuse_req_t req,
+                          fuse_ino_t parent,
+                          const char *name,
+                          mode_t mode)
+{
+  pTVirtFile pDir=&(pVirtFiles[VIRT_FILE_INO_VMDK_LOCK_DIR-1]);
+  pTVirtFile pDir2=&(pVirtFiles[VIRT_FILE_INO_VMDK_LOCK_DIR2-1]);
+
+  if(FindVirtFile(parent,name)!=0) {
+    fuse_reply_err(req,EEXIST);
+    return;
+  }
+  // Only allow creation of VMWare's lock directories
+  if(pVmdkImage!=NULL) {
+    if(pDir->pName==NULL)  {
+      char aVmdkLockDir[strlen(pVmdkImage->pPath)+5];
+      sprintf(aVmdkLockDir,"%s.lck",pVmdkImage->pPath+1);
+      if(parent==VIRT_FILE_INO_ROOT && strcmp(name,aVmdkLockDir)==0) {
+        LOG_DEBUG("Creating virtual directory \"%s\"\n",aVmdkLockDir)
+        pDir->Parent=parent;
+        XMOUNT_STRSET(pDir->pName,aVmdkLockDir)
+        ReplyVirtFileEntry(req,VIRT_FILE_INO_VMDK_LOCK_DIR);
+        return;
+      } else {
+        LOG_ERROR("Attempt to create illegal directory \"%s\"!\n",name)
+        LOG_DEBUG("Supposed: %s\n",aVmdkLockDir)
+        fuse_reply_err(req,EPERM);
+        return;
+      }
+    } else if(pDir2->pName==NULL && parent==VIRT_FILE_INO_VMDK_LOCK_DIR) {
+      LOG_DEBUG("Creating virtual directory \"%s/%s\"\n",pDir->pName,name)
+      pDir2->Parent=parent;
+      XMOUNT_STRSET(pDir2->pName,name)
+      ReplyVirtFileEntry(req,VIRT_FILE_INO_VMDK_LOCK_DIR2);
+      return;
+    } else {
+      LOG_ERROR("Attempt to create illegal directory \"%s\"!\n",name)
+      fuse_reply_err(req,EPERM);
+      return;
+    }
+  }
+  LOG_ERROR("Attempt to create directory \"%s\" "
+            "on read-only filesystem!\n",name)
+  fuse_reply_err(req,EPERM);
+}
+
+/*
+ * CreateVirtFile:
+ *   FUSE mknod implementation.
+ *   Only allows to create VMWare's lock file!
+ *
+ * Params:
+ *   req: FUSE request
+ *   parent: Inode number of parent directory
+ *   name: File to create
+ *   mode: File mode
+ *   dev: ??? but not used
+ *
+ * Returns:
+ *   n/a
+ */
+static void CreateVirtFile(fuse_req_t req,
+                           fuse_ino_t parent,
+                           const char *name,
+                           mode_t mode,
+                           dev_t dev)
+{
+  pTVirtFile pFile=&(pVirtFiles[VIRT_FILE_INO_VMDK_LOCK_FILE-1]);
+
+  if(pVmdkImage!=NULL &&
+     pVirtFiles[VIRT_FILE_INO_VMDK_LOCK_DIR-1].pName!=NULL &&
+     pFile->pName==NULL &&
+     (parent==VIRT_FILE_INO_VMDK_LOCK_DIR ||
+      parent==VIRT_FILE_INO_VMDK_LOCK_DIR2) &&
+     GetVirtFile(parent)!=NULL)
+  {
+    LOG_DEBUG("Creating virtual file \"%s\"\n",name)
+    pFile->Parent=parent;
+    XMOUNT_STRSET(pFile->pName,name)
+    ReplyVirtFileEntry(req,VIRT_FILE_INO_VMDK_LOCK_FILE);
+  } else {
+    LOG_ERROR("Attempt to create illegal file \"%s\"\n",name)
+    fuse_reply_err(req,EPERM);
+  }
+}
+
+/*
+ * ListVirtFiles:
+ *   List a virtual directory. Entries are numbered by their position in the
+ *   inode table, so the offset of an entry never changes.
+ *
+ * Params:
+ *   req: FUSE request
+ *   ino: Inode number of directory to list
+ *   size: Max. size of reply
+ *   offset: Offset of first entry to return
+ *   Plus: If "TRUE", also return the attributes of every entry
+ *
+ * Returns:
+ *   n/a
+ */
+static void ListVirtFiles(fuse_req_t req,
+                          fuse_ino_t ino,
+                          size_t size,
+                          off_t offset,
+                          int Plus)
+{
+  pTVirtFile pDir=GetVirtFile(ino);
+  struct fuse_entry_param Entry;
+  const char *pName;
+  char *pBuf;
+  size_t BufSize=0;
+  size_t EntrySize;
+  fuse_ino_t i;
+
+  if(pDir==NULL) {
+    fuse_reply_err(req,ENOENT);
+    return;
+  }
+  if(!S_ISDIR(pDir->Mode)) {
+    fuse_reply_err(req,ENOTDIR);
+    return;
+  }
+
+  XMOUNT_MALLOC(pBuf,char*,size*sizeof(char))
+  memset(&Entry,0,sizeof(struct fuse_entry_param));
+  // Entry 0 and 1 are the std . and .. entrys, entry i+1 is inode i
+  for(i=offset;i<VirtFileCount+2;i++) {
+    if(i==0) {
+      pName=".";
+      Entry.attr.st_ino=ino;
+      Entry.attr.st_mode=pDir->Mode;
+    } else if(i==1) {
+      pName="..";
+      Entry.attr.st_ino=(pDir->Parent!=0) ? pDir->Parent : ino;
+      Entry.attr.st_mode=S_IFDIR;
+    } else {
+      if(pVirtFiles[i-2].Parent!=ino || pVirtFiles[i-2].pName==NULL) continue;
+      pName=pVirtFiles[i-2].pName;
+      Entry.attr.st_ino=i-1;
+      Entry.attr.st_mode=pVirtFiles[i-2].Mode;
+    }
+#ifdef HAVE_LIBFUSE3
+    if(Plus) {
+      // The kernel doesn't look up . and .., they don't need an inode
+      Entry.ino=0;
+      if(i>1) {
+        if(!StatVirtFile(i-1,&(Entry.attr))) continue;
+        Entry.ino=i-1;
+        Entry.attr_timeout=GetVirtFileTimeout(i-1);
+        Entry.entry_timeout=VIRT_FILE_STATIC_TIMEOUT;
+      }
+      EntrySize=fuse_add_direntry_plus(req,pBuf+BufSize,size-BufSize,
+                                       pName,&Entry,i+1);
+    } else
+#endif
+    EntrySize=fuse_add_direntry(req,pBuf+BufSize,size-BufSize,
+                                pName,&(Entry.attr),i+1);
+    if(EntrySize>size-BufSize) break;
+    BufSize+=EntrySize;
+  }
+  fuse_reply_buf(req,pBuf,BufSize);
+  free(pBuf);
+}
+
+/*
+ * GetVirtFiles:
+ *   FUSE readdir implementation
+ *
+ * Params:
+ *   req: FUSE request
+ *   ino: Inode number of directory to list
+ *   size: Max. size of reply
+ *   offset: Offset of first entry to return
+ *   fi: Unused
+ *
+ * Returns:
+ *   n/a
+ */
+static void GetVirtFiles(fuse_req_t req,
+                         fuse_ino_t ino,
+                         size_t size,
+                         off_t offset,
+                         struct fuse_file_info *fi)
+{
+  (void)fi;
+  ListVirtFiles(req,ino,size,offset,FALSE);
+}
+
+#ifdef HAVE_LIBFUSE3
+/*
+ * GetVirtFilesPlus:
+ *   FUSE readdirplus implementation. Saves the kernel from looking up every
+ *   listed file.
+ *
+ * Params:
+ *   req: FUSE request
+ *   ino: Inode number of directory to list
+ *   size: Max. size of reply
+ *   offset: Offset of first entry to return
+ *   fi: Unused
+ *
+ * Returns:
+ *   n/a
+ */
+static void GetVirtFilesPlus(fuse_req_t req,
+                             fuse_ino_t ino,
+                             size_t size,
+                             off_t offset,
+                             struct fuse_file_info *fi)
+{
+  (void)fi;
+  ListVirtFiles(req,ino,size,offset,TRUE);
+}
+#endif
+
+/*
+ * IsPrivilegedRequest:
+ *   Check if a request was sent by root or by the user running xmount. As
+ *   mounts are accessible to all users by default (allow_other), files
+ *   controlling xmount must check this themselves.
+ *
+ * Params:
+ *   req: FUSE request
+ *
+ * Returns:
+ *   "TRUE" if privileged, "FALSE" otherwise
+ */
+static int IsPrivilegedRequest(fuse_req_t req) {
+  const struct fuse_ctx *pCtx=fuse_req_ctx(req);
+
+  return pCtx!=NULL && (pCtx->uid==0 || pCtx->uid==getuid());
+}
+
+/*
+ * OpenVirtFile:
+ *   FUSE open implementation. The virtual file is saved as file handle so
+ *   further requests don't need to look it up again. The kernel keeps cached
+ *   image data across opens.
+ *
+ * Params:
+ *   req: FUSE request
+ *   ino: Inode number of file to open
+ *   fi: Open flags and file handle
+ *
+ * Returns:
+ *   n/a
+ */
+static void OpenVirtFile(fuse_req_t req,
+                         fuse_ino_t ino,
+                         struct fuse_file_info *fi)
+{
+  pTVirtFile pFile=GetVirtFile(ino);
+
+  if(pFile==NULL) {
+    // Attempt to open a non existant file
+    LOG_DEBUG("Attempt to open non existant file %" PRIu64 ".\n",
+              (uint64_t)ino)
+    fuse_reply_err(req,ENOENT);
+    return;
+  }
+  if(pFile->pOps==NULL) {
+    fuse_reply_err(req,EISDIR);
+    return;
+  }
+  // Check open permissions
+  if((fi->flags & 3)!=O_RDONLY &&
+     (pFile->pOps->Write==NULL || (pFile->Mode & S_IWUSR)==0))
+  {
+    // Attempt to open a read-only file for writing
+    LOG_DEBUG("Attempt to open the read-only file \"%s\" for writing.\n",
+              pFile->pName)
+    fuse_reply_err(req,EACCES);
+    return;
+  }
+  if(ino==VIRT_FILE_INO_CONTROL && !IsPrivilegedRequest(req)) {
+    // Commands make xmount create files
+    LOG_DEBUG("Attempt to open the control file by unprivileged user.\n")
+    fuse_reply_err(req,EACCES);
+    return;
+  }
+  if(pFile->pImage!=NULL || pFile->pPartition!=NULL) {
+    // Image data only changes through writes, after which WriteVirtFile drops
+    // it from the cache of all other files showing it
+    fi->keep_cache=1;
+  } else if(ino==VIRT_FILE_INO_INFO || ino==VIRT_FILE_INO_CONTROL) {
+    // Bypass the page cache for generated text whose size changes. Commands
+    // must also reach xmount right away instead of being cached.
+    fi->direct_io=1;
+  }
+  fi->fh=(uint64_t)(uintptr_t)pFile;
+  fuse_reply_open(req,fi);
+}
+
+#if FUSE_VERSION >= 29
+/*
+ * SpliceVirtFile:
+ *   Reply to a read request of a raw image or partition file with buffers
+ *   referencing the DD input files (See SpliceDdSegments). FUSE can then
+ *   splice their data to the kernel without copying it through xmount.
+ *
+ * Params:
+ *   req: FUSE request
+ *   pFile: Virtual file to read from
+ *   size: Number of bytes to read
+ *   offset: Offset to start reading at
+ *
+ * Returns:
+ *   n/a
+ */
+static void SpliceVirtFile(fuse_req_t req,
+                           pTVirtFile pFile,
+                           size_t size,
+                           off_t offset)
+{
+  struct fuse_bufvec *pBuf;
+  uint64_t len=0;
+  uint64_t DataOff=offset;
+  uint32_t seg=0;
+  uint32_t count=1;
+  size_t CurSize;
+  int hole;
+
+  if(pFile->pPartition!=NULL) {
+    len=pFile->pPartition->Size;
+    DataOff+=pFile->pPartition->Offset;
+  } else GetOrigImageSize(&len);
+  if(offset>=len) size=0;
+  else if(offset+size>len) size=len-offset;
+
+  // Every input file segment touched by the read becomes one buffer. Holes
+  // are replied from a zero buffer so the filesystem doesn't generate zeros.
+  // Each of them adds up to two buffers, plus one for every zero buffer size.
+  if(size!=0) {
+    seg=FindDdSegment(DataOff);
+    count=FindDdSegment(DataOff+size-1)-seg+1;
+    if(DdHoleCount!=0) {
+      count+=2*(FindDdHole(DataOff+size-1)-FindDdHole(DataOff)+1)+
+        size/CACHE_BLOCK_SIZE;
+    }
+  }
+  XMOUNT_MALLOC(pBuf,struct fuse_bufvec*,
+                sizeof(struct fuse_bufvec)+(count-1)*sizeof(struct fuse_buf))
+  memset(pBuf,0,sizeof(struct fuse_bufvec)+(count-1)*sizeof(struct fuse_buf));
+  while(size!=0) {
+    CurSize=pDdSegments[seg].Offset+pDdSegments[seg].Size-DataOff;
+    if(CurSize>size) CurSize=size;
+    CurSize=GetDdHoleExtent(DataOff,CurSize,&hole);
+    if(hole) {
+      if(CurSize>CACHE_BLOCK_SIZE) CurSize=CACHE_BLOCK_SIZE;
+      pBuf->buf[pBuf->idx].size=CurSize;
+      pBuf->buf[pBuf->idx].mem=pDdZeroBuf;
+    } else {
+      pBuf->buf[pBuf->idx].size=CurSize;
+      pBuf->buf[pBuf->idx].flags=FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      pBuf->buf[pBuf->idx].fd=fileno(pDdSegments[seg].hFile);
+      pBuf->buf[pBuf->idx].pos=DataOff-pDdSegments[seg].Offset;
+    }
+    pBuf->idx++;
+    DataOff+=CurSize;
+    size-=CurSize;
+    if(DataOff>=pDdSegments[seg].Offset+pDdSegments[seg].Size) seg++;
+  }
+  pBuf->count=(pBuf->idx>0) ? pBuf->idx : 1;
+  pBuf->idx=0;
+  if(pFile->pPartition!=NULL) {
+    pthread_mutex_lock(&mutex_image_rw);
+    pFile->pPartition->ReadCount++;
+    pFile->pPartition->ReadBytes+=fuse_buf_size(pBuf);
+    pthread_mutex_unlock(&mutex_image_rw);
+  }
+  fuse_reply_data(req,pBuf,FUSE_BUF_SPLICE_MOVE);
+  free(pBuf);
+}
+#endif
+
+/*
+ * ReadVirtFile:
+ *   FUSE read implementation
+ *
+ * Params:
+ *   req: FUSE request
+ *   ino: Unused
+ *   size: Number of bytes to read
+ *   offset: Offset to start reading at
+ *   fi: File handle of opened file
+ *
+ * Returns:
+ *   n/a
+ */
+static void ReadVirtFile(fuse_req_t req,
+                         fuse_ino_t ino,
+                         size_t size,
+                         off_t offset,
+                         struct fuse_file_info *fi)
+{
+  pTVirtFile pFile=(pTVirtFile)(uintptr_t)fi->fh;
+  char *pBuf;
+  int ret;
+
+#if FUSE_VERSION >= 29
+  if(SpliceDdSegments &&
+     (pFile->pPartition!=NULL ||
+      (pFile->pImage!=NULL && (pFile->pImage->Type==TVirtImageType_DD ||
+                               pFile->pImage->Type==TVirtImageType_DMG))))
+  {
+    SpliceVirtFile(req,pFile,size,offset);
+    return;
+  }
+#endif
+
+  XMOUNT_MALLOC(pBuf,char*,(size+1)*sizeof(char))
+  ret=pFile->pOps->Read(pFile,pBuf,size,offset);
+  if(ret<0) fuse_reply_err(req,-ret);
+  else fuse_reply_buf(req,pBuf,ret);
+  free(pBuf);
+}
+
+#ifdef HAVE_LIBFUSE3
+/*
+ * SeekVirtFile:
+ *   FUSE lseek implementation. Answers SEEK_DATA and SEEK_HOLE using the zero
+ *   map (See GetVirtFileExtent). Without it, files have no holes except the
+ *   implicit one at their end. Other whence values are handled by the kernel.
+ *
+ * Params:
+ *   req: FUSE request
+ *   ino: Unused
+ *   offset: Offset to start searching at
+ *   whence: SEEK_DATA or SEEK_HOLE
+ *   fi: File handle of opened file
+ *
+ * Returns:
+ *   n/a
+ */
+static void SeekVirtFile(fuse_req_t req,
+                         fuse_ino_t ino,
+                         off_t offset,
+                         int whence,
+                         struct fuse_file_info *fi)
+{
+  pTVirtFile pFile=(pTVirtFile)(uintptr_t)fi->fh;
+  uint64_t size;
+  uint64_t off=offset;
+  uint64_t len;
+  int zero;
+
+  (void)ino;
+  if(whence!=SEEK_DATA && whence!=SEEK_HOLE) {
+    fuse_reply_err(req,EINVAL);
+    return;
+  }
+  if(!pFile->pOps->GetSize(pFile,&size)) {
+    fuse_reply_err(req,EIO);
+    return;
+  }
+  if(offset<0 || off>=size) {
+    fuse_reply_err(req,ENXIO);
+    return;
+  }
+  while(off<size) {
+    len=GetVirtFileExtent(pFile,off,size-off,&zero);
+    if(zero==(whence==SEEK_HOLE)) break;
+    off+=len;
+  }
+  if(off>=size) {
+    // No more data or only the implicit hole at the end of the file
+    if(whence==SEEK_DATA) {
+      fuse_reply_err(req,ENXIO);
+      return;
+    }
+    off=size;
+  }
+  fuse_reply_lseek(req,off);
+}
+#endif
+
+/*
+ * RenameVirtFile:
+ *   FUSE rename implementation. Only VmWare's lock file can be renamed.
+ *
+ * Params:
+ *   req: FUSE request
+ *   parent: Inode number of directory containing file
+ *   name: File to rename
+ *   newparent: Inode number of new directory
+ *   newname: New filename
+ *   flags: RENAME_* flags (libfuse 3 only). None are supported.
+ *
+ * Returns:
+ *   n/a
+ */
+static void RenameVirtFile(fuse_req_t req,
+                           fuse_ino_t parent,
+                           const char *name,
+                           fuse_ino_t newparent,
+#ifdef HAVE_LIBFUSE3
+                           const char *newname,
+                           unsigned int flags)
+#else
+                           const char *newname)
+#endif
+{
+  pTVirtFile pFile=&(pVirtFiles[VIRT_FILE_INO_VMDK_LOCK_FILE-1]);
+  pTVirtFile pDir=GetVirtFile(newparent);
+
+#ifdef HAVE_LIBFUSE3
+  if(flags!=0) {
+    fuse_reply_err(req,EINVAL);
+    return;
+  }
+#endif
+  if(FindVirtFile(parent,name)==VIRT_FILE_INO_VMDK_LOCK_FILE &&
+     pDir!=NULL && S_ISDIR(pDir->Mode))
+  {
+    LOG_DEBUG("Renaming virtual lock file from \"%s\" to \"%s\"\n",
+              pFile->pName,
+              newname)
+    XMOUNT_REALLOC(pFile->pName,char*,(strlen(newname)+1)*sizeof(char));
+    strcpy(pFile->pName,newname);
+    pFile->Parent=newparent;
+    fuse_reply_err(req,0);
+    return;
+  }
+  fuse_reply_err(req,ENOENT);
+}
+
+/*
+ * DeleteVirtDir:
+ *   FUSE rmdir implementation
+ *
+ * Params:
+ *   req: FUSE request
+ *   parent: Inode number of directory containing directory to delete
+ *   name: Directory to delete
+ *
+ * Returns:
+ *   n/a
+ */
+static void DeleteVirtDir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  fuse_ino_t ino=FindVirtFile(parent,name);
+
+  // Only VMWare's lock directories can be deleted
+  if(ino==VIRT_FILE_INO_VMDK_LOCK_DIR || ino==VIRT_FILE_INO_VMDK_LOCK_DIR2) {
+    LOG_DEBUG("Deleting virtual lock dir \"%s\"\n",name)
+    free(pVirtFiles[ino-1].pName);
+    pVirtFiles[ino-1].pName=NULL;
+    fuse_reply_err(req,0);
+    return;
+  }
+  fuse_reply_err(req,EPERM);
+}
+
+/*
+ * DeleteVirtFile:
+ *   FUSE unlink implementation
+ *
+ * Params:
+ *   req: FUSE request
+ *   parent: Inode number of directory containing file to delete
+ *   name: File to delete
+ *
+ * Returns:
+ *   n/a
+ */
+static void DeleteVirtFile(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  pTVirtFile pFile=&(pVirtFiles[VIRT_FILE_INO_VMDK_LOCK_FILE-1]);
+
+  // Only VMWare's lock file can be deleted
+  if(FindVirtFile(parent,name)==VIRT_FILE_INO_VMDK_LOCK_FILE) {
+    LOG_DEBUG("Deleting virtual file \"%s\"\n",pFile->pName)
+    pthread_mutex_lock(&mutex_image_rw);
+    free(pFile->pName);
+    free(pVirtualVmdkLockFileData);
+    pFile->pName=NULL;
+    pVirtualVmdkLockFileData=NULL;
+    VirtualVmdkLockFileDataSize=0;
+    pthread_mutex_unlock(&mutex_image_rw);
+    fuse_reply_err(req,0);
+    return;
+  }
+  fuse_reply_err(req,EPERM);
+}
+
+/*
+ * GetVirtFsStats:
+ *   FUSE statfs implementation
+ *
+ * Params:
+ *   path: Get stats for fs that the specified file resides in
+ *   stats: Stats
+ *
+ * Returns:
+ *   "0" on success, negated error code on error
+ */
+/*
+static int GetVirtFsStats(const char *path, struct statvfs *stats) {
+  struct statvfs CacheFileFsStats;
+  int ret;
+
+  if(XMountConfData.Writable==TRUE) {
+    // If write support is enabled, return stats of fs upon which cache file
+    // resides in
+    if((ret=statvfs(XMountConfData.pCacheFile,&CacheFileFsStats))==0) {
+      memcpy(stats,&CacheFileFsStats,sizeof(struct statvfs));
+      return 0;
+    } else {
+      LOG_ERROR("Couldn't get stats for fs upon which resides \"%s\"\n",
+                XMountConfData.pCacheFile)
+      return ret;
+    }
+  } else {
+    // TODO: Return read only
+    return 0;
+  }
+}
+*/
+
+/*
+ * InvalidateFiles:
+ *   Invalidation thread sending queued invalidations to the kernel. If the
+ *   queue overflowed, all image and partition files are dropped completely.
+ *
+ * Params:
+ *   p: Unused
+ *
+ * Returns:
+ *   NULL
+ */
+static void *InvalidateFiles(void *p) {
+  TInvalRequest Requests[INVAL_QUEUE_SIZE];
+  uint32_t count;
+  uint32_t i;
+  int overflow;
+
+  pthread_mutex_lock(&mutex_inval);
+  while(!InvalThreadStop) {
+    if(InvalQueueCount==0 && !InvalQueueOverflow) {
+      pthread_cond_wait(&cond_inval,&mutex_inval);
+      continue;
+    }
+    count=InvalQueueCount;
+    overflow=InvalQueueOverflow;
+    memcpy(Requests,InvalQueue,count*sizeof(TInvalRequest));
+    InvalQueueCount=0;
+    InvalQueueOverflow=FALSE;
+    pthread_mutex_unlock(&mutex_inval);
+
+    if(overflow) {
+      for(i=0;i<VirtFileCount;i++) {
+        if(pVirtFiles[i].pImage!=NULL || pVirtFiles[i].pPartition!=NULL) {
+          NotifyInvalInode(i+1,0,0);
+        }
+      }
+    } else {
+      for(i=0;i<count;i++) {
+        NotifyInvalInode(Requests[i].Ino,Requests[i].Offset,Requests[i].Size);
+      }
+    }
+    pthread_mutex_lock(&mutex_inval);
+  }
+  pthread_mutex_unlock(&mutex_inval);
+  return NULL;
+}
+
+/*
+ * QueueInvalidation:
+ *   Queue part of a virtual file to be dropped from the kernel's page cache
+ *   by the invalidation thread
+ *
+ * Params:
+ *   ino: Inode number of virtual file
+ *   offset: Offset of range to drop
+ *   size: Size of range to drop
+ *
+ * Returns:
+ *   n/a
+ */
+static void QueueInvalidation(fuse_ino_t ino, off_t offset, off_t size) {
+  pthread_mutex_lock(&mutex_inval);
+  if(InvalQueueCount>0 &&
+     InvalQueue[InvalQueueCount-1].Ino==ino &&
+     InvalQueue[InvalQueueCount-1].Offset+
+       InvalQueue[InvalQueueCount-1].Size==offset)
+  {
+    // Merge with previous sequential write
+    InvalQueue[InvalQueueCount-1].Size+=size;
+  } else if(InvalQueueCount<INVAL_QUEUE_SIZE) {
+    InvalQueue[InvalQueueCount].Ino=ino;
+    InvalQueue[InvalQueueCount].Offset=offset;
+    InvalQueue[InvalQueueCount].Size=size;
+    InvalQueueCount++;
+  } else InvalQueueOverflow=TRUE;
+  pthread_cond_signal(&cond_inval);
+  pthread_mutex_unlock(&mutex_inval);
+}
+
+/*
+ * InvalidateVirtFiles:
+ *   Drop data written through a virtual image or partition file from the
+ *   kernel's page cache of all other virtual files showing the same part of
+ *   the data area. Invalidations are sent by the invalidation thread, as the
+ *   kernel might need FUSE threads to write back dirty pages meanwhile, which
+ *   would deadlock when running single threaded.
+ *
+ * Params:
+ *   pFile: Virtual file that has been written to
+ *   offset: Offset of written data inside pFile
+ *   size: Amount of written bytes
+ *
+ * Returns:
+ *   n/a
+ */
+static void InvalidateVirtFiles(pTVirtFile pFile, off_t offset, size_t size) {
+  uint64_t DataOff=offset;
+  uint64_t DataEnd=offset+size;
+  uint64_t OrigImageSize;
+  uint64_t Start,End,Base;
+  fuse_ino_t i;
+
+  if(!InvalThreadRunning) return;
+  if(!GetOrigImageSize(&OrigImageSize)) return;
+
+  // Get written range of data area
+  if(pFile->pPartition!=NULL) {
+    DataOff+=pFile->pPartition->Offset;
+    DataEnd+=pFile->pPartition->Offset;
+  } else if(pFile->pImage!=NULL) {
+    Base=GetVirtImageDataOffset(pFile->pImage);
+    DataOff=(DataOff>Base) ? DataOff-Base : 0;
+    DataEnd=(DataEnd>Base) ? DataEnd-Base : 0;
+  } else return;
+  if(DataEnd>OrigImageSize) DataEnd=OrigImageSize;
+  if(DataOff>=DataEnd) return;
+
+  for(i=0;i<VirtFileCount;i++) {
+    if(&(pVirtFiles[i])==pFile || pVirtFiles[i].pName==NULL) continue;
+    if(pVirtFiles[i].pPartition!=NULL) {
+      // Only the part overlapping the partition, relative to its start
+      Base=pVirtFiles[i].pPartition->Offset;
+      Start=(DataOff>Base) ? DataOff : Base;
+      End=Base+pVirtFiles[i].pPartition->Size;
+      if(DataEnd<End) End=DataEnd;
+      if(Start>=End) continue;
+      Start-=Base;
+      End-=Base;
+    } else if(pVirtFiles[i].pImage!=NULL) {
+      Base=GetVirtImageDataOffset(pVirtFiles[i].pImage);
+      Start=DataOff+Base;
+      End=DataEnd+Base;
+    } else continue;
+    QueueInvalidation(i+1,Start,End-Start);
+  }
+}
+
+/*
+ * WriteVirtFile:
+ *   FUSE write implementation
+ *
+ * Params:
+ *   req: FUSE request
+ *   ino: Unused
+ *   buf: Buffer containing data to write
+ *   size: Number of bytes to write
+ *   offset: Offset to start writing at
+ *   fi: File handle of opened file
+ *
+ * Returns:
+ *   n/a
+ */
+static void WriteVirtFile(fuse_req_t req,
+                          fuse_ino_t ino,
+                          const char *buf,
+                          size_t size,
+                          off_t offset,
+                          struct fuse_file_info *fi)
+{
+  pTVirtFile pFile=(pTVirtFile)(uintptr_t)fi->fh;
+  int ret;
+
+  if(pFile->pOps->Write==NULL) {
+    // Attempt to write data to read only file
+    LOG_DEBUG("Attempt to write data to read-only file \"%s\"\n",pFile->pName)
+    fuse_reply_err(req,EBADF);
+    return;
+  }
+  if(pFile==&(pVirtFiles[VIRT_FILE_INO_CONTROL-1]) &&
+     !IsPrivilegedRequest(req))
+  {
+    // Handle might have been passed on to another process
+    fuse_reply_err(req,EACCES);
+    return;
+  }
+  ret=pFile->pOps->Write(pFile,buf,size,offset);
+  if(ret<0) {
+    fuse_reply_err(req,-ret);
+    return;
+  }
+  fuse_reply_write(req,ret);
+  // Invalidate only after replying. Until then, the kernel holds the pages of
+  // this file, which a concurrent write to another file might invalidate.
+  if(ret>0) InvalidateVirtFiles(pFile,offset,ret);
+}
+
+#ifdef HAVE_LIBFUSE3
+/*
+ * CopyVirtFileRange:
+ *   FUSE copy_file_range implementation. The kernel only uses it for copies
+ *   between files of this mount (e.g. from a partition file into the virtual
+ *   DD image), which are done here without passing data through the kernel.
+ *   Holes of the source aren't written if the destination already has a hole
+ *   there. Copies to other filesystems aren't affected (See ExportVirtImage).
+ *
+ * Params:
+ *   req: FUSE request
+ *   ino_in: Unused
+ *   off_in: Offset to start reading at
+ *   fi_in: File handle of file to read from
+ *   ino_out: Unused
+ *   off_out: Offset to start writing at
+ *   fi_out: File handle of file to write to
+ *   len: Number of bytes to copy
+ *   flags: Unused (Always 0)
+ *
+ * Returns:
+ *   n/a
+ */
+static void CopyVirtFileRange(fuse_req_t req,
+                              fuse_ino_t ino_in,
+                              off_t off_in,
+                              struct fuse_file_info *fi_in,
+                              fuse_ino_t ino_out,
+                              off_t off_out,
+                              struct fuse_file_info *fi_out,
+                              size_t len,
+                              int flags)
+{
+  pTVirtFile pIn=(pTVirtFile)(uintptr_t)fi_in->fh;
+  pTVirtFile pOut=(pTVirtFile)(uintptr_t)fi_out->fh;
+  uint64_t InFileOff,InAreaOff,OutFileOff,OutAreaOff,AreaSize;
+  uint64_t InStart,OutStart;
+  uint64_t size;
+  uint64_t CurSize;
+  uint64_t pos;
+  size_t copied=0;
+  int Backwards=FALSE;
+  int zero;
+  char *pBuf;
+  int ret=0;
+
+  (void)ino_in;
+  (void)ino_out;
+  if(flags!=0) {
+    fuse_reply_err(req,EINVAL);
+    return;
+  }
+  if(pOut->pOps->Write==NULL) {
+    fuse_reply_err(req,EBADF);
+    return;
+  }
+  if(!pIn->pOps->GetSize(pIn,&size)) {
+    fuse_reply_err(req,EIO);
+    return;
+  }
+  if((uint64_t)off_in>=size) len=0;
+  else if(len>size-off_in) len=size-off_in;
+
+  // Different files can show the same data. If the destination overlaps the
+  // end of the source, copy from back to front. Data area files can't grow, so
+  // nothing is copied past the end of the destination.
+  if(GetVirtFileDataArea(pIn,&InFileOff,&InAreaOff,&AreaSize) &&
+     GetVirtFileDataArea(pOut,&OutFileOff,&OutAreaOff,&AreaSize) &&
+     (uint64_t)off_in>=InFileOff && (uint64_t)off_out>=OutFileOff)
+  {
+    if((uint64_t)off_out-OutFileOff>=AreaSize) len=0;
+    else if(len>AreaSize-(off_out-OutFileOff)) {
+      len=AreaSize-(off_out-OutFileOff);
+    }
+    InStart=InAreaOff+(off_in-InFileOff);
+    OutStart=OutAreaOff+(off_out-OutFileOff);
+    Backwards=(OutStart>InStart && OutStart<InStart+len);
+  }
+
+  XMOUNT_MALLOC(pBuf,char*,CACHE_BLOCK_SIZE*sizeof(char))
+  while(copied<len) {
+    CurSize=len-copied;
+    if(CurSize>CACHE_BLOCK_SIZE) CurSize=CACHE_BLOCK_SIZE;
+    if(Backwards) {
+      pos=len-copied-CurSize;
+      zero=FALSE;
+    } else {
+      pos=copied;
+      CurSize=GetVirtFileExtent(pIn,off_in+pos,CurSize,&zero);
+    }
+    if(zero) {
+      // Nothing to do if destination is a hole too
+      CurSize=GetVirtFileExtent(pOut,off_out+pos,CurSize,&zero);
+      if(zero) {
+        copied+=CurSize;
+        continue;
+      }
+      memset(pBuf,0,CurSize);
+    } else {
+      ret=pIn->pOps->Read(pIn,pBuf,CurSize,off_in+pos);
+      if(ret<=0) break;
+      CurSize=ret;
+    }
+    ret=pOut->pOps->Write(pOut,pBuf,CurSize,off_out+pos);
+    if(ret<=0) break;
+    if(Backwards && (uint64_t)ret!=CurSize) {
+      // A short write would leave a gap
+      ret=-EIO;
+      break;
+    }
+    copied+=ret;
+  }
+  free(pBuf);
+  if(ret<0 && (copied==0 || Backwards)) {
+    fuse_reply_err(req,-ret);
+    return;
+  }
+  fuse_reply_write(req,copied);
+  if(copied>0) {
+    if(Backwards) InvalidateVirtFiles(pOut,off_out,len);
+    else InvalidateVirtFiles(pOut,off_out,copied);
+  }
+}
+#endif
+
+/*
+ * CalculateInputImageHash:
+ *   Calculates an MD5 hash of the first HASH_AMOUNT bytes of the input image.
+ *
+ * Params:
+ *   pHashLow : Pointer to the lower 64 bit of the hash
+ *   pHashHigh : Pointer to the higher 64 bit of the hash
+ *
+ * Returns:
+ *   TRUE on success, FALSE on error
+ */
+static int CalculateInputImageHash(uint64_t *pHashLow, uint64_t *pHashHigh) {
+  char hash[16];
+  md5_state_t md5_state;
+  char *buf;
+  XMOUNT_MALLOC(buf,char*,HASH_AMOUNT*sizeof(char))
+  size_t read_data=GetOrigImageData(buf,0,HASH_AMOUNT);
+  if(read_data>0) {
+    // Calculate MD5 hash
+    md5_init(&md5_state);
+    md5_append(&md5_state,buf,HASH_AMOUNT);
+    md5_finish(&md5_state,hash);
+    // Convert MD5 hash into two 64bit integers
+    *pHashLow=*((uint64_t*)hash);
+    *pHashHigh=*((uint64_t*)(hash+8));
+    free(buf);
+    return TRUE;
+  } else {
+    LOG_ERROR("Couldn't read data from original image file!\n")
+    free(buf);
+    return FALSE;
+  }
+}
+
+/*
+ * AddDdHole:
+ *   Add a hole to the DD input image's hole list. Holes must be added in
+ *   ascending order. Adjacent holes are merged.
+ *
+ * Params:
+ *   offset: Offset of hole inside input image
+ *   size: Size of hole
+ *
+ * Returns:
+ *   n/a
+ */
+static void AddDdHole(uint64_t offset, uint64_t size) {
+  if(DdHoleCount>0 &&
+     pDdHoles[DdHoleCount-1].Offset+pDdHoles[DdHoleCount-1].Size==offset)
+  {
+    pDdHoles[DdHoleCount-1].Size+=size;
+    return;
+  }
+  if((DdHoleCount%DD_HOLE_ALLOC_COUNT)==0) {
+    XMOUNT_REALLOC(pDdHoles,
+                   pTDdHole,
+                   (DdHoleCount+DD_HOLE_ALLOC_COUNT)*sizeof(TDdHole))
+  }
+  pDdHoles[DdHoleCount].Offset=offset;
+  pDdHoles[DdHoleCount].Size=size;
+  DdHoleCount++;
+}
+
+/*
+ * MapDdSegmentHoles:
+ *   Find holes of a sparse DD segment file using SEEK_DATA and SEEK_HOLE.
+ *   Filesystems not supporting them report the whole file as data.
+ *
+ * Params:
+ *   seg: Segment number
+ *
+ * Returns:
+ *   n/a
+ */
+static void MapDdSegmentHoles(uint32_t seg) {
+#ifdef SEEK_DATA
+  int fd=fileno(pDdSegments[seg].hFile);
+  off_t size=pDdSegments[seg].Size;
+  off_t pos=0;
+  off_t data;
+
+  while(pos<size) {
+    data=lseek(fd,pos,SEEK_DATA);
+    if(data==-1) {
+      // No more data behind pos
+      if(errno!=ENXIO) return;
+      data=size;
+    }
+    if(data>pos) AddDdHole(pDdSegments[seg].Offset+pos,data-pos);
+    if(data>=size) break;
+    pos=lseek(fd,data,SEEK_HOLE);
+    if(pos==-1) return;
+  }
+#else
+  (void)seg;
+#endif
+}
+
+/*
+ * OpenDdSegments:
+ *   Open all segments of a (split) DD input image and determine their sizes
+ *   and holes
+ *
+ * Params:
+ *   ppFiles: Segment files in the order they should be concatenated
+ *   FileCount: Amount of segment files
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int OpenDdSegments(char **ppFiles, int FileCount) {
+  uint64_t offset=0;
+  int i;
+
+  XMOUNT_MALLOC(pDdSegments,pTDdSegment,FileCount*sizeof(TDdSegment))
+  for(i=0;i<FileCount;i++) {
+    pDdSegments[i].hFile=(FILE*)FOPEN(ppFiles[i],"rb");
+    if(pDdSegments[i].hFile==NULL) {
+      LOG_ERROR("Couldn't open DD file \"%s\"\n",ppFiles[i])
+      return FALSE;
+    }
+    DdSegmentCount++;
+    // The absolute path is needed to reference segments from descriptors
+    pDdSegments[i].pPath=realpath(ppFiles[i],NULL);
+    if(pDdSegments[i].pPath==NULL) {
+      LOG_ERROR("Couldn't resolve path of DD file \"%s\"\n",ppFiles[i])
+      return FALSE;
+    }
+    if(fseeko(pDdSegments[i].hFile,0,SEEK_END)!=0) {
+      LOG_ERROR("Couldn't seek to end of image file \"%s\"!\n",ppFiles[i])
+      return FALSE;
+    }
+    pDdSegments[i].Offset=offset;
+    pDdSegments[i].Size=ftello(pDdSegments[i].hFile);
+    offset+=pDdSegments[i].Size;
+    LOG_DEBUG("DD segment %d: \"%s\" at offset %" PRIu64 ", size %" PRIu64
+              "\n",i,pDdSegments[i].pPath,pDdSegments[i].Offset,
+              pDdSegments[i].Size)
+    MapDdSegmentHoles(i);
+  }
+  if(DdHoleCount!=0) {
+    // Used to reply to spliced reads of holes (See SpliceVirtFile)
+    XMOUNT_MALLOC(pDdZeroBuf,char*,CACHE_BLOCK_SIZE*sizeof(char))
+    memset(pDdZeroBuf,0,CACHE_BLOCK_SIZE*sizeof(char));
+    LOG_DEBUG("DD input image contains %" PRIu32 " holes\n",DdHoleCount)
+  }
+  return TRUE;
+}
+
+/*
+ * AlignDataOffset:
+ *   Round up the offset of an emulated image's data area to the configured
+ *   alignment. Guest I/O aligned to the data area then also lines up with
+ *   cache blocks and input image chunks.
+ *
+ * Params:
+ *   offset: Unaligned offset
+ *
+ * Returns:
+ *   Aligned offset
+ */
+static uint64_t AlignDataOffset(uint64_t offset) {
+  return ((offset+XMountConfData.Alignment-1)/XMountConfData.Alignment)*
+    XMountConfData.Alignment;
+}
+
+/*
+ * InitVirtVdiHeader:
+ *   Build and init virtual VDI file header
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitVirtVdiHeader() {
+  // See http://forums.virtualbox.org/viewtopic.php?t=8046 for a
+  // "description" of the various header fields
+
+  uint64_t ImageSize;
+  uint32_t BlockEntries;
+
+  // Get input image size
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return FALSE;
+  }
+
+  // Calculate how many VDI blocks we need
+  BlockEntries=ImageSize/VDI_IMAGE_BLOCK_SIZE;
+  if((ImageSize%VDI_IMAGE_BLOCK_SIZE)!=0) BlockEntries++;
+  VdiBlockMapSize=BlockEntries*sizeof(uint32_t);
+  LOG_DEBUG("BlockMap: %d (%08X) entries, %d (%08X) bytes!\n",
+            BlockEntries,
+            BlockEntries,
+            VdiBlockMapSize,
+            VdiBlockMapSize)
+
+  // Allocate memory for vdi header. The block map following it is generated
+  // on the fly by GenerateVdiFileHeaderData. It is padded so data blocks
+  // start aligned.
+  VdiFileHeaderSize=AlignDataOffset(sizeof(TVdiFileHeader)+VdiBlockMapSize);
+  XMOUNT_MALLOC(pVdiFileHeader,pTVdiFileHeader,sizeof(TVdiFileHeader))
+  memset(pVdiFileHeader,0,sizeof(TVdiFileHeader));
+
+  // Init header values
+  strncpy(pVdiFileHeader->szFileInfo,VDI_FILE_COMMENT,
+          strlen(VDI_FILE_COMMENT)+1);
+  pVdiFileHeader->u32Signature=VDI_IMAGE_SIGNATURE;
+  pVdiFileHeader->u32Version=VDI_IMAGE_VERSION;
+  pVdiFileHeader->cbHeader=0x00000180;  // No idea what this is for! Testimage had same value
+  // Sparse images must be dynamic for the block map to contain unallocated
+  // blocks. As data blocks keep their position, all blocks count as allocated.
+  if(SparseVirtImages) pVdiFileHeader->u32Type=VDI_IMAGE_TYPE_NORMAL;
+  else pVdiFileHeader->u32Type=VDI_IMAGE_TYPE_FIXED;
+  pVdiFileHeader->fFlags=VDI_IMAGE_FLAGS;
+  strncpy(pVdiFileHeader->szComment,VDI_HEADER_COMMENT,
+          strlen(VDI_HEADER_COMMENT)+1);
+  pVdiFileHeader->offData=VdiFileHeaderSize;
+  pVdiFileHeader->offBlocks=sizeof(TVdiFileHeader);
+  pVdiFileHeader->cCylinders=0; // Legacy info
+  pVdiFileHeader->cHeads=0; // Legacy info
+  pVdiFileHeader->cSectors=0; // Legacy info
+  pVdiFileHeader->cbSector=512; // Legacy info
+  pVdiFileHeader->u32Dummy=0;
+  pVdiFileHeader->cbDisk=ImageSize;
+  // Seems as VBox is always using a 1MB blocksize
+  pVdiFileHeader->cbBlock=VDI_IMAGE_BLOCK_SIZE;
+  pVdiFileHeader->cbBlockExtra=0;
+  pVdiFileHeader->cBlocks=BlockEntries;
+  pVdiFileHeader->cBlocksAllocated=BlockEntries;
+  // Use partial MD5 input file hash as creation UUID and generate a random
+  // modification UUID. VBox won't accept immages where create and modify UUIDS
+  // aren't set.
+  pVdiFileHeader->uuidCreate_l=XMountConfData.InputHashLo;
+  pVdiFileHeader->uuidCreate_h=XMountConfData.InputHashHi;
+  //*((uint32_t*)(&(pVdiFileHeader->uuidCreate_l)))=rand();
+  //*((uint32_t*)(&(pVdiFileHeader->uuidCreate_l))+4)=rand();
+  //*((uint32_t*)(&(pVdiFileHeader->uuidCreate_h)))=rand();
+  //*((uint32_t*)(&(pVdiFileHeader->uuidCreate_h))+4)=rand();
+
+#define rand64(var) {              \
+  *((uint32_t*)&(var))=rand();     \
+  *(((uint32_t*)&(var))+1)=rand(); \
+}
+
+  rand64(pVdiFileHeader->uuidModify_l);
+  rand64(pVdiFileHeader->uuidModify_h);
+
+#undef rand64
+
+  LOG_DEBUG("VDI header size = %u\n",VdiFileHeaderSize)
+
+  return TRUE;
+}
+
+/*
+ * InitVirtVhdDynHeader:
+ *   Build and init virtual dynamic VHD disk header
+ *
+ * Params:
+ *   ImageSize: Size of input image
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitVirtVhdDynHeader(uint64_t ImageSize) {
+  uint64_t BlocksOff;
+  uint32_t checksum=0;
+  uint16_t i=0;
+
+  // Calculate how many VHD blocks we need. The BAT is padded to a whole
+  // sector.
+  VhdBatEntries=ImageSize/VHD_DYN_BLOCK_SIZE;
+  if((ImageSize%VHD_DYN_BLOCK_SIZE)!=0) VhdBatEntries++;
+  VhdBatSize=((VhdBatEntries*sizeof(uint32_t))+511) & ~511;
+
+  // BAT entries are 32bit sector numbers which limits dynamic VHDs to
+  // roughly 2TB
+  BlocksOff=sizeof(TVhdFileHeader)+sizeof(TVhdDynHeader)+VhdBatSize;
+  if((BlocksOff+(((uint64_t)VhdBatEntries)*
+                 (VHD_DYN_BITMAP_SIZE+VHD_DYN_BLOCK_SIZE)))/512>
+     VHD_DYN_BAT_UNUSED)
+  {
+    LOG_ERROR("Input image is too large to be emulated as dynamic VHD!\n")
+    return FALSE;
+  }
+
+  XMOUNT_MALLOC(pVhdDynHeader,pTVhdDynHeader,sizeof(TVhdDynHeader))
+  memset(pVhdDynHeader,0,sizeof(TVhdDynHeader));
+
+  // Init header values
+  pVhdDynHeader->cookie=VHD_DYN_HVAL_COOKIE;
+  pVhdDynHeader->data_offset=VHD_IMAGE_HVAL_DATA_OFFSET;
+  pVhdDynHeader->table_offset=htobe64(sizeof(TVhdFileHeader)+
+                                      sizeof(TVhdDynHeader));
+  pVhdDynHeader->header_version=VHD_DYN_HVAL_HEADER_VERSION;
+  pVhdDynHeader->max_table_entries=htobe32(VhdBatEntries);
+  pVhdDynHeader->block_size=htobe32(VHD_DYN_BLOCK_SIZE);
+
+  // Calculate header checksum
+  for(i=0;i<sizeof(TVhdDynHeader);i++) {
+    checksum+=*((uint8_t*)(pVhdDynHeader)+i);
+  }
+  pVhdDynHeader->checksum=htobe32(~checksum);
+
+  LOG_DEBUG("VHD BAT: %" PRIu32 " entries, %" PRIu32 " bytes\n",
+            VhdBatEntries,VhdBatSize)
+
+  return TRUE;
+}
+
+/*
+ * InitVirtVhdHeader:
+ *   Build and init virtual VHD file header
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitVirtVhdHeader() {
+  uint64_t orig_image_size=0;
+  uint16_t i=0;
+  uint64_t geom_tot_s=0;
+  uint64_t geom_c_x_h=0;
+  uint16_t geom_c=0;
+  uint8_t geom_h=0;
+  uint8_t geom_s=0;
+  uint32_t checksum=0;
+
+  // Get input image size
+  if(!GetOrigImageSize(&orig_image_size)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return FALSE;
+  }
+
+  // Allocate memory for vhd header
+  XMOUNT_MALLOC(pVhdFileHeader,pTVhdFileHeader,sizeof(TVhdFileHeader))
+  memset(pVhdFileHeader,0,sizeof(TVhdFileHeader));
+
+  // Init header values
+  pVhdFileHeader->cookie=VHD_IMAGE_HVAL_COOKIE;
+  pVhdFileHeader->features=VHD_IMAGE_HVAL_FEATURES;
+  pVhdFileHeader->file_format_version=VHD_IMAGE_HVAL_FILE_FORMAT_VERSION;
+  pVhdFileHeader->data_offset=VHD_IMAGE_HVAL_DATA_OFFSET;
+  pVhdFileHeader->creation_time=htobe32(time(NULL)-
+                                          VHD_IMAGE_TIME_CONVERSION_OFFSET);
+  pVhdFileHeader->creator_app=VHD_IMAGE_HVAL_CREATOR_APPLICATION;
+  pVhdFileHeader->creator_ver=VHD_IMAGE_HVAL_CREATOR_VERSION;
+  pVhdFileHeader->creator_os=VHD_IMAGE_HVAL_CREATOR_HOST_OS;
+  pVhdFileHeader->size_original=htobe64(orig_image_size);
+  pVhdFileHeader->size_current=pVhdFileHeader->size_original;
+
+  // Convert size to sectors
+  if(orig_image_size>136899993600) {
+    // image is larger then CHS values can address.
+    // Set sectors to max (C65535*H16*S255).
+    geom_tot_s=267382800;
+  } else {
+    // Calculate actual sectors
+    geom_tot_s=orig_image_size/512;
+    if((orig_image_size%512)!=0) geom_tot_s++;
+  }
+
+  // Calculate CHS values. This is done according to the VHD specs
+  if(geom_tot_s>=66059280) { // C65535 * H16 * S63
+    geom_s=255;
+    geom_h=16;
+    geom_c_x_h=geom_tot_s/geom_s;
+  } else {
+    geom_s=17;
+    geom_c_x_h=geom_tot_s/geom_s;
+    geom_h=(geom_c_x_h+1023)/1024;
+    if(geom_h<4) geom_h=4;
+    if(geom_c_x_h>=(geom_h*1024) || geom_h>16) {
+      geom_s=31;
+      geom_h=16;
+      geom_c_x_h=geom_tot_s/geom_s;
+    }
+    if(geom_c_x_h>=(geom_h*1024)) {
+      geom_s=63;
+      geom_h=16;
+      geom_c_x_h=geom_tot_s/geom_s;
+    }
+  }
+  geom_c=geom_c_x_h/geom_h;
+
+  pVhdFileHeader->disk_geometry_c=htobe16(geom_c);
+  pVhdFileHeader->disk_geometry_h=geom_h;
+  pVhdFileHeader->disk_geometry_s=geom_s;
+
+  if(SparseVirtImages) {
+    // Emulate a dynamic VHD to be able to report zero blocks as unallocated
+    pVhdFileHeader->data_offset=htobe64(sizeof(TVhdFileHeader));
+    pVhdFileHeader->disk_type=VHD_IMAGE_HVAL_DISK_TYPE_DYNAMIC;
+    if(!InitVirtVhdDynHeader(orig_image_size)) return FALSE;
+  } else pVhdFileHeader->disk_type=VHD_IMAGE_HVAL_DISK_TYPE;
+
+  pVhdFileHeader->uuid_l=XMountConfData.InputHashLo;
+  pVhdFileHeader->uuid_h=XMountConfData.InputHashHi;
+  pVhdFileHeader->saved_state=0x00;
+
+  // Calculate footer checksum
+  for(i=0;i<sizeof(TVhdFileHeader);i++) {
+    checksum+=*((uint8_t*)(pVhdFileHeader)+i);
+  }
+  pVhdFileHeader->checksum=htobe32(~checksum);
+
+  LOG_DEBUG("VHD header size = %u\n",sizeof(TVhdFileHeader));
+
+  return TRUE;
+}
+
+/*
+ * InitVirtQcow2Header:
+ *   Build and init virtual QCOW2 header and calculate the layout of the
+ *   QCOW2 metadata
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitVirtQcow2Header() {
+  uint64_t ImageSize;
+  uint64_t L1Clusters;
+  uint64_t RefTableClusters=0;
+  uint64_t RefBlocks=0;
+  uint64_t TotalClusters;
+  uint64_t NewRefBlocks;
+  uint64_t NewRefTableClusters;
+  uint64_t PadClusters=0;
+
+  // Get input image size
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return FALSE;
+  }
+
+  // Calculate how many data clusters and L2 tables we need
+  Qcow2DataClusters=ImageSize/QCOW2_CLUSTER_SIZE;
+  if((ImageSize%QCOW2_CLUSTER_SIZE)!=0) Qcow2DataClusters++;
+  Qcow2L1Entries=Qcow2DataClusters/QCOW2_L2_ENTRIES;
+  if((Qcow2DataClusters%QCOW2_L2_ENTRIES)!=0) Qcow2L1Entries++;
+  L1Clusters=((Qcow2L1Entries*sizeof(uint64_t))+QCOW2_CLUSTER_SIZE-1)/
+    QCOW2_CLUSTER_SIZE;
+  if(L1Clusters==0) L1Clusters=1;
+
+  // Refcount blocks have to cover the whole file including themselves and the
+  // padding in front of the aligned data clusters
+  do {
+    TotalClusters=1+L1Clusters+RefTableClusters+RefBlocks+Qcow2L1Entries;
+    PadClusters=(AlignDataOffset(TotalClusters*QCOW2_CLUSTER_SIZE)/
+                 QCOW2_CLUSTER_SIZE)-TotalClusters;
+    TotalClusters+=PadClusters+Qcow2DataClusters;
+    NewRefBlocks=(TotalClusters+QCOW2_REFCOUNT_ENTRIES-1)/
+      QCOW2_REFCOUNT_ENTRIES;
+    NewRefTableClusters=((NewRefBlocks*sizeof(uint64_t))+
+                         QCOW2_CLUSTER_SIZE-1)/QCOW2_CLUSTER_SIZE;
+    if(NewRefBlocks==RefBlocks && NewRefTableClusters==RefTableClusters) break;
+    RefBlocks=NewRefBlocks;
+    RefTableClusters=NewRefTableClusters;
+  } while(1);
+
+  // Layout: Header, L1 table, refcount table, refcount blocks, L2 tables,
+  // padding and data clusters
+  Qcow2RefBlocks=RefBlocks;
+  Qcow2L1Off=QCOW2_CLUSTER_SIZE;
+  Qcow2RefTableOff=Qcow2L1Off+(L1Clusters*QCOW2_CLUSTER_SIZE);
+  Qcow2RefBlockOff=Qcow2RefTableOff+(RefTableClusters*QCOW2_CLUSTER_SIZE);
+  Qcow2L2Off=Qcow2RefBlockOff+(RefBlocks*QCOW2_CLUSTER_SIZE);
+  Qcow2HeaderSize=Qcow2L2Off+
+    ((Qcow2L1Entries+PadClusters)*QCOW2_CLUSTER_SIZE);
+
+  // Init header values
+  XMOUNT_MALLOC(pQcow2Header,pTQcow2Header,sizeof(TQcow2Header))
+  memset(pQcow2Header,0,sizeof(TQcow2Header));
+  pQcow2Header->magic=htobe32(QCOW2_MAGIC);
+  pQcow2Header->version=htobe32(QCOW2_VERSION);
+  pQcow2Header->cluster_bits=htobe32(QCOW2_CLUSTER_BITS);
+  pQcow2Header->size=htobe64(ImageSize);
+  pQcow2Header->l1_size=htobe32((uint32_t)Qcow2L1Entries);
+  pQcow2Header->l1_table_offset=htobe64(Qcow2L1Off);
+  pQcow2Header->refcount_table_offset=htobe64(Qcow2RefTableOff);
+  pQcow2Header->refcount_table_clusters=htobe32((uint32_t)RefTableClusters);
+
+  LOG_DEBUG("QCOW2 metadata size = %" PRIu64 " (%" PRIu64 " L2 tables, %"
+            PRIu64 " refcount blocks)\n",
+            Qcow2HeaderSize,Qcow2L1Entries,Qcow2RefBlocks)
+
+  return TRUE;
+}
+
+/*
+ * GetRandomGuid:
+ *   Generate a random (Version 4) GUID using the system's random source
+ *
+ * Params:
+ *   pGuid: 16 bytes buffer to write GUID to
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int GetRandomGuid(uint8_t *pGuid) {
+  int fd;
+  ssize_t ret;
+
+  fd=open("/dev/urandom",O_RDONLY);
+  if(fd==-1) {
+    LOG_ERROR("Couldn't open /dev/urandom: %s!\n",strerror(errno))
+    return FALSE;
+  }
+  ret=read(fd,pGuid,16);
+  close(fd);
+  if(ret!=16) {
+    LOG_ERROR("Couldn't read random data from /dev/urandom!\n")
+    return FALSE;
+  }
+  // Set version and variant. GUIDs store their third field little endian.
+  pGuid[7]=(pGuid[7] & 0x0F) | 0x40;
+  pGuid[8]=(pGuid[8] & 0x3F) | 0x80;
+  return TRUE;
+}
+
+/*
+ * InitVirtVhdxHeader:
+ *   Build and init virtual VHDX headers, region table and metadata
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitVirtVhdxHeader() {
+  const uint8_t BatGuid[16]=VHDX_GUID_BAT_REGION;
+  const uint8_t MetadataGuid[16]=VHDX_GUID_METADATA_REGION;
+  const uint8_t FileParametersGuid[16]=VHDX_GUID_FILE_PARAMETERS;
+  const uint8_t VirtualDiskSizeGuid[16]=VHDX_GUID_VIRTUAL_DISK_SIZE;
+  const uint8_t VirtualDiskIdGuid[16]=VHDX_GUID_VIRTUAL_DISK_ID;
+  const uint8_t LogicalSectorSizeGuid[16]=VHDX_GUID_LOGICAL_SECTOR_SIZE;
+  const uint8_t PhysicalSectorSizeGuid[16]=VHDX_GUID_PHYSICAL_SECTOR_SIZE;
+  const char *pCreator="xmount " PACKAGE_VERSION;
+  pTVhdxRegionTableHeader pRegionTableHeader;
+  pTVhdxRegionTableEntry pRegionTableEntry;
+  pTVhdxMetadataTableHeader pMetadataTableHeader;
+  pTVhdxMetadataTableEntry pMetadataTableEntry;
+  pTVhdxMetadataItems pMetadataItems;
+  uint64_t ImageSize;
+  uint64_t DiskSize;
+  uint64_t BatRegionSize;
+  uint32_t LogicalSectorSize;
+  int i;
+
+  // Get input image size
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return FALSE;
+  }
+
+  // Evidence is usually taken from 512 byte sector disks, 4k logical sectors
+  // (4Kn) must be requested explicitly. The virtual disk size must be a
+  // multiple of the logical sector size and is rounded up if needed.
+  if(XMountConfData.Vhdx4kn) LogicalSectorSize=VHDX_4KN_SECTOR_SIZE;
+  else LogicalSectorSize=VHDX_LOGICAL_SECTOR_SIZE;
+  DiskSize=ImageSize;
+  if((DiskSize%LogicalSectorSize)!=0) {
+    DiskSize+=LogicalSectorSize-(DiskSize%LogicalSectorSize);
+  }
+  if(DiskSize>VHDX_MAX_DISK_SIZE) {
+    LOG_ERROR("Input image is too large to be emulated as VHDX!\n")
+    return FALSE;
+  }
+
+  // Calculate BAT size
+  VhdxBlockCount=DiskSize/VHDX_BLOCK_SIZE;
+  if((DiskSize%VHDX_BLOCK_SIZE)!=0) VhdxBlockCount++;
+  VhdxChunkRatio=(((uint64_t)1<<23)*LogicalSectorSize)/VHDX_BLOCK_SIZE;
+  VhdxBatEntries=VhdxBlockCount+((VhdxBlockCount-1)/VhdxChunkRatio);
+  BatRegionSize=((VhdxBatEntries*sizeof(uint64_t))+VHDX_ALIGNMENT-1) &
+    ~((uint64_t)VHDX_ALIGNMENT-1);
+  VhdxHeaderSize=VHDX_BAT_OFFSET+BatRegionSize;
+
+  // File type identifier
+  XMOUNT_MALLOC(pVhdxFileIdentifier,
+                pTVhdxFileIdentifier,
+                sizeof(TVhdxFileIdentifier))
+  memset(pVhdxFileIdentifier,0,sizeof(TVhdxFileIdentifier));
+  pVhdxFileIdentifier->signature=htole64(VHDX_FILE_SIGNATURE);
+  for(i=0;pCreator[i]!='\0' && i<255;i++) {
+    pVhdxFileIdentifier->creator[i]=htole16(pCreator[i]);
+  }
+
+  // Headers. The one with the higher sequence number is used. As there is no
+  // log to replay, the log guid stays zero.
+  XMOUNT_MALLOC(pVhdxHeaders,pTVhdxHeader,2*sizeof(TVhdxHeader))
+  memset(pVhdxHeaders,0,2*sizeof(TVhdxHeader));
+  pVhdxHeaders[0].signature=htole32(VHDX_HEADER_SIGNATURE);
+  if(!GetRandomGuid(pVhdxHeaders[0].file_write_guid)) return FALSE;
+  memcpy(pVhdxHeaders[0].data_write_guid,&(XMountConfData.InputHashLo),8);
+  memcpy(pVhdxHeaders[0].data_write_guid+8,&(XMountConfData.InputHashHi),8);
+  pVhdxHeaders[0].version=htole16(VHDX_HEADER_VERSION);
+  pVhdxHeaders[0].log_length=htole32(VHDX_LOG_SIZE);
+  pVhdxHeaders[0].log_offset=htole64(VHDX_LOG_OFFSET);
+  memcpy(&(pVhdxHeaders[1]),&(pVhdxHeaders[0]),sizeof(TVhdxHeader));
+  for(i=0;i<2;i++) {
+    pVhdxHeaders[i].sequence_number=htole64(i+1);
+    pVhdxHeaders[i].checksum=
+      htole32(Crc32c(0,&(pVhdxHeaders[i]),sizeof(TVhdxHeader)));
+  }
+
+  // Region table
+  XMOUNT_MALLOC(pVhdxRegionTable,char*,VHDX_REGION_TABLE_SIZE)
+  memset(pVhdxRegionTable,0,VHDX_REGION_TABLE_SIZE);
+  pRegionTableHeader=(pTVhdxRegionTableHeader)pVhdxRegionTable;
+  pRegionTableHeader->signature=htole32(VHDX_REGION_TABLE_SIGNATURE);
+  pRegionTableHeader->entry_count=htole32(2);
+  pRegionTableEntry=(pTVhdxRegionTableEntry)(pRegionTableHeader+1);
+  memcpy(pRegionTableEntry[0].guid,BatGuid,16);
+  pRegionTableEntry[0].file_offset=htole64(VHDX_BAT_OFFSET);
+  pRegionTableEntry[0].length=htole32((uint32_t)BatRegionSize);
+  pRegionTableEntry[0].required=htole32(VHDX_REGION_REQUIRED);
+  memcpy(pRegionTableEntry[1].guid,MetadataGuid,16);
+  pRegionTableEntry[1].file_offset=htole64(VHDX_METADATA_OFFSET);
+  pRegionTableEntry[1].length=htole32(VHDX_METADATA_SIZE);
+  pRegionTableEntry[1].required=htole32(VHDX_REGION_REQUIRED);
+  pRegionTableHeader->checksum=
+    htole32(Crc32c(0,pVhdxRegionTable,VHDX_REGION_TABLE_SIZE));
+
+  // Metadata table followed by metadata items
+  XMOUNT_MALLOC(pVhdxMetadata,
+                char*,
+                VHDX_METADATA_ITEMS_OFFSET+sizeof(TVhdxMetadataItems))
+  memset(pVhdxMetadata,
+         0,
+         VHDX_METADATA_ITEMS_OFFSET+sizeof(TVhdxMetadataItems));
+  pMetadataTableHeader=(pTVhdxMetadataTableHeader)pVhdxMetadata;
+  pMetadataTableHeader->signature=htole64(VHDX_METADATA_SIGNATURE);
+  pMetadataTableHeader->entry_count=htole16(5);
+  pMetadataTableEntry=(pTVhdxMetadataTableEntry)(pMetadataTableHeader+1);
+  pMetadataItems=
+    (pTVhdxMetadataItems)(pVhdxMetadata+VHDX_METADATA_ITEMS_OFFSET);
+
+#define SET_METADATA_ENTRY(num,guid,item,EntryFlags) {               \
+  memcpy(pMetadataTableEntry[num].item_id,guid,16);                  \
+  pMetadataTableEntry[num].offset=                                   \
+    htole32(VHDX_METADATA_ITEMS_OFFSET+                              \
+            offsetof(TVhdxMetadataItems,item));                      \
+  pMetadataTableEntry[num].length=                                   \
+    htole32(sizeof(pMetadataItems->item));                           \
+  pMetadataTableEntry[num].flags=htole32(EntryFlags);                \
+}
+
+  SET_METADATA_ENTRY(0,FileParametersGuid,block_size,
+                     VHDX_METADATA_IS_REQUIRED)
+  // File parameters consist of block size and flags
+  pMetadataTableEntry[0].length=htole32(2*sizeof(uint32_t));
+  SET_METADATA_ENTRY(1,VirtualDiskSizeGuid,virtual_disk_size,
+                     VHDX_METADATA_IS_VIRTUAL_DISK | VHDX_METADATA_IS_REQUIRED)
+  SET_METADATA_ENTRY(2,VirtualDiskIdGuid,virtual_disk_id,
+                     VHDX_METADATA_IS_VIRTUAL_DISK | VHDX_METADATA_IS_REQUIRED)
+  SET_METADATA_ENTRY(3,LogicalSectorSizeGuid,logical_sector_size,
+                     VHDX_METADATA_IS_VIRTUAL_DISK | VHDX_METADATA_IS_REQUIRED)
+  SET_METADATA_ENTRY(4,PhysicalSectorSizeGuid,physical_sector_size,
+                     VHDX_METADATA_IS_VIRTUAL_DISK | VHDX_METADATA_IS_REQUIRED)
+
+#undef SET_METADATA_ENTRY
+
+  pMetadataItems->block_size=htole32(VHDX_BLOCK_SIZE);
+  pMetadataItems->file_parameter_flags=0;
+  pMetadataItems->virtual_disk_size=htole64(DiskSize);
+  memcpy(pMetadataItems->virtual_disk_id,&(XMountConfData.InputHashLo),8);
+  memcpy(pMetadataItems->virtual_disk_id+8,&(XMountConfData.InputHashHi),8);
+  pMetadataItems->logical_sector_size=htole32(LogicalSectorSize);
+  pMetadataItems->physical_sector_size=htole32(VHDX_PHYSICAL_SECTOR_SIZE);
+
+  LOG_DEBUG("VHDX: %" PRIu64 " payload blocks, %" PRIu64 " BAT entries, "
+            "%" PRIu32 " byte logical sectors\n",
+            VhdxBlockCount,VhdxBatEntries,LogicalSectorSize)
+
+  return TRUE;
+}
+
+/*
+ * InitVirtVmdkHeader:
+ *   Build and init virtual VMDK header and embedded descriptor and calculate
+ *   the layout of the VMDK metadata
+ *
+ * Params:
+ *   pImage: Virtual VMDK image
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitVirtVmdkHeader(pTVirtImage pImage) {
+  uint64_t ImageSize;
+  uint64_t ImageSectors;
+  uint64_t GdSize;
+  uint64_t cylinders;
+  char buf[VMDK_DESCRIPTOR_SECTORS*VMDK_SECTOR_SIZE];
+  int len;
+
+  // Get input image size
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return FALSE;
+  }
+
+  // Calculate how many grains and grain tables we need
+  ImageSectors=ImageSize/VMDK_SECTOR_SIZE;
+  if((ImageSize%VMDK_SECTOR_SIZE)!=0) ImageSectors++;
+  VmdkGrains=ImageSize/VMDK_GRAIN_SIZE;
+  if((ImageSize%VMDK_GRAIN_SIZE)!=0) VmdkGrains++;
+  VmdkGrainTables=VmdkGrains/VMDK_GTES_PER_GT;
+  if((VmdkGrains%VMDK_GTES_PER_GT)!=0) VmdkGrainTables++;
+
+  // Layout: Header, embedded descriptor, grain directory, grain tables and
+  // grains. The first grain is aligned to the grain size and the configured
+  // data alignment.
+  VmdkGdOff=(VMDK_DESCRIPTOR_OFFSET+VMDK_DESCRIPTOR_SECTORS)*VMDK_SECTOR_SIZE;
+  GdSize=((VmdkGrainTables*sizeof(uint32_t))+VMDK_SECTOR_SIZE-1)/
+    VMDK_SECTOR_SIZE;
+  VmdkGtOff=VmdkGdOff+(GdSize*VMDK_SECTOR_SIZE);
+  VmdkHeaderSize=VmdkGtOff+(VmdkGrainTables*VMDK_GT_SIZE);
+  VmdkHeaderSize=((VmdkHeaderSize+VMDK_GRAIN_SIZE-1)/VMDK_GRAIN_SIZE)*
+    VMDK_GRAIN_SIZE;
+  VmdkHeaderSize=AlignDataOffset(VmdkHeaderSize);
+
+  // Grain table entries can't address more than 2^32 sectors
+  if((VmdkHeaderSize/VMDK_SECTOR_SIZE)+(VmdkGrains*VMDK_GRAIN_SECTORS)>
+     VMDK_MAX_SECTORS)
+  {
+    LOG_ERROR("Input image is too big to be emulated as VMDK file!\n")
+    return FALSE;
+  }
+
+  // Build embedded descriptor
+  cylinders=ImageSectors/(16*63);
+  if(cylinders>16383) cylinders=16383;
+
+#define VMDK_DESC_FILE "# Disk DescriptorFile\n" \
+                       "version=1\n" \
+                       "CID=fffffffe\n" \
+                       "parentCID=ffffffff\n" \
+                       "createType=\"monolithicSparse\"\n\n" \
+                       "# Extent description\n" \
+                       "RW %" PRIu64 " SPARSE \"%s\"\n\n" \
+                       "# The Disk Data Base\n" \
+                       "#DDB\n" \
+                       "ddb.virtualHWVersion = \"3\"\n" \
+                       "ddb.adapterType = \"%s\"\n" \
+                       "ddb.geometry.cylinders = \"%" PRIu64 "\"\n" \
+                       "ddb.geometry.heads = \"16\"\n" \
+                       "ddb.geometry.sectors = \"63\"\n"
+
+  len=snprintf(buf,
+               sizeof(buf),
+               VMDK_DESC_FILE,
+               ImageSectors,
+               (pImage->pPath)+1,
+               pImage->Type==TVirtImageType_VMDKS ? "scsi" : "ide",
+               cylinders);
+
+#undef VMDK_DESC_FILE
+
+  if(len<0 || len>=sizeof(buf)) {
+    LOG_ERROR("Virtual VMDK descriptor is too big!\n")
+    return FALSE;
+  }
+  XMOUNT_STRSET(pVmdkDescriptor,buf)
+  pVmdkImage=pImage;
+
+  // Init header values
+  XMOUNT_MALLOC(pVmdkHeader,pTVmdkSparseHeader,sizeof(TVmdkSparseHeader))
+  memset(pVmdkHeader,0,sizeof(TVmdkSparseHeader));
+  pVmdkHeader->magicNumber=htole32(VMDK_SPARSE_MAGIC);
+  pVmdkHeader->version=htole32(VMDK_SPARSE_VERSION);
+  pVmdkHeader->flags=htole32(VMDK_SPARSE_FLAG_VALID_NEWLINE);
+  pVmdkHeader->capacity=htole64(ImageSectors);
+  pVmdkHeader->grainSize=htole64(VMDK_GRAIN_SECTORS);
+  pVmdkHeader->descriptorOffset=htole64(VMDK_DESCRIPTOR_OFFSET);
+  pVmdkHeader->descriptorSize=htole64(VMDK_DESCRIPTOR_SECTORS);
+  pVmdkHeader->numGTEsPerGT=htole32(VMDK_GTES_PER_GT);
+  pVmdkHeader->gdOffset=htole64(VmdkGdOff/VMDK_SECTOR_SIZE);
+  pVmdkHeader->overHead=htole64(VmdkHeaderSize/VMDK_SECTOR_SIZE);
+  pVmdkHeader->singleEndLineChar='\n';
+  pVmdkHeader->nonEndLineChar=' ';
+  pVmdkHeader->doubleEndLineChar1='\r';
+  pVmdkHeader->doubleEndLineChar2='\n';
+
+  LOG_DEBUG("VMDK metadata size = %" PRIu64 " (%" PRIu64 " grain tables)\n",
+            VmdkHeaderSize,VmdkGrainTables)
+
+  return TRUE;
+}
+
+/*
+ * InitVirtVmdkDirectDescriptor:
+ *   Build a VMDK descriptor referencing the DD input image segments as flat
+ *   extents. The virtual VMDK file then only consists of this descriptor and
+ *   VMware reads the input image without going through xmount.
+ *
+ * Params:
+ *   pImage: Virtual VMDK image
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitVirtVmdkDirectDescriptor(pTVirtImage pImage) {
+  uint64_t ImageSize;
+  uint64_t cylinders;
+  char buf[500];
+  uint32_t i;
+  int SmallExtents=TRUE;
+
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return FALSE;
+  }
+
+  for(i=0;i<DdSegmentCount;i++) {
+    // Flat extents are specified in whole sectors
+    if((pDdSegments[i].Size%VMDK_SECTOR_SIZE)!=0) {
+      LOG_ERROR("Size of DD file \"%s\" isn't a multiple of %u bytes and "
+                "can't be referenced directly!\n",
+                pDdSegments[i].pPath,
+                VMDK_SECTOR_SIZE)
+      return FALSE;
+    }
+    // Extent file names are quoted in the descriptor, which has no way to
+    // escape quotes or line breaks. Backslashes are path separators on
+    // Windows hosts.
+    if(strpbrk(pDdSegments[i].pPath,"\"\\\r\n")!=NULL) {
+      LOG_ERROR("Path of DD file \"%s\" contains characters that can't be "
+                "used in a VMDK descriptor!\n",
+                pDdSegments[i].pPath)
+      return FALSE;
+    }
+    if(pDdSegments[i].Size>VMDK_2GB_MAX_EXTENT_SIZE) SmallExtents=FALSE;
+  }
+
+  XMOUNT_STRSET(pVmdkDescriptor,"# Disk DescriptorFile\n"
+                                "version=1\n"
+                                "CID=fffffffe\n"
+                                "parentCID=ffffffff\n")
+  if(DdSegmentCount==1 || !SmallExtents) {
+    // Split images with extents larger than 2 GB aren't twoGbMaxExtentFlat
+    XMOUNT_STRAPP(pVmdkDescriptor,"createType=\"monolithicFlat\"\n\n")
+  } else {
+    XMOUNT_STRAPP(pVmdkDescriptor,"createType=\"twoGbMaxExtentFlat\"\n\n")
+  }
+  XMOUNT_STRAPP(pVmdkDescriptor,"# Extent description\n")
+  for(i=0;i<DdSegmentCount;i++) {
+    // Input image must never be written to
+    XMOUNT_STRAPP(pVmdkDescriptor,"RDONLY ")
+    sprintf(buf,"%" PRIu64 " FLAT \"",pDdSegments[i].Size/VMDK_SECTOR_SIZE);
+    XMOUNT_STRAPP(pVmdkDescriptor,buf)
+    XMOUNT_STRAPP(pVmdkDescriptor,pDdSegments[i].pPath)
+    XMOUNT_STRAPP(pVmdkDescriptor,"\" 0\n")
+  }
+
+  cylinders=(ImageSize/VMDK_SECTOR_SIZE)/(16*63);
+  if(cylinders>16383) cylinders=16383;
+  sprintf(buf,
+          "\n# The Disk Data Base\n"
+          "#DDB\n"
+          "ddb.virtualHWVersion = \"3\"\n"
+          "ddb.adapterType = \"%s\"\n"
+          "ddb.geometry.cylinders = \"%" PRIu64 "\"\n"
+          "ddb.geometry.heads = \"16\"\n"
+          "ddb.geometry.sectors = \"63\"\n",
+          pImage->Type==TVirtImageType_VMDKS ? "scsi" : "ide",
+          cylinders);
+  XMOUNT_STRAPP(pVmdkDescriptor,buf)
+
+  // The descriptor is all there is. No grains follow it.
+  VmdkHeaderSize=strlen(pVmdkDescriptor);
+  VmdkGrains=0;
+  VmdkGrainTables=0;
+  pVmdkImage=pImage;
+
+  LOG_DEBUG("VMDK descriptor references %u DD files directly\n",
+            DdSegmentCount)
+
+  return TRUE;
+}
+
+/*
+ * InitVirtImageInfoFile:
+ *   Create virtual image info file
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitVirtImageInfoFile() {
+  char buf[200];
+  int ret;
+
+  // Add static header to file
+  XMOUNT_MALLOC(pVirtualImageInfoFile,char*,(strlen(IMAGE_INFO_HEADER)+1))
+  strncpy(pVirtualImageInfoFile,IMAGE_INFO_HEADER,strlen(IMAGE_INFO_HEADER)+1);
+
+  switch(XMountConfData.OrigImageType) {
+    case TOrigImageType_DD:
+      // Original image is a DD file. There isn't much info to extract. Perhaps
+      // just add image size
+      // TODO: Add infos to virtual image info file
+      break;
+
+#ifdef WITH_LIBEWF
+#define M_SAVE_VALUE(DESC,SHORT_DESC) { \
+  if(ret==1) {             \
+    XMOUNT_REALLOC(pVirtualImageInfoFile,char*, \
+      (strlen(pVirtualImageInfoFile)+strlen(buf)+strlen(DESC)+2)) \
+    strncpy((pVirtualImageInfoFile+strlen(pVirtualImageInfoFile)),DESC,strlen(DESC)+1); \
+    strncpy((pVirtualImageInfoFile+strlen(pVirtualImageInfoFile)),buf,strlen(buf)+1); \
+    strncpy((pVirtualImageInfoFile+strlen(pVirtualImageInfoFile)),"\n",2); \
+  } else if(ret==-1) { \
+    LOG_WARNING("Couldn't query EWF image header value '%s'\n",SHORT_DESC) \
+  } \
+}
+    case TOrigImageType_EWF:
+      // Original image is an EWF file. Extract various infos from ewf file and
+      // add them to the virtual image info file content.
+#if defined( HAVE_LIBEWF_V2_API )
+      ret=libewf_handle_get_utf8_header_value_case_number(hEwfFile,buf,sizeof(buf),NULL);
+      M_SAVE_VALUE("Case number: ","Case number")
+      ret=libewf_handle_get_utf8_header_value_description(hEwfFile,buf,sizeof(buf),NULL);
+      M_SAVE_VALUE("Description: ","Description")
+      ret=libewf_handle_get_utf8_header_value_examiner_name(hEwfFile,buf,sizeof(buf),NULL);
+      M_SAVE_VALUE("Examiner: ","Examiner")
+      ret=libewf_handle_get_utf8_header_value_evidence_number(hEwfFile,buf,sizeof(buf),NULL);
+      M_SAVE_VALUE("Evidence number: ","Evidence number")
+      ret=libewf_handle_get_utf8_header_value_notes(hEwfFile,buf,sizeof(buf),NULL);
+      M_SAVE_VALUE("Notes: ","Notes")
+      ret=libewf_handle_get_utf8_header_value_acquiry_date(hEwfFile,buf,sizeof(buf),NULL);
+      M_SAVE_VALUE("Acquiry date: ","Acquiry date")
+      ret=libewf_handle_get_utf8_header_value_system_date(hEwfFile,buf,sizeof(buf),NULL);
+      M_SAVE_VALUE("System date: ","System date")
+      ret=libewf_handle_get_utf8_header_value_acquiry_operating_system(hEwfFile,buf,sizeof(buf),NULL);
+      M_SAVE_VALUE("Acquiry os: ","Acquiry os")
+      ret=libewf_handle_get_utf8_header_value_acquiry_software_version(hEwfFile,buf,sizeof(buf),NULL);
+      M_SAVE_VALUE("Acquiry sw version: ","Acquiry sw version")
+      ret=libewf_handle_get_utf8_hash_value_md5(hEwfFile,buf,sizeof(buf),NULL);
+      M_SAVE_VALUE("MD5 hash: ","MD5 hash")
+      ret=libewf_handle_get_utf8_hash_value_sha1(hEwfFile,buf,sizeof(buf),NULL);
+      M_SAVE_VALUE("SHA1 hash: ","SHA1 hash")
+#else
+      ret=libewf_get_header_value_case_number(hEwfFile,buf,sizeof(buf));
+      M_SAVE_VALUE("Case number: ","Case number")
+      ret=libewf_get_header_value_description(hEwfFile,buf,sizeof(buf));
+      M_SAVE_VALUE("Description: ","Description")
+      ret=libewf_get_header_value_examiner_name(hEwfFile,buf,sizeof(buf));
+      M_SAVE_VALUE("Examiner: ","Examiner")
+      ret=libewf_get_header_value_evidence_number(hEwfFile,buf,sizeof(buf));
+      M_SAVE_VALUE("Evidence number: ","Evidence number")
+      ret=libewf_get_header_value_notes(hEwfFile,buf,sizeof(buf));
+      M_SAVE_VALUE("Notes: ","Notes")
+      ret=libewf_get_header_value_acquiry_date(hEwfFile,buf,sizeof(buf));
+      M_SAVE_VALUE("Acquiry date: ","Acquiry date")
+      ret=libewf_get_header_value_system_date(hEwfFile,buf,sizeof(buf));
+      M_SAVE_VALUE("System date: ","System date")
+      ret=libewf_get_header_value_acquiry_operating_system(hEwfFile,buf,sizeof(buf));
+      M_SAVE_VALUE("Acquiry os: ","Acquiry os")
+      ret=libewf_get_header_value_acquiry_software_version(hEwfFile,buf,sizeof(buf));
+      M_SAVE_VALUE("Acquiry sw version: ","Acquiry sw version")
+      ret=libewf_get_hash_value_md5(hEwfFile,buf,sizeof(buf));
+      M_SAVE_VALUE("MD5 hash: ","MD5 hash")
+      ret=libewf_get_hash_value_sha1(hEwfFile,buf,sizeof(buf));
+      M_SAVE_VALUE("SHA1 hash: ","SHA1 hash")
+#endif
+      break;
+#undef M_SAVE_VALUE
+#endif
+
+#ifdef WITH_LIBAFF
+    case TOrigImageType_AFF:
+      // Original image is an AFF file.
+      // TODO: Extract some infos from AFF file to add to our info file
+      break;
+#endif
+    default:
+      LOG_ERROR("Unsupported input image type!\n")
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/*
+ * AddPartition:
+ *   Add a virtual partition file and list it in the virtual image info file
+ *
+ * Params:
+ *   number: Partition number
+ *   offset: Offset of partition inside input image
+ *   size: Size of partition
+ *   pDesc: Partition type description for the info file
+ *
+ * Returns:
+ *   n/a
+ */
+static void AddPartition(uint32_t number,
+                         uint64_t offset,
+                         uint64_t size,
+                         const char *pDesc)
+{
+  pTPartition pPartition;
+  uint64_t ImageSize;
+  char buf[200];
+
+  if(!GetOrigImageSize(&ImageSize)) return;
+  if(size==0 || offset>=ImageSize) {
+    LOG_WARNING("Ignoring partition %u lying outside of input image\n",number)
+    return;
+  }
+  if(offset+size>ImageSize) {
+    LOG_WARNING("Partition %u exceeds input image and is truncated\n",number)
+    size=ImageSize-offset;
+  }
+
+  PartitionCount++;
+  XMOUNT_REALLOC(pPartitions,pTPartition,PartitionCount*sizeof(TPartition))
+  pPartition=&(pPartitions[PartitionCount-1]);
+  pPartition->Number=number;
+  pPartition->Offset=offset;
+  pPartition->Size=size;
+  pPartition->ReadCount=0;
+  pPartition->ReadBytes=0;
+
+  // Partition files are named after the info file
+  XMOUNT_STRNSET(pPartition->pPath,
+                 XMountConfData.pVirtualImageInfoPath,
+                 strlen(XMountConfData.pVirtualImageInfoPath)-strlen(".info"))
+  sprintf(buf,".p%u.dd",number);
+  XMOUNT_STRAPP(pPartition->pPath,buf)
+
+  if(PartitionCount==1 &&
+     (strlen(pVirtualImageInfoFile)<2 ||
+      strcmp(pVirtualImageInfoFile+strlen(pVirtualImageInfoFile)-2,"\n\n")!=0))
+  {
+    // Separate partition list from input image infos
+    XMOUNT_STRAPP(pVirtualImageInfoFile,"\n")
+  }
+  sprintf(buf,
+          "Partition %u: Offset %" PRIu64 ", size %" PRIu64 ", %s\n",
+          number,
+          offset,
+          size,
+          pDesc);
+  XMOUNT_STRAPP(pVirtualImageInfoFile,buf)
+  LOG_DEBUG("Added virtual partition file \"%s\"\n",pPartition->pPath)
+}
+
+/*
+ * InitMbrPartitions:
+ *   Add all primary and logical partitions of a MBR partition table
+ *
+ * Params:
+ *   pMbr: MBR sector
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitMbrPartitions(char *pMbr) {
+  pTMbrPartitionEntry pEntries;
+  char ebr[MBR_SECTOR_SIZE];
+  uint64_t ImageSize;
+  uint64_t ExtStart;
+  uint64_t EbrLba;
+  uint32_t number=5;
+  char desc[50];
+  int i,j;
+
+  if(!GetOrigImageSize(&ImageSize)) return FALSE;
+  pEntries=(pTMbrPartitionEntry)(pMbr+MBR_PARTITION_TABLE_OFFSET);
+  for(i=0;i<4;i++) {
+    if(pEntries[i].type==MBR_TYPE_EMPTY) continue;
+    if(!MBR_IS_EXTENDED(pEntries[i].type)) {
+      sprintf(desc,"MBR type 0x%02X",pEntries[i].type);
+      AddPartition(i+1,
+                   ((uint64_t)le32toh(pEntries[i].lba_first))*MBR_SECTOR_SIZE,
+                   ((uint64_t)le32toh(pEntries[i].sectors))*MBR_SECTOR_SIZE,
+                   desc);
+      continue;
+    }
+
+    // Walk chain of extended boot records. Logical partitions are relative
+    // to their EBR, the next EBR is relative to the extended partition.
+    ExtStart=le32toh(pEntries[i].lba_first);
+    EbrLba=ExtStart;
+    for(j=0;j<MBR_MAX_LOGICAL_PARTITIONS;j++) {
+      if((EbrLba+1)*MBR_SECTOR_SIZE>ImageSize ||
+         ReadDataArea(ebr,EbrLba*MBR_SECTOR_SIZE,MBR_SECTOR_SIZE)!=
+           MBR_SECTOR_SIZE)
+      {
+        LOG_WARNING("Couldn't read extended boot record at sector %" PRIu64
+                    "\n",EbrLba)
+        break;
+      }
+      if(le16toh(*((uint16_t*)(ebr+MBR_SIGNATURE_OFFSET)))!=MBR_SIGNATURE) {
+        break;
+      }
+      pEntries=(pTMbrPartitionEntry)(ebr+MBR_PARTITION_TABLE_OFFSET);
+      if(pEntries[0].type!=MBR_TYPE_EMPTY && pEntries[0].sectors!=0) {
+        sprintf(desc,"MBR type 0x%02X (logical)",pEntries[0].type);
+        AddPartition(number++,
+                     (EbrLba+le32toh(pEntries[0].lba_first))*MBR_SECTOR_SIZE,
+                     ((uint64_t)le32toh(pEntries[0].sectors))*MBR_SECTOR_SIZE,
+                     desc);
+      }
+      if(!MBR_IS_EXTENDED(pEntries[1].type) || pEntries[1].lba_first==0) {
+        break;
+      }
+      EbrLba=ExtStart+le32toh(pEntries[1].lba_first);
+    }
+    pEntries=(pTMbrPartitionEntry)(pMbr+MBR_PARTITION_TABLE_OFFSET);
+  }
+  return TRUE;
+}
+
+/*
+ * InitGptPartitions:
+ *   Add all partitions of a GPT partition table
+ *
+ * Params:
+ *   SectorSize: Logical sector size to look for the GPT header with
+ *
+ * Returns:
+ *   "TRUE" if a GPT was found, "FALSE" otherwise
+ */
+static int InitGptPartitions(uint32_t SectorSize) {
+  TGptHeader header;
+  pTGptPartitionEntry pEntry;
+  char *pEntries;
+  uint64_t ImageSize;
+  uint64_t EntriesSize;
+  uint64_t EntriesOff;
+  uint64_t FirstLba;
+  uint64_t LastLba;
+  uint32_t EntrySize;
+  uint32_t i;
+  char desc[80];
+  const uint8_t ZeroGuid[16]={0};
+  uint8_t *g;
+
+  if(!GetOrigImageSize(&ImageSize)) return FALSE;
+  if(2*SectorSize>ImageSize ||
+     ReadDataArea((char*)&header,SectorSize,sizeof(TGptHeader))!=
+       sizeof(TGptHeader))
+  {
+    return FALSE;
+  }
+  if(le64toh(header.signature)!=GPT_HEADER_SIGNATURE) return FALSE;
+
+  EntrySize=le32toh(header.partition_entry_size);
+  if(EntrySize<sizeof(TGptPartitionEntry) || (EntrySize%8)!=0 ||
+     le32toh(header.num_partition_entries)>GPT_MAX_ENTRIES)
+  {
+    LOG_WARNING("Ignoring GPT with invalid partition entry array\n")
+    return FALSE;
+  }
+  EntriesSize=((uint64_t)EntrySize)*le32toh(header.num_partition_entries);
+  EntriesOff=le64toh(header.partition_entry_lba)*SectorSize;
+  if(EntriesOff>ImageSize || EntriesSize>ImageSize-EntriesOff) {
+    LOG_WARNING("Ignoring GPT with partition entry array outside of input "
+                "image\n")
+    return FALSE;
+  }
+
+  XMOUNT_MALLOC(pEntries,char*,EntriesSize+1)
+  if(ReadDataArea(pEntries,EntriesOff,EntriesSize)!=EntriesSize) {
+    free(pEntries);
+    return FALSE;
+  }
+  for(i=0;i<le32toh(header.num_partition_entries);i++) {
+    pEntry=(pTGptPartitionEntry)(pEntries+(((uint64_t)i)*EntrySize));
+    if(memcmp(pEntry->type_guid,ZeroGuid,16)==0) continue;
+    FirstLba=le64toh(pEntry->first_lba);
+    LastLba=le64toh(pEntry->last_lba);
+    if(LastLba<FirstLba) continue;
+    // GUIDs are stored mixed-endian
+    g=pEntry->type_guid;
+    sprintf(desc,
+            "GPT type %02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-"
+            "%02X%02X%02X%02X%02X%02X",
+            g[3],g[2],g[1],g[0],g[5],g[4],g[7],g[6],
+            g[8],g[9],g[10],g[11],g[12],g[13],g[14],g[15]);
+    AddPartition(i+1,
+                 FirstLba*SectorSize,
+                 ((LastLba-FirstLba)+1)*SectorSize,
+                 desc);
+  }
+  free(pEntries);
+  return TRUE;
+}
+
+/*
+ * InitPartitions:
+ *   Parse partition table of input image and create virtual partition files
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitPartitions() {
+  pTMbrPartitionEntry pEntries;
+  char mbr[MBR_SECTOR_SIZE];
+  uint64_t ImageSize;
+  int i;
+
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return FALSE;
+  }
+  if(ImageSize<MBR_SECTOR_SIZE) {
+    LOG_WARNING("Input image is too small to contain a partition table\n")
+    return TRUE;
+  }
+  if(ReadDataArea(mbr,0,MBR_SECTOR_SIZE)!=MBR_SECTOR_SIZE) {
+    LOG_ERROR("Couldn't read partition table!\n")
+    return FALSE;
+  }
+  if(le16toh(*((uint16_t*)(mbr+MBR_SIGNATURE_OFFSET)))!=MBR_SIGNATURE) {
+    LOG_WARNING("Input image doesn't contain a MBR or GPT partition table\n")
+    return TRUE;
+  }
+
+  // A protective MBR entry indicates a GPT. Disks with 4k sectors have their
+  // GPT header at offset 4096.
+  pEntries=(pTMbrPartitionEntry)(mbr+MBR_PARTITION_TABLE_OFFSET);
+  for(i=0;i<4;i++) {
+    if(pEntries[i].type==MBR_TYPE_GPT_PROTECTIVE) {
+      if(InitGptPartitions(512) || InitGptPartitions(4096)) return TRUE;
+      LOG_WARNING("Protective MBR found but no valid GPT\n")
+      return TRUE;
+    }
+  }
+  return InitMbrPartitions(mbr);
+}
+
+/*
+ * RepairCacheFileCrcs:
+ *   Check all assigned cache blocks of a cache file that wasn't marked clean
+ *   (See SetCacheFileDirty). A crash between writing a block's data and its
+ *   checksum can't be told apart from corruption of blocks written in that
+ *   session, so mismatching checksums are replaced by the block's current
+ *   checksum and a warning is added to the virtual image info file.
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int RepairCacheFileCrcs() {
+  char buf[200];
+  uint32_t crc;
+  uint64_t repaired=0;
+  uint64_t i;
+
+  LOG_WARNING("Cache file wasn't closed cleanly. Checking all cache "
+              "blocks.\n")
+  for(i=0;i<pCacheFileHeader->BlockCount;i++) {
+    if(pCacheFileBlockIndex[i].Assigned!=TRUE) continue;
+    if(fseeko(hCacheFile,pCacheFileBlockIndex[i].off_data,SEEK_SET)!=0 ||
+       fread(pCacheBlockBuf,CACHE_BLOCK_SIZE,1,hCacheFile)!=1)
+    {
+      LOG_ERROR("Couldn't read cache block %" PRIu64 " from cache file!\n",i)
+      return FALSE;
+    }
+    crc=Crc32c(0,pCacheBlockBuf,CACHE_BLOCK_SIZE);
+    pCacheFileBlockVerified[i]=CACHE_BLOCK_VERIFIED;
+    if(crc==pCacheFileBlockCrcs[i]) continue;
+    pCacheFileBlockCrcs[i]=crc;
+    if(!WriteCacheFileBlockCrc(i)) return FALSE;
+    LOG_WARNING("Checksum of cache block %" PRIu64 " didn't match after "
+                "unclean shutdown. Updated it.\n",i)
+    sprintf(buf,
+            "WARNING: Cache block %" PRIu64 " (Offset %" PRIu64
+            ") was possibly written partially before an unclean shutdown!\n",
+            i,
+            i*CACHE_BLOCK_SIZE);
+    if(pVirtualImageInfoFile!=NULL) XMOUNT_STRAPP(pVirtualImageInfoFile,buf)
+    repaired++;
+  }
+  LOG_DEBUG("Updated checksums of %" PRIu64 " cache blocks\n",repaired)
+  return SetCacheFileDirty(FALSE);
+}
+
+/*
+ * InitCacheFileCrcs:
+ *   Load cache block checksums. Cache files created by older versions don't
+ *   have any, in which case they are calculated for all assigned blocks and
+ *   appended to the cache file.
+ *
+ * Params:
+ *   CacheFileSize: Current size of cache file
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitCacheFileCrcs(uint64_t CacheFileSize) {
+  uint64_t BlockCount=pCacheFileHeader->BlockCount;
+  uint64_t CrcsSize=BlockCount*sizeof(uint32_t);
+  uint64_t i;
+
+  XMOUNT_MALLOC(pCacheFileBlockCrcs,uint32_t*,CrcsSize)
+  XMOUNT_MALLOC(pCacheFileBlockVerified,uint8_t*,BlockCount*sizeof(uint8_t))
+  XMOUNT_MALLOC(pCacheBlockBuf,char*,CACHE_BLOCK_SIZE*sizeof(char))
+  memset(pCacheFileBlockCrcs,0,CrcsSize);
+  memset(pCacheFileBlockVerified,
+         CACHE_BLOCK_UNVERIFIED,
+         BlockCount*sizeof(uint8_t));
+
+  if(XMountConfData.CacheFormat==TCacheFormat_QCOW2) {
+    // QEMU may change blocks of QCOW2 cache files without updating any
+    // checksums. Their blocks are therefore never checked.
+    memset(pCacheFileBlockVerified,
+           CACHE_BLOCK_VERIFIED,
+           BlockCount*sizeof(uint8_t));
+    return TRUE;
+  }
+
+  if(pCacheFileHeader->BlockCrcsPresent==TRUE) {
+    // Load checksums
+    if(pCacheFileHeader->pBlockCrcs+CrcsSize>CacheFileSize ||
+       fseeko(hCacheFile,pCacheFileHeader->pBlockCrcs,SEEK_SET)!=0 ||
+       fread(pCacheFileBlockCrcs,CrcsSize,1,hCacheFile)!=1)
+    {
+      LOG_ERROR("Cache file corrupt!\n")
+      return FALSE;
+    }
+    if(pCacheFileHeader->CacheFileDirty==TRUE) return RepairCacheFileCrcs();
+    return TRUE;
+  }
+
+  // Calculate checksums of already assigned blocks
+  LOG_DEBUG("Cache file has no block checksums. Calculating them\n")
+  for(i=0;i<BlockCount;i++) {
+    if(pCacheFileBlockIndex[i].Assigned!=TRUE) continue;
+    if(fseeko(hCacheFile,pCacheFileBlockIndex[i].off_data,SEEK_SET)!=0 ||
+       fread(pCacheBlockBuf,CACHE_BLOCK_SIZE,1,hCacheFile)!=1)
+    {
+      LOG_ERROR("Couldn't read cache block %" PRIu64 " from cache file!\n",i)
+      return FALSE;
+    }
+    pCacheFileBlockCrcs[i]=Crc32c(0,pCacheBlockBuf,CACHE_BLOCK_SIZE);
+  }
+
+  // Append checksums to cache file and update header
+  pCacheFileHeader->BlockCrcsPresent=TRUE;
+  pCacheFileHeader->pBlockCrcs=CacheFileSize;
+  if(fseeko(hCacheFile,CacheFileSize,SEEK_SET)!=0 ||
+     fwrite(pCacheFileBlockCrcs,CrcsSize,1,hCacheFile)!=1 ||
+     !WriteCacheFileHeader())
+  {
+    LOG_ERROR("Couldn't write cache block checksums to cache file!\n")
+    return FALSE;
+  }
+  fflush(hCacheFile);
+  return TRUE;
+}
+
+/*
+ * WriteQcow2CacheHeader:
+ *   Write QCOW2 header, header extensions and backing file name to the first
+ *   cluster of a QCOW2 cache file
+ *
+ * Params:
+ *   ImageSize: Size of input image
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int WriteQcow2CacheHeader(uint64_t ImageSize) {
+  TQcow2Header header;
+  TQcow2HeaderExtension ext;
+  uint64_t off;
+  char fmt[8]="raw";
+
+  // Layout: Header, xmount extension, backing format extension, end of
+  // extensions, backing file name
+  off=sizeof(TQcow2Header)+
+    (3*sizeof(TQcow2HeaderExtension))+sizeof(uint64_t)+sizeof(fmt);
+  if(off+strlen(pQcow2CacheBackingFile)>QCOW2_CACHE_CLUSTER_SIZE) {
+    LOG_ERROR("Backing file name is too long!\n")
+    return FALSE;
+  }
+
+  memset(&header,0,sizeof(TQcow2Header));
+  header.magic=htobe32(QCOW2_MAGIC);
+  header.version=htobe32(QCOW2_VERSION);
+  header.backing_file_offset=htobe64(off);
+  header.backing_file_size=htobe32(strlen(pQcow2CacheBackingFile));
+  header.cluster_bits=htobe32(QCOW2_CACHE_CLUSTER_BITS);
+  header.size=htobe64(ImageSize);
+  header.crypt_method=htobe32(0);
+  header.l1_size=htobe32(Qcow2CacheL1Size);
+  header.l1_table_offset=htobe64(Qcow2CacheL1Off);
+  header.refcount_table_offset=htobe64(Qcow2CacheRefTableOff);
+  header.refcount_table_clusters=htobe32(1);
+  header.nb_snapshots=htobe32(0);
+  header.snapshots_offset=htobe64(0);
+  if(fseeko(hCacheFile,0,SEEK_SET)!=0 ||
+     fwrite(&header,sizeof(TQcow2Header),1,hCacheFile)!=1)
+  {
+    LOG_ERROR("Couldn't write QCOW2 header to cache file!\n")
+    return FALSE;
+  }
+
+  // Unknown extensions are ignored by QEMU
+  ext.type=htobe32(QCOW2_EXT_XMOUNT);
+  ext.length=htobe32(sizeof(uint64_t));
+  off=htobe64(CacheFileHeaderOff);
+  if(fwrite(&ext,sizeof(TQcow2HeaderExtension),1,hCacheFile)!=1 ||
+     fwrite(&off,sizeof(uint64_t),1,hCacheFile)!=1)
+  {
+    LOG_ERROR("Couldn't write QCOW2 header extension to cache file!\n")
+    return FALSE;
+  }
+  // Tell QEMU not to probe the backing file
+  ext.type=htobe32(QCOW2_EXT_BACKING_FORMAT);
+  ext.length=htobe32(strlen(fmt));
+  if(fwrite(&ext,sizeof(TQcow2HeaderExtension),1,hCacheFile)!=1 ||
+     fwrite(fmt,sizeof(fmt),1,hCacheFile)!=1)
+  {
+    LOG_ERROR("Couldn't write QCOW2 header extension to cache file!\n")
+    return FALSE;
+  }
+  ext.type=htobe32(QCOW2_EXT_END);
+  ext.length=0;
+  if(fwrite(&ext,sizeof(TQcow2HeaderExtension),1,hCacheFile)!=1 ||
+     fwrite(pQcow2CacheBackingFile,
+            strlen(pQcow2CacheBackingFile),
+            1,
+            hCacheFile)!=1)
+  {
+    LOG_ERROR("Couldn't write backing file name to cache file!\n")
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/*
+ * InitQcow2CacheFile:
+ *   Create / load a QCOW2 cache file. The block index is built from the L2
+ *   tables, so blocks written by QEMU are picked up as well.
+ *
+ * Params:
+ *   BlockCount: Amount of cache blocks
+ *   CacheFileSize: Current size of cache file
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitQcow2CacheFile(uint64_t BlockCount, uint64_t CacheFileSize) {
+  TQcow2Header header;
+  TQcow2HeaderExtension ext;
+  uint64_t ImageSize;
+  uint64_t ExtOff;
+  uint64_t *pL2;
+  uint64_t entry;
+  uint64_t block;
+  uint64_t i,j;
+
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return FALSE;
+  }
+
+  // The block index is only kept in memory
+  XMOUNT_MALLOC(pCacheFileHeader,
+                pTCacheFileHeader,
+                sizeof(TCacheFileHeader)+
+                  (BlockCount*sizeof(TCacheFileBlockIndex)))
+  memset(pCacheFileHeader,
+         0,
+         sizeof(TCacheFileHeader)+(BlockCount*sizeof(TCacheFileBlockIndex)));
+  pCacheFileBlockIndex=(pTCacheFileBlockIndex)((void*)pCacheFileHeader+
+                       sizeof(TCacheFileHeader));
+  XMOUNT_MALLOC(pQcow2CacheRefTable,uint64_t*,QCOW2_CACHE_CLUSTER_SIZE)
+  memset(pQcow2CacheRefTable,0,QCOW2_CACHE_CLUSTER_SIZE);
+
+  if(CacheFileSize==0) {
+    // New cache file. Layout: QCOW2 header, xmount cache file header,
+    // refcount table, first refcount block, L1 table and L2 tables.
+    LOG_DEBUG("Cache file is empty. Generating new QCOW2 cache file\n")
+    Qcow2CacheL1Size=(BlockCount+QCOW2_CACHE_L2_ENTRIES-1)/
+      QCOW2_CACHE_L2_ENTRIES;
+    if(Qcow2CacheL1Size==0) Qcow2CacheL1Size=1;
+    if(Qcow2CacheL1Size>QCOW2_CACHE_L2_ENTRIES) {
+      LOG_ERROR("Input image is too big for a QCOW2 cache file!\n")
+      return FALSE;
+    }
+    CacheFileHeaderOff=QCOW2_CACHE_CLUSTER_SIZE;
+    Qcow2CacheRefTableOff=2*QCOW2_CACHE_CLUSTER_SIZE;
+    pQcow2CacheRefTable[0]=3*QCOW2_CACHE_CLUSTER_SIZE;
+    Qcow2CacheRefBlocks=1;
+    Qcow2CacheL1Off=4*QCOW2_CACHE_CLUSTER_SIZE;
+    Qcow2CacheClusters=5+Qcow2CacheL1Size;
+    XMOUNT_MALLOC(pQcow2CacheL1,uint64_t*,Qcow2CacheL1Size*sizeof(uint64_t))
+    XMOUNT_MALLOC(pL2,uint64_t*,QCOW2_CACHE_CLUSTER_SIZE)
+    for(i=0;i<Qcow2CacheL1Size;i++) {
+      pQcow2CacheL1[i]=(5+i)*QCOW2_CACHE_CLUSTER_SIZE;
+      pL2[i]=htobe64(pQcow2CacheL1[i] | QCOW2_OFLAG_COPIED);
+    }
+
+    // Unused parts of tables must be zero
+    if(ftruncate(fileno(hCacheFile),
+                 Qcow2CacheClusters*QCOW2_CACHE_CLUSTER_SIZE)!=0 ||
+       fseeko(hCacheFile,Qcow2CacheL1Off,SEEK_SET)!=0 ||
+       fwrite(pL2,Qcow2CacheL1Size*sizeof(uint64_t),1,hCacheFile)!=1)
+    {
+      LOG_ERROR("Couldn't write L1 table to cache file!\n")
+      free(pL2);
+      return FALSE;
+    }
+    entry=htobe64(pQcow2CacheRefTable[0]);
+    if(fseeko(hCacheFile,Qcow2CacheRefTableOff,SEEK_SET)!=0 ||
+       fwrite(&entry,sizeof(uint64_t),1,hCacheFile)!=1)
+    {
+      LOG_ERROR("Couldn't write refcount table to cache file!\n")
+      free(pL2);
+      return FALSE;
+    }
+    free(pL2);
+    for(i=0;i<Qcow2CacheClusters;i++) {
+      if(!SetQcow2CacheRefcount(i)) return FALSE;
+    }
+
+    pCacheFileHeader->FileSignature=CACHE_FILE_SIGNATURE;
+    pCacheFileHeader->CacheFileVersion=CUR_CACHE_FILE_VERSION;
+    pCacheFileHeader->BlockSize=CACHE_BLOCK_SIZE;
+    pCacheFileHeader->BlockCount=BlockCount;
+    // Block index isn't stored in the xmount header
+    pCacheFileHeader->pBlockIndex=0;
+    if(!WriteCacheFileHeader()) return FALSE;
+    return WriteQcow2CacheHeader(ImageSize);
+  }
+
+  // Existing cache file, check QCOW2 header
+  LOG_DEBUG("Cache file not empty. Parsing QCOW2 header\n")
+  if(fseeko(hCacheFile,0,SEEK_SET)!=0 ||
+     fread(&header,sizeof(TQcow2Header),1,hCacheFile)!=1 ||
+     be32toh(header.magic)!=QCOW2_MAGIC)
+  {
+    LOG_ERROR("Not a QCOW2 cache file!\n")
+    return FALSE;
+  }
+  if(!LockQcow2CacheByte(QCOW2_LOCK_PERM_WRITE,TRUE)) {
+    LOG_ERROR("QCOW2 cache file is in use by QEMU!\n")
+    return FALSE;
+  }
+  if(be32toh(header.version)!=QCOW2_VERSION ||
+     be32toh(header.cluster_bits)!=QCOW2_CACHE_CLUSTER_BITS ||
+     be32toh(header.crypt_method)!=0 ||
+     be32toh(header.refcount_table_clusters)!=1)
+  {
+    LOG_ERROR("Unsupported QCOW2 cache file!\n")
+    return FALSE;
+  }
+  if(be32toh(header.nb_snapshots)!=0) {
+    LOG_ERROR("QCOW2 cache files containing snapshots aren't supported!\n")
+    return FALSE;
+  }
+  if(be64toh(header.size)!=ImageSize) {
+    LOG_ERROR("QCOW2 cache file doesn't match input image size!\n")
+    return FALSE;
+  }
+
+  // Look for xmount header extension
+  ExtOff=sizeof(TQcow2Header);
+  CacheFileHeaderOff=0;
+  while(ExtOff+sizeof(TQcow2HeaderExtension)<=QCOW2_CACHE_CLUSTER_SIZE) {
+    if(fseeko(hCacheFile,ExtOff,SEEK_SET)!=0 ||
+       fread(&ext,sizeof(TQcow2HeaderExtension),1,hCacheFile)!=1 ||
+       be32toh(ext.type)==QCOW2_EXT_END)
+    {
+      break;
+    }
+    if(be32toh(ext.type)==QCOW2_EXT_XMOUNT &&
+       be32toh(ext.length)==sizeof(uint64_t))
+    {
+      if(fread(&entry,sizeof(uint64_t),1,hCacheFile)==1) {
+        CacheFileHeaderOff=be64toh(entry);
+      }
+      break;
+    }
+    ExtOff+=sizeof(TQcow2HeaderExtension)+((be32toh(ext.length)+7) & ~7);
+  }
+  if(CacheFileHeaderOff==0 ||
+     fseeko(hCacheFile,CacheFileHeaderOff,SEEK_SET)!=0 ||
+     fread(pCacheFileHeader,sizeof(TCacheFileHeader),1,hCacheFile)!=1 ||
+     pCacheFileHeader->FileSignature!=CACHE_FILE_SIGNATURE)
+  {
+    LOG_ERROR("QCOW2 image isn't an xmount cache file!\n")
+    return FALSE;
+  }
+  if(pCacheFileHeader->BlockSize!=CACHE_BLOCK_SIZE ||
+     pCacheFileHeader->BlockCount!=BlockCount)
+  {
+    LOG_ERROR("Cache file does not match input image!\n")
+    return FALSE;
+  }
+
+  // Load refcount table
+  Qcow2CacheRefTableOff=be64toh(header.refcount_table_offset);
+  if(fseeko(hCacheFile,Qcow2CacheRefTableOff,SEEK_SET)!=0 ||
+     fread(pQcow2CacheRefTable,QCOW2_CACHE_CLUSTER_SIZE,1,hCacheFile)!=1)
+  {
+    LOG_ERROR("Couldn't read refcount table from cache file!\n")
+    return FALSE;
+  }
+  for(i=0;i<QCOW2_CACHE_REFTABLE_ENTRIES;i++) {
+    pQcow2CacheRefTable[i]=be64toh(pQcow2CacheRefTable[i]) &
+      QCOW2_OFFSET_MASK;
+    if(pQcow2CacheRefTable[i]==0) break;
+  }
+  Qcow2CacheRefBlocks=i;
+
+  // Load L1 table and build block index from L2 tables
+  Qcow2CacheL1Size=be32toh(header.l1_size);
+  Qcow2CacheL1Off=be64toh(header.l1_table_offset);
+  if((uint64_t)Qcow2CacheL1Size*QCOW2_CACHE_L2_ENTRIES<BlockCount) {
+    LOG_ERROR("L1 table of cache file is too small!\n")
+    return FALSE;
+  }
+  XMOUNT_MALLOC(pQcow2CacheL1,uint64_t*,Qcow2CacheL1Size*sizeof(uint64_t))
+  if(fseeko(hCacheFile,Qcow2CacheL1Off,SEEK_SET)!=0 ||
+     fread(pQcow2CacheL1,
+           Qcow2CacheL1Size*sizeof(uint64_t),
+           1,
+           hCacheFile)!=1)
+  {
+    LOG_ERROR("Couldn't read L1 table from cache file!\n")
+    return FALSE;
+  }
+  XMOUNT_MALLOC(pL2,uint64_t*,QCOW2_CACHE_CLUSTER_SIZE)
+  for(i=0;i<Qcow2CacheL1Size;i++) {
+    pQcow2CacheL1[i]=be64toh(pQcow2CacheL1[i]) & QCOW2_OFFSET_MASK;
+    if(pQcow2CacheL1[i]==0 || i*QCOW2_CACHE_L2_ENTRIES>=BlockCount) continue;
+    if(fseeko(hCacheFile,pQcow2CacheL1[i],SEEK_SET)!=0 ||
+       fread(pL2,QCOW2_CACHE_CLUSTER_SIZE,1,hCacheFile)!=1)
+    {
+      LOG_ERROR("Couldn't read L2 table from cache file!\n")
+      free(pL2);
+      return FALSE;
+    }
+    for(j=0;j<QCOW2_CACHE_L2_ENTRIES;j++) {
+      block=(i*QCOW2_CACHE_L2_ENTRIES)+j;
+      if(block>=BlockCount) break;
+      entry=be64toh(pL2[j]);
+      if((entry & QCOW2_OFLAG_COMPRESSED)!=0) {
+        LOG_ERROR("Compressed clusters in cache file aren't supported!\n")
+        free(pL2);
+        return FALSE;
+      }
+      if((entry & QCOW2_OFFSET_MASK)==0) continue;
+      pCacheFileBlockIndex[block].Assigned=TRUE;
+      pCacheFileBlockIndex[block].off_data=entry & QCOW2_OFFSET_MASK;
+    }
+  }
+  free(pL2);
+
+  // New clusters are appended to the end of the file
+  Qcow2CacheClusters=(CacheFileSize+QCOW2_CACHE_CLUSTER_SIZE-1)/
+    QCOW2_CACHE_CLUSTER_SIZE;
+
+  // Mountpoint might have changed, update backing file name
+  return WriteQcow2CacheHeader(ImageSize);
+}
+
+/*
+ * CheckCacheFileLayout:
+ *   Make sure emulated images keep the layout cached header data was written
+ *   for. The data area alignment is stored in the cache file header and can't
+ *   be changed afterwards. VDI headers cached as a whole by older versions
+ *   are only valid for the unaligned layout of these versions.
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int CheckCacheFileLayout() {
+  if(pCacheFileHeader->DataAlignment==0) {
+    // New cache file or one written by an older version
+    pCacheFileHeader->DataAlignment=XMountConfData.Alignment;
+    if(!WriteCacheFileHeader()) return FALSE;
+  } else if(pCacheFileHeader->DataAlignment!=XMountConfData.Alignment) {
+    LOG_ERROR("Cache file was created using \"--align %" PRIu64 "\"!\n",
+              pCacheFileHeader->DataAlignment/1024)
+    return FALSE;
+  }
+  if(pCacheFileHeader->VdiFileHeaderCached==TRUE && pVdiFileHeader!=NULL) {
+    VdiFileHeaderSize=sizeof(TVdiFileHeader)+VdiBlockMapSize;
+    pVdiFileHeader->offData=VdiFileHeaderSize;
+    LOG_DEBUG("Using unaligned VDI layout of cached VDI header\n")
+  }
+  return TRUE;
+}
+
+/*
+ * InitCacheFile:
+ *   Create / load cache file to enable virtual write support
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitCacheFile() {
+  uint64_t ImageSize=0;
+  uint64_t BlockIndexSize=0;
+  uint64_t CacheFileHeaderSize=0;
+  uint64_t CacheFileSize=0;
+  uint32_t NeededBlocks=0;
+  uint64_t buf;
+
+  if(!XMountConfData.OverwriteCache) {
+    // Try to open an existing cache file or create a new one
+    hCacheFile=(FILE*)FOPEN(XMountConfData.pCacheFile,"rb+");
+    if(hCacheFile==NULL) {
+      // As the c lib seems to have no possibility to open a file rw wether it
+      // exists or not (w+ does not work because it truncates an existing file),
+      // when r+ returns NULL the file could simply not exist
+      LOG_DEBUG("Cache file does not exist. Creating new one\n")
+      hCacheFile=(FILE*)FOPEN(XMountConfData.pCacheFile,"wb+");
+      if(hCacheFile==NULL) {
+        // There is really a problem opening the file
+        LOG_ERROR("Couldn't open cache file \"%s\"!\n",
+                  XMountConfData.pCacheFile)
+        return FALSE;
+      }
+    }
+  } else {
+    // Overwrite existing cache file or create a new one
+    hCacheFile=(FILE*)FOPEN(XMountConfData.pCacheFile,"wb+");
+    if(hCacheFile==NULL) {
+      LOG_ERROR("Couldn't open cache file \"%s\"!\n",
+                XMountConfData.pCacheFile)
+      return FALSE;
+    }
+  }
+
+  // Get input image size
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return FALSE;
+  }
+
+  // Calculate how many blocks are needed and how big the buffers must be
+  // for the actual cache file version
+  NeededBlocks=ImageSize/CACHE_BLOCK_SIZE;
+  if((ImageSize%CACHE_BLOCK_SIZE)!=0) NeededBlocks++;
+  BlockIndexSize=NeededBlocks*sizeof(TCacheFileBlockIndex);
+  CacheFileHeaderSize=sizeof(TCacheFileHeader)+BlockIndexSize;
+  LOG_DEBUG("Cache blocks: %u (%04X) entries, %zd (%08zX) bytes\n",
+            NeededBlocks,
+            NeededBlocks,
+            BlockIndexSize,
+            BlockIndexSize)
+
+  // Get cache file size
+  // fseeko64 had massive problems!
+  if(fseeko(hCacheFile,0,SEEK_END)!=0) {
+    LOG_ERROR("Couldn't seek to end of cache file!\n")
+    return FALSE;
+  }
+  // Same here, ftello64 didn't work at all and returned 0 all the times
+  CacheFileSize=ftello(hCacheFile);
+  LOG_DEBUG("Cache file has %zd bytes\n",CacheFileSize)
+
+  if(XMountConfData.CacheFormat==TCacheFormat_QCOW2) {
+    // QCOW2 cache files keep their block index in L2 tables
+    if(!InitQcow2CacheFile(NeededBlocks,CacheFileSize)) return FALSE;
+  } else if(CacheFileSize>0) {
+    // Cache file isn't empty, parse block header
+    LOG_DEBUG("Cache file not empty. Parsing block header\n")
+    if(fseeko(hCacheFile,0,SEEK_SET)!=0) {
+      LOG_ERROR("Couldn't seek to beginning of cache file!\n")
+      return FALSE;
+    }
+    // Read and check file signature
+    if(fread(&buf,8,1,hCacheFile)!=1 || buf!=CACHE_FILE_SIGNATURE) {
+      free(pCacheFileHeader);
+      LOG_ERROR("Not an xmount cache file or cache file corrupt!\n")
+      return FALSE;
+    }
+    // Now get cache file version (Has only 32bit!)
+    if(fread(&buf,4,1,hCacheFile)!=1) {
+      free(pCacheFileHeader);
+      LOG_ERROR("Not an xmount cache file or cache file corrupt!\n")
+      return FALSE;
+    }
+    switch((uint32_t)buf) {
+      case 0x00000001:
+        // Old v1 cache file.
+        LOG_ERROR("Unsupported cache file version!\n")
+        LOG_ERROR("Please use xmount-tool to upgrade your cache file.\n")
+        return FALSE;
+      case 0x00000002:
+      case CUR_CACHE_FILE_VERSION:
+        // v2 and current version share the same header layout
+        if(fseeko(hCacheFile,0,SEEK_SET)!=0) {
+          LOG_ERROR("Couldn't seek to beginning of cache file!\n")
+          return FALSE;
+        }
+        // Alloc memory for header and block index
+        XMOUNT_MALLOC(pCacheFileHeader,pTCacheFileHeader,CacheFileHeaderSize)
+        memset(pCacheFileHeader,0,CacheFileHeaderSize);
+        // Read header and block index from file
+        if(fread(pCacheFileHeader,CacheFileHeaderSize,1,hCacheFile)!=1) {
+          // Cache file isn't big enough
+          free(pCacheFileHeader);
+          LOG_ERROR("Cache file corrupt!\n")
+          return FALSE;
         }
-        LOG_DEBUG("Prepended changed data with %" PRIu64
-                  " bytes from virtual image file at offset %" PRIu64
-                  "\n",BlockOff,FileOff-BlockOff)
-        free(buf2);
-      }
-      if(fwrite(WriteBuf,CurToWrite,1,hCacheFile)!=1) {
-        LOG_ERROR("Error while writing %zd bytes "
-                  "to cache file at offset %" PRIu64 "!\n",
-                  CurToWrite,
-                  pCacheFileBlockIndex[CurBlock].off_data+BlockOff);
-        return -1;
+        if(pCacheFileHeader->CacheFileVersion==0x00000002) {
+          // Upgrade v2 cache file. Versions only knowing v2 change blocks
+          // without updating their checksums, so existing ones can't be
+          // trusted and are calculated again (See InitCacheFileCrcs). The
+          // header is written back with the new version afterwards, which
+          // prevents older versions from opening the cache file again.
+          LOG_DEBUG("Upgrading v2 cache file to v%u\n",CUR_CACHE_FILE_VERSION)
+          pCacheFileHeader->CacheFileVersion=CUR_CACHE_FILE_VERSION;
+          pCacheFileHeader->BlockCrcsPresent=FALSE;
+          pCacheFileHeader->pBlockCrcs=0;
+        }
+        break;
+      default:
+        LOG_ERROR("Unknown cache file version!\n")
+        return FALSE;
+    }
+    // Check if cache file has same block size as we do
+    if(pCacheFileHeader->BlockSize!=CACHE_BLOCK_SIZE) {
+      LOG_ERROR("Cache file does not use default cache block size!\n")
+      return FALSE;
+    }
+    // Set pointer to block index
+    pCacheFileBlockIndex=(pTCacheFileBlockIndex)((void*)pCacheFileHeader+
+                          pCacheFileHeader->pBlockIndex);
+  } else {
+    // New cache file, generate a new block header
+    LOG_DEBUG("Cache file is empty. Generating new block header\n");
+    // Alloc memory for header and block index
+    XMOUNT_MALLOC(pCacheFileHeader,pTCacheFileHeader,CacheFileHeaderSize)
+    memset(pCacheFileHeader,0,CacheFileHeaderSize);
+    pCacheFileHeader->FileSignature=CACHE_FILE_SIGNATURE;
+    pCacheFileHeader->CacheFileVersion=CUR_CACHE_FILE_VERSION;
+    pCacheFileHeader->BlockSize=CACHE_BLOCK_SIZE;
+    pCacheFileHeader->BlockCount=NeededBlocks;
+    //pCacheFileHeader->UsedBlocks=0;
+    // The following pointer is only usuable when reading data from cache file
+    pCacheFileHeader->pBlockIndex=sizeof(TCacheFileHeader);
+    pCacheFileBlockIndex=(pTCacheFileBlockIndex)((void*)pCacheFileHeader+
+                         sizeof(TCacheFileHeader));
+    pCacheFileHeader->VdiFileHeaderCached=FALSE;
+    pCacheFileHeader->pVdiFileHeader=0;
+    pCacheFileHeader->VmdkFileCached=FALSE;
+    pCacheFileHeader->VmdkFileSize=0;
+    pCacheFileHeader->pVmdkFile=0;
+    pCacheFileHeader->VhdFileHeaderCached=FALSE;
+    pCacheFileHeader->pVhdFileHeader=0;
+    // Write header to file
+    if(fwrite(pCacheFileHeader,CacheFileHeaderSize,1,hCacheFile)!=1) {
+      free(pCacheFileHeader);
+      LOG_ERROR("Couldn't write cache file header to file!\n");
+      return FALSE;
+    }
+  }
+
+  // Load or generate cache block checksums
+  if(fseeko(hCacheFile,0,SEEK_END)!=0) {
+    LOG_ERROR("Couldn't seek to end of cache file!\n")
+    return FALSE;
+  }
+  if(!InitCacheFileCrcs(ftello(hCacheFile))) return FALSE;
+
+  // Load header page index
+  if(pCacheFileHeader->HeaderPageCount!=0) {
+    XMOUNT_MALLOC(pCacheFileHeaderPages,
+                  pTCacheFileHeaderPage,
+                  pCacheFileHeader->HeaderPageCount*
+                    sizeof(TCacheFileHeaderPage))
+    if(fseeko(hCacheFile,pCacheFileHeader->pHeaderPageIndex,SEEK_SET)!=0 ||
+       fread(pCacheFileHeaderPages,
+             pCacheFileHeader->HeaderPageCount*sizeof(TCacheFileHeaderPage),
+             1,
+             hCacheFile)!=1)
+    {
+      LOG_ERROR("Couldn't read header page index from cache file!\n")
+      return FALSE;
+    }
+  }
+  LOG_DEBUG("Using %s CRC32C implementation\n",
+            Crc32cIsHwAccelerated() ? "SSE4.2" : "slicing-by-8")
+
+  return CheckCacheFileLayout();
+}
+
+/*
+ * InitReadCacheFile:
+ *   Create / load read cache file holding decoded input image blocks
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitReadCacheFile() {
+  uint64_t ImageSize=0;
+  uint64_t ImageBlocks=0;
+  uint64_t SlotCount=0;
+  uint64_t SlotIndexSize=0;
+  uint64_t ReadCacheFileSize=0;
+  uint64_t i;
+  int ReuseReadCache=FALSE;
+
+  // Get input image size
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return FALSE;
+  }
+
+  // Calculate amount of slots. There is no need to have more slots than the
+  // input image has blocks.
+  ImageBlocks=ImageSize/CACHE_BLOCK_SIZE;
+  if((ImageSize%CACHE_BLOCK_SIZE)!=0) ImageBlocks++;
+  if(XMountConfData.ReadCacheSize==0) {
+    XMountConfData.ReadCacheSize=READ_CACHE_DEFAULT_SIZE;
+  }
+  SlotCount=(XMountConfData.ReadCacheSize*1024*1024)/CACHE_BLOCK_SIZE;
+  if(SlotCount>ImageBlocks) SlotCount=ImageBlocks;
+  if(SlotCount==0) SlotCount=1;
+  if(SlotCount>=READ_CACHE_NO_SLOT) SlotCount=READ_CACHE_NO_SLOT-1;
+  SlotIndexSize=SlotCount*sizeof(TReadCacheFileSlot);
+
+  // Open an existing read cache file or create a new one
+  hReadCacheFile=(FILE*)FOPEN(XMountConfData.pReadCacheFile,"rb+");
+  if(hReadCacheFile==NULL) {
+    LOG_DEBUG("Read cache file does not exist. Creating new one\n")
+    hReadCacheFile=(FILE*)FOPEN(XMountConfData.pReadCacheFile,"wb+");
+    if(hReadCacheFile==NULL) {
+      LOG_ERROR("Couldn't open read cache file \"%s\"!\n",
+                XMountConfData.pReadCacheFile)
+      return FALSE;
+    }
+  }
+
+  // Get read cache file size
+  if(fseeko(hReadCacheFile,0,SEEK_END)!=0) {
+    LOG_ERROR("Couldn't seek to end of read cache file!\n")
+    return FALSE;
+  }
+  ReadCacheFileSize=ftello(hReadCacheFile);
+
+  XMOUNT_MALLOC(pReadCacheFileHeader,
+                pTReadCacheFileHeader,
+                sizeof(TReadCacheFileHeader))
+  memset(pReadCacheFileHeader,0,sizeof(TReadCacheFileHeader));
+
+  if(ReadCacheFileSize>0) {
+    // Read cache file isn't empty, parse and check header
+    LOG_DEBUG("Read cache file not empty. Parsing header\n")
+    if(fseeko(hReadCacheFile,0,SEEK_SET)!=0 ||
+       fread(pReadCacheFileHeader,
+             sizeof(TReadCacheFileHeader),
+             1,
+             hReadCacheFile)!=1 ||
+       pReadCacheFileHeader->FileSignature!=READ_CACHE_FILE_SIGNATURE)
+    {
+      // Never touch files that aren't read cache files
+      LOG_ERROR("Not an xmount read cache file or read cache file corrupt!\n")
+      return FALSE;
+    }
+    if(pReadCacheFileHeader->ReadCacheFileVersion!=
+         CUR_READ_CACHE_FILE_VERSION ||
+       pReadCacheFileHeader->BlockSize!=CACHE_BLOCK_SIZE)
+    {
+      LOG_WARNING("Unsupported read cache file version or block size. "
+                  "Discarding read cache content.\n")
+    } else if(pReadCacheFileHeader->InputHashLo!=XMountConfData.InputHashLo ||
+              pReadCacheFileHeader->InputHashHi!=XMountConfData.InputHashHi ||
+              pReadCacheFileHeader->InputImageSize!=ImageSize)
+    {
+      LOG_WARNING("Read cache file belongs to another input image. "
+                  "Discarding read cache content.\n")
+    } else if(pReadCacheFileHeader->SlotCount!=SlotCount) {
+      LOG_WARNING("Read cache file has a different size. "
+                  "Discarding read cache content.\n")
+    } else ReuseReadCache=TRUE;
+  }
+
+  // Alloc memory for slot index and hash table
+  for(i=1;i<SlotCount;i<<=1);
+  ReadCacheHashMask=i-1;
+  XMOUNT_MALLOC(pReadCacheFileSlots,pTReadCacheFileSlot,SlotIndexSize)
+  XMOUNT_MALLOC(pReadCacheSlotRef,uint8_t*,SlotCount*sizeof(uint8_t))
+  XMOUNT_MALLOC(pReadCacheHashNext,uint32_t*,SlotCount*sizeof(uint32_t))
+  XMOUNT_MALLOC(pReadCacheHashHead,uint32_t*,(i)*sizeof(uint32_t))
+  XMOUNT_MALLOC(pReadCacheBlockBuf,char*,CACHE_BLOCK_SIZE*sizeof(char))
+  memset(pReadCacheSlotRef,0,SlotCount*sizeof(uint8_t));
+  memset(pReadCacheHashNext,0xFF,SlotCount*sizeof(uint32_t));
+  memset(pReadCacheHashHead,0xFF,(i)*sizeof(uint32_t));
+
+  if(ReuseReadCache) {
+    // Load slot index and rebuild hash table
+    if(fseeko(hReadCacheFile,pReadCacheFileHeader->pSlotIndex,SEEK_SET)!=0 ||
+       fread(pReadCacheFileSlots,SlotIndexSize,1,hReadCacheFile)!=1)
+    {
+      LOG_ERROR("Read cache file corrupt!\n")
+      return FALSE;
+    }
+    for(i=0;i<SlotCount;i++) {
+      if(pReadCacheFileSlots[i].Block==READ_CACHE_SLOT_FREE) continue;
+      if(pReadCacheFileSlots[i].Block>=ImageBlocks) {
+        // Invalid entry, simply drop it
+        pReadCacheFileSlots[i].Block=READ_CACHE_SLOT_FREE;
+        continue;
       }
-      if(BlockOff+CurToWrite!=CACHE_BLOCK_SIZE) {
-        // Changed data does not end at block boundry. Need to append
-        // with data from virtual image file
-        XMOUNT_MALLOC(buf2,char*,(CACHE_BLOCK_SIZE-
-                                 (BlockOff+CurToWrite))*sizeof(char))
-        memset(buf2,0,CACHE_BLOCK_SIZE-(BlockOff+CurToWrite));
-        if((FileOff-BlockOff)+CACHE_BLOCK_SIZE>OrigImageSize) {
-          // Original image is smaller than full cache block
-          if(GetOrigImageData(buf2,
-               FileOff+CurToWrite,
-               OrigImageSize-(FileOff+CurToWrite))!=
-             OrigImageSize-(FileOff+CurToWrite))
-          {
-            LOG_ERROR("Couldn't read data from virtual image file!\n")
-            return -1;
-          }
-        } else {
-          if(GetOrigImageData(buf2,
-               FileOff+CurToWrite,
-               CACHE_BLOCK_SIZE-(BlockOff+CurToWrite))!=
-             CACHE_BLOCK_SIZE-(BlockOff+CurToWrite))
-          {
-            LOG_ERROR("Couldn't read data from virtual image file!\n")
-            return -1;
-          }
-        }
-        if(fwrite(buf2,
-                  CACHE_BLOCK_SIZE-(BlockOff+CurToWrite),
-                  1,
-                  hCacheFile)!=1)
-        {
-          LOG_ERROR("Error while writing %zd bytes "
-                    "to cache file at offset %" PRIu64 "!\n",
-                    CACHE_BLOCK_SIZE-(BlockOff+CurToWrite),
-                    pCacheFileBlockIndex[CurBlock].off_data+
-                      BlockOff+CurToWrite);
-          return -1;
-        }
-        free(buf2);
+      ReadCacheLinkSlot(i);
+    }
+    LOG_DEBUG("Read cache file loaded successfully\n")
+  } else {
+    // Generate a new header and slot index
+    LOG_DEBUG("Generating new read cache header with %" PRIu64 " slots\n",
+              SlotCount)
+    if(ftruncate(fileno(hReadCacheFile),0)!=0) {
+      LOG_ERROR("Couldn't truncate read cache file!\n")
+      return FALSE;
+    }
+    memset(pReadCacheFileHeader,0,sizeof(TReadCacheFileHeader));
+    pReadCacheFileHeader->FileSignature=READ_CACHE_FILE_SIGNATURE;
+    pReadCacheFileHeader->ReadCacheFileVersion=CUR_READ_CACHE_FILE_VERSION;
+    pReadCacheFileHeader->BlockSize=CACHE_BLOCK_SIZE;
+    pReadCacheFileHeader->SlotCount=SlotCount;
+    pReadCacheFileHeader->InputHashLo=XMountConfData.InputHashLo;
+    pReadCacheFileHeader->InputHashHi=XMountConfData.InputHashHi;
+    pReadCacheFileHeader->InputImageSize=ImageSize;
+    pReadCacheFileHeader->pSlotIndex=sizeof(TReadCacheFileHeader);
+    // Let slot data begin at a block boundary
+    pReadCacheFileHeader->pSlotData=sizeof(TReadCacheFileHeader)+SlotIndexSize;
+    if((pReadCacheFileHeader->pSlotData%CACHE_BLOCK_SIZE)!=0) {
+      pReadCacheFileHeader->pSlotData+=CACHE_BLOCK_SIZE-
+        (pReadCacheFileHeader->pSlotData%CACHE_BLOCK_SIZE);
+    }
+    memset(pReadCacheFileSlots,0xFF,SlotIndexSize);
+    if(fseeko(hReadCacheFile,0,SEEK_SET)!=0 ||
+       fwrite(pReadCacheFileHeader,
+              sizeof(TReadCacheFileHeader),
+              1,
+              hReadCacheFile)!=1 ||
+       fwrite(pReadCacheFileSlots,SlotIndexSize,1,hReadCacheFile)!=1)
+    {
+      LOG_ERROR("Couldn't write read cache file header to file!\n")
+      return FALSE;
+    }
+    fflush(hReadCacheFile);
+  }
+  ReadCacheClockHand=0;
+
+  return TRUE;
+}
+
+/*
+ * InitMemCache:
+ *   Allocate memory cache entries and access counters
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitMemCache() {
+  uint64_t ImageSize=0;
+  uint64_t ImageBlocks=0;
+  uint64_t EntryCount=0;
+  uint64_t HashSize=1;
+  uint64_t i;
+
+  // Get input image size
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return FALSE;
+  }
+
+  // Calculate amount of entries. There is no need to have more entries than
+  // the input image has blocks.
+  ImageBlocks=ImageSize/CACHE_BLOCK_SIZE;
+  if((ImageSize%CACHE_BLOCK_SIZE)!=0) ImageBlocks++;
+  EntryCount=(XMountConfData.MemCacheSize*1024*1024)/CACHE_BLOCK_SIZE;
+  if(EntryCount>ImageBlocks) EntryCount=ImageBlocks;
+  if(EntryCount==0) EntryCount=1;
+  if(EntryCount>=MEM_CACHE_NO_ENTRY) EntryCount=MEM_CACHE_NO_ENTRY-1;
+  MemCacheEntryCount=(uint32_t)EntryCount;
+
+  // Entry data is allocated lazily by GetMemCacheVictim
+  XMOUNT_MALLOC(pMemCacheEntries,
+                pTMemCacheEntry,
+                MemCacheEntryCount*sizeof(TMemCacheEntry))
+  for(i=0;i<MemCacheEntryCount;i++) {
+    pMemCacheEntries[i].Block=READ_CACHE_SLOT_FREE;
+    pMemCacheEntries[i].Hits=0;
+    pMemCacheEntries[i].Next=MEM_CACHE_NO_ENTRY;
+    pMemCacheEntries[i].DataSize=0;
+    pMemCacheEntries[i].pData=NULL;
+  }
+
+  // Build empty hash table
+  while(HashSize<EntryCount) HashSize<<=1;
+  MemCacheHashMask=HashSize-1;
+  XMOUNT_MALLOC(pMemCacheHashHead,uint32_t*,HashSize*sizeof(uint32_t))
+  memset(pMemCacheHashHead,0xFF,HashSize*sizeof(uint32_t));
+
+  // Access counters are indexed by the topmost bits of a multiplicative hash
+  // of the block number, so their amount must be a power of two
+  MemCacheCounterCount=1024;
+  MemCacheCounterShift=54;
+  while(MemCacheCounterCount<4*EntryCount) {
+    MemCacheCounterCount<<=1;
+    MemCacheCounterShift--;
+  }
+  XMOUNT_MALLOC(pMemCacheCounters,
+                uint8_t*,
+                MemCacheCounterCount*sizeof(uint8_t))
+  memset(pMemCacheCounters,0,MemCacheCounterCount*sizeof(uint8_t));
+  MemCacheCountedAccesses=0;
+  MemCacheClockHand=0;
+
+  LOG_DEBUG("Memory cache holds up to %" PRIu32 " blocks\n",
+            MemCacheEntryCount)
+  return TRUE;
+}
+
+/*
+ * InitZeroMap:
+ *   Alloc zero map and load it from read cache file if possible
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitZeroMap() {
+  uint64_t ImageSize=0;
+  uint64_t ZeroMapSize;
+  uint64_t i;
+
+  // Get input image size
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return FALSE;
+  }
+  ZeroMapBlockCount=ImageSize/CACHE_BLOCK_SIZE;
+  if((ImageSize%CACHE_BLOCK_SIZE)!=0) ZeroMapBlockCount++;
+  ZeroMapSize=(ZeroMapBlockCount+3)/4;
+  XMOUNT_MALLOC(pZeroMap,uint8_t*,ZeroMapSize*sizeof(uint8_t))
+  XMOUNT_MALLOC(pZeroScanBuf,char*,CACHE_BLOCK_SIZE*sizeof(char))
+  memset(pZeroMap,0,ZeroMapSize*sizeof(uint8_t));
+  ZeroMapZeroBlocks=0;
+  ZeroMapKnownBlocks=0;
+
+  if(hReadCacheFile==NULL) {
+    MarkDdHoleBlocks();
+    return TRUE;
+  }
+
+  if(pReadCacheFileHeader->pZeroMap!=0) {
+    // Load zero map saved in read cache file. Parts that were never written
+    // are simply unknown.
+    if(fseeko(hReadCacheFile,pReadCacheFileHeader->pZeroMap,SEEK_SET)==0) {
+      if(fread(pZeroMap,ZeroMapSize,1,hReadCacheFile)!=1) clearerr(hReadCacheFile);
+    }
+    for(i=0;i<ZeroMapBlockCount;i++) {
+      switch(GetZeroMapState(i)) {
+        case ZERO_MAP_ZERO:
+          // Zero blocks are known blocks too
+          ZeroMapZeroBlocks++;
+          // Fall through
+        case ZERO_MAP_DATA:
+          ZeroMapKnownBlocks++;
+          break;
+        case ZERO_MAP_UNKNOWN:
+          break;
+        default:
+          // Invalid state, forget about this block
+          pZeroMap[i/4]&=~(3<<((i%4)*2));
       }
-      // All important data for this cache block has been written,
-      // flush all buffers and mark cache block as assigned
-      fflush(hCacheFile);
-#ifndef __APPLE__
-      ioctl(fileno(hCacheFile),BLKFLSBUF,0);
+    }
+    LOG_DEBUG("Loaded zero map from read cache file. %" PRIu64 " of %" PRIu64
+              " blocks known\n",ZeroMapKnownBlocks,ZeroMapBlockCount)
+    MarkDdHoleBlocks();
+    return TRUE;
+  }
+
+  // Place zero map behind read cache slot data
+  pReadCacheFileHeader->pZeroMap=pReadCacheFileHeader->pSlotData+
+    (pReadCacheFileHeader->SlotCount*pReadCacheFileHeader->BlockSize);
+  if(fseeko(hReadCacheFile,pReadCacheFileHeader->pZeroMap,SEEK_SET)!=0 ||
+     fwrite(pZeroMap,ZeroMapSize,1,hReadCacheFile)!=1 ||
+     fseeko(hReadCacheFile,0,SEEK_SET)!=0 ||
+     fwrite(pReadCacheFileHeader,
+            sizeof(TReadCacheFileHeader),
+            1,
+            hReadCacheFile)!=1)
+  {
+    LOG_ERROR("Couldn't write zero map to read cache file!\n")
+    return FALSE;
+  }
+  MarkDdHoleBlocks();
+  fflush(hReadCacheFile);
+  return TRUE;
+}
+
+/*
+ * InitStageFile:
+ *   Open / create stage file and stage map file
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitStageFile() {
+  char *pStageMapFile=NULL;
+  uint64_t ImageSize=0;
+  uint64_t BitmapSize=0;
+  uint64_t StageFileSize=0;
+  uint64_t StageMapFileSize=0;
+  uint64_t i;
+  int ReuseStageFile=FALSE;
+
+  // Get input image size
+  if(!GetOrigImageSize(&ImageSize)) {
+    LOG_ERROR("Couldn't get input image size!\n")
+    return FALSE;
+  }
+  StageBlockCount=ImageSize/CACHE_BLOCK_SIZE;
+  if((ImageSize%CACHE_BLOCK_SIZE)!=0) StageBlockCount++;
+  BitmapSize=(StageBlockCount+7)/8;
+
+  // Open existing stage and stage map file or create new ones
+  XMOUNT_STRSET(pStageMapFile,XMountConfData.pStageFile)
+  XMOUNT_STRAPP(pStageMapFile,".map")
+  hStageFile=(FILE*)FOPEN(XMountConfData.pStageFile,"rb+");
+  if(hStageFile==NULL) {
+    LOG_DEBUG("Stage file does not exist. Creating new one\n")
+    hStageFile=(FILE*)FOPEN(XMountConfData.pStageFile,"wb+");
+    if(hStageFile==NULL) {
+      LOG_ERROR("Couldn't open stage file \"%s\"!\n",XMountConfData.pStageFile)
+      free(pStageMapFile);
+      return FALSE;
+    }
+  }
+  if(fseeko(hStageFile,0,SEEK_END)!=0) {
+    LOG_ERROR("Couldn't seek to end of stage file!\n")
+    free(pStageMapFile);
+    return FALSE;
+  }
+  StageFileSize=ftello(hStageFile);
+  hStageMapFile=(FILE*)FOPEN(pStageMapFile,"rb+");
+  if(hStageMapFile==NULL) {
+    if(StageFileSize!=0) {
+      // Never overwrite files we don't know anything about
+      LOG_ERROR("Stage file \"%s\" exists but stage map file \"%s\" is "
+                "missing!\n",XMountConfData.pStageFile,pStageMapFile)
+      free(pStageMapFile);
+      return FALSE;
+    }
+    LOG_DEBUG("Stage map file does not exist. Creating new one\n")
+    hStageMapFile=(FILE*)FOPEN(pStageMapFile,"wb+");
+    if(hStageMapFile==NULL) {
+      LOG_ERROR("Couldn't open stage map file \"%s\"!\n",pStageMapFile)
+      free(pStageMapFile);
+      return FALSE;
+    }
+  }
+  free(pStageMapFile);
+  if(fseeko(hStageMapFile,0,SEEK_END)!=0) {
+    LOG_ERROR("Couldn't seek to end of stage map file!\n")
+    return FALSE;
+  }
+  StageMapFileSize=ftello(hStageMapFile);
+
+  XMOUNT_MALLOC(pStageMapFileHeader,
+                pTStageMapFileHeader,
+                sizeof(TStageMapFileHeader))
+  XMOUNT_MALLOC(pStageBitmap,uint8_t*,BitmapSize*sizeof(uint8_t))
+  XMOUNT_MALLOC(pStageBlockBuf,char*,CACHE_BLOCK_SIZE*sizeof(char))
+  memset(pStageMapFileHeader,0,sizeof(TStageMapFileHeader));
+  memset(pStageBitmap,0,BitmapSize*sizeof(uint8_t));
+
+  if(StageMapFileSize>0) {
+    // Stage map file isn't empty, parse and check header
+    LOG_DEBUG("Stage map file not empty. Parsing header\n")
+    if(fseeko(hStageMapFile,0,SEEK_SET)!=0 ||
+       fread(pStageMapFileHeader,
+             sizeof(TStageMapFileHeader),
+             1,
+             hStageMapFile)!=1 ||
+       pStageMapFileHeader->FileSignature!=STAGE_MAP_FILE_SIGNATURE)
+    {
+      LOG_ERROR("Not an xmount stage map file or stage map file corrupt!\n")
+      return FALSE;
+    }
+    if(pStageMapFileHeader->StageMapFileVersion!=CUR_STAGE_MAP_FILE_VERSION ||
+       pStageMapFileHeader->BlockSize!=CACHE_BLOCK_SIZE)
+    {
+      LOG_WARNING("Unsupported stage map file version or block size. "
+                  "Discarding staged data.\n")
+    } else if(pStageMapFileHeader->InputHashLo!=XMountConfData.InputHashLo ||
+              pStageMapFileHeader->InputHashHi!=XMountConfData.InputHashHi ||
+              pStageMapFileHeader->InputImageSize!=ImageSize)
+    {
+      LOG_WARNING("Stage file belongs to another input image. "
+                  "Discarding staged data.\n")
+    } else if(StageFileSize!=ImageSize) {
+      LOG_WARNING("Stage file has an unexpected size. "
+                  "Discarding staged data.\n")
+    } else ReuseStageFile=TRUE;
+  }
+
+  if(ReuseStageFile) {
+    // Load bitmap and count staged blocks
+    if(fseeko(hStageMapFile,pStageMapFileHeader->pBitmap,SEEK_SET)!=0 ||
+       fread(pStageBitmap,BitmapSize,1,hStageMapFile)!=1)
+    {
+      LOG_ERROR("Stage map file corrupt!\n")
+      return FALSE;
+    }
+    StagedBlocks=0;
+    for(i=0;i<StageBlockCount;i++) {
+      if(IsBlockStaged(i)) StagedBlocks++;
+    }
+    LOG_DEBUG("Stage file loaded successfully. %" PRIu64 " of %" PRIu64
+              " blocks already staged\n",StagedBlocks,StageBlockCount)
+  } else {
+    // Start over with an empty (sparse) stage file and a new stage map
+    LOG_DEBUG("Generating new stage map for %" PRIu64 " blocks\n",
+              StageBlockCount)
+    if(ftruncate(fileno(hStageFile),0)!=0 ||
+       ftruncate(fileno(hStageFile),ImageSize)!=0 ||
+       ftruncate(fileno(hStageMapFile),0)!=0)
+    {
+      LOG_ERROR("Couldn't truncate stage file or stage map file!\n")
+      return FALSE;
+    }
+    memset(pStageMapFileHeader,0,sizeof(TStageMapFileHeader));
+    pStageMapFileHeader->FileSignature=STAGE_MAP_FILE_SIGNATURE;
+    pStageMapFileHeader->StageMapFileVersion=CUR_STAGE_MAP_FILE_VERSION;
+    pStageMapFileHeader->BlockSize=CACHE_BLOCK_SIZE;
+    pStageMapFileHeader->InputHashLo=XMountConfData.InputHashLo;
+    pStageMapFileHeader->InputHashHi=XMountConfData.InputHashHi;
+    pStageMapFileHeader->InputImageSize=ImageSize;
+    pStageMapFileHeader->pBitmap=sizeof(TStageMapFileHeader);
+    if(fseeko(hStageMapFile,0,SEEK_SET)!=0 ||
+       fwrite(pStageMapFileHeader,
+              sizeof(TStageMapFileHeader),
+              1,
+              hStageMapFile)!=1 ||
+       fwrite(pStageBitmap,BitmapSize,1,hStageMapFile)!=1)
+    {
+      LOG_ERROR("Couldn't write stage map file header to file!\n")
+      return FALSE;
+    }
+    fflush(hStageMapFile);
+    StagedBlocks=0;
+  }
+  StageCursor=0;
+  StageQueueHead=0;
+  StageQueueLen=0;
+
+  return TRUE;
+}
+
+/*
+ * InitVirtFiles:
+ *   Set up the table of virtual files and directories. Inode numbers of fixed
+ *   files are defined by VIRT_FILE_INO_*, virtual images and partition files
+ *   follow in the order they were set up.
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int InitVirtFiles() {
+  mode_t mode=XMountConfData.Writable ? 0666 : 0444;
+  pTVirtFile pFile;
+  uint32_t i;
+
+  VirtFileCount=VIRT_FILE_INO_IMAGES-1+
+                  XMountConfData.VirtImageCount+PartitionCount;
+  XMOUNT_MALLOC(pVirtFiles,pTVirtFile,VirtFileCount*sizeof(TVirtFile))
+  memset(pVirtFiles,0,VirtFileCount*sizeof(TVirtFile));
+
+  // Mountpoint
+  pFile=&(pVirtFiles[VIRT_FILE_INO_ROOT-1]);
+  pFile->pName="/";
+  pFile->Mode=S_IFDIR | 0777;
+  // Virtual image info file
+  pFile=&(pVirtFiles[VIRT_FILE_INO_INFO-1]);
+  pFile->Parent=VIRT_FILE_INO_ROOT;
+  pFile->pName=XMountConfData.pVirtualImageInfoPath+1;
+  pFile->Mode=S_IFREG | 0444;
+  pFile->pOps=&InfoFileOps;
+  // Virtual control file
+  pFile=&(pVirtFiles[VIRT_FILE_INO_CONTROL-1]);
+  pFile->Parent=VIRT_FILE_INO_ROOT;
+  pFile->pName=XMountConfData.pVirtualControlPath+1;
+  pFile->Mode=S_IFREG | 0600;
+  pFile->pOps=&ControlFileOps;
+  // VmWare's lock directories and lock file only exist once created
+  pVirtFiles[VIRT_FILE_INO_VMDK_LOCK_DIR-1].Mode=S_IFDIR | 0777;
+  pVirtFiles[VIRT_FILE_INO_VMDK_LOCK_DIR2-1].Mode=S_IFDIR | 0777;
+  pFile=&(pVirtFiles[VIRT_FILE_INO_VMDK_LOCK_FILE-1]);
+  pFile->Mode=S_IFREG | mode;
+  pFile->pOps=&VmdkLockFileOps;
+  // Virtual images and partition files (p+1 to ignore starting "/")
+  pFile=&(pVirtFiles[VIRT_FILE_INO_IMAGES-1]);
+  for(i=0;i<XMountConfData.VirtImageCount;i++,pFile++) {
+    pFile->Parent=VIRT_FILE_INO_ROOT;
+    pFile->pName=XMountConfData.pVirtImages[i].pPath+1;
+    pFile->Mode=S_IFREG | mode;
+    pFile->pOps=&VirtImageFileOps;
+    pFile->pImage=&(XMountConfData.pVirtImages[i]);
+  }
+  for(i=0;i<PartitionCount;i++,pFile++) {
+    pFile->Parent=VIRT_FILE_INO_ROOT;
+    pFile->pName=pPartitions[i].pPath+1;
+    pFile->Mode=S_IFREG | mode;
+    pFile->pOps=&PartitionFileOps;
+    pFile->pPartition=&(pPartitions[i]);
+  }
+  return TRUE;
+}
+
+/*
+ * InitFuse:
+ *   Called by FUSE once the filesystem has been mounted. Starts the stage,
+ *   zero map and invalidation threads as threads created before daemonizing
+ *   won't survive it and enables splicing of raw input image data if possible. When built against
+ *   libfuse 3, also negotiates request size and writeback caching.
+ *
+ * Params:
+ *   p: Unused
+ *   conn: FUSE connection infos
+ *
+ * Returns:
+ *   n/a
+ */
+static void InitFuse(void *p, struct fuse_conn_info *conn) {
+#if FUSE_VERSION >= 29
+  if(conn!=NULL && SpliceDdSegments) {
+    // Move data read by SpliceVirtFile from input files to the kernel using
+    // splice
+    conn->want|=conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+  }
 #endif
-      pCacheFileBlockIndex[CurBlock].Assigned=1;
-      // Update cache block index entry in cache file
-      fseeko(hCacheFile,
-             sizeof(TCacheFileHeader)+(CurBlock*sizeof(TCacheFileBlockIndex)),
-             SEEK_SET);
-      if(fwrite(&(pCacheFileBlockIndex[CurBlock]),
-                sizeof(TCacheFileBlockIndex),
-                1,
-                hCacheFile)!=1)
-      {
-        LOG_ERROR("Couldn't update cache file block index!\n");
-        return -1;
-      }
-      LOG_DEBUG("Updated cache file block index: Number=%" PRIu64
-                ", Data offset=%" PRIu64 "\n",CurBlock,
-                pCacheFileBlockIndex[CurBlock].off_data);
+#ifdef HAVE_LIBFUSE3
+  if(conn!=NULL && XMountConfData.FuseMaxIo!=0) {
+    // libfuse derives the max. amount of pages per request from max_write,
+    // which limits the size of read requests too
+    conn->max_write=XMountConfData.FuseMaxIo;
+  }
+  if(conn!=NULL && XMountConfData.FuseWriteback) {
+    if(conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+      conn->want|=FUSE_CAP_WRITEBACK_CACHE;
+    } else {
+      LOG_WARNING("Kernel doesn't support writeback caching. Ignoring "
+                  "--writeback.\n")
+      XMountConfData.FuseWriteback=FALSE;
     }
-    // Flush buffers
-    fflush(hCacheFile);
-#ifndef __APPLE__
-    ioctl(fileno(hCacheFile),BLKFLSBUF,0);
+  }
 #endif
-    BlockOff=0;
-    CurBlock++;
-    WriteBuf+=CurToWrite;
-    ToWrite-=CurToWrite;
-    FileOff+=CurToWrite;
+  if(hStageFile!=NULL && StagedBlocks<StageBlockCount) {
+    StageThreadStop=FALSE;
+    if(pthread_create(&StageThread,NULL,StageImage,NULL)!=0) {
+      LOG_ERROR("Couldn't start stage thread!\n")
+    } else StageThreadRunning=TRUE;
+  }
+  if(pZeroMap!=NULL && ZeroMapKnownBlocks<ZeroMapBlockCount) {
+    ZeroScanThreadStop=FALSE;
+    if(pthread_create(&ZeroScanThread,NULL,ScanZeroBlocks,NULL)!=0) {
+      LOG_ERROR("Couldn't start zero map thread!\n")
+    } else ZeroScanThreadRunning=TRUE;
   }
+  if(conn!=NULL && XMountConfData.Writable) {
+    InvalThreadStop=FALSE;
+    if(pthread_create(&InvalThread,NULL,InvalidateFiles,NULL)!=0) {
+      LOG_ERROR("Couldn't start invalidation thread! Other virtual files "
+                "might show outdated data after writes.\n")
+    } else InvalThreadRunning=TRUE;
+  }
+}
 
-  if(to_write_later!=0) {
-    // Cache virtual image type specific data preceeding original image data
-    switch(XMountConfData.VirtImageType) {
-      case TVirtImageType_DD:
-      case TVirtImageType_DMG:
-      case TVirtImageType_VMDK:
-      case TVirtImageType_VMDKS:
-      case TVirtImageType_VDI:
-        break;
-      case TVirtImageType_VHD:
-        // Micro$oft has choosen to use a footer rather then a header.
-        ret=SetVhdFileHeaderData(WriteBuf,FileOff-OrigImageSize,to_write_later);
-        if(ret==-1) {
-          LOG_ERROR("Couldn't write data to virtual VHD file footer!\n")
-          return -1;
-        }
-        break;
-    }
+/*
+ * DestroyFuse:
+ *   Called by FUSE on unmount. Stops the stage, zero map and invalidation
+ *   threads.
+ *
+ * Params:
+ *   p: Unused
+ *
+ * Returns:
+ *   n/a
+ */
+static void DestroyFuse(void *p) {
+  if(StageThreadRunning) {
+    pthread_mutex_lock(&mutex_image_rw);
+    StageThreadStop=TRUE;
+    pthread_mutex_unlock(&mutex_image_rw);
+    pthread_join(StageThread,NULL);
+    StageThreadRunning=FALSE;
+  }
+  if(ZeroScanThreadRunning) {
+    pthread_mutex_lock(&mutex_image_rw);
+    ZeroScanThreadStop=TRUE;
+    pthread_mutex_unlock(&mutex_image_rw);
+    pthread_join(ZeroScanThread,NULL);
+    ZeroScanThreadRunning=FALSE;
+  }
+  if(InvalThreadRunning) {
+    pthread_mutex_lock(&mutex_inval);
+    InvalThreadStop=TRUE;
+    pthread_cond_signal(&cond_inval);
+    pthread_mutex_unlock(&mutex_inval);
+    pthread_join(InvalThread,NULL);
+    InvalThreadRunning=FALSE;
   }
+}
 
-  return size;
+/*
+ * NbdRecv:
+ *   Receive exactly size bytes from a NBD socket
+ *
+ * Params:
+ *   sock: Socket to read from
+ *   buf: Buffer to read data into
+ *   size: Amount of bytes to read
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error or if the peer disconnected
+ */
+static int NbdRecv(int sock, void *buf, size_t size) {
+  ssize_t ret;
+
+  while(size!=0) {
+    ret=recv(sock,buf,size,0);
+    if(ret<0 && errno==EINTR) continue;
+    if(ret<=0) return FALSE;
+    buf=((char*)buf)+ret;
+    size-=ret;
+  }
+  return TRUE;
 }
 
 /*
- * GetVirtFileAccess:
- *   FUSE access implementation
+ * NbdSend:
+ *   Send exactly size bytes over a NBD socket
  *
  * Params:
- *   path: Path of file to get attributes from
- *   perm: Requested permissisons
+ *   sock: Socket to write to
+ *   buf: Data to send
+ *   size: Amount of bytes to send
  *
  * Returns:
- *   "0" on success, negated error code on error
+ *   "TRUE" on success, "FALSE" on error
  */
-/*
-static int GetVirtFileAccess(const char *path, int perm) {
-  // TODO: Implement propper file permission handling
-  // http://www.cs.cf.ac.uk/Dave/C/node20.html
-  // Values for the second argument to access.
-  // These may be OR'd together.
-  //#define	R_OK	4		// Test for read permission.
-  //#define	W_OK	2		// Test for write permission.
-  //#define	X_OK	1		// Test for execute permission.
-  //#define	F_OK	0		// Test for existence.
-  return 0;
+static int NbdSend(int sock, const void *buf, size_t size) {
+  ssize_t ret;
+
+  while(size!=0) {
+    ret=send(sock,buf,size,0);
+    if(ret<0 && errno==EINTR) continue;
+    if(ret<=0) return FALSE;
+    buf=((const char*)buf)+ret;
+    size-=ret;
+  }
+  return TRUE;
 }
-*/
 
 /*
- * GetVirtFileAttr:
- *   FUSE getattr implementation
+ * NbdSendOptionReply:
+ *   Send a reply to a NBD option during handshake
  *
  * Params:
- *   path: Path of file to get attributes from
- *   stbuf: Pointer to stat structure to save attributes to
+ *   pConn: NBD connection
+ *   option: Option being replied to
+ *   type: Reply type (NBD_REP_*)
+ *   pData: Reply data (May be NULL if DataSize is 0)
+ *   DataSize: Size of reply data
  *
  * Returns:
- *   "0" on success, negated error code on error
+ *   "TRUE" on success, "FALSE" on error
  */
-static int GetVirtFileAttr(const char *path, struct stat *stbuf) {
-  memset(stbuf,0,sizeof(struct stat));
-  if(strcmp(path,"/")==0) {
-    // Attributes of mountpoint
-    stbuf->st_mode=S_IFDIR | 0777;
-    stbuf->st_nlink=2;
-  } else if(strcmp(path,XMountConfData.pVirtualImagePath)==0) {
-    // Attributes of virtual image
-    if(!XMountConfData.Writable) stbuf->st_mode=S_IFREG | 0444;
-    else stbuf->st_mode=S_IFREG | 0666;
-    stbuf->st_nlink=1;
-    // Get virtual image file size
-    if(!GetVirtImageSize(&(stbuf->st_size))) {
-      LOG_ERROR("Couldn't get image size!\n");
-      return -ENOENT;
-    }
-    if(XMountConfData.VirtImageType==TVirtImageType_VHD) {
-      // Make sure virtual image seems to be fully allocated (not sparse file).
-      // Without this, Windows won't attach the vhd file!
-      stbuf->st_blocks=stbuf->st_size/512;
-      if(stbuf->st_size%512!=0) stbuf->st_blocks++;
-    }
-  } else if(strcmp(path,XMountConfData.pVirtualImageInfoPath)==0) {
-    // Attributes of virtual image info file
-    stbuf->st_mode=S_IFREG | 0444;
-    stbuf->st_nlink=1;
-    // Get virtual image info file size
-    if(pVirtualImageInfoFile!=NULL) {
-      stbuf->st_size=strlen(pVirtualImageInfoFile);
-    } else stbuf->st_size=0;
-  } else if(XMountConfData.VirtImageType==TVirtImageType_VMDK ||
-            XMountConfData.VirtImageType==TVirtImageType_VMDKS)
-  {
-    // Some special files only present when emulating VMDK files
-    if(strcmp(path,XMountConfData.pVirtualVmdkPath)==0) {
-      // Attributes of virtual vmdk file
-      if(!XMountConfData.Writable) stbuf->st_mode=S_IFREG | 0444;
-      else stbuf->st_mode=S_IFREG | 0666;
-      stbuf->st_nlink=1;
-      // Get virtual image info file size
-      if(pVirtualVmdkFile!=NULL) {
-        stbuf->st_size=VirtualVmdkFileSize;
-      } else stbuf->st_size=0;
-    } else if(pVirtualVmdkLockDir!=NULL &&
-              strcmp(path,pVirtualVmdkLockDir)==0)
-    {
-      stbuf->st_mode=S_IFDIR | 0777;
-      stbuf->st_nlink=2;
-    } else if(pVirtualVmdkLockDir2!=NULL &&
-              strcmp(path,pVirtualVmdkLockDir2)==0)
-    {
-      stbuf->st_mode=S_IFDIR | 0777;
-      stbuf->st_nlink=2;
-    } else if(pVirtualVmdkLockFileName!=NULL &&
-              strcmp(path,pVirtualVmdkLockFileName)==0)
-    {
-      stbuf->st_mode=S_IFREG | 0666;
-      if(pVirtualVmdkLockFileName!=NULL) {
-        stbuf->st_size=strlen(pVirtualVmdkLockFileName);
-      } else stbuf->st_size=0;
-    } else return -ENOENT;
-  } else return -ENOENT;
-  // Set uid and gid of all files to uid and gid of current process
-  stbuf->st_uid=getuid();
-  stbuf->st_gid=getgid();
-  return 0;
+static int NbdSendOptionReply(pTNbdConnection pConn,
+                              uint32_t option,
+                              uint32_t type,
+                              const void *pData,
+                              uint32_t DataSize)
+{
+  TNbdOptionReply reply;
+
+  reply.Magic=htobe64(NBD_OPT_REPLY_MAGIC);
+  reply.Option=htobe32(option);
+  reply.Type=htobe32(type);
+  reply.Length=htobe32(DataSize);
+  if(!NbdSend(pConn->Socket,&reply,sizeof(TNbdOptionReply))) return FALSE;
+  if(DataSize!=0) return NbdSend(pConn->Socket,pData,DataSize);
+  return TRUE;
 }
 
 /*
- * CreateVirtDir:
- *   FUSE mkdir implementation
+ * NbdSendExportName:
+ *   Send a NBD_REP_SERVER reply naming one export
  *
  * Params:
- *   path: Directory path
- *   mode: Directory permissions
+ *   pConn: NBD connection
+ *   pPath: Path of virtual file to announce
  *
  * Returns:
- *   "0" on success, negated error code on error
+ *   "TRUE" on success, "FALSE" on error
  */
-static int CreateVirtDir(const char *path, mode_t mode) {
-  // Only allow creation of VMWare's lock directories
-  if(XMountConfData.VirtImageType==TVirtImageType_VMDK ||
-     XMountConfData.VirtImageType==TVirtImageType_VMDKS)
-  {
-    if(pVirtualVmdkLockDir==NULL)  {
-      char aVmdkLockDir[strlen(XMountConfData.pVirtualVmdkPath)+5];
-      sprintf(aVmdkLockDir,"%s.lck",XMountConfData.pVirtualVmdkPath);
-      if(strcmp(path,aVmdkLockDir)==0) {
-        LOG_DEBUG("Creating virtual directory \"%s\"\n",aVmdkLockDir)
-        XMOUNT_STRSET(pVirtualVmdkLockDir,aVmdkLockDir)
-        return 0;
-      } else {
-        LOG_ERROR("Attempt to create illegal directory \"%s\"!\n",path)
-        LOG_DEBUG("Supposed: %s\n",aVmdkLockDir)
-        return -1;
-      }
-    } else if(pVirtualVmdkLockDir2==NULL &&
-              strncmp(path,pVirtualVmdkLockDir,strlen(pVirtualVmdkLockDir))==0)
-    {
-      LOG_DEBUG("Creating virtual directory \"%s\"\n",path)
-      XMOUNT_STRSET(pVirtualVmdkLockDir2,path)
-      return 0;
-    } else {
-      LOG_ERROR("Attempt to create illegal directory \"%s\"!\n",path)
-      LOG_DEBUG("Compared to first %u chars of \"%s\"\n",strlen(pVirtualVmdkLockDir),pVirtualVmdkLockDir)
-      return -1;
-    }
-  }
-  LOG_ERROR("Attempt to create directory \"%s\" "
-            "on read-only filesystem!\n",path)
-  return -1;
+static int NbdSendExportName(pTNbdConnection pConn, const char *pPath) {
+  char buf[4+NBD_MAX_OPTION_SIZE];
+  uint32_t len=strlen(pPath+1);
+
+  if(len>NBD_MAX_OPTION_SIZE) return TRUE;
+  *((uint32_t*)buf)=htobe32(len);
+  memcpy(buf+4,pPath+1,len);
+  return NbdSendOptionReply(pConn,NBD_OPT_LIST,NBD_REP_SERVER,buf,4+len);
 }
 
 /*
- * CreateVirtFile:
- *   FUSE create implementation.
- *   Only allows to create VMWare's lock file!
+ * NbdFindExport:
+ *   Look up the virtual file exported under the given name. Every virtual image
+ *   and partition file is exported under its file name. The empty (default)
+ *   name selects the first virtual image.
  *
  * Params:
- *   path: File to create
- *   mode: File mode
- *   dev: ??? but not used
+ *   pName: Export name
+ *   ppFile: Virtual file is written to this var
+ *   pSize: Size of virtual file is written to this var
  *
  * Returns:
- *   "0" on success, negated error code on error
+ *   "TRUE" if the export exists, "FALSE" otherwise
  */
-static int CreateVirtFile(const char *path,
-                          mode_t mode,
-                          dev_t dev)
+static int NbdFindExport(const char *pName,
+                         pTVirtFile *ppFile,
+                         uint64_t *pSize)
 {
-  if((XMountConfData.VirtImageType==TVirtImageType_VMDK ||
-      XMountConfData.VirtImageType==TVirtImageType_VMDKS) &&
-     pVirtualVmdkLockDir!=NULL && pVirtualVmdkLockFileName==NULL)
+  pTVirtFile pFile;
+
+  if(*pName=='\0') pFile=GetVirtFile(VIRT_FILE_INO_IMAGES);
+  else pFile=GetVirtFile(FindVirtFile(VIRT_FILE_INO_ROOT,pName));
+  if(pFile==NULL ||
+     (pFile->pImage==NULL && pFile->pPartition==NULL) ||
+     !pFile->pOps->GetSize(pFile,pSize))
   {
-    LOG_DEBUG("Creating virtual file \"%s\"\n",path)
-    XMOUNT_STRSET(pVirtualVmdkLockFileName,path);
-    return 0;
-  } else {
-    LOG_ERROR("Attempt to create illegal file \"%s\"\n",path)
-    return -1;
+    LOG_DEBUG("NBD client requested unknown export \"%s\"\n",pName)
+    return FALSE;
   }
+  *ppFile=pFile;
+  return TRUE;
 }
 
 /*
- * GetVirtFiles:
- *   FUSE readdir implementation
+ * NbdGetTransmissionFlags:
+ *   Get NBD transmission flags of exports
  *
  * Params:
- *   path: Path from where files should be listed
- *   buf: Buffer to write file entrys to
- *   filler: Function to write file entrys to buffer
- *   offset: ??? but not used
- *   fi: ??? but not used
+ *   n/a
  *
  * Returns:
- *   "0" on success, negated error code on error
+ *   Transmission flags
+ */
+static uint16_t NbdGetTransmissionFlags() {
+  uint16_t flags=NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH |
+                 NBD_FLAG_SEND_FUA | NBD_FLAG_CAN_MULTI_CONN;
+
+  if(!XMountConfData.Writable) flags|=NBD_FLAG_READ_ONLY;
+  return flags;
+}
+
+/*
+ * NbdSendExportInfo:
+ *   Reply to NBD_OPT_INFO or NBD_OPT_GO with infos about the selected export
+ *
+ * Params:
+ *   pConn: NBD connection
+ *   option: NBD_OPT_INFO or NBD_OPT_GO
+ *   ExportSize: Size of export
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
  */
-static int GetVirtFiles(const char *path,
-                        void *buf,
-                        fuse_fill_dir_t filler,
-                        off_t offset,
-                        struct fuse_file_info *fi)
+static int NbdSendExportInfo(pTNbdConnection pConn,
+                             uint32_t option,
+                             uint64_t ExportSize)
 {
-  (void)offset;
-  (void)fi;
+  char buf[14];
+
+  // Export size and transmission flags
+  *((uint16_t*)buf)=htobe16(NBD_INFO_EXPORT);
+  *((uint64_t*)(buf+2))=htobe64(ExportSize);
+  *((uint16_t*)(buf+10))=htobe16(NbdGetTransmissionFlags());
+  if(!NbdSendOptionReply(pConn,option,NBD_REP_INFO,buf,12)) return FALSE;
+  // Block size constraints. Any alignment is fine, but requests should be
+  // made in whole cache blocks.
+  *((uint16_t*)buf)=htobe16(NBD_INFO_BLOCK_SIZE);
+  *((uint32_t*)(buf+2))=htobe32(1);
+  *((uint32_t*)(buf+6))=htobe32(CACHE_BLOCK_SIZE);
+  *((uint32_t*)(buf+10))=htobe32(NBD_MAX_REQUEST_SIZE);
+  if(!NbdSendOptionReply(pConn,option,NBD_REP_INFO,buf,14)) return FALSE;
+  return NbdSendOptionReply(pConn,option,NBD_REP_ACK,NULL,0);
+}
 
-  if(strcmp(path,"/")==0) {
-    // Add std . and .. entrys
-    filler(buf,".",NULL,0);
-    filler(buf,"..",NULL,0);
-    // Add our virtual files (p+1 to ignore starting "/")
-    filler(buf,XMountConfData.pVirtualImagePath+1,NULL,0);
-    filler(buf,XMountConfData.pVirtualImageInfoPath+1,NULL,0);
-    if(XMountConfData.VirtImageType==TVirtImageType_VMDK ||
-       XMountConfData.VirtImageType==TVirtImageType_VMDKS)
+/*
+ * NbdHandleMetaContext:
+ *   Handle NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT. The only
+ *   supported meta context is "base:allocation".
+ *
+ * Params:
+ *   pConn: NBD connection
+ *   option: NBD_OPT_LIST_META_CONTEXT or NBD_OPT_SET_META_CONTEXT
+ *   pData: Option data
+ *   DataSize: Size of option data
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int NbdHandleMetaContext(pTNbdConnection pConn,
+                                uint32_t option,
+                                char *pData,
+                                uint32_t DataSize)
+{
+  char buf[4+sizeof(NBD_META_CONTEXT_ALLOCATION)];
+  pTVirtFile pFile;
+  uint64_t size;
+  uint32_t NameLen,QueryCount,QueryLen,pos;
+  char saved;
+  int match;
+
+  if(option==NBD_OPT_SET_META_CONTEXT && !pConn->StructuredReplies) {
+    return NbdSendOptionReply(pConn,option,NBD_REP_ERR_INVALID,NULL,0);
+  }
+  // Data consists of export name followed by a list of queries
+  if(DataSize<8) {
+    return NbdSendOptionReply(pConn,option,NBD_REP_ERR_INVALID,NULL,0);
+  }
+  NameLen=be32toh(*((uint32_t*)pData));
+  if(NameLen>DataSize-8) {
+    return NbdSendOptionReply(pConn,option,NBD_REP_ERR_INVALID,NULL,0);
+  }
+  QueryCount=be32toh(*((uint32_t*)(pData+4+NameLen)));
+  saved=pData[4+NameLen];
+  pData[4+NameLen]='\0';
+  if(!NbdFindExport(pData+4,&pFile,&size)) {
+    return NbdSendOptionReply(pConn,option,NBD_REP_ERR_UNKNOWN,NULL,0);
+  }
+  pData[4+NameLen]=saved;
+
+  *((uint32_t*)buf)=htobe32(NBD_META_CONTEXT_ALLOCATION_ID);
+  memcpy(buf+4,NBD_META_CONTEXT_ALLOCATION,
+         sizeof(NBD_META_CONTEXT_ALLOCATION)-1);
+  if(option==NBD_OPT_SET_META_CONTEXT) pConn->BlockStatus=FALSE;
+  if(QueryCount==0 && option==NBD_OPT_LIST_META_CONTEXT) {
+    // List all supported contexts
+    if(!NbdSendOptionReply(pConn,option,NBD_REP_META_CONTEXT,buf,
+                           sizeof(buf)-1))
     {
-      // For VMDK's, we use an additional descriptor file
-      filler(buf,XMountConfData.pVirtualVmdkPath+1,NULL,0);
-      // And there could also be a lock directory
-      if(pVirtualVmdkLockDir!=NULL) {
-        filler(buf,pVirtualVmdkLockDir+1,NULL,0);
-      }
+      return FALSE;
     }
-  } else if(XMountConfData.VirtImageType==TVirtImageType_VMDK ||
-            XMountConfData.VirtImageType==TVirtImageType_VMDKS)
-  {
-    // For VMDK emulation, there could be a lock directory
-    if(pVirtualVmdkLockDir!=NULL && strcmp(path,pVirtualVmdkLockDir)==0) {
-      filler(buf,".",NULL,0);
-      filler(buf,"..",NULL,0);
-      if(pVirtualVmdkLockFileName!=NULL) {
-        filler(buf,pVirtualVmdkLockFileName+strlen(pVirtualVmdkLockDir)+1,NULL,0);
-      }
-    } else if(pVirtualVmdkLockDir2!=NULL &&
-              strcmp(path,pVirtualVmdkLockDir2)==0)
+  }
+  pos=8+NameLen;
+  while(QueryCount--) {
+    if(pos+4>DataSize) {
+      return NbdSendOptionReply(pConn,option,NBD_REP_ERR_INVALID,NULL,0);
+    }
+    QueryLen=be32toh(*((uint32_t*)(pData+pos)));
+    pos+=4;
+    if(QueryLen>DataSize-pos) {
+      return NbdSendOptionReply(pConn,option,NBD_REP_ERR_INVALID,NULL,0);
+    }
+    match=(QueryLen==sizeof(NBD_META_CONTEXT_ALLOCATION)-1 &&
+           memcmp(pData+pos,NBD_META_CONTEXT_ALLOCATION,QueryLen)==0) ||
+          (option==NBD_OPT_LIST_META_CONTEXT &&
+           QueryLen==5 && memcmp(pData+pos,"base:",5)==0);
+    pos+=QueryLen;
+    if(!match) continue;
+    if(option==NBD_OPT_SET_META_CONTEXT) {
+      if(pConn->BlockStatus) continue;
+      pConn->BlockStatus=TRUE;
+    }
+    if(!NbdSendOptionReply(pConn,option,NBD_REP_META_CONTEXT,buf,
+                           sizeof(buf)-1))
     {
-      filler(buf,".",NULL,0);
-      filler(buf,"..",NULL,0);
-    } else return -ENOENT;
-  } else return -ENOENT;
-  return 0;
+      return FALSE;
+    }
+  }
+  return NbdSendOptionReply(pConn,option,NBD_REP_ACK,NULL,0);
 }
 
 /*
- * OpenVirtFile:
- *   FUSE open implementation
+ * NbdHandshake:
+ *   Perform fixed newstyle NBD handshake and let client select an export
  *
  * Params:
- *   path: Path to file to open
- *   fi: ??? but not used
+ *   pConn: NBD connection
  *
  * Returns:
- *   "0" on success, negated error code on error
+ *   "TRUE" if client entered transmission phase, "FALSE" otherwise
  */
-static int OpenVirtFile(const char *path, struct fuse_file_info *fi) {
-  if(strcmp(path,XMountConfData.pVirtualImagePath)==0 ||
-     strcmp(path,XMountConfData.pVirtualImageInfoPath)==0)
-  {
-    // Check open permissions
-    if(!XMountConfData.Writable && (fi->flags & 3)!=O_RDONLY) {
-      // Attempt to open a read-only file for writing
-      LOG_DEBUG("Attempt to open the read-only file \"%s\" for writing.\n",path)
-      return -EACCES;
+static int NbdHandshake(pTNbdConnection pConn) {
+  char buf[18];
+  TNbdOptionHeader OptHeader;
+  char *pData=NULL;
+  uint32_t ClientFlags,NameLen;
+  uint64_t size;
+  pTVirtFile pFile;
+  int ret=FALSE;
+
+  // Send server greeting
+  *((uint64_t*)buf)=htobe64(NBD_MAGIC);
+  *((uint64_t*)(buf+8))=htobe64(NBD_OPTS_MAGIC);
+  *((uint16_t*)(buf+16))=htobe16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+  if(!NbdSend(pConn->Socket,buf,18)) return FALSE;
+  if(!NbdRecv(pConn->Socket,&ClientFlags,sizeof(uint32_t))) return FALSE;
+  ClientFlags=be32toh(ClientFlags);
+  pConn->NoZeroes=(ClientFlags & NBD_FLAG_C_NO_ZEROES) ? TRUE : FALSE;
+
+  // Handle client options
+  XMOUNT_MALLOC(pData,char*,(NBD_MAX_OPTION_SIZE+1)*sizeof(char))
+  while(NbdRecv(pConn->Socket,&OptHeader,sizeof(TNbdOptionHeader))) {
+    if(be64toh(OptHeader.Magic)!=NBD_OPTS_MAGIC) break;
+    OptHeader.Option=be32toh(OptHeader.Option);
+    OptHeader.Length=be32toh(OptHeader.Length);
+    if(OptHeader.Length>NBD_MAX_OPTION_SIZE) {
+      // No legitimate option is this large
+      LOG_DEBUG("NBD client sent oversized option %" PRIu32 "\n",
+                OptHeader.Option)
+      break;
     }
-    return 0;
-  } else if(XMountConfData.VirtImageType==TVirtImageType_VMDK ||
-            XMountConfData.VirtImageType==TVirtImageType_VMDKS)
-  {
-    if(strcmp(path,XMountConfData.pVirtualVmdkPath)==0) {
-      // Check open permissions
-      if(!XMountConfData.Writable && (fi->flags & 3)!=O_RDONLY) {
-        // Attempt to open a read-only file for writing
-        LOG_DEBUG("Attempt to open the read-only file \"%s\" for writing.\n",path)
-        return -EACCES;
-      }
-      return 0;
-    } else if(pVirtualVmdkLockFileName!=NULL &&
-              strcmp(path,pVirtualVmdkLockFileName)==0)
-    {
-      // Check open permissions
-      if(!XMountConfData.Writable && (fi->flags & 3)!=O_RDONLY) {
-        // Attempt to open a read-only file for writing
-        LOG_DEBUG("Attempt to open the read-only file \"%s\" for writing.\n",path)
-        return -EACCES;
+    if(!NbdRecv(pConn->Socket,pData,OptHeader.Length)) break;
+    pData[OptHeader.Length]='\0';
+    LOG_DEBUG("Got NBD option %" PRIu32 " (%" PRIu32 " bytes)\n",
+              OptHeader.Option,OptHeader.Length)
+
+    switch(OptHeader.Option) {
+      case NBD_OPT_EXPORT_NAME:
+        // Old way of selecting an export. Errors can't be reported.
+        if(!NbdFindExport(pData,&(pConn->pExport),&(pConn->ExportSize))) {
+          goto NbdHandshake_end;
+        }
+        *((uint64_t*)buf)=htobe64(pConn->ExportSize);
+        *((uint16_t*)(buf+8))=htobe16(NbdGetTransmissionFlags());
+        if(!NbdSend(pConn->Socket,buf,10)) goto NbdHandshake_end;
+        if(!pConn->NoZeroes) {
+          memset(pData,0,124);
+          if(!NbdSend(pConn->Socket,pData,124)) goto NbdHandshake_end;
+        }
+        ret=TRUE;
+        goto NbdHandshake_end;
+      case NBD_OPT_ABORT:
+        NbdSendOptionReply(pConn,OptHeader.Option,NBD_REP_ACK,NULL,0);
+        goto NbdHandshake_end;
+      case NBD_OPT_LIST: {
+        uint32_t i;
+
+        if(OptHeader.Length!=0) {
+          if(!NbdSendOptionReply(pConn,OptHeader.Option,NBD_REP_ERR_INVALID,
+                                 NULL,0))
+          {
+            goto NbdHandshake_end;
+          }
+          break;
+        }
+        for(i=0;i<XMountConfData.VirtImageCount;i++) {
+          if(!NbdSendExportName(pConn,XMountConfData.pVirtImages[i].pPath)) {
+            goto NbdHandshake_end;
+          }
+        }
+        for(i=0;i<PartitionCount;i++) {
+          if(!NbdSendExportName(pConn,pPartitions[i].pPath)) {
+            goto NbdHandshake_end;
+          }
+        }
+        if(!NbdSendOptionReply(pConn,OptHeader.Option,NBD_REP_ACK,NULL,0)) {
+          goto NbdHandshake_end;
+        }
+        break;
       }
-      return 0;
-    } else {
-      // Attempt to open a non existant file
-      LOG_DEBUG("Attempt to open non existant file \"%s\".\n",path)
-      return -ENOENT;
+      case NBD_OPT_INFO:
+      case NBD_OPT_GO:
+        // Data consists of export name followed by a list of requested infos
+        // which is ignored as all infos we have are sent anyway
+        if(OptHeader.Length<6 ||
+           (NameLen=be32toh(*((uint32_t*)pData)))>OptHeader.Length-6 ||
+           OptHeader.Length!=6+NameLen+
+             2*be16toh(*((uint16_t*)(pData+4+NameLen))))
+        {
+          if(!NbdSendOptionReply(pConn,OptHeader.Option,NBD_REP_ERR_INVALID,
+                                 NULL,0))
+          {
+            goto NbdHandshake_end;
+          }
+          break;
+        }
+        pData[4+NameLen]='\0';
+        if(!NbdFindExport(pData+4,&pFile,&size)) {
+          if(!NbdSendOptionReply(pConn,OptHeader.Option,NBD_REP_ERR_UNKNOWN,
+                                 NULL,0))
+          {
+            goto NbdHandshake_end;
+          }
+          break;
+        }
+        if(!NbdSendExportInfo(pConn,OptHeader.Option,size)) {
+          goto NbdHandshake_end;
+        }
+        if(OptHeader.Option==NBD_OPT_GO) {
+          pConn->pExport=pFile;
+          pConn->ExportSize=size;
+          ret=TRUE;
+          goto NbdHandshake_end;
+        }
+        break;
+      case NBD_OPT_STRUCTURED_REPLY:
+        if(OptHeader.Length!=0) {
+          if(!NbdSendOptionReply(pConn,OptHeader.Option,NBD_REP_ERR_INVALID,
+                                 NULL,0))
+          {
+            goto NbdHandshake_end;
+          }
+          break;
+        }
+        pConn->StructuredReplies=TRUE;
+        if(!NbdSendOptionReply(pConn,OptHeader.Option,NBD_REP_ACK,NULL,0)) {
+          goto NbdHandshake_end;
+        }
+        break;
+      case NBD_OPT_LIST_META_CONTEXT:
+      case NBD_OPT_SET_META_CONTEXT:
+        if(!NbdHandleMetaContext(pConn,
+                                 OptHeader.Option,
+                                 pData,
+                                 OptHeader.Length))
+        {
+          goto NbdHandshake_end;
+        }
+        break;
+      default:
+        // Including NBD_OPT_STARTTLS
+        if(!NbdSendOptionReply(pConn,OptHeader.Option,NBD_REP_ERR_UNSUP,
+                               NULL,0))
+        {
+          goto NbdHandshake_end;
+        }
     }
-  } else {
-    // Attempt to open a non existant file
-    LOG_DEBUG("Attempt to open non existant file \"%s\".\n",path)
-    return -ENOENT;
   }
+
+NbdHandshake_end:
+  free(pData);
+  return ret;
 }
 
 /*
- * ReadVirtFile:
- *   FUSE read implementation
+ * NbdSendReply:
+ *   Send reply to a NBD request. If structured replies were negotiated, reads
+ *   and errors are sent as a single structured reply chunk.
  *
  * Params:
- *   buf: Buffer where read data is written to
- *   size: Number of bytes to read
- *   offset: Offset to start reading at
- *   fi: ?? but not used
+ *   pConn: NBD connection
+ *   pRequest: Request to reply to (in host byte order)
+ *   error: Error value (NBD_E*) or 0 on success
+ *   pData: Data read by a NBD_CMD_READ request (May be NULL)
+ *   DataSize: Size of read data
  *
  * Returns:
- *   Read bytes on success, negated error code on error
+ *   "TRUE" on success, "FALSE" on error
  */
-static int ReadVirtFile(const char *path,
-                        char *buf,
-                        size_t size,
-                        off_t offset,
-                        struct fuse_file_info *fi)
+static int NbdSendReply(pTNbdConnection pConn,
+                        pTNbdRequest pRequest,
+                        uint32_t error,
+                        const char *pData,
+                        uint32_t DataSize)
 {
-  uint64_t len;
-
-  if(strcmp(path,XMountConfData.pVirtualImagePath)==0) {
-    // Wait for other threads to end reading/writing data
-    pthread_mutex_lock(&mutex_image_rw);
-
-    // Get virtual image file size
-    if(!GetVirtImageSize(&len)) {
-      LOG_ERROR("Couldn't get virtual image size!\n")
-      pthread_mutex_unlock(&mutex_image_rw);
-      return 0;
-    }
-    if(offset<len) {
-      if(offset+size>len) size=len-offset;
-      if(GetVirtImageData(buf,offset,size)!=size) {
-        LOG_ERROR("Couldn't read data from virtual image file!\n")
-        pthread_mutex_unlock(&mutex_image_rw);
-        return 0;
-      }
-    } else {
-      LOG_DEBUG("Attempt to read past EOF of virtual image file\n");
-      pthread_mutex_unlock(&mutex_image_rw);
-      return 0;
-    }
-
-    // Allow other threads to read/write data again
-    pthread_mutex_unlock(&mutex_image_rw);
+  TNbdSimpleReply SimpleReply;
+  TNbdStructuredReply ChunkHeader;
+  char buf[8];
 
-  } else if(strcmp(path,XMountConfData.pVirtualImageInfoPath)==0) {
-    // Read data from virtual image info file
-    len=strlen(pVirtualImageInfoFile);
-    if(offset<len) {
-      if(offset+size>len) {
-        size=len-offset;
-        LOG_DEBUG("Attempt to read past EOF of virtual image info file\n")
-      }
-      pthread_mutex_lock(&mutex_info_read);
-      memcpy(buf,pVirtualImageInfoFile+offset,size);
-      pthread_mutex_unlock(&mutex_info_read);
-      LOG_DEBUG("Read %" PRIu64 " bytes at offset %" PRIu64
-                " from virtual image info file\n",size,offset)
-    } else {
-      LOG_DEBUG("Attempt to read past EOF of virtual info file\n");
-      return 0;
-    }
-  } else if(strcmp(path,XMountConfData.pVirtualVmdkPath)==0) {
-    // Read data from virtual vmdk file
-    len=VirtualVmdkFileSize;
-    if(offset<len) {
-      if(offset+size>len) {
-        LOG_DEBUG("Attempt to read past EOF of virtual vmdk file\n")
-        LOG_DEBUG("Adjusting read size from %u to %u\n",size,len-offset)
-        size=len-offset;
-      }
-      pthread_mutex_lock(&mutex_image_rw);
-      memcpy(buf,pVirtualVmdkFile+offset,size);
-      pthread_mutex_unlock(&mutex_image_rw);
-      LOG_DEBUG("Read %" PRIu64 " bytes at offset %" PRIu64
-                " from virtual vmdk file\n",size,offset)
-    } else {
-      LOG_DEBUG("Attempt to read behind EOF of virtual vmdk file\n");
-      return 0;
-    }
-  } else if(pVirtualVmdkLockFileName!=NULL &&
-            strcmp(path,pVirtualVmdkLockFileName)==0)
+  if(!pConn->StructuredReplies ||
+     (error==0 && pRequest->Type!=NBD_CMD_READ))
   {
-    // Read data from virtual lock file
-    len=VirtualVmdkLockFileDataSize;
-    if(offset<len) {
-      if(offset+size>len) {
-        LOG_DEBUG("Attempt to read past EOF of virtual vmdk lock file\n")
-        LOG_DEBUG("Adjusting read size from %u to %u\n",size,len-offset)
-        size=len-offset;
-      }
-      pthread_mutex_lock(&mutex_image_rw);
-      memcpy(buf,pVirtualVmdkLockFileData+offset,size);
-      pthread_mutex_unlock(&mutex_image_rw);
-      LOG_DEBUG("Read %" PRIu64 " bytes at offset %" PRIu64
-                " from virtual vmdk lock file\n",size,offset)
-    } else {
-      LOG_DEBUG("Attempt to read past EOF of virtual vmdk lock file\n");
-      return 0;
+    SimpleReply.Magic=htobe32(NBD_SIMPLE_REPLY_MAGIC);
+    SimpleReply.Error=htobe32(error);
+    SimpleReply.Handle=pRequest->Handle;
+    if(!NbdSend(pConn->Socket,&SimpleReply,sizeof(TNbdSimpleReply))) {
+      return FALSE;
     }
-  } else {
-    // Attempt to read non existant file
-    LOG_DEBUG("Attempt to read from non existant file \"%s\"\n",path)
-    return -ENOENT;
+    if(error==0 && DataSize!=0) return NbdSend(pConn->Socket,pData,DataSize);
+    return TRUE;
   }
 
-  return size;
+  ChunkHeader.Magic=htobe32(NBD_STRUCTURED_REPLY_MAGIC);
+  ChunkHeader.Flags=htobe16(NBD_REPLY_FLAG_DONE);
+  ChunkHeader.Handle=pRequest->Handle;
+  if(error!=0) {
+    // Error chunk without message
+    ChunkHeader.Type=htobe16(NBD_REPLY_TYPE_ERROR);
+    ChunkHeader.Length=htobe32(6);
+    *((uint32_t*)buf)=htobe32(error);
+    *((uint16_t*)(buf+4))=0;
+    return NbdSend(pConn->Socket,&ChunkHeader,sizeof(TNbdStructuredReply)) &&
+           NbdSend(pConn->Socket,buf,6);
+  }
+  if(DataSize==0) {
+    ChunkHeader.Type=htobe16(NBD_REPLY_TYPE_NONE);
+    ChunkHeader.Length=0;
+    return NbdSend(pConn->Socket,&ChunkHeader,sizeof(TNbdStructuredReply));
+  }
+  ChunkHeader.Type=htobe16(NBD_REPLY_TYPE_OFFSET_DATA);
+  ChunkHeader.Length=htobe32(8+DataSize);
+  *((uint64_t*)buf)=htobe64(pRequest->Offset);
+  return NbdSend(pConn->Socket,&ChunkHeader,sizeof(TNbdStructuredReply)) &&
+         NbdSend(pConn->Socket,buf,8) &&
+         NbdSend(pConn->Socket,pData,DataSize);
 }
 
 /*
- * RenameVirtFile:
- *   FUSE rename implementation
+ * NbdGetExtent:
+ *   Get allocation state of the exported file starting at the given offset
+ *   (See GetVirtFileExtent).
  *
  * Params:
- *   path: File to rename
- *   npath: New filename
+ *   pConn: NBD connection
+ *   offset: Offset inside export
+ *   length: Max. length of extent
  *
  * Returns:
- *   "0" on error, negated error code on error
+ *   Length of extent. Its flags (NBD_STATE_*) are written to pFlags
  */
-static int RenameVirtFile(const char *path, const char *npath) {
-  if(XMountConfData.VirtImageType==TVirtImageType_VMDK ||
-     XMountConfData.VirtImageType==TVirtImageType_VMDKS)
-  {
-    if(pVirtualVmdkLockFileName!=NULL &&
-       strcmp(path,pVirtualVmdkLockFileName)==0)
-    {
-      LOG_DEBUG("Renaming virtual lock file from \"%s\" to \"%s\"\n",
-                pVirtualVmdkLockFileName,
-                npath)
-      XMOUNT_REALLOC(pVirtualVmdkLockFileName,char*,
-                     (strlen(npath)+1)*sizeof(char));
-      strcpy(pVirtualVmdkLockFileName,npath);
-      return 0;
-    }
-  }
-  return -ENOENT;
+static uint32_t NbdGetExtent(pTNbdConnection pConn,
+                             uint64_t offset,
+                             uint32_t length,
+                             uint32_t *pFlags)
+{
+  int zero;
+
+  length=GetVirtFileExtent(pConn->pExport,offset,length,&zero);
+  if(zero) *pFlags=NBD_STATE_HOLE | NBD_STATE_ZERO;
+  else *pFlags=0;
+  return length;
 }
 
 /*
- * DeleteVirtDir:
- *   FUSE rmdir implementation
+ * NbdSendBlockStatus:
+ *   Reply to a NBD_CMD_BLOCK_STATUS request
  *
  * Params:
- *   path: Directory to delete
+ *   pConn: NBD connection
+ *   pRequest: Request to reply to (in host byte order)
+ *   pBuf: Buffer of at least 4+8*NBD_MAX_EXTENTS bytes
  *
  * Returns:
- *   "0" on success, negated error code on error
+ *   "TRUE" on success, "FALSE" on error
  */
-static int DeleteVirtDir(const char *path) {
-  // Only VMWare's lock directories can be deleted
-  if(XMountConfData.VirtImageType==TVirtImageType_VMDK ||
-     XMountConfData.VirtImageType==TVirtImageType_VMDKS)
-  {
-    if(pVirtualVmdkLockDir!=NULL && strcmp(path,pVirtualVmdkLockDir)==0) {
-      LOG_DEBUG("Deleting virtual lock dir \"%s\"\n",pVirtualVmdkLockDir)
-      free(pVirtualVmdkLockDir);
-      pVirtualVmdkLockDir=NULL;
-      return 0;
-    } else if(pVirtualVmdkLockDir2!=NULL &&
-              strcmp(path,pVirtualVmdkLockDir2)==0)
-    {
-      LOG_DEBUG("Deleting virtual lock dir \"%s\"\n",pVirtualVmdkLockDir)
-      free(pVirtualVmdkLockDir2);
-      pVirtualVmdkLockDir2=NULL;
-      return 0;
+static int NbdSendBlockStatus(pTNbdConnection pConn,
+                              pTNbdRequest pRequest,
+                              char *pBuf)
+{
+  TNbdStructuredReply ChunkHeader;
+  uint64_t offset=pRequest->Offset;
+  uint32_t remaining=pRequest->Length;
+  uint32_t count=0,len,flags,LastFlags=0;
+  uint32_t *pExtents=(uint32_t*)(pBuf+4);
+
+  *((uint32_t*)pBuf)=htobe32(NBD_META_CONTEXT_ALLOCATION_ID);
+  while(remaining!=0 && count<NBD_MAX_EXTENTS) {
+    len=NbdGetExtent(pConn,offset,remaining,&flags);
+    if(count!=0 && flags==LastFlags) {
+      // Extend previous extent
+      pExtents[2*(count-1)]=htobe32(be32toh(pExtents[2*(count-1)])+len);
+    } else {
+      if((pRequest->Flags & NBD_CMD_FLAG_REQ_ONE) && count==1) break;
+      pExtents[2*count]=htobe32(len);
+      pExtents[2*count+1]=htobe32(flags);
+      LastFlags=flags;
+      count++;
     }
+    offset+=len;
+    remaining-=len;
   }
-  return -1;
+
+  ChunkHeader.Magic=htobe32(NBD_STRUCTURED_REPLY_MAGIC);
+  ChunkHeader.Flags=htobe16(NBD_REPLY_FLAG_DONE);
+  ChunkHeader.Type=htobe16(NBD_REPLY_TYPE_BLOCK_STATUS);
+  ChunkHeader.Handle=pRequest->Handle;
+  ChunkHeader.Length=htobe32(4+8*count);
+  return NbdSend(pConn->Socket,&ChunkHeader,sizeof(TNbdStructuredReply)) &&
+         NbdSend(pConn->Socket,pBuf,4+8*count);
 }
 
 /*
- * DeleteVirtFile:
- *   FUSE unlink implementation
+ * FlushCacheFile:
+ *   Make sure all changes written to the cache file are on disk
  *
  * Params:
- *   path: File to delete
+ *   n/a
  *
  * Returns:
- *   "0" on success, negated error code on error
+ *   "TRUE" on success, "FALSE" on error
  */
-static int DeleteVirtFile(const char *path) {
-  // Only VMWare's lock file can be deleted
-  if(XMountConfData.VirtImageType==TVirtImageType_VMDK ||
-     XMountConfData.VirtImageType==TVirtImageType_VMDKS)
-  {
-    if(pVirtualVmdkLockFileName!=NULL &&
-       strcmp(path,pVirtualVmdkLockFileName)==0)
-    {
-      LOG_DEBUG("Deleting virtual file \"%s\"\n",pVirtualVmdkLockFileName)
-      free(pVirtualVmdkLockFileName);
-      free(pVirtualVmdkLockFileData);
-      pVirtualVmdkLockFileName=NULL;
-      pVirtualVmdkLockFileData=NULL;
-      VirtualVmdkLockFileDataSize=0;
-      return 0;
-    }
-  }
-  return -1;
+static int FlushCacheFile() {
+  int ret=TRUE;
+
+  if(!XMountConfData.Writable) return TRUE;
+  pthread_mutex_lock(&mutex_image_rw);
+  if(fflush(hCacheFile)!=0 || fsync(fileno(hCacheFile))!=0) ret=FALSE;
+  pthread_mutex_unlock(&mutex_image_rw);
+  return ret;
 }
 
 /*
- * GetVirtFsStats:
- *   FUSE statfs implementation
+ * NbdHandleRequests:
+ *   Process NBD requests of a client until it disconnects
  *
  * Params:
- *   path: Get stats for fs that the specified file resides in
- *   stats: Stats
+ *   pConn: NBD connection
  *
  * Returns:
- *   "0" on success, negated error code on error
+ *   n/a
  */
-/*
-static int GetVirtFsStats(const char *path, struct statvfs *stats) {
-  struct statvfs CacheFileFsStats;
+static void NbdHandleRequests(pTNbdConnection pConn) {
+  TNbdRequest request;
+  char *pBuf=NULL;
+  uint32_t BufSize=4+8*NBD_MAX_EXTENTS;
+  uint32_t error;
   int ret;
 
-  if(XMountConfData.Writable==TRUE) {
-    // If write support is enabled, return stats of fs upon which cache file
-    // resides in
-    if((ret=statvfs(XMountConfData.pCacheFile,&CacheFileFsStats))==0) {
-      memcpy(stats,&CacheFileFsStats,sizeof(struct statvfs));
-      return 0;
-    } else {
-      LOG_ERROR("Couldn't get stats for fs upon which resides \"%s\"\n",
-                XMountConfData.pCacheFile)
-      return ret;
+  XMOUNT_MALLOC(pBuf,char*,BufSize*sizeof(char))
+  while(NbdRecv(pConn->Socket,&request,sizeof(TNbdRequest))) {
+    if(be32toh(request.Magic)!=NBD_REQUEST_MAGIC) break;
+    // Handle is sent back as is
+    request.Flags=be16toh(request.Flags);
+    request.Type=be16toh(request.Type);
+    request.Offset=be64toh(request.Offset);
+    request.Length=be32toh(request.Length);
+    if(request.Type==NBD_CMD_DISC) break;
+
+    error=0;
+    if((request.Type==NBD_CMD_READ || request.Type==NBD_CMD_WRITE) &&
+       request.Length>NBD_MAX_REQUEST_SIZE)
+    {
+      // Request data can't be skipped reliably
+      LOG_ERROR("NBD client sent oversized request!\n")
+      break;
+    }
+    if(request.Type==NBD_CMD_WRITE) {
+      if(request.Length>BufSize) {
+        BufSize=request.Length;
+        XMOUNT_REALLOC(pBuf,char*,BufSize*sizeof(char))
+      }
+      if(!NbdRecv(pConn->Socket,pBuf,request.Length)) break;
     }
-  } else {
-    // TODO: Return read only
-    return 0;
+    if((request.Type==NBD_CMD_READ ||
+        request.Type==NBD_CMD_WRITE ||
+        request.Type==NBD_CMD_BLOCK_STATUS) &&
+       (request.Offset>pConn->ExportSize ||
+        request.Length>pConn->ExportSize-request.Offset))
+    {
+      error=(request.Type==NBD_CMD_WRITE) ? NBD_ENOSPC : NBD_EINVAL;
+      if(!NbdSendReply(pConn,&request,error,NULL,0)) break;
+      continue;
+    }
+
+    switch(request.Type) {
+      case NBD_CMD_READ:
+        if(request.Length>BufSize) {
+          BufSize=request.Length;
+          XMOUNT_REALLOC(pBuf,char*,BufSize*sizeof(char))
+        }
+        if(request.Length!=0) {
+          ret=pConn->pExport->pOps->Read(pConn->pExport,
+                                         pBuf,
+                                         request.Length,
+                                         request.Offset);
+          if(ret!=request.Length) error=NBD_EIO;
+        }
+        ret=NbdSendReply(pConn,&request,error,pBuf,request.Length);
+        break;
+      case NBD_CMD_WRITE:
+        if(!XMountConfData.Writable) error=NBD_EPERM;
+        else if(request.Length!=0) {
+          ret=pConn->pExport->pOps->Write(pConn->pExport,
+                                          pBuf,
+                                          request.Length,
+                                          request.Offset);
+          if(ret!=request.Length) error=NBD_EIO;
+          else if((request.Flags & NBD_CMD_FLAG_FUA) && !FlushCacheFile()) {
+            error=NBD_EIO;
+          }
+        }
+        ret=NbdSendReply(pConn,&request,error,NULL,0);
+        break;
+      case NBD_CMD_FLUSH:
+        if(!FlushCacheFile()) error=NBD_EIO;
+        ret=NbdSendReply(pConn,&request,error,NULL,0);
+        break;
+      case NBD_CMD_BLOCK_STATUS:
+        if(!pConn->BlockStatus || request.Length==0) {
+          ret=NbdSendReply(pConn,&request,NBD_EINVAL,NULL,0);
+        } else ret=NbdSendBlockStatus(pConn,&request,pBuf);
+        break;
+      default:
+        ret=NbdSendReply(pConn,&request,NBD_EINVAL,NULL,0);
+    }
+    if(!ret) break;
   }
+  free(pBuf);
 }
-*/
 
 /*
- * WriteVirtFile:
- *   FUSE write implementation
+ * NbdServeClient:
+ *   Thread serving a single NBD client
  *
  * Params:
- *   buf: Buffer containing data to write
- *   size: Number of bytes to write
- *   offset: Offset to start writing at
- *   fi: ?? but not used
+ *   p: NBD connection
  *
  * Returns:
- *   Written bytes on success, negated error code on error
+ *   NULL
  */
-static int WriteVirtFile(const char *path,
-                         const char *buf,
-                         size_t size,
-                         off_t offset,
-                         struct fuse_file_info *fi)
-{
-  uint64_t len;
+static void *NbdServeClient(void *p) {
+  pTNbdConnection pConn=(pTNbdConnection)p;
+  uint32_t i;
 
-  if(strcmp(path,XMountConfData.pVirtualImagePath)==0) {
-    // Wait for other threads to end reading/writing data
-    pthread_mutex_lock(&mutex_image_rw);
-
-    // Get virtual image file size
-    if(!GetVirtImageSize(&len)) {
-      LOG_ERROR("Couldn't get virtual image size!\n")
-      pthread_mutex_unlock(&mutex_image_rw);
-      return 0;
-    }
-    if(offset<len) {
-      if(offset+size>len) size=len-offset;
-      if(SetVirtImageData(buf,offset,size)!=size) {
-        LOG_ERROR("Couldn't write data to virtual image file!\n")
-        pthread_mutex_unlock(&mutex_image_rw);
-        return 0;
-      }
-    } else {
-      LOG_DEBUG("Attempt to write past EOF of virtual image file\n")
-      pthread_mutex_unlock(&mutex_image_rw);
-      return 0;
-    }
+  if(NbdHandshake(pConn)) {
+    LOG_DEBUG("NBD client selected export \"%s\"\n",pConn->pExport->pName)
+    NbdHandleRequests(pConn);
+  }
 
-    // Allow other threads to read/write data again
-    pthread_mutex_unlock(&mutex_image_rw);
-  } else if(strcmp(path,XMountConfData.pVirtualVmdkPath)==0) {
-    pthread_mutex_lock(&mutex_image_rw);
-    len=VirtualVmdkFileSize;
-    if((offset+size)>len) {
-      // Enlarge or create buffer if needed
-      if(len==0) {
-        len=offset+size;
-        XMOUNT_MALLOC(pVirtualVmdkFile,char*,len*sizeof(char))
-      } else {
-        len=offset+size;
-        XMOUNT_REALLOC(pVirtualVmdkFile,char*,len*sizeof(char))
-      }
-      VirtualVmdkFileSize=offset+size;
-    }
-    // Copy data to buffer
-    memcpy(pVirtualVmdkFile+offset,buf,size);
-    pthread_mutex_unlock(&mutex_image_rw);
-  } else if(pVirtualVmdkLockFileName!=NULL &&
-            strcmp(path,pVirtualVmdkLockFileName)==0)
-  {
-    pthread_mutex_lock(&mutex_image_rw);
-    if((offset+size)>VirtualVmdkLockFileDataSize) {
-      // Enlarge or create buffer if needed
-      if(VirtualVmdkLockFileDataSize==0) {
-        VirtualVmdkLockFileDataSize=offset+size;
-        XMOUNT_MALLOC(pVirtualVmdkLockFileData,char*,
-                      VirtualVmdkLockFileDataSize*sizeof(char))
-      } else {
-        VirtualVmdkLockFileDataSize=offset+size;
-        XMOUNT_REALLOC(pVirtualVmdkLockFileData,char*,
-                       VirtualVmdkLockFileDataSize*sizeof(char))
-      }
+  // Unregister connection
+  pthread_mutex_lock(&mutex_nbd);
+  for(i=0;i<NBD_MAX_CONNECTIONS;i++) {
+    if(NbdClientSockets[i]==pConn->Socket) {
+      NbdClientSockets[i]=-1;
+      break;
     }
-    // Copy data to buffer
-    memcpy(pVirtualVmdkLockFileData+offset,buf,size);
-    pthread_mutex_unlock(&mutex_image_rw);
-  } else if(strcmp(path,XMountConfData.pVirtualImageInfoPath)==0) {
-    // Attempt to write data to read only image info file
-    LOG_DEBUG("Attempt to write data to virtual info file\n");
-    return -ENOENT;
-  } else {
-    // Attempt to write to non existant file
-    LOG_DEBUG("Attempt to write to the non existant file \"%s\"\n",path)
-    return -ENOENT;
   }
-
-  return size;
+  close(pConn->Socket);
+  NbdClientCount--;
+  pthread_cond_signal(&cond_nbd);
+  pthread_mutex_unlock(&mutex_nbd);
+  free(pConn);
+  return NULL;
 }
 
 /*
- * CalculateInputImageHash:
- *   Calculates an MD5 hash of the first HASH_AMOUNT bytes of the input image.
+ * NbdStopServer:
+ *   Signal handler stopping the NBD server
  *
  * Params:
- *   pHashLow : Pointer to the lower 64 bit of the hash
- *   pHashHigh : Pointer to the higher 64 bit of the hash
+ *   sig: Signal number
  *
  * Returns:
- *   TRUE on success, FALSE on error
+ *   n/a
  */
-static int CalculateInputImageHash(uint64_t *pHashLow, uint64_t *pHashHigh) {
-  char hash[16];
-  md5_state_t md5_state;
-  char *buf;
-  XMOUNT_MALLOC(buf,char*,HASH_AMOUNT*sizeof(char))
-  size_t read_data=GetOrigImageData(buf,0,HASH_AMOUNT);
-  if(read_data>0) {
-    // Calculate MD5 hash
-    md5_init(&md5_state);
-    md5_append(&md5_state,buf,HASH_AMOUNT);
-    md5_finish(&md5_state,hash);
-    // Convert MD5 hash into two 64bit integers
-    *pHashLow=*((uint64_t*)hash);
-    *pHashHigh=*((uint64_t*)(hash+8));
-    free(buf);
-    return TRUE;
-  } else {
-    LOG_ERROR("Couldn't read data from original image file!\n")
-    free(buf);
-    return FALSE;
-  }
+static void NbdStopServer(int sig) {
+  NbdServerStop=TRUE;
+  // Wake up accept()
+  shutdown(NbdListenSocket,SHUT_RDWR);
 }
 
 /*
- * InitVirtVdiHeader:
- *   Build and init virtual VDI file header
+ * NbdOpenListenSocket:
+ *   Create NBD listen socket. NBD has no authentication, so if the NBD address
+ *   only consists of digits, it is used as TCP port on the loopback interface.
+ *   Other interfaces need an explicit "<host>:<port>" or "[<ipv6>]:<port>"
+ *   address (e.g. "0.0.0.0:10809"). Anything else is the path of a unix
+ *   socket to create.
  *
  * Params:
  *   n/a
@@ -2188,94 +10281,93 @@ static int CalculateInputImageHash(uint64_t *pHashLow, uint64_t *pHashHigh) {
  * Returns:
  *   "TRUE" on success, "FALSE" on error
  */
-static int InitVirtVdiHeader() {
-  // See http://forums.virtualbox.org/viewtopic.php?t=8046 for a
-  // "description" of the various header fields
-
-  uint64_t ImageSize;
-  off_t offset;
-  uint32_t i,BlockEntries;
+static int NbdOpenListenSocket() {
+  char *pAddress=XMountConfData.pNbdAddress;
+  char *pHost=NULL;
+  char *pPort=strrchr(pAddress,':');
+  struct addrinfo hints;
+  struct addrinfo *pAddrInfo,*pCur;
+  struct sockaddr_un UnixAddr;
+  int on=1;
+  int ret;
 
-  // Get input image size
-  if(!GetOrigImageSize(&ImageSize)) {
-    LOG_ERROR("Couldn't get input image size!\n")
-    return FALSE;
+  if(strspn(pAddress,"0123456789")==strlen(pAddress)) {
+    // Bare TCP port, only reachable from this machine
+    XMOUNT_STRSET(pHost,"127.0.0.1")
+    pPort=pAddress;
+  } else if(strchr(pAddress,'/')==NULL && pPort!=NULL && pPort[1]!='\0' &&
+            strspn(pPort+1,"0123456789")==strlen(pPort+1))
+  {
+    // Host and TCP port. IPv6 addresses are enclosed in brackets.
+    if(pAddress[0]=='[' && pPort>pAddress+1 && pPort[-1]==']') {
+      XMOUNT_STRNSET(pHost,pAddress+1,pPort-pAddress-2)
+    } else XMOUNT_STRNSET(pHost,pAddress,pPort-pAddress)
+    pPort++;
   }
 
-  // Calculate how many VDI blocks we need
-  BlockEntries=ImageSize/VDI_IMAGE_BLOCK_SIZE;
-  if((ImageSize%VDI_IMAGE_BLOCK_SIZE)!=0) BlockEntries++;
-  VdiBlockMapSize=BlockEntries*sizeof(uint32_t);
-  LOG_DEBUG("BlockMap: %d (%08X) entries, %d (%08X) bytes!\n",
-            BlockEntries,
-            BlockEntries,
-            VdiBlockMapSize,
-            VdiBlockMapSize)
-
-  // Allocate memory for vdi header and block map
-  VdiFileHeaderSize=sizeof(TVdiFileHeader)+VdiBlockMapSize;
-  XMOUNT_MALLOC(pVdiFileHeader,pTVdiFileHeader,VdiFileHeaderSize)
-  memset(pVdiFileHeader,0,VdiFileHeaderSize);
-  pVdiBlockMap=((void*)pVdiFileHeader)+sizeof(TVdiFileHeader);
-
-  // Init header values
-  strncpy(pVdiFileHeader->szFileInfo,VDI_FILE_COMMENT,
-          strlen(VDI_FILE_COMMENT)+1);
-  pVdiFileHeader->u32Signature=VDI_IMAGE_SIGNATURE;
-  pVdiFileHeader->u32Version=VDI_IMAGE_VERSION;
-  pVdiFileHeader->cbHeader=0x00000180;  // No idea what this is for! Testimage had same value
-  pVdiFileHeader->u32Type=VDI_IMAGE_TYPE_FIXED;
-  pVdiFileHeader->fFlags=VDI_IMAGE_FLAGS;
-  strncpy(pVdiFileHeader->szComment,VDI_HEADER_COMMENT,
-          strlen(VDI_HEADER_COMMENT)+1);
-  pVdiFileHeader->offData=VdiFileHeaderSize;
-  pVdiFileHeader->offBlocks=sizeof(TVdiFileHeader);
-  pVdiFileHeader->cCylinders=0; // Legacy info
-  pVdiFileHeader->cHeads=0; // Legacy info
-  pVdiFileHeader->cSectors=0; // Legacy info
-  pVdiFileHeader->cbSector=512; // Legacy info
-  pVdiFileHeader->u32Dummy=0;
-  pVdiFileHeader->cbDisk=ImageSize;
-  // Seems as VBox is always using a 1MB blocksize
-  pVdiFileHeader->cbBlock=VDI_IMAGE_BLOCK_SIZE;
-  pVdiFileHeader->cbBlockExtra=0;
-  pVdiFileHeader->cBlocks=BlockEntries;
-  pVdiFileHeader->cBlocksAllocated=BlockEntries;
-  // Use partial MD5 input file hash as creation UUID and generate a random
-  // modification UUID. VBox won't accept immages where create and modify UUIDS
-  // aren't set.
-  pVdiFileHeader->uuidCreate_l=XMountConfData.InputHashLo;
-  pVdiFileHeader->uuidCreate_h=XMountConfData.InputHashHi;
-  //*((uint32_t*)(&(pVdiFileHeader->uuidCreate_l)))=rand();
-  //*((uint32_t*)(&(pVdiFileHeader->uuidCreate_l))+4)=rand();
-  //*((uint32_t*)(&(pVdiFileHeader->uuidCreate_h)))=rand();
-  //*((uint32_t*)(&(pVdiFileHeader->uuidCreate_h))+4)=rand();
-
-#define rand64(var) {              \
-  *((uint32_t*)&(var))=rand();     \
-  *(((uint32_t*)&(var))+1)=rand(); \
-}
-
-  rand64(pVdiFileHeader->uuidModify_l);
-  rand64(pVdiFileHeader->uuidModify_h);
-
-#undef rand64
-
-  // Generate block map
-  i=0;
-  for(offset=0;offset<VdiBlockMapSize;offset+=4) {
-    *((uint32_t*)(pVdiBlockMap+offset))=i;
-    i++;
+  if(pHost!=NULL) {
+    // TCP socket
+    memset(&hints,0,sizeof(struct addrinfo));
+    hints.ai_family=AF_UNSPEC;
+    hints.ai_socktype=SOCK_STREAM;
+    hints.ai_flags=AI_PASSIVE;
+    ret=getaddrinfo(pHost,pPort,&hints,&pAddrInfo);
+    free(pHost);
+    if(ret!=0) {
+      LOG_ERROR("Couldn't resolve NBD address \"%s\": %s\n",
+                pAddress,gai_strerror(ret))
+      return FALSE;
+    }
+    // Prefer an IPv6 socket which, when bound to "::", usually also accepts
+    // IPv4 connections
+    for(pCur=pAddrInfo;pCur!=NULL;pCur=pCur->ai_next) {
+      if(pCur->ai_family==AF_INET6) break;
+    }
+    if(pCur==NULL) pCur=pAddrInfo;
+    NbdListenSocket=socket(pCur->ai_family,pCur->ai_socktype,
+                           pCur->ai_protocol);
+    if(NbdListenSocket<0) {
+      LOG_ERROR("Couldn't create NBD socket: %s\n",strerror(errno))
+      freeaddrinfo(pAddrInfo);
+      return FALSE;
+    }
+    setsockopt(NbdListenSocket,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+    ret=bind(NbdListenSocket,pCur->ai_addr,pCur->ai_addrlen);
+    freeaddrinfo(pAddrInfo);
+    NbdUnixSocket=FALSE;
+  } else {
+    // Unix socket
+    if(strlen(pAddress)>=sizeof(UnixAddr.sun_path)) {
+      LOG_ERROR("NBD socket path \"%s\" is too long!\n",pAddress)
+      return FALSE;
+    }
+    memset(&UnixAddr,0,sizeof(struct sockaddr_un));
+    UnixAddr.sun_family=AF_UNIX;
+    strcpy(UnixAddr.sun_path,pAddress);
+    NbdListenSocket=socket(AF_UNIX,SOCK_STREAM,0);
+    if(NbdListenSocket<0) {
+      LOG_ERROR("Couldn't create NBD socket: %s\n",strerror(errno))
+      return FALSE;
+    }
+    ret=bind(NbdListenSocket,
+             (struct sockaddr*)&UnixAddr,
+             sizeof(struct sockaddr_un));
+    NbdUnixSocket=TRUE;
+  }
+  if(ret!=0 || listen(NbdListenSocket,NBD_MAX_CONNECTIONS)!=0) {
+    LOG_ERROR("Couldn't listen on NBD address \"%s\": %s\n",
+              pAddress,strerror(errno))
+    close(NbdListenSocket);
+    NbdListenSocket=-1;
+    return FALSE;
   }
-
-  LOG_DEBUG("VDI header size = %u\n",VdiFileHeaderSize)
-
   return TRUE;
 }
 
 /*
- * InitVirtVhdHeader:
- *   Build and init virtual VHD file header
+ * NbdServe:
+ *   Serve virtual images and partitions via NBD until SIGINT or SIGTERM is
+ *   received. Used instead of FuseServe when --nbd was specified.
  *
  * Params:
  *   n/a
@@ -2283,443 +10375,855 @@ static int InitVirtVdiHeader() {
  * Returns:
  *   "TRUE" on success, "FALSE" on error
  */
-static int InitVirtVhdHeader() {
-  uint64_t orig_image_size=0;
-  uint16_t i=0;
-  uint64_t geom_tot_s=0;
-  uint64_t geom_c_x_h=0;
-  uint16_t geom_c=0;
-  uint8_t geom_h=0;
-  uint8_t geom_s=0;
-  uint32_t checksum=0;
-
-  // Get input image size
-  if(!GetOrigImageSize(&orig_image_size)) {
-    LOG_ERROR("Couldn't get input image size!\n")
-    return FALSE;
-  }
-
-  // Allocate memory for vhd header
-  XMOUNT_MALLOC(pVhdFileHeader,pTVhdFileHeader,sizeof(TVhdFileHeader))
-  memset(pVhdFileHeader,0,sizeof(TVhdFileHeader));
-
-  // Init header values
-  pVhdFileHeader->cookie=VHD_IMAGE_HVAL_COOKIE;
-  pVhdFileHeader->features=VHD_IMAGE_HVAL_FEATURES;
-  pVhdFileHeader->file_format_version=VHD_IMAGE_HVAL_FILE_FORMAT_VERSION;
-  pVhdFileHeader->data_offset=VHD_IMAGE_HVAL_DATA_OFFSET;
-  pVhdFileHeader->creation_time=htobe32(time(NULL)-
-                                          VHD_IMAGE_TIME_CONVERSION_OFFSET);
-  pVhdFileHeader->creator_app=VHD_IMAGE_HVAL_CREATOR_APPLICATION;
-  pVhdFileHeader->creator_ver=VHD_IMAGE_HVAL_CREATOR_VERSION;
-  pVhdFileHeader->creator_os=VHD_IMAGE_HVAL_CREATOR_HOST_OS;
-  pVhdFileHeader->size_original=htobe64(orig_image_size);
-  pVhdFileHeader->size_current=pVhdFileHeader->size_original;
-
-  // Convert size to sectors
-  if(orig_image_size>136899993600) {
-    // image is larger then CHS values can address.
-    // Set sectors to max (C65535*H16*S255).
-    geom_tot_s=267382800;
-  } else {
-    // Calculate actual sectors
-    geom_tot_s=orig_image_size/512;
-    if((orig_image_size%512)!=0) geom_tot_s++;
-  }
+static int NbdServe() {
+  struct sigaction SigAction;
+  sigset_t SigSet,OldSigSet;
+  pTNbdConnection pConn;
+  pthread_t thread;
+  uint32_t i;
+  int sock;
+  int on=1;
+  int ret;
 
-  // Calculate CHS values. This is done according to the VHD specs
-  if(geom_tot_s>=66059280) { // C65535 * H16 * S63
-    geom_s=255;
-    geom_h=16;
-    geom_c_x_h=geom_tot_s/geom_s;
-  } else {
-    geom_s=17;
-    geom_c_x_h=geom_tot_s/geom_s;
-    geom_h=(geom_c_x_h+1023)/1024;
-    if(geom_h<4) geom_h=4;
-    if(geom_c_x_h>=(geom_h*1024) || geom_h>16) {
-      geom_s=31;
-      geom_h=16;
-      geom_c_x_h=geom_tot_s/geom_s;
+  if(!NbdOpenListenSocket()) return FALSE;
+  pthread_mutex_init(&mutex_nbd,NULL);
+  pthread_cond_init(&cond_nbd,NULL);
+  for(i=0;i<NBD_MAX_CONNECTIONS;i++) NbdClientSockets[i]=-1;
+
+  // Disconnecting clients must not kill us
+  signal(SIGPIPE,SIG_IGN);
+  // Stop on SIGINT and SIGTERM. Only this thread handles them so they are able
+  // to interrupt accept().
+  memset(&SigAction,0,sizeof(struct sigaction));
+  SigAction.sa_handler=NbdStopServer;
+  sigemptyset(&(SigAction.sa_mask));
+  sigaction(SIGINT,&SigAction,NULL);
+  sigaction(SIGTERM,&SigAction,NULL);
+  sigemptyset(&SigSet);
+  sigaddset(&SigSet,SIGINT);
+  sigaddset(&SigSet,SIGTERM);
+
+  // Start the same background threads as when mounting
+  pthread_sigmask(SIG_BLOCK,&SigSet,&OldSigSet);
+  InitFuse(NULL,NULL);
+  pthread_sigmask(SIG_SETMASK,&OldSigSet,NULL);
+
+  LOG_DEBUG("Serving virtual images via NBD on \"%s\"\n",
+            XMountConfData.pNbdAddress)
+  while(!NbdServerStop) {
+    sock=accept(NbdListenSocket,NULL,NULL);
+    if(sock<0) {
+      if(errno==EINTR || errno==ECONNABORTED) continue;
+      if(!NbdServerStop) {
+        LOG_ERROR("Couldn't accept NBD connection: %s\n",strerror(errno))
+      }
+      break;
     }
-    if(geom_c_x_h>=(geom_h*1024)) {
-      geom_s=63;
-      geom_h=16;
-      geom_c_x_h=geom_tot_s/geom_s;
+    if(!NbdUnixSocket) {
+      setsockopt(sock,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
     }
-  }
-  geom_c=geom_c_x_h/geom_h;
 
-  pVhdFileHeader->disk_geometry_c=htobe16(geom_c);
-  pVhdFileHeader->disk_geometry_h=geom_h;
-  pVhdFileHeader->disk_geometry_s=geom_s;
-
-  pVhdFileHeader->disk_type=VHD_IMAGE_HVAL_DISK_TYPE;
-
-  pVhdFileHeader->uuid_l=XMountConfData.InputHashLo;
-  pVhdFileHeader->uuid_h=XMountConfData.InputHashHi;
-  pVhdFileHeader->saved_state=0x00;
+    // Register connection
+    pthread_mutex_lock(&mutex_nbd);
+    if(NbdClientCount==NBD_MAX_CONNECTIONS) {
+      pthread_mutex_unlock(&mutex_nbd);
+      LOG_WARNING("Too many NBD clients. Refusing connection.\n")
+      close(sock);
+      continue;
+    }
+    for(i=0;NbdClientSockets[i]!=-1;i++);
+    NbdClientSockets[i]=sock;
+    NbdClientCount++;
+    pthread_mutex_unlock(&mutex_nbd);
+
+    XMOUNT_MALLOC(pConn,pTNbdConnection,sizeof(TNbdConnection))
+    memset(pConn,0,sizeof(TNbdConnection));
+    pConn->Socket=sock;
+    pthread_sigmask(SIG_BLOCK,&SigSet,&OldSigSet);
+    ret=pthread_create(&thread,NULL,NbdServeClient,pConn);
+    pthread_sigmask(SIG_SETMASK,&OldSigSet,NULL);
+    if(ret!=0) {
+      LOG_ERROR("Couldn't start NBD client thread!\n")
+      pthread_mutex_lock(&mutex_nbd);
+      NbdClientSockets[i]=-1;
+      NbdClientCount--;
+      pthread_mutex_unlock(&mutex_nbd);
+      close(sock);
+      free(pConn);
+    } else pthread_detach(thread);
+  }
 
-  // Calculate footer checksum
-  for(i=0;i<sizeof(TVhdFileHeader);i++) {
-    checksum+=*((uint8_t*)(pVhdFileHeader)+i);
+  // Disconnect remaining clients and wait for their threads to end
+  pthread_mutex_lock(&mutex_nbd);
+  for(i=0;i<NBD_MAX_CONNECTIONS;i++) {
+    if(NbdClientSockets[i]!=-1) shutdown(NbdClientSockets[i],SHUT_RDWR);
   }
-  pVhdFileHeader->checksum=htobe32(~checksum);
+  while(NbdClientCount!=0) pthread_cond_wait(&cond_nbd,&mutex_nbd);
+  pthread_mutex_unlock(&mutex_nbd);
+
+  DestroyFuse(NULL);
+  close(NbdListenSocket);
+  if(NbdUnixSocket) unlink(XMountConfData.pNbdAddress);
+  pthread_cond_destroy(&cond_nbd);
+  pthread_mutex_destroy(&mutex_nbd);
+  return TRUE;
+}
 
-  LOG_DEBUG("VHD header size = %u\n",sizeof(TVhdFileHeader));
+#ifdef WITH_UBLK
+/*
+ * UblkSetupRing:
+ *   Create an io_uring with 128 byte SQEs as needed for ublk commands. liburing
+ *   isn't used to avoid another dependency.
+ *
+ * Params:
+ *   pRing: Ring to set up
+ *   entries: Amount of SQEs
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int UblkSetupRing(pTUblkRing pRing, uint32_t entries) {
+  struct io_uring_params params;
+
+  memset(pRing,0,sizeof(TUblkRing));
+  memset(&params,0,sizeof(struct io_uring_params));
+  params.flags=IORING_SETUP_SQE128;
+  pRing->Fd=syscall(__NR_io_uring_setup,entries,&params);
+  if(pRing->Fd<0) {
+    LOG_ERROR("Couldn't create io_uring: %s\n",strerror(errno))
+    return FALSE;
+  }
 
+  // Map submission and completion rings and SQEs
+  pRing->SqRingSize=params.sq_off.array+params.sq_entries*sizeof(uint32_t);
+  pRing->CqRingSize=params.cq_off.cqes+
+                    params.cq_entries*sizeof(struct io_uring_cqe);
+  pRing->SqesSize=params.sq_entries*UBLK_SQE_SIZE;
+  pRing->pSqRing=mmap(NULL,pRing->SqRingSize,PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,pRing->Fd,IORING_OFF_SQ_RING);
+  pRing->pCqRing=mmap(NULL,pRing->CqRingSize,PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,pRing->Fd,IORING_OFF_CQ_RING);
+  pRing->pSqes=mmap(NULL,pRing->SqesSize,PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE,pRing->Fd,IORING_OFF_SQES);
+  if(pRing->pSqRing==MAP_FAILED ||
+     pRing->pCqRing==MAP_FAILED ||
+     pRing->pSqes==MAP_FAILED)
+  {
+    LOG_ERROR("Couldn't map io_uring: %s\n",strerror(errno))
+    return FALSE;
+  }
+  pRing->pSqTail=(uint32_t*)(pRing->pSqRing+params.sq_off.tail);
+  pRing->SqMask=*((uint32_t*)(pRing->pSqRing+params.sq_off.ring_mask));
+  pRing->pSqArray=(uint32_t*)(pRing->pSqRing+params.sq_off.array);
+  pRing->pCqHead=(uint32_t*)(pRing->pCqRing+params.cq_off.head);
+  pRing->pCqTail=(uint32_t*)(pRing->pCqRing+params.cq_off.tail);
+  pRing->CqMask=*((uint32_t*)(pRing->pCqRing+params.cq_off.ring_mask));
+  pRing->pCqes=(struct io_uring_cqe*)(pRing->pCqRing+params.cq_off.cqes);
   return TRUE;
 }
 
 /*
- * InitVirtualVmdkFile:
- *   Init the virtual VMDK file
+ * UblkFreeRing:
+ *   Unmap and close an io_uring created by UblkSetupRing
  *
  * Params:
- *   n/a
+ *   pRing: Ring to free
  *
  * Returns:
- *   "TRUE" on success, "FALSE" on error
+ *   n/a
  */
-static int InitVirtualVmdkFile() {
-  uint64_t ImageSize=0;
-  uint64_t ImageBlocks=0;
-  char buf[500];
-
-  // Get original image size
-  if(!GetOrigImageSize(&ImageSize)) {
-    LOG_ERROR("Couldn't get original image size!\n")
-    return FALSE;
+static void UblkFreeRing(pTUblkRing pRing) {
+  if(pRing->pSqRing!=NULL && pRing->pSqRing!=MAP_FAILED) {
+    munmap(pRing->pSqRing,pRing->SqRingSize);
   }
+  if(pRing->pCqRing!=NULL && pRing->pCqRing!=MAP_FAILED) {
+    munmap(pRing->pCqRing,pRing->CqRingSize);
+  }
+  if(pRing->pSqes!=NULL && pRing->pSqes!=MAP_FAILED) {
+    munmap(pRing->pSqes,pRing->SqesSize);
+  }
+  if(pRing->Fd>=0) close(pRing->Fd);
+  pRing->Fd=-1;
+}
 
-  ImageBlocks=ImageSize/512;
-  if(ImageSize%512!=0) ImageBlocks++;
+/*
+ * UblkGetSqe:
+ *   Get next free SQE of an io_uring. The SQE is queued for submission with
+ *   the next call to UblkSubmit.
+ *
+ * Params:
+ *   pRing: Ring to get SQE from
+ *
+ * Returns:
+ *   Zeroed SQE. There is always one as never more commands than SQEs are in
+ *   flight.
+ */
+static struct io_uring_sqe *UblkGetSqe(pTUblkRing pRing) {
+  uint32_t tail=*(pRing->pSqTail);
+  uint32_t index=tail & pRing->SqMask;
+  struct io_uring_sqe *pSqe;
+
+  pSqe=(struct io_uring_sqe*)(pRing->pSqes+index*UBLK_SQE_SIZE);
+  memset(pSqe,0,UBLK_SQE_SIZE);
+  pRing->pSqArray[index]=index;
+  __atomic_store_n(pRing->pSqTail,tail+1,__ATOMIC_RELEASE);
+  pRing->Pending++;
+  return pSqe;
+}
 
-#define VMDK_DESC_FILE "# Disk DescriptorFile\n" \
-                       "version=1\n" \
-                       "CID=fffffffe\n" \
-                       "parentCID=ffffffff\n" \
-                       "createType=\"monolithicFlat\"\n\n" \
-                       "# Extent description\n" \
-                       "RW %" PRIu64 " FLAT \"%s\" 0\n\n" \
-                       "# The Disk Data Base\n" \
-                       "#DDB\n" \
-                       "ddb.virtualHWVersion = \"3\"\n" \
-                       "ddb.adapterType = \"%s\"\n" \
-                       "ddb.geometry.cylinders = \"0\"\n" \
-                       "ddb.geometry.heads = \"0\"\n" \
-                       "ddb.geometry.sectors = \"0\"\n"
+/*
+ * UblkSubmit:
+ *   Submit queued SQEs and optionally wait for a completion
+ *
+ * Params:
+ *   pRing: Ring to submit SQEs of
+ *   wait: If "TRUE", wait for at least one CQE
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int UblkSubmit(pTUblkRing pRing, int wait) {
+  int ret;
 
-  if(XMountConfData.VirtImageType==TVirtImageType_VMDK) {
-    // VMDK with IDE bus
-    sprintf(buf,
-            VMDK_DESC_FILE,
-            ImageBlocks,
-            (XMountConfData.pVirtualImagePath)+1,
-            "ide");
-  } else if(XMountConfData.VirtImageType==TVirtImageType_VMDKS){
-    // VMDK with SCSI bus
-    sprintf(buf,
-            VMDK_DESC_FILE,
-            ImageBlocks,
-            (XMountConfData.pVirtualImagePath)+1,
-            "scsi");
-  } else {
-    LOG_ERROR("Unknown virtual VMDK file format!\n")
+  do {
+    ret=syscall(__NR_io_uring_enter,pRing->Fd,pRing->Pending,wait ? 1 : 0,
+                wait ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+  } while(ret<0 && errno==EINTR);
+  if(ret<0) {
+    LOG_ERROR("Couldn't submit to io_uring: %s\n",strerror(errno))
     return FALSE;
   }
-
-#undef VMDK_DESC_FILE
-
-  // Do not use XMOUNT_STRSET here to avoid adding '\0' to the buffer!
-  XMOUNT_MALLOC(pVirtualVmdkFile,char*,strlen(buf))
-  strncpy(pVirtualVmdkFile,buf,strlen(buf));
-  VirtualVmdkFileSize=strlen(buf);
-
+  pRing->Pending-=ret;
   return TRUE;
 }
 
 /*
- * InitVirtImageInfoFile:
- *   Create virtual image info file
+ * UblkCtrlCmd:
+ *   Send a command to the ublk control device and wait for its result
  *
  * Params:
- *   n/a
+ *   CmdOp: Command (UBLK_CTRL_CMD(...))
+ *   pCmd: Command data
  *
  * Returns:
- *   "TRUE" on success, "FALSE" on error
+ *   Result of command (Negated error code on error)
  */
-static int InitVirtImageInfoFile() {
-  char buf[200];
+static int UblkCtrlCmd(uint32_t CmdOp, struct ublksrv_ctrl_cmd *pCmd) {
+  struct io_uring_sqe *pSqe;
+  struct io_uring_cqe *pCqe;
+  uint32_t head;
   int ret;
 
-  // Add static header to file
-  XMOUNT_MALLOC(pVirtualImageInfoFile,char*,(strlen(IMAGE_INFO_HEADER)+1))
-  strncpy(pVirtualImageInfoFile,IMAGE_INFO_HEADER,strlen(IMAGE_INFO_HEADER)+1);
-
-  switch(XMountConfData.OrigImageType) {
-    case TOrigImageType_DD:
-      // Original image is a DD file. There isn't much info to extract. Perhaps
-      // just add image size
-      // TODO: Add infos to virtual image info file
-      break;
-
-#ifdef WITH_LIBEWF
-#define M_SAVE_VALUE(DESC,SHORT_DESC) { \
-  if(ret==1) {             \
-    XMOUNT_REALLOC(pVirtualImageInfoFile,char*, \
-      (strlen(pVirtualImageInfoFile)+strlen(buf)+strlen(DESC)+2)) \
-    strncpy((pVirtualImageInfoFile+strlen(pVirtualImageInfoFile)),DESC,strlen(DESC)+1); \
-    strncpy((pVirtualImageInfoFile+strlen(pVirtualImageInfoFile)),buf,strlen(buf)+1); \
-    strncpy((pVirtualImageInfoFile+strlen(pVirtualImageInfoFile)),"\n",2); \
-  } else if(ret==-1) { \
-    LOG_WARNING("Couldn't query EWF image header value '%s'\n",SHORT_DESC) \
-  } \
+  pSqe=UblkGetSqe(&UblkCtrlRing);
+  pSqe->opcode=IORING_OP_URING_CMD;
+  pSqe->fd=hUblkCtrl;
+  pSqe->cmd_op=CmdOp;
+  memcpy(pSqe->cmd,pCmd,sizeof(struct ublksrv_ctrl_cmd));
+  do {
+    if(!UblkSubmit(&UblkCtrlRing,TRUE)) return -EIO;
+    head=*(UblkCtrlRing.pCqHead);
+  } while(head==__atomic_load_n(UblkCtrlRing.pCqTail,__ATOMIC_ACQUIRE));
+  pCqe=&(UblkCtrlRing.pCqes[head & UblkCtrlRing.CqMask]);
+  ret=pCqe->res;
+  __atomic_store_n(UblkCtrlRing.pCqHead,head+1,__ATOMIC_RELEASE);
+  return ret;
 }
-    case TOrigImageType_EWF:
-      // Original image is an EWF file. Extract various infos from ewf file and
-      // add them to the virtual image info file content.
-#if defined( HAVE_LIBEWF_V2_API )
-      ret=libewf_handle_get_utf8_header_value_case_number(hEwfFile,buf,sizeof(buf),NULL);
-      M_SAVE_VALUE("Case number: ","Case number")
-      ret=libewf_handle_get_utf8_header_value_description(hEwfFile,buf,sizeof(buf),NULL);
-      M_SAVE_VALUE("Description: ","Description")
-      ret=libewf_handle_get_utf8_header_value_examiner_name(hEwfFile,buf,sizeof(buf),NULL);
-      M_SAVE_VALUE("Examiner: ","Examiner")
-      ret=libewf_handle_get_utf8_header_value_evidence_number(hEwfFile,buf,sizeof(buf),NULL);
-      M_SAVE_VALUE("Evidence number: ","Evidence number")
-      ret=libewf_handle_get_utf8_header_value_notes(hEwfFile,buf,sizeof(buf),NULL);
-      M_SAVE_VALUE("Notes: ","Notes")
-      ret=libewf_handle_get_utf8_header_value_acquiry_date(hEwfFile,buf,sizeof(buf),NULL);
-      M_SAVE_VALUE("Acquiry date: ","Acquiry date")
-      ret=libewf_handle_get_utf8_header_value_system_date(hEwfFile,buf,sizeof(buf),NULL);
-      M_SAVE_VALUE("System date: ","System date")
-      ret=libewf_handle_get_utf8_header_value_acquiry_operating_system(hEwfFile,buf,sizeof(buf),NULL);
-      M_SAVE_VALUE("Acquiry os: ","Acquiry os")
-      ret=libewf_handle_get_utf8_header_value_acquiry_software_version(hEwfFile,buf,sizeof(buf),NULL);
-      M_SAVE_VALUE("Acquiry sw version: ","Acquiry sw version")
-      ret=libewf_handle_get_utf8_hash_value_md5(hEwfFile,buf,sizeof(buf),NULL);
-      M_SAVE_VALUE("MD5 hash: ","MD5 hash")
-      ret=libewf_handle_get_utf8_hash_value_sha1(hEwfFile,buf,sizeof(buf),NULL);
-      M_SAVE_VALUE("SHA1 hash: ","SHA1 hash")
-#else
-      ret=libewf_get_header_value_case_number(hEwfFile,buf,sizeof(buf));
-      M_SAVE_VALUE("Case number: ","Case number")
-      ret=libewf_get_header_value_description(hEwfFile,buf,sizeof(buf));
-      M_SAVE_VALUE("Description: ","Description")
-      ret=libewf_get_header_value_examiner_name(hEwfFile,buf,sizeof(buf));
-      M_SAVE_VALUE("Examiner: ","Examiner")
-      ret=libewf_get_header_value_evidence_number(hEwfFile,buf,sizeof(buf));
-      M_SAVE_VALUE("Evidence number: ","Evidence number")
-      ret=libewf_get_header_value_notes(hEwfFile,buf,sizeof(buf));
-      M_SAVE_VALUE("Notes: ","Notes")
-      ret=libewf_get_header_value_acquiry_date(hEwfFile,buf,sizeof(buf));
-      M_SAVE_VALUE("Acquiry date: ","Acquiry date")
-      ret=libewf_get_header_value_system_date(hEwfFile,buf,sizeof(buf));
-      M_SAVE_VALUE("System date: ","System date")
-      ret=libewf_get_header_value_acquiry_operating_system(hEwfFile,buf,sizeof(buf));
-      M_SAVE_VALUE("Acquiry os: ","Acquiry os")
-      ret=libewf_get_header_value_acquiry_software_version(hEwfFile,buf,sizeof(buf));
-      M_SAVE_VALUE("Acquiry sw version: ","Acquiry sw version")
-      ret=libewf_get_hash_value_md5(hEwfFile,buf,sizeof(buf));
-      M_SAVE_VALUE("MD5 hash: ","MD5 hash")
-      ret=libewf_get_hash_value_sha1(hEwfFile,buf,sizeof(buf));
-      M_SAVE_VALUE("SHA1 hash: ","SHA1 hash")
-#endif
-      break;
-#undef M_SAVE_VALUE
-#endif
 
-#ifdef WITH_LIBAFF
-    case TOrigImageType_AFF:
-      // Original image is an AFF file.
-      // TODO: Extract some infos from AFF file to add to our info file
-      break;
-#endif
-    default:
-      LOG_ERROR("Unsupported input image type!\n")
-      return FALSE;
-  }
-  return TRUE;
+/*
+ * UblkQueueIoCmd:
+ *   Queue a fetch or commit command for a tag of a ublk queue
+ *
+ * Params:
+ *   pQueue: ublk queue
+ *   tag: Tag of request
+ *   CmdOp: UBLK_IO_CMD(FETCH_REQ) or UBLK_IO_CMD(COMMIT_AND_FETCH_REQ)
+ *   result: Result of handled request (Ignored for fetch commands)
+ *
+ * Returns:
+ *   n/a
+ */
+static void UblkQueueIoCmd(pTUblkQueue pQueue,
+                           uint16_t tag,
+                           uint32_t CmdOp,
+                           int32_t result)
+{
+  struct io_uring_sqe *pSqe;
+  struct ublksrv_io_cmd IoCmd;
+
+  pSqe=UblkGetSqe(&(pQueue->Ring));
+  pSqe->opcode=IORING_OP_URING_CMD;
+  pSqe->fd=hUblkChar;
+  pSqe->cmd_op=CmdOp;
+  pSqe->user_data=tag;
+  IoCmd.q_id=pQueue->Id;
+  IoCmd.tag=tag;
+  IoCmd.result=result;
+  IoCmd.addr=(uint64_t)(uintptr_t)(pQueue->ppBufs[tag]);
+  memcpy(pSqe->cmd,&IoCmd,sizeof(struct ublksrv_io_cmd));
 }
 
 /*
- * InitCacheFile:
- *   Create / load cache file to enable virtual write support
+ * UblkReadDdSegments:
+ *   Read data of a raw image directly from the DD input files using pread, so
+ *   queue threads don't have to wait for each other (See UblkDirectRead).
  *
  * Params:
- *   n/a
+ *   buf: Buffer to write read data to
+ *   offset: Offset inside input image
+ *   size: Number of bytes to read
  *
  * Returns:
  *   "TRUE" on success, "FALSE" on error
  */
-static int InitCacheFile() {
-  uint64_t ImageSize=0;
-  uint64_t BlockIndexSize=0;
-  uint64_t CacheFileHeaderSize=0;
-  uint64_t CacheFileSize=0;
-  uint32_t NeededBlocks=0;
-  uint64_t buf;
+static int UblkReadDdSegments(char *buf, uint64_t offset, size_t size) {
+  uint32_t seg=FindDdSegment(offset);
+  size_t CurSize;
+  ssize_t ret;
+  int hole;
 
-  if(!XMountConfData.OverwriteCache) {
-    // Try to open an existing cache file or create a new one
-    hCacheFile=(FILE*)FOPEN(XMountConfData.pCacheFile,"rb+");
-    if(hCacheFile==NULL) {
-      // As the c lib seems to have no possibility to open a file rw wether it
-      // exists or not (w+ does not work because it truncates an existing file),
-      // when r+ returns NULL the file could simply not exist
-      LOG_DEBUG("Cache file does not exist. Creating new one\n")
-      hCacheFile=(FILE*)FOPEN(XMountConfData.pCacheFile,"wb+");
-      if(hCacheFile==NULL) {
-        // There is really a problem opening the file
-        LOG_ERROR("Couldn't open cache file \"%s\"!\n",
-                  XMountConfData.pCacheFile)
+  while(size!=0) {
+    if(seg>=DdSegmentCount) return FALSE;
+    if(offset>=pDdSegments[seg].Offset+pDdSegments[seg].Size) {
+      seg++;
+      continue;
+    }
+    CurSize=pDdSegments[seg].Offset+pDdSegments[seg].Size-offset;
+    if(CurSize>size) CurSize=size;
+    CurSize=GetDdHoleExtent(offset,CurSize,&hole);
+    if(hole) memset(buf,0,CurSize);
+    else {
+      ret=pread(fileno(pDdSegments[seg].hFile),
+                buf,
+                CurSize,
+                offset-pDdSegments[seg].Offset);
+      if(ret<=0) {
+        if(ret<0 && errno==EINTR) continue;
         return FALSE;
       }
+      CurSize=ret;
     }
-  } else {
-    // Overwrite existing cache file or create a new one
-    hCacheFile=(FILE*)FOPEN(XMountConfData.pCacheFile,"wb+");
-    if(hCacheFile==NULL) {
-      LOG_ERROR("Couldn't open cache file \"%s\"!\n",
-                XMountConfData.pCacheFile)
-      return FALSE;
-    }
+    buf+=CurSize;
+    offset+=CurSize;
+    size-=CurSize;
   }
+  return TRUE;
+}
 
-  // Get input image size
-  if(!GetOrigImageSize(&ImageSize)) {
-    LOG_ERROR("Couldn't get input image size!\n")
-    return FALSE;
+/*
+ * UblkHandleIo:
+ *   Handle a block device request using the same functions as FUSE
+ *
+ * Params:
+ *   pQueue: ublk queue
+ *   tag: Tag of request
+ *
+ * Returns:
+ *   Amount of handled bytes on success, negated error code on error
+ */
+static int32_t UblkHandleIo(pTUblkQueue pQueue, uint16_t tag) {
+  struct ublksrv_io_desc *pIoDesc=&(pQueue->pIoDescs[tag]);
+  uint64_t offset=pIoDesc->start_sector<<9;
+  uint32_t size=pIoDesc->nr_sectors<<9;
+  int ret;
+
+  switch(pIoDesc->op_flags & 0xFF) {
+    case UBLK_IO_OP_READ:
+      if(UblkDirectRead) {
+        if(!UblkReadDdSegments(pQueue->ppBufs[tag],offset,size)) return -EIO;
+        return size;
+      }
+      ret=pUblkExport->pOps->Read(pUblkExport,pQueue->ppBufs[tag],size,offset);
+      if(ret!=size) return -EIO;
+      return size;
+    case UBLK_IO_OP_WRITE:
+      if(!XMountConfData.Writable) return -EROFS;
+      ret=pUblkExport->pOps->Write(pUblkExport,
+                                   pQueue->ppBufs[tag],
+                                   size,
+                                   offset);
+      if(ret!=size) return -EIO;
+      if((pIoDesc->op_flags & UBLK_IO_F_FUA) && !FlushCacheFile()) {
+        return -EIO;
+      }
+      return size;
+    case UBLK_IO_OP_FLUSH:
+      if(!FlushCacheFile()) return -EIO;
+      return 0;
+    default:
+      return -EOPNOTSUPP;
   }
+}
 
-  // Calculate how many blocks are needed and how big the buffers must be
-  // for the actual cache file version
-  NeededBlocks=ImageSize/CACHE_BLOCK_SIZE;
-  if((ImageSize%CACHE_BLOCK_SIZE)!=0) NeededBlocks++;
-  BlockIndexSize=NeededBlocks*sizeof(TCacheFileBlockIndex);
-  CacheFileHeaderSize=sizeof(TCacheFileHeader)+BlockIndexSize;
-  LOG_DEBUG("Cache blocks: %u (%04X) entries, %zd (%08zX) bytes\n",
-            NeededBlocks,
-            NeededBlocks,
-            BlockIndexSize,
-            BlockIndexSize)
+/*
+ * UblkServeQueue:
+ *   Thread serving one ublk hardware queue through its own io_uring
+ *
+ * Params:
+ *   p: ublk queue
+ *
+ * Returns:
+ *   NULL
+ */
+static void *UblkServeQueue(void *p) {
+  pTUblkQueue pQueue=(pTUblkQueue)p;
+  struct io_uring_cqe *pCqe;
+  uint32_t head,tail;
+  uint32_t active=UBLK_QUEUE_DEPTH;
+  uint16_t tag;
+  int ret=TRUE;
+
+  // The driver hands out requests in reply to fetch commands
+  for(tag=0;tag<UBLK_QUEUE_DEPTH;tag++) {
+    UblkQueueIoCmd(pQueue,tag,UBLK_IO_CMD(FETCH_REQ),0);
+  }
+  ret=UblkSubmit(&(pQueue->Ring),FALSE);
+  pthread_mutex_lock(&mutex_ublk);
+  if(!ret) UblkQueueFailed=TRUE;
+  UblkQueuesReady++;
+  pthread_cond_signal(&cond_ublk);
+  pthread_mutex_unlock(&mutex_ublk);
+
+  while(ret && active!=0) {
+    if(!UblkSubmit(&(pQueue->Ring),TRUE)) break;
+    head=*(pQueue->Ring.pCqHead);
+    tail=__atomic_load_n(pQueue->Ring.pCqTail,__ATOMIC_ACQUIRE);
+    for(;head!=tail;head++) {
+      pCqe=&(pQueue->Ring.pCqes[head & pQueue->Ring.CqMask]);
+      tag=pCqe->user_data;
+      if(pCqe->res!=UBLK_IO_RES_OK) {
+        // Device is being stopped (UBLK_IO_RES_ABORT) or command failed
+        active--;
+        continue;
+      }
+      UblkQueueIoCmd(pQueue,
+                     tag,
+                     UBLK_IO_CMD(COMMIT_AND_FETCH_REQ),
+                     UblkHandleIo(pQueue,tag));
+    }
+    __atomic_store_n(pQueue->Ring.pCqHead,head,__ATOMIC_RELEASE);
+  }
+  return NULL;
+}
 
-  // Get cache file size
-  // fseeko64 had massive problems!
-  if(fseeko(hCacheFile,0,SEEK_END)!=0) {
-    LOG_ERROR("Couldn't seek to end of cache file!\n")
+/*
+ * UblkStopServer:
+ *   Signal handler stopping the ublk device
+ *
+ * Params:
+ *   sig: Signal number
+ *
+ * Returns:
+ *   n/a
+ */
+static void UblkStopServer(int sig) {
+  UblkStop=TRUE;
+}
+
+/*
+ * UblkServe:
+ *   Expose the first virtual image as ublk block device (/dev/ublkbN) until
+ *   SIGINT or SIGTERM is received. Used instead of FuseServe when --ublk was
+ *   specified. Every hardware queue is served by its own thread.
+ *
+ * Params:
+ *   n/a
+ *
+ * Returns:
+ *   "TRUE" on success, "FALSE" on error
+ */
+static int UblkServe() {
+  struct ublksrv_ctrl_dev_info DevInfo;
+  struct ublk_params params;
+  struct ublksrv_ctrl_cmd cmd;
+  struct sigaction SigAction;
+  sigset_t SigSet,OldSigSet;
+  char DevPath[32];
+  uint64_t ImageSize;
+  size_t DescSize=0,DescMaxSize;
+  uint32_t QueueCount=XMountConfData.UblkQueues;
+  uint32_t StartedQueues=0;
+  uint32_t i,j;
+  int err;
+  int DevAdded=FALSE;
+  int ret=FALSE;
+  long PageSize=sysconf(_SC_PAGESIZE);
+
+  pUblkExport=GetVirtFile(VIRT_FILE_INO_IMAGES);
+  if(!GetVirtImageSize(pUblkExport->pImage,&ImageSize)) {
+    LOG_ERROR("Couldn't get virtual image size!\n")
+    return FALSE;
+  }
+  if((ImageSize%512)!=0) {
+    LOG_WARNING("Size of virtual image isn't a multiple of 512 bytes. The "
+                "last %" PRIu64 " bytes won't be accessible.\n",ImageSize%512)
+  }
+  // Reads of raw images go through mutex_image_rw and would serialize all
+  // queues. When nothing caches or changes their data (See SpliceDdSegments),
+  // read them from the DD input files directly instead.
+  UblkDirectRead=(SpliceDdSegments &&
+                  pUblkExport->pImage->Type==TVirtImageType_DD);
+  if(UblkDirectRead) LOG_DEBUG("Reading ublk requests from DD input files\n")
+
+  hUblkCtrl=open(UBLK_CONTROL_DEVICE,O_RDWR);
+  if(hUblkCtrl<0) {
+    LOG_ERROR("Couldn't open \"%s\": %s (Is the ublk_drv module loaded?)\n",
+              UBLK_CONTROL_DEVICE,strerror(errno))
     return FALSE;
   }
-  // Same here, ftello64 didn't work at all and returned 0 all the times
-  CacheFileSize=ftello(hCacheFile);
-  LOG_DEBUG("Cache file has %zd bytes\n",CacheFileSize)
+  pthread_mutex_init(&mutex_ublk,NULL);
+  pthread_cond_init(&cond_ublk,NULL);
+  if(!UblkSetupRing(&UblkCtrlRing,UBLK_CTRL_RING_DEPTH)) goto UblkServe_end;
+
+  // Add device
+  memset(&DevInfo,0,sizeof(struct ublksrv_ctrl_dev_info));
+  DevInfo.nr_hw_queues=QueueCount;
+  DevInfo.queue_depth=UBLK_QUEUE_DEPTH;
+  DevInfo.max_io_buf_bytes=UBLK_MAX_IO_SIZE;
+  DevInfo.dev_id=UBLK_DEV_ID_ANY;
+  DevInfo.ublksrv_pid=getpid();
+  memset(&cmd,0,sizeof(struct ublksrv_ctrl_cmd));
+  cmd.dev_id=UBLK_DEV_ID_ANY;
+  cmd.queue_id=(uint16_t)-1;
+  cmd.addr=(uint64_t)(uintptr_t)&DevInfo;
+  cmd.len=sizeof(struct ublksrv_ctrl_dev_info);
+  if((err=UblkCtrlCmd(UBLK_CTRL_CMD(ADD_DEV),&cmd))!=0) {
+    LOG_ERROR("Couldn't add ublk device: %s\n",strerror(-err))
+    goto UblkServe_end;
+  }
+  DevAdded=TRUE;
+  cmd.dev_id=DevInfo.dev_id;
+  LOG_DEBUG("Added ublk device %" PRIu32 " with %" PRIu16 " queues\n",
+            DevInfo.dev_id,DevInfo.nr_hw_queues)
+
+  // Set device parameters
+  memset(&params,0,sizeof(struct ublk_params));
+  params.len=sizeof(struct ublk_params);
+  params.types=UBLK_PARAM_TYPE_BASIC;
+  if(XMountConfData.Writable) params.basic.attrs=UBLK_ATTR_VOLATILE_CACHE |
+                                                 UBLK_ATTR_FUA;
+  else params.basic.attrs=UBLK_ATTR_READ_ONLY;
+  params.basic.logical_bs_shift=9;
+  params.basic.physical_bs_shift=12;
+  params.basic.io_opt_shift=12;
+  params.basic.io_min_shift=9;
+  params.basic.max_sectors=UBLK_MAX_IO_SIZE>>9;
+  params.basic.dev_sectors=ImageSize>>9;
+  cmd.addr=(uint64_t)(uintptr_t)&params;
+  cmd.len=sizeof(struct ublk_params);
+  if((err=UblkCtrlCmd(UBLK_CTRL_CMD(SET_PARAMS),&cmd))!=0) {
+    LOG_ERROR("Couldn't set ublk device parameters: %s\n",strerror(-err))
+    goto UblkServe_end;
+  }
+
+  // Open char device. It might take udev a moment to create it.
+  sprintf(DevPath,"/dev/ublkc%" PRIu32,DevInfo.dev_id);
+  for(i=0;i<UBLK_CHAR_DEVICE_TIMEOUT*10;i++) {
+    if((hUblkChar=open(DevPath,O_RDWR))>=0 || errno!=ENOENT) break;
+    usleep(100000);
+  }
+  if(hUblkChar<0) {
+    LOG_ERROR("Couldn't open \"%s\": %s\n",DevPath,strerror(errno))
+    goto UblkServe_end;
+  }
 
-  if(CacheFileSize>0) {
-    // Cache file isn't empty, parse block header
-    LOG_DEBUG("Cache file not empty. Parsing block header\n")
-    if(fseeko(hCacheFile,0,SEEK_SET)!=0) {
-      LOG_ERROR("Couldn't seek to beginning of cache file!\n")
-      return FALSE;
+  // Set up queues. Every queue has its own ring, request descriptors shared
+  // with the driver and one buffer per tag.
+  DescSize=UBLK_QUEUE_DEPTH*sizeof(struct ublksrv_io_desc);
+  DescSize=(DescSize+PageSize-1)/PageSize*PageSize;
+  DescMaxSize=UBLK_MAX_QUEUE_DEPTH*sizeof(struct ublksrv_io_desc);
+  DescMaxSize=(DescMaxSize+PageSize-1)/PageSize*PageSize;
+  XMOUNT_MALLOC(pUblkQueues,pTUblkQueue,QueueCount*sizeof(TUblkQueue))
+  memset(pUblkQueues,0,QueueCount*sizeof(TUblkQueue));
+  for(i=0;i<QueueCount;i++) {
+    pUblkQueues[i].Id=i;
+    pUblkQueues[i].Ring.Fd=-1;
+    pUblkQueues[i].pIoDescs=mmap(NULL,DescSize,PROT_READ,
+                                 MAP_SHARED | MAP_POPULATE,hUblkChar,
+                                 UBLKSRV_CMD_BUF_OFFSET+i*DescMaxSize);
+    if(pUblkQueues[i].pIoDescs==MAP_FAILED) {
+      pUblkQueues[i].pIoDescs=NULL;
+      LOG_ERROR("Couldn't map ublk request descriptors: %s\n",strerror(errno))
+      goto UblkServe_end;
     }
-    // Read and check file signature
-    if(fread(&buf,8,1,hCacheFile)!=1 || buf!=CACHE_FILE_SIGNATURE) {
-      free(pCacheFileHeader);
-      LOG_ERROR("Not an xmount cache file or cache file corrupt!\n")
-      return FALSE;
+    XMOUNT_MALLOC(pUblkQueues[i].ppBufs,char**,UBLK_QUEUE_DEPTH*sizeof(char*))
+    for(j=0;j<UBLK_QUEUE_DEPTH;j++) {
+      if(posix_memalign((void**)&(pUblkQueues[i].ppBufs[j]),
+                        PageSize,
+                        UBLK_MAX_IO_SIZE)!=0)
+      {
+        LOG_ERROR("Couldn't allocate memmory!\n")
+        exit(1);
+      }
     }
-    // Now get cache file version (Has only 32bit!)
-    if(fread(&buf,4,1,hCacheFile)!=1) {
-      free(pCacheFileHeader);
-      LOG_ERROR("Not an xmount cache file or cache file corrupt!\n")
-      return FALSE;
+    if(!UblkSetupRing(&(pUblkQueues[i].Ring),UBLK_QUEUE_DEPTH)) {
+      goto UblkServe_end;
     }
-    switch((uint32_t)buf) {
-      case 0x00000001:
-        // Old v1 cache file.
-        LOG_ERROR("Unsupported cache file version!\n")
-        LOG_ERROR("Please use xmount-tool to upgrade your cache file.\n")
-        return FALSE;
-      case CUR_CACHE_FILE_VERSION:
-        // Current version
-        if(fseeko(hCacheFile,0,SEEK_SET)!=0) {
-          LOG_ERROR("Couldn't seek to beginning of cache file!\n")
-          return FALSE;
-        }
-        // Alloc memory for header and block index
-        XMOUNT_MALLOC(pCacheFileHeader,pTCacheFileHeader,CacheFileHeaderSize)
-        memset(pCacheFileHeader,0,CacheFileHeaderSize);
-        // Read header and block index from file
-        if(fread(pCacheFileHeader,CacheFileHeaderSize,1,hCacheFile)!=1) {
-          // Cache file isn't big enough
-          free(pCacheFileHeader);
-          LOG_ERROR("Cache file corrupt!\n")
-          return FALSE;
-        }
-        break;
-      default:
-        LOG_ERROR("Unknown cache file version!\n")
-        return FALSE;
+  }
+
+  // Stop on SIGINT and SIGTERM. Only this thread handles them.
+  memset(&SigAction,0,sizeof(struct sigaction));
+  SigAction.sa_handler=UblkStopServer;
+  sigemptyset(&(SigAction.sa_mask));
+  sigaction(SIGINT,&SigAction,NULL);
+  sigaction(SIGTERM,&SigAction,NULL);
+  sigemptyset(&SigSet);
+  sigaddset(&SigSet,SIGINT);
+  sigaddset(&SigSet,SIGTERM);
+  pthread_sigmask(SIG_BLOCK,&SigSet,&OldSigSet);
+
+  // Start the same background threads as when mounting and one thread per
+  // queue
+  InitFuse(NULL,NULL);
+  for(i=0;i<QueueCount;i++) {
+    if(pthread_create(&(pUblkQueues[i].Thread),
+                      NULL,
+                      UblkServeQueue,
+                      &(pUblkQueues[i]))!=0)
+    {
+      LOG_ERROR("Couldn't start ublk queue thread!\n")
+      break;
     }
-    // Check if cache file has same block size as we do
-    if(pCacheFileHeader->BlockSize!=CACHE_BLOCK_SIZE) {
-      LOG_ERROR("Cache file does not use default cache block size!\n")
-      return FALSE;
+    StartedQueues++;
+  }
+  // All queues must have fetched their requests before the device can start
+  pthread_mutex_lock(&mutex_ublk);
+  while(UblkQueuesReady!=StartedQueues) {
+    pthread_cond_wait(&cond_ublk,&mutex_ublk);
+  }
+  pthread_mutex_unlock(&mutex_ublk);
+
+  if(StartedQueues==QueueCount && !UblkQueueFailed) {
+    memset(&cmd,0,sizeof(struct ublksrv_ctrl_cmd));
+    cmd.dev_id=DevInfo.dev_id;
+    cmd.queue_id=(uint16_t)-1;
+    cmd.data[0]=getpid();
+    if((err=UblkCtrlCmd(UBLK_CTRL_CMD(START_DEV),&cmd))!=0) {
+      LOG_ERROR("Couldn't start ublk device: %s\n",strerror(-err))
+    } else {
+      ret=TRUE;
+      printf("Virtual image \"%s\" is available as /dev/ublkb%" PRIu32 "\n",
+             pUblkExport->pName,DevInfo.dev_id);
+      fflush(stdout);
+      // Wait for SIGINT or SIGTERM
+      while(!UblkStop) sigsuspend(&OldSigSet);
     }
-    // Set pointer to block index
-    pCacheFileBlockIndex=(pTCacheFileBlockIndex)((void*)pCacheFileHeader+
-                          pCacheFileHeader->pBlockIndex);
-  } else {
-    // New cache file, generate a new block header
-    LOG_DEBUG("Cache file is empty. Generating new block header\n");
-    // Alloc memory for header and block index
-    XMOUNT_MALLOC(pCacheFileHeader,pTCacheFileHeader,CacheFileHeaderSize)
-    memset(pCacheFileHeader,0,CacheFileHeaderSize);
-    pCacheFileHeader->FileSignature=CACHE_FILE_SIGNATURE;
-    pCacheFileHeader->CacheFileVersion=CUR_CACHE_FILE_VERSION;
-    pCacheFileHeader->BlockSize=CACHE_BLOCK_SIZE;
-    pCacheFileHeader->BlockCount=NeededBlocks;
-    //pCacheFileHeader->UsedBlocks=0;
-    // The following pointer is only usuable when reading data from cache file
-    pCacheFileHeader->pBlockIndex=sizeof(TCacheFileHeader);
-    pCacheFileBlockIndex=(pTCacheFileBlockIndex)((void*)pCacheFileHeader+
-                         sizeof(TCacheFileHeader));
-    pCacheFileHeader->VdiFileHeaderCached=FALSE;
-    pCacheFileHeader->pVdiFileHeader=0;
-    pCacheFileHeader->VmdkFileCached=FALSE;
-    pCacheFileHeader->VmdkFileSize=0;
-    pCacheFileHeader->pVmdkFile=0;
-    pCacheFileHeader->VhdFileHeaderCached=FALSE;
-    pCacheFileHeader->pVhdFileHeader=0;
-    // Write header to file
-    if(fwrite(pCacheFileHeader,CacheFileHeaderSize,1,hCacheFile)!=1) {
-      free(pCacheFileHeader);
-      LOG_ERROR("Couldn't write cache file header to file!\n");
-      return FALSE;
+  }
+  pthread_sigmask(SIG_SETMASK,&OldSigSet,NULL);
+
+  // Stopping the device aborts all pending fetch commands which ends the
+  // queue threads
+  memset(&cmd,0,sizeof(struct ublksrv_ctrl_cmd));
+  cmd.dev_id=DevInfo.dev_id;
+  cmd.queue_id=(uint16_t)-1;
+  UblkCtrlCmd(UBLK_CTRL_CMD(STOP_DEV),&cmd);
+  for(i=0;i<StartedQueues;i++) pthread_join(pUblkQueues[i].Thread,NULL);
+  DestroyFuse(NULL);
+
+UblkServe_end:
+  if(pUblkQueues!=NULL) {
+    for(i=0;i<QueueCount;i++) {
+      UblkFreeRing(&(pUblkQueues[i].Ring));
+      if(pUblkQueues[i].pIoDescs!=NULL) {
+        munmap(pUblkQueues[i].pIoDescs,DescSize);
+      }
+      if(pUblkQueues[i].ppBufs!=NULL) {
+        for(j=0;j<UBLK_QUEUE_DEPTH;j++) free(pUblkQueues[i].ppBufs[j]);
+        free(pUblkQueues[i].ppBufs);
+      }
     }
+    free(pUblkQueues);
+    pUblkQueues=NULL;
   }
-  return TRUE;
+  if(hUblkChar>=0) close(hUblkChar);
+  if(DevAdded) {
+    memset(&cmd,0,sizeof(struct ublksrv_ctrl_cmd));
+    cmd.dev_id=DevInfo.dev_id;
+    cmd.queue_id=(uint16_t)-1;
+    UblkCtrlCmd(UBLK_CTRL_CMD(DEL_DEV),&cmd);
+  }
+  UblkFreeRing(&UblkCtrlRing);
+  pthread_cond_destroy(&cond_ublk);
+  pthread_mutex_destroy(&mutex_ublk);
+  close(hUblkCtrl);
+  return ret;
 }
+#endif
 
 /*
- * Struct containing implemented FUSE functions
+ * Struct containing implemented FUSE functions. As all inodes are fixed,
+ * there is nothing to do on forget and release.
  */
-static struct fuse_operations xmount_operations = {
+static struct fuse_lowlevel_ops xmount_operations = {
 //  .access=GetVirtFileAccess,
+  .lookup=LookupVirtFile,
   .getattr=GetVirtFileAttr,
+  .setattr=SetVirtFileAttr,
+  .init=InitFuse,
+  .destroy=DestroyFuse,
   .mkdir=CreateVirtDir,
   .mknod=CreateVirtFile,
   .open=OpenVirtFile,
   .readdir=GetVirtFiles,
+#ifdef HAVE_LIBFUSE3
+  .readdirplus=GetVirtFilesPlus,
+#endif
   .read=ReadVirtFile,
+#ifdef HAVE_LIBFUSE3
+  .lseek=SeekVirtFile,
+  .copy_file_range=CopyVirtFileRange,
+#endif
   .rename=RenameVirtFile,
   .rmdir=DeleteVirtDir,
 //  .statfs=GetVirtFsStats,
   .unlink=DeleteVirtFile,
   .write=WriteVirtFile
-//  .release=mountewf_release,
 };
 
+#ifdef HAVE_LIBFUSE3
+/*
+ * FuseServe:
+ *   Mount the virtual files and serve FUSE requests until unmounted. Does the
+ *   same as fuse_main but using the low-level API. The multi-threaded loop is
+ *   configured using the --threads, --idlethreads and --clonefd options.
+ *
+ * Params:
+ *   argc: Amount of FUSE options
+ *   argv: FUSE options including mountpoint
+ *
+ * Returns:
+ *   "0" on success, "1" on error
+ */
+static int FuseServe(int argc, char **argv) {
+  struct fuse_args FuseArgs=FUSE_ARGS_INIT(argc,argv);
+  struct fuse_cmdline_opts FuseOpts;
+  struct fuse_loop_config *pLoopConfig;
+  int ret=-1;
+
+  if(fuse_parse_cmdline(&FuseArgs,&FuseOpts)!=0) {
+    fuse_opt_free_args(&FuseArgs);
+    return 1;
+  }
+  if(FuseOpts.show_version) {
+    printf("FUSE library version %s\n",fuse_pkgversion());
+    fuse_lowlevel_version();
+    free(FuseOpts.mountpoint);
+    fuse_opt_free_args(&FuseArgs);
+    return 0;
+  }
+  if(FuseOpts.mountpoint==NULL) {
+    LOG_ERROR("No mountpoint specified!\n")
+    fuse_opt_free_args(&FuseArgs);
+    return 1;
+  }
+  if(XMountConfData.FuseThreads!=0) {
+    FuseOpts.max_threads=XMountConfData.FuseThreads;
+  }
+  if(XMountConfData.FuseIdleThreads!=0) {
+    FuseOpts.max_idle_threads=XMountConfData.FuseIdleThreads;
+  }
+  if(XMountConfData.FuseCloneFd) FuseOpts.clone_fd=1;
+
+  pFuseSession=fuse_session_new(&FuseArgs,
+                                &xmount_operations,
+                                sizeof(xmount_operations),
+                                NULL);
+  if(pFuseSession!=NULL) {
+    if(fuse_set_signal_handlers(pFuseSession)==0) {
+      if(fuse_session_mount(pFuseSession,FuseOpts.mountpoint)==0) {
+        if(fuse_daemonize(FuseOpts.foreground)==0) {
+          FuseSingleThreaded=(FuseOpts.singlethread ||
+                              FuseOpts.max_threads==1);
+          if(FuseOpts.singlethread) ret=fuse_session_loop(pFuseSession);
+          else {
+            pLoopConfig=fuse_loop_cfg_create();
+            fuse_loop_cfg_set_clone_fd(pLoopConfig,FuseOpts.clone_fd);
+            fuse_loop_cfg_set_idle_threads(pLoopConfig,
+                                           FuseOpts.max_idle_threads);
+            fuse_loop_cfg_set_max_threads(pLoopConfig,FuseOpts.max_threads);
+            ret=fuse_session_loop_mt(pFuseSession,pLoopConfig);
+            fuse_loop_cfg_destroy(pLoopConfig);
+          }
+          // The loops return the number of the signal that stopped them
+          if(ret==SIGINT || ret==SIGTERM || ret==SIGHUP) ret=0;
+        }
+        fuse_session_unmount(pFuseSession);
+      } else {
+        LOG_ERROR("Couldn't mount virtual files on \"%s\"!\n",
+                  FuseOpts.mountpoint)
+      }
+      fuse_remove_signal_handlers(pFuseSession);
+    }
+    fuse_session_destroy(pFuseSession);
+    pFuseSession=NULL;
+  }
+  free(FuseOpts.mountpoint);
+  fuse_opt_free_args(&FuseArgs);
+  return (ret==0) ? 0 : 1;
+}
+#else
+/*
+ * FuseServe:
+ *   Mount the virtual files and serve FUSE requests until unmounted. Does the
+ *   same as fuse_main but using the low-level API.
+ *
+ * Params:
+ *   argc: Amount of FUSE options
+ *   argv: FUSE options including mountpoint
+ *
+ * Returns:
+ *   "0" on success, "1" on error
+ */
+static int FuseServe(int argc, char **argv) {
+  struct fuse_args FuseArgs=FUSE_ARGS_INIT(argc,argv);
+  struct fuse_session *pFuseSession;
+  char *pMountpoint=NULL;
+  int MultiThreaded;
+  int Foreground;
+  int ret=-1;
+
+  if(fuse_parse_cmdline(&FuseArgs,&pMountpoint,&MultiThreaded,&Foreground)!=0)
+  {
+    fuse_opt_free_args(&FuseArgs);
+    return 1;
+  }
+  if(pMountpoint==NULL) {
+    // Only version or help infos were requested
+    fuse_opt_free_args(&FuseArgs);
+    return 0;
+  }
+
+  pFuseChan=fuse_mount(pMountpoint,&FuseArgs);
+  if(pFuseChan==NULL) {
+    LOG_ERROR("Couldn't mount virtual files on \"%s\"!\n",pMountpoint)
+    free(pMountpoint);
+    fuse_opt_free_args(&FuseArgs);
+    return 1;
+  }
+  pFuseSession=fuse_lowlevel_new(&FuseArgs,
+                                 &xmount_operations,
+                                 sizeof(xmount_operations),
+                                 NULL);
+  if(pFuseSession!=NULL) {
+    if(fuse_set_signal_handlers(pFuseSession)!=-1) {
+      fuse_session_add_chan(pFuseSession,pFuseChan);
+      if(fuse_daemonize(Foreground)!=-1) {
+        FuseSingleThreaded=!MultiThreaded;
+        if(MultiThreaded) ret=fuse_session_loop_mt(pFuseSession);
+        else ret=fuse_session_loop(pFuseSession);
+      }
+      fuse_remove_signal_handlers(pFuseSession);
+      fuse_session_remove_chan(pFuseChan);
+    }
+    fuse_session_destroy(pFuseSession);
+  }
+  fuse_unmount(pMountpoint,pFuseChan);
+  pFuseChan=NULL;
+  free(pMountpoint);
+  fuse_opt_free_args(&FuseArgs);
+  return (ret==0) ? 0 : 1;
+}
+#endif
+
 /*
  * Main
  */
@@ -2730,6 +11234,7 @@ int main(int argc, char *argv[])
   int nargc=0;
   char **ppNargv=NULL;
   char *pMountpoint=NULL;
+  pTVirtImage pImage;
   int ret=1;
   int i=0;
 
@@ -2738,22 +11243,34 @@ int main(int argc, char *argv[])
 
   // Init XMountConfData
   XMountConfData.OrigImageType=TOrigImageType_DD;
-#ifndef __APPLE__
-  XMountConfData.VirtImageType=TVirtImageType_DD;
-#else
-  XMountConfData.VirtImageType=TVirtImageType_DMG;
-#endif
+  XMountConfData.pVirtImages=NULL;
+  XMountConfData.VirtImageCount=0;
   XMountConfData.Debug=FALSE;
-  XMountConfData.pVirtualImagePath=NULL;
-  XMountConfData.pVirtualVmdkPath=NULL;
   XMountConfData.pVirtualImageInfoPath=NULL;
+  XMountConfData.pVirtualControlPath=NULL;
   XMountConfData.Writable=FALSE;
   XMountConfData.OverwriteCache=FALSE;
   XMountConfData.pCacheFile=NULL;
   XMountConfData.OrigImageSize=0;
-  XMountConfData.VirtImageSize=0;
   XMountConfData.InputHashLo=0;
   XMountConfData.InputHashHi=0;
+  XMountConfData.pReadCacheFile=NULL;
+  XMountConfData.ReadCacheSize=0;
+  XMountConfData.MemCacheSize=0;
+  XMountConfData.pStageFile=NULL;
+  XMountConfData.Sparse=FALSE;
+  XMountConfData.Partitions=FALSE;
+  XMountConfData.Alignment=DEFAULT_DATA_ALIGNMENT;
+  XMountConfData.DirectVmdk=FALSE;
+  XMountConfData.Vhdx4kn=FALSE;
+  XMountConfData.CacheFormat=TCacheFormat_XMOUNT;
+  XMountConfData.pNbdAddress=NULL;
+  XMountConfData.UblkQueues=0;
+  XMountConfData.FuseThreads=0;
+  XMountConfData.FuseIdleThreads=0;
+  XMountConfData.FuseCloneFd=FALSE;
+  XMountConfData.FuseMaxIo=0;
+  XMountConfData.FuseWriteback=FALSE;
 
   // Parse command line options
   if(!ParseCmdLine(argc,
@@ -2770,12 +11287,82 @@ int main(int argc, char *argv[])
   }
 
   // Check command line options
-  if(nargc<2 /*|| InputFilenameCount==0 || pMountpoint==NULL*/) {
+  if((nargc<2 &&
+      XMountConfData.pNbdAddress==NULL &&
+      XMountConfData.UblkQueues==0)
+     /*|| InputFilenameCount==0 || pMountpoint==NULL*/)
+  {
     LOG_ERROR("Couldn't parse command line options!\n")
     PrintUsage(argv[0]);
     return 1;
   }
 
+  if(XMountConfData.VirtImageCount==0) {
+    // Use default output image type
+#ifndef __APPLE__
+    AddVirtImage(TVirtImageType_DD);
+#else
+    AddVirtImage(TVirtImageType_DMG);
+#endif
+  }
+
+  if(XMountConfData.Sparse==TRUE) {
+    // The zero map is always used to report holes through SEEK_HOLE /
+    // SEEK_DATA, st_blocks and NBD block status. Emulated images only get
+    // unallocated blocks when their metadata can't change anymore.
+    if(XMountConfData.Writable==TRUE) {
+      LOG_WARNING("Emulated images aren't sparse together with virtual write "
+                  "access. Only reporting holes.\n")
+    } else SparseVirtImages=TRUE;
+  }
+
+  if(XMountConfData.CacheFormat==TCacheFormat_QCOW2) {
+    if(XMountConfData.Writable==FALSE) {
+      LOG_WARNING("No cache file specified. Ignoring --cacheformat.\n")
+      XMountConfData.CacheFormat=TCacheFormat_XMOUNT;
+    } else if(XMountConfData.pNbdAddress!=NULL ||
+              XMountConfData.UblkQueues!=0)
+    {
+      // The backing file would have to live inside a mountpoint
+      LOG_WARNING("QCOW2 cache files can't be used without a mountpoint. "
+                  "Ignoring --cacheformat.\n")
+      XMountConfData.CacheFormat=TCacheFormat_XMOUNT;
+    } else if(FindVirtImageByType(TVirtImageType_DD)==NULL &&
+              FindVirtImageByType(TVirtImageType_DMG)==NULL)
+    {
+      // QCOW2 cache files need the raw image as backing file
+#ifndef __APPLE__
+      AddVirtImage(TVirtImageType_DD);
+#else
+      AddVirtImage(TVirtImageType_DMG);
+#endif
+      LOG_DEBUG("Added raw output image as backing file of QCOW2 cache\n")
+    }
+  }
+
+  if(XMountConfData.DirectVmdk==TRUE) {
+    if(FindVirtImageByType(TVirtImageType_VMDK)==NULL &&
+       FindVirtImageByType(TVirtImageType_VMDKS)==NULL)
+    {
+      LOG_WARNING("Direct extents are only supported for VMDK images. "
+                  "Ignoring --direct.\n")
+      XMountConfData.DirectVmdk=FALSE;
+    } else if(XMountConfData.OrigImageType!=TOrigImageType_DD) {
+      LOG_WARNING("Direct extents are only supported for DD input images. "
+                  "Ignoring --direct.\n")
+      XMountConfData.DirectVmdk=FALSE;
+    } else if(XMountConfData.Writable==TRUE) {
+      LOG_WARNING("Direct extents aren't supported together with virtual "
+                  "write access. Ignoring --direct.\n")
+      XMountConfData.DirectVmdk=FALSE;
+    }
+  }
+
+  if(XMountConfData.FuseWriteback==TRUE && XMountConfData.Writable==FALSE) {
+    LOG_WARNING("No cache file specified. Ignoring --writeback.\n")
+    XMountConfData.FuseWriteback=FALSE;
+  }
+
   if(XMountConfData.Debug==TRUE) {
     LOG_DEBUG("Options passed to FUSE: ")
     for(i=0;i<nargc;i++) { printf("%s ",ppNargv[i]); }
@@ -2803,6 +11390,11 @@ int main(int argc, char *argv[])
   // Init mutexes
   pthread_mutex_init(&mutex_image_rw,NULL);
   pthread_mutex_init(&mutex_info_read,NULL);
+  pthread_mutex_init(&mutex_inval,NULL);
+  pthread_cond_init(&cond_inval,NULL);
+
+  // Init checksum tables
+  Crc32cInit();
 
   if(InputFilenameCount==1) {
     LOG_DEBUG("Loading image file \"%s\"...\n",
@@ -2819,12 +11411,9 @@ int main(int argc, char *argv[])
   // Open input image
   switch(XMountConfData.OrigImageType) {
     case TOrigImageType_DD:
-      // Input image is a DD file
-      hDdFile=(FILE*)FOPEN(ppInputFilenames[0],"rb");
-      if(hDdFile==NULL) {
-        LOG_ERROR("Couldn't open DD file \"%s\"\n",ppInputFilenames[0])
-        return 1;
-      }
+      // Input image is a DD file or a set of split DD files which are
+      // concatenated in the given order
+      if(!OpenDdSegments(ppInputFilenames,InputFilenameCount)) return 1;
       break;
 #ifdef WITH_LIBEWF
     case TOrigImageType_EWF:
@@ -2900,6 +11489,33 @@ int main(int argc, char *argv[])
     printf("\n");
   }
 
+  if(XMountConfData.pReadCacheFile!=NULL) {
+    // Init read cache file
+    if(!InitReadCacheFile()) {
+      LOG_ERROR("Couldn't initialize read cache file!\n")
+      return 1;
+    }
+    LOG_DEBUG("Read cache file initialized successfully\n")
+  }
+
+  if(XMountConfData.pStageFile!=NULL) {
+    // Init stage file
+    if(!InitStageFile()) {
+      LOG_ERROR("Couldn't initialize stage file!\n")
+      return 1;
+    }
+    LOG_DEBUG("Stage file initialized successfully\n")
+  }
+
+  if(XMountConfData.Sparse==TRUE) {
+    // Init zero map
+    if(!InitZeroMap()) {
+      LOG_ERROR("Couldn't initialize zero map!\n")
+      return 1;
+    }
+    LOG_DEBUG("Zero map initialized successfully\n")
+  }
+
   if(!ExtractVirtFileNames(ppInputFilenames[0])) {
     LOG_ERROR("Couldn't extract virtual file names!\n");
     return 1;
@@ -2914,37 +11530,77 @@ int main(int argc, char *argv[])
   LOG_DEBUG("Virtual image info file build successfully\n")
 
   // Do some virtual image type specific initialisations
-  switch(XMountConfData.VirtImageType) {
-    case TVirtImageType_DD:
-    case TVirtImageType_DMG:
-      break;
-    case TVirtImageType_VDI:
-      // When mounting as VDI, we need to construct a vdi header
-      if(!InitVirtVdiHeader()) {
-        LOG_ERROR("Couldn't initialize virtual VDI file header!\n")
-        return 1;
-      }
-      LOG_DEBUG("Virtual VDI file header build successfully\n")
-      break;
-    case TVirtImageType_VHD:
-      // When mounting as VHD, we need to construct a vhd footer
-      if(!InitVirtVhdHeader()) {
-        LOG_ERROR("Couldn't initialize virtual VHD file footer!\n")
-        return 1;
-      }
-      LOG_DEBUG("Virtual VHD file footer build successfully\n")
-      break;
-    case TVirtImageType_VMDK:
-    case TVirtImageType_VMDKS:
-      // When mounting as VMDK, we need to construct the VMDK descriptor file
-      if(!InitVirtualVmdkFile()) {
-        LOG_ERROR("Couldn't initialize virtual VMDK file!\n")
-        return 1;
-      }
-      break;
+  for(i=0;i<XMountConfData.VirtImageCount;i++) {
+    switch(XMountConfData.pVirtImages[i].Type) {
+      case TVirtImageType_DD:
+      case TVirtImageType_DMG:
+        break;
+      case TVirtImageType_VDI:
+        // When mounting as VDI, we need to construct a vdi header
+        if(!InitVirtVdiHeader()) {
+          LOG_ERROR("Couldn't initialize virtual VDI file header!\n")
+          return 1;
+        }
+        LOG_DEBUG("Virtual VDI file header build successfully\n")
+        break;
+      case TVirtImageType_VHD:
+        // When mounting as VHD, we need to construct a vhd footer
+        if(!InitVirtVhdHeader()) {
+          LOG_ERROR("Couldn't initialize virtual VHD file footer!\n")
+          return 1;
+        }
+        LOG_DEBUG("Virtual VHD file footer build successfully\n")
+        break;
+      case TVirtImageType_QCOW2:
+        // When mounting as QCOW2, we need to construct the QCOW2 header
+        if(!InitVirtQcow2Header()) {
+          LOG_ERROR("Couldn't initialize virtual QCOW2 file header!\n")
+          return 1;
+        }
+        LOG_DEBUG("Virtual QCOW2 file header build successfully\n")
+        break;
+      case TVirtImageType_VHDX:
+        // When mounting as VHDX, we need to construct the VHDX structures
+        if(!InitVirtVhdxHeader()) {
+          LOG_ERROR("Couldn't initialize virtual VHDX file header!\n")
+          return 1;
+        }
+        LOG_DEBUG("Virtual VHDX file header build successfully\n")
+        break;
+      case TVirtImageType_VMDK:
+      case TVirtImageType_VMDKS:
+        // When mounting as VMDK, we need to construct the VMDK header or a
+        // descriptor referencing the input image
+        if(XMountConfData.DirectVmdk==TRUE) {
+          if(!InitVirtVmdkDirectDescriptor(&(XMountConfData.pVirtImages[i]))) {
+            LOG_ERROR("Couldn't initialize virtual VMDK descriptor!\n")
+            return 1;
+          }
+          LOG_DEBUG("Virtual VMDK descriptor build successfully\n")
+          break;
+        }
+        if(!InitVirtVmdkHeader(&(XMountConfData.pVirtImages[i]))) {
+          LOG_ERROR("Couldn't initialize virtual VMDK file header!\n")
+          return 1;
+        }
+        LOG_DEBUG("Virtual VMDK file header build successfully\n")
+        break;
+    }
   }
 
   if(XMountConfData.Writable) {
+    if(XMountConfData.CacheFormat==TCacheFormat_QCOW2) {
+      // The raw virtual image inside the mountpoint serves as backing file
+      if((pImage=FindVirtImageByType(TVirtImageType_DD))==NULL) {
+        pImage=FindVirtImageByType(TVirtImageType_DMG);
+      }
+      pQcow2CacheBackingFile=realpath(pMountpoint,NULL);
+      if(pQcow2CacheBackingFile==NULL) {
+        LOG_ERROR("Couldn't resolve path of mountpoint \"%s\"!\n",pMountpoint)
+        return 1;
+      }
+      XMOUNT_STRAPP(pQcow2CacheBackingFile,pImage->pPath)
+    }
     // Init cache file and cache file block index
     if(!InitCacheFile()) {
       LOG_ERROR("Couldn't initialize cache file!\n")
@@ -2953,17 +11609,73 @@ int main(int argc, char *argv[])
     LOG_DEBUG("Cache file initialized successfully\n")
   }
 
-  // Call fuse_main to do the fuse magic
-  ret=fuse_main(nargc,ppNargv,&xmount_operations,NULL);
+  if(XMountConfData.MemCacheSize!=0) {
+    // Init memory cache
+    if(!InitMemCache()) {
+      LOG_ERROR("Couldn't initialize memory cache!\n")
+      return 1;
+    }
+    LOG_DEBUG("Memory cache initialized successfully\n")
+  }
+
+  if(XMountConfData.Partitions==TRUE) {
+    // Parse partition table. Done last so changes to it in the cache file are
+    // taken into account.
+    if(!InitPartitions()) {
+      LOG_ERROR("Couldn't initialize virtual partition files!\n")
+      return 1;
+    }
+    LOG_DEBUG("Found %u partitions\n",PartitionCount)
+  }
+
+  // Assign inode numbers to all virtual files
+  if(!InitVirtFiles()) {
+    LOG_ERROR("Couldn't initialize virtual files!\n")
+    return 1;
+  }
+
+  if(XMountConfData.OrigImageType==TOrigImageType_DD &&
+     XMountConfData.Writable==FALSE &&
+     XMountConfData.MemCacheSize==0 &&
+     hReadCacheFile==NULL &&
+     hStageFile==NULL &&
+     pZeroMap==NULL)
+  {
+    // Nothing between FUSE and the DD input files changes or caches data of
+    // raw images and partition files. Let FUSE read it directly from them.
+    SpliceDdSegments=TRUE;
+    LOG_DEBUG("Enabling splicing of raw input image data\n")
+  }
+
+  if(XMountConfData.pNbdAddress!=NULL) {
+    // Serve virtual images via NBD instead of mounting them
+    ret=NbdServe() ? 0 : 1;
+#ifdef WITH_UBLK
+  } else if(XMountConfData.UblkQueues!=0) {
+    // Expose first virtual image as block device instead of mounting it
+    ret=UblkServe() ? 0 : 1;
+#endif
+  } else {
+    // Do the fuse magic
+    ret=FuseServe(nargc,ppNargv);
+  }
 
   // Destroy mutexes
   pthread_mutex_destroy(&mutex_image_rw);
   pthread_mutex_destroy(&mutex_info_read);
+  pthread_cond_destroy(&cond_inval);
+  pthread_mutex_destroy(&mutex_inval);
 
   // Close input image
   switch(XMountConfData.OrigImageType) {
     case TOrigImageType_DD:
-      fclose(hDdFile);
+      for(i=0;i<DdSegmentCount;i++) {
+        fclose(pDdSegments[i].hFile);
+        free(pDdSegments[i].pPath);
+      }
+      free(pDdSegments);
+      free(pDdHoles);
+      free(pDdZeroBuf);
       break;
 #ifdef WITH_LIBEWF
     case TOrigImageType_EWF:
@@ -2985,38 +11697,114 @@ int main(int argc, char *argv[])
   }
 
   if(XMountConfData.Writable) {
-    // Write support was enabled, close cache file
+    // Write support was enabled, close cache file. All block checksums are
+    // up to date now.
+    SetCacheFileDirty(FALSE);
     fclose(hCacheFile);
     free(pCacheFileHeader);
+    free(pCacheFileBlockCrcs);
+    free(pCacheFileBlockVerified);
+    free(pCacheBlockBuf);
+    free(pCacheFileHeaderPages);
+    free(pQcow2CacheL1);
+    free(pQcow2CacheRefTable);
+    free(pQcow2CacheBackingFile);
+  }
+
+  if(MemCacheEntryCount!=0) {
+    // Memory cache was enabled, free entries
+    LOG_DEBUG("Memory cache hits: %" PRIu64 ", misses: %" PRIu64 "\n",
+              MemCacheHits,MemCacheMisses)
+    for(i=0;i<MemCacheEntryCount;i++) free(pMemCacheEntries[i].pData);
+    free(pMemCacheEntries);
+    free(pMemCacheHashHead);
+    free(pMemCacheCounters);
+  }
+
+  if(PartitionCount!=0) {
+    // Partition files were added, free them
+    for(i=0;i<PartitionCount;i++) {
+      LOG_DEBUG("Partition %u: %" PRIu64 " reads, %" PRIu64 " bytes\n",
+                pPartitions[i].Number,
+                pPartitions[i].ReadCount,
+                pPartitions[i].ReadBytes)
+      free(pPartitions[i].pPath);
+    }
+    free(pPartitions);
+  }
+
+  if(hStageFile!=NULL) {
+    // Staging was enabled, close stage files
+    fclose(hStageFile);
+    fclose(hStageMapFile);
+    free(pStageMapFileHeader);
+    free(pStageBitmap);
+    free(pStageBlockBuf);
+  }
+
+  if(pZeroMap!=NULL) {
+    // Sparse output was enabled, free zero map
+    free(pZeroMap);
+    free(pZeroScanBuf);
+  }
+
+  if(hReadCacheFile!=NULL) {
+    // Read cache was enabled, close read cache file
+    fclose(hReadCacheFile);
+    free(pReadCacheFileHeader);
+    free(pReadCacheFileSlots);
+    free(pReadCacheSlotRef);
+    free(pReadCacheHashHead);
+    free(pReadCacheHashNext);
+    free(pReadCacheBlockBuf);
   }
 
   // Free allocated memory
-  if(XMountConfData.VirtImageType==TVirtImageType_VDI) {
+  if(FindVirtImageByType(TVirtImageType_VDI)!=NULL) {
     // Free constructed VDI header
     free(pVdiFileHeader);
   }
-  if(XMountConfData.VirtImageType==TVirtImageType_VHD) {
+  if(FindVirtImageByType(TVirtImageType_VHD)!=NULL) {
     // Free constructed VHD header
     free(pVhdFileHeader);
+    free(pVhdDynHeader);
   }
-  if(XMountConfData.VirtImageType==TVirtImageType_VMDK ||
-     XMountConfData.VirtImageType==TVirtImageType_VMDKS)
-  {
-    // Free constructed VMDK file
-    free(pVirtualVmdkFile);
-    free(XMountConfData.pVirtualVmdkPath);
-    if(pVirtualVmdkLockFileName!=NULL) free(pVirtualVmdkLockFileName);
+  if(FindVirtImageByType(TVirtImageType_QCOW2)!=NULL) {
+    // Free constructed QCOW2 header
+    free(pQcow2Header);
+  }
+  if(FindVirtImageByType(TVirtImageType_VHDX)!=NULL) {
+    // Free constructed VHDX structures
+    free(pVhdxFileIdentifier);
+    free(pVhdxHeaders);
+    free(pVhdxRegionTable);
+    free(pVhdxMetadata);
+  }
+  if(pVmdkImage!=NULL) {
+    // Free constructed VMDK header
+    free(pVmdkHeader);
+    free(pVmdkDescriptor);
     if(pVirtualVmdkLockFileData!=NULL) free(pVirtualVmdkLockFileData);
-    if(pVirtualVmdkLockDir!=NULL) free(pVirtualVmdkLockDir);
-    if(pVirtualVmdkLockDir2!=NULL) free(pVirtualVmdkLockDir2);
+    for(i=VIRT_FILE_INO_VMDK_LOCK_DIR;i<=VIRT_FILE_INO_VMDK_LOCK_FILE;i++) {
+      if(pVirtFiles[i-1].pName!=NULL) free(pVirtFiles[i-1].pName);
+    }
   }
+  free(pVirtFiles);
   for(i=0;i<InputFilenameCount;i++) free(ppInputFilenames[i]);
   free(ppInputFilenames);
   for(i=0;i<nargc;i++) free(ppNargv[i]);
   free(ppNargv);
-  free(XMountConfData.pVirtualImagePath);
+  for(i=0;i<XMountConfData.VirtImageCount;i++) {
+    free(XMountConfData.pVirtImages[i].pPath);
+  }
+  free(XMountConfData.pVirtImages);
   free(XMountConfData.pVirtualImageInfoPath);
+  free(XMountConfData.pVirtualControlPath);
+  free(pVirtualControlFile);
   free(XMountConfData.pCacheFile);
+  if(XMountConfData.pReadCacheFile!=NULL) free(XMountConfData.pReadCacheFile);
+  if(XMountConfData.pStageFile!=NULL) free(XMountConfData.pStageFile);
+  if(XMountConfData.pNbdAddress!=NULL) free(XMountConfData.pNbdAddress);
 
   return ret;
 }
@@ -3197,4 +11985,142 @@ int main(int argc, char *argv[])
               GetVirtFileAttr. This makes Windows not think the emulated
               file would be a sparse file. Sparse vhd files are not attachable
               in Windows.
+  20261019: * Added --rcache and --rcachesize options and InitReadCacheFile
+              function. The read cache file keeps decoded input image blocks
+              on local storage across mounts and is bound to the input image
+              by its partial MD5 hash. Slots are evicted using the clock
+              algorithm.
+            * Split GetOrigImageData into ReadOrigImageData doing the actual
+              input image access and GetOrigImageData routing reads through
+              the read cache.
+            * Added --memcache option and InitMemCache function. Blocks that
+              are accessed repeatedly are promoted into RAM and demoted to the
+              read cache when evicted.
+            * Moved data area block reading from GetVirtImageData to new
+              GetDataAreaData function.
+            * Added --stage option, InitStageFile function and stage thread
+              copying the input image to a local stage file. Already staged
+              blocks are read from the stage file by GetOrigImageData and
+              demand reads are staged first. Staged blocks are synced in
+              batches without holding the image mutex before they are
+              marked in the stage map (SyncStagedBlocks).
+            * Added InitFuse and DestroyFuse functions to start and stop
+              background threads.
+            * Added CRC32C checksums for cache blocks. Checksums are kept up
+              to date by SetVirtImageData and every block is verified on its
+              first read. Corrupt blocks are reported in the info file and
+              reads fail with EIO. Cache files are upgraded to v3 so older
+              versions can't write them anymore. Cache files are marked dirty
+              while being written (SetCacheFileDirty) and checksums are
+              repaired after an unclean shutdown (RepairCacheFileCrcs).
+            * Added virtual control file accepting a "snapshot <file>" command
+              to save a copy of the cache file while the image stays mounted.
+              The copy is done using FICLONE if possible, copy_file_range or
+              read/write otherwise, skipping holes of the cache file.
+              Only root and the user running xmount may write commands, which
+              need absolute paths. Files are created with mode 0600. Writes
+              are only blocked for non-reflink copies if the cache file
+              changed during SNAPSHOT_COPY_ATTEMPTS unblocked copies
+              (CacheFileWriteCount, IsPrivilegedRequest).
+            * Added TruncateVirtFile function.
+            * The VDI block map is no longer kept in memory but generated on
+              the fly by GenerateVdiFileHeaderData. Changed VDI header data is
+              cached in pages using the new header page index of the cache
+              file (AddHeaderPage, FindHeaderPage). Cache files holding a whole
+              VDI header are still supported.
+            * Added --sparse option. Input image blocks are classified while
+              being read and by a background thread (ScanZeroBlocks). Blocks
+              containing only zeros are reported as unallocated in the block
+              map of a dynamic VDI image. The zero map is saved in the read
+              cache file if one is used.
+            * Added dynamic VHD emulation (--out vhd --sparse). The dynamic
+              disk header is built by InitVirtVhdDynHeader, the BAT and block
+              bitmaps are generated on the fly by GetVhdDynData.
+            * Moved data area reading loop of GetVirtImageData to new
+              ReadDataArea function.
+            * Added QCOW2 emulation (--out qcow2). The QCOW2 header is built by
+              InitVirtQcow2Header, L1, L2 and refcount tables are generated on
+              the fly by GenerateQcow2HeaderData.
+            * Moved header page handling of the VDI header functions to new
+              GetHeaderPages and SetHeaderPages functions usable for all
+              generated headers.
+            * Added VHDX emulation (--out vhdx). Headers, region table and
+              metadata are built by InitVirtVhdxHeader, BAT entries are
+              calculated on the fly by GenerateVhdxHeaderData. Added --4kn
+              option and GetRandomGuid.
+            * VMDK emulation now builds a single monolithicSparse file with an
+              embedded descriptor (InitVirtVmdkHeader) instead of a separate
+              descriptor file. Grain directory and grain tables are generated
+              on the fly by GenerateVmdkHeaderData.
+            * --out can be specified multiple times. All virtual images are
+              kept in XMountConfData.pVirtImages (AddVirtImage, FindVirtImage)
+              and share input image, caches and cache file.
+            * Moved data area writing loop of SetVirtImageData to new
+              WriteDataArea function.
+            * Added --partitions option. Partitions found in MBR (including
+              logical partitions) or GPT partition tables are exposed as
+              virtual files mapping directly to the data area (InitPartitions,
+              FindPartition).
+            * Added --align option. Data areas of emulated VDI, QCOW2 and
+              VMDK images now start at a multiple of 1 MB by default
+              (AlignDataOffset). The alignment is stored in the cache file,
+              VDI headers cached as a whole keep the unaligned layout
+              (CheckCacheFileLayout).
+            * DD input images can now consist of several split files
+              (OpenDdSegments, ReadDdSegments).
+            * Added --direct option. Emulated VMDK files then only consist of
+              a descriptor referencing the DD input files as flat extents
+              (InitVirtVmdkDirectDescriptor).
+            * Added --cacheformat option. QCOW2 cache files can be used by
+              QEMU directly as overlay of the virtual DD image
+              (InitQcow2CacheFile, AllocCacheFileSpace,
+              WriteCacheFileBlockIndex). xmount takes QEMU's image locks on
+              its first write to them (LockQcow2CacheFile).
+            * Added --nbd option. Virtual images and partition files can be
+              served via NBD instead of FUSE, including structured replies
+              and base:allocation block status (NbdServe and friends). A
+              bare TCP port only listens on the loopback interface, others
+              need "<host>:<port>".
+            * Added --ublk option. The first virtual image can be exposed as
+              Linux ublk block device served by one io_uring and thread per
+              hardware queue (UblkServe and friends). Renamed NbdFlush to
+              FlushCacheFile. Queues read raw DD images directly from the
+              input files without taking mutex_image_rw (UblkReadDdSegments).
+            * Raw DD input data of virtual DD/DMG images and partition files
+              is passed to FUSE as file descriptor buffers for splicing if
+              nothing caches or changes it (ReadVirtFileBuf, FindDdSegment).
+            * Switched to FUSE's low-level API (FuseServe). Every virtual
+              file has a fixed inode number and a set of data access functions
+              (InitVirtFiles, TVirtFileOps) which open stores in the file
+              handle, so requests no longer look up paths. Replaced
+              ReadVirtFileBuf with SpliceVirtFile and TruncateVirtFile with
+              SetVirtFileAttr, which ignores timestamps. Added
+              LookupVirtFile.
+            * Added libfuse 3 build (configure --without-fuse3 keeps libfuse
+              2). Added --threads, --idlethreads, --clonefd, --maxio and
+              --writeback options to tune FUSE's loop and requests, and
+              readdirplus support (GetVirtFilesPlus, ListVirtFiles).
+            * Virtual image and partition files keep their page cache across
+              opens and have long attribute timeouts (GetVirtFileTimeout).
+              Writes invalidate the written range in all other virtual files
+              (InvalidateVirtFiles). Info and control file use direct I/O.
+            * Invalidations are queued for a dedicated thread
+              (QueueInvalidation, InvalidateFiles) as sending them from a
+              FUSE thread deadlocks with -s or --threads 1.
+            * --sparse now works with any output format and with --cache.
+              Holes found by the zero map are reported through lseek
+              SEEK_DATA/SEEK_HOLE (SeekVirtFile, libfuse 3 only) and
+              st_blocks of all virtual files (GetVirtFileExtent, generalized
+              from NbdGetExtent). Emulated images only become sparse on
+              read-only mounts (SparseVirtImages).
+            * Added "export <file>" control command saving the virtual DD
+              image without passing it through FUSE (ExportVirtImage,
+              CopyFileRange) and libfuse 3 copy_file_range support for copies
+              inside the mount point (CopyVirtFileRange). Exports are created
+              with mode 0600 and flush writes cached by the kernel first
+              (FlushVirtFilePages, FuseSingleThreaded).
+            * Holes of sparse DD input files are mapped when opening them
+              (MapDdSegmentHoles) and read as zeros. They are reported as
+              holes of the virtual files (IsZeroBlock) and mark zero map
+              blocks as zero without scanning them (MarkDdHoleBlocks).
 */
@@ -18,8 +18,12 @@
 * this program. If not, see <http://www.gnu.org/licenses/>.                    *
 *******************************************************************************/
 
-#define FUSE_USE_VERSION 26
-#include <fuse.h>
+#ifdef HAVE_LIBFUSE3
+  #define FUSE_USE_VERSION 312
+#else
+  #define FUSE_USE_VERSION 26
+#endif
+#include <fuse_lowlevel.h>
 #include <sys/types.h>
 #include <inttypes.h>
 #include <stdarg.h>
@@ -36,6 +40,16 @@
   #define FOPEN fopen
 #endif
 
+#if defined(__linux__) && !defined(SEEK_DATA)
+  // glibc only defines these when compiling with _GNU_SOURCE
+  #define SEEK_DATA 3
+  #define SEEK_HOLE 4
+#endif
+#if defined(__linux__) && !defined(F_OFD_SETLK)
+  #define F_OFD_GETLK 36
+  #define F_OFD_SETLK 37
+#endif
+
 /*
  * Constants
  */
@@ -57,7 +71,11 @@ typedef enum TVirtImageType {
   /** Virtual image is a VMDK file (SCSI bus)*/
   TVirtImageType_VMDKS,
   /** Virtual image is a VHD file*/
-  TVirtImageType_VHD
+  TVirtImageType_VHD,
+  /** Virtual image is a QCOW2 file*/
+  TVirtImageType_QCOW2,
+  /** Virtual image is a VHDX file*/
+  TVirtImageType_VHDX
 } TVirtImageType;
 
 /*
@@ -72,22 +90,70 @@ typedef enum TOrigImageType {
   TOrigImageType_AFF
 } TOrigImageType;
 
+/*
+ * Supported cache file formats
+ */
+typedef enum TCacheFormat {
+  /** Cache file uses xmount's own format */
+  TCacheFormat_XMOUNT,
+  /** Cache file is a QCOW2 image backed by the virtual DD image */
+  TCacheFormat_QCOW2
+} TCacheFormat;
+
+/*
+ * Emulated virtual image
+ */
+typedef struct TVirtImage {
+  /** Virtual image type */
+  TVirtImageType Type;
+  /** Path of virtual image file */
+  char *pPath;
+  /** Size of virtual image */
+  uint64_t Size;
+} __attribute__ ((packed)) TVirtImage, *pTVirtImage;
+
+/*
+ * Segment of a (split) DD input image
+ */
+typedef struct TDdSegment {
+  /** Handle of segment file */
+  FILE *hFile;
+  /** Absolute path of segment file */
+  char *pPath;
+  /** Offset of segment inside input image */
+  uint64_t Offset;
+  /** Size of segment */
+  uint64_t Size;
+} __attribute__ ((packed)) TDdSegment, *pTDdSegment;
+
+/*
+ * Hole of sparse DD input files. Holes are mapped when opening the files and
+ * read as zeros without accessing them.
+ */
+#define DD_HOLE_ALLOC_COUNT 256 // Amount of hole entries to allocate at once
+typedef struct TDdHole {
+  /** Offset of hole inside input image */
+  uint64_t Offset;
+  /** Size of hole */
+  uint64_t Size;
+} __attribute__ ((packed)) TDdHole, *pTDdHole;
+
 /*
  * Various mountimg runtime options
  */
 typedef struct TXMountConfData {
   /** Input image type */
   TOrigImageType OrigImageType;
-  /** Virtual image type */
-  TVirtImageType VirtImageType;
+  /** Virtual images to emulate */
+  pTVirtImage pVirtImages;
+  /** Amount of virtual images to emulate */
+  uint32_t VirtImageCount;
   /** Enable debug output */
   uint32_t Debug;
-  /** Path of virtual image file */
-  char *pVirtualImagePath;
-  /** Path of virtual VMDK file */
-  char *pVirtualVmdkPath;
   /** Path of virtual image info file */
   char *pVirtualImageInfoPath;
+  /** Path of virtual control file */
+  char *pVirtualControlPath;
   /** Enable virtual write support */
   uint32_t Writable;
   /** Overwrite existing cache */
@@ -96,11 +162,43 @@ typedef struct TXMountConfData {
   char *pCacheFile;
   /** Size of input image */
   uint64_t OrigImageSize;
-  /** Size of virtual image */
-  uint64_t VirtImageSize;
   /** Partial MD5 hash of input image */
   uint64_t InputHashLo;
   uint64_t InputHashHi;
+  /** Read cache file to keep decoded input image data in */
+  char *pReadCacheFile;
+  /** Size of read cache in megabytes */
+  uint64_t ReadCacheSize;
+  /** Size of memory cache in megabytes (0 = disabled) */
+  uint64_t MemCacheSize;
+  /** Local file to stage a copy of the decoded input image to */
+  char *pStageFile;
+  /** Report input image blocks containing only zeros as unallocated */
+  uint32_t Sparse;
+  /** Expose partitions of input image as virtual files */
+  uint32_t Partitions;
+  /** Alignment of data area inside emulated images in bytes */
+  uint64_t Alignment;
+  /** Let VMDK descriptor reference the DD input files directly */
+  uint32_t DirectVmdk;
+  /** Use 4096 byte logical sectors in emulated VHDX images */
+  uint32_t Vhdx4kn;
+  /** Format of cache file */
+  TCacheFormat CacheFormat;
+  /** Serve virtual images via NBD on this unix socket or TCP port */
+  char *pNbdAddress;
+  /** Amount of ublk hardware queues (0 = no ublk device) */
+  uint32_t UblkQueues;
+  /** Max. amount of FUSE worker threads (0 = FUSE's default) */
+  uint32_t FuseThreads;
+  /** Max. amount of idle FUSE worker threads (0 = FUSE's default) */
+  uint32_t FuseIdleThreads;
+  /** Let every FUSE worker thread use its own /dev/fuse file descriptor */
+  uint32_t FuseCloneFd;
+  /** Max. size of FUSE read and write requests in bytes (0 = default) */
+  uint32_t FuseMaxIo;
+  /** Let the kernel cache writes to virtual files */
+  uint32_t FuseWriteback;
 } __attribute__ ((packed)) TXMountConfData;
 
 /*
@@ -111,9 +209,11 @@ typedef struct TXMountConfData {
                            PACKAGE_VERSION
 #define VDI_IMAGE_SIGNATURE 0xBEDA107F // 1:1 copy from hp
 #define VDI_IMAGE_VERSION 0x00010001 // Vers 1.1
+#define VDI_IMAGE_TYPE_NORMAL 0x00000001 // Type 1 (dynamically expanding)
 #define VDI_IMAGE_TYPE_FIXED 0x00000002 // Type 2 (fixed size)
 #define VDI_IMAGE_FLAGS 0
 #define VDI_IMAGE_BLOCK_SIZE (1024*1024) // 1 Megabyte
+#define VDI_IMAGE_BLOCK_ZERO 0xFFFFFFFE // Unallocated block reading as zeros
 typedef struct TVdiFileHeader {
 // ----- VDIPREHEADER ------
   /** Just text info about image type, for eyes only. */
@@ -221,6 +321,7 @@ typedef struct TVdiFileHeader {
 // and Macintosh. I'm going to choose the most common one.
 #define VHD_IMAGE_HVAL_CREATOR_HOST_OS 0x6B326957 // "Win2k"
 #define VHD_IMAGE_HVAL_DISK_TYPE 0x02000000
+#define VHD_IMAGE_HVAL_DISK_TYPE_DYNAMIC 0x03000000
 // Seconds from January 1st, 1970 to January 1st, 2000
 #define VHD_IMAGE_TIME_CONVERSION_OFFSET 0x386D97E0
 typedef struct TVhdFileHeader {
@@ -245,6 +346,390 @@ typedef struct TVhdFileHeader {
   char Reserved[427];
 } __attribute__ ((packed)) TVhdFileHeader, *pTVhdFileHeader;
 
+/*
+ * VHD Binary dynamic disk header structure
+ *
+ * Follows a copy of the footer at the beginning of dynamic VHD files. The
+ * block allocation table (BAT) follows this header. Every allocated block
+ * starts with a sector bitmap followed by the block's data.
+ *
+ * Warning: All values are big-endian!
+ */
+#ifdef __LP64__
+  #define VHD_DYN_HVAL_COOKIE 0x6573726170737863 // "cxsparse"
+#else
+  #define VHD_DYN_HVAL_COOKIE 0x6573726170737863LL
+#endif
+#define VHD_DYN_HVAL_HEADER_VERSION 0x00000100
+#define VHD_DYN_BLOCK_SIZE (2*1024*1024) // 2 Megabyte
+#define VHD_DYN_BITMAP_SIZE 512 // One bit per sector, padded to a sector
+#define VHD_DYN_BAT_UNUSED 0xFFFFFFFF
+typedef struct TVhdDynHeader {
+  uint64_t cookie;
+  uint64_t data_offset;
+  uint64_t table_offset;
+  uint32_t header_version;
+  uint32_t max_table_entries;
+  uint32_t block_size;
+  uint32_t checksum;
+  uint64_t parent_uuid_l;
+  uint64_t parent_uuid_h;
+  uint32_t parent_time_stamp;
+  uint32_t Reserved1;
+  char parent_unicode_name[512];
+  char parent_locators[192];
+  char Reserved2[256];
+} __attribute__ ((packed)) TVhdDynHeader, *pTVhdDynHeader;
+
+/*
+ * QCOW2 Binary File Header structure (Version 2)
+ *
+ * At the time of writing, the specs could be found here:
+ *   https://gitlab.com/qemu-project/qemu/-/blob/master/docs/interop/qcow2.txt
+ *
+ * Warning: All values are big-endian!
+ */
+#define QCOW2_MAGIC 0x514649FB // "QFI\xfb"
+#define QCOW2_VERSION 2
+#define QCOW2_CLUSTER_BITS 16
+#define QCOW2_CLUSTER_SIZE (1<<QCOW2_CLUSTER_BITS) // 64 kilobyte
+#define QCOW2_L2_ENTRIES (QCOW2_CLUSTER_SIZE/sizeof(uint64_t))
+#define QCOW2_REFCOUNT_ENTRIES (QCOW2_CLUSTER_SIZE/sizeof(uint16_t))
+#ifdef __LP64__
+  #define QCOW2_OFLAG_COPIED 0x8000000000000000
+#else
+  #define QCOW2_OFLAG_COPIED 0x8000000000000000LL
+#endif
+typedef struct TQcow2Header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t backing_file_offset;
+  uint32_t backing_file_size;
+  uint32_t cluster_bits;
+  uint64_t size;
+  uint32_t crypt_method;
+  uint32_t l1_size;
+  uint64_t l1_table_offset;
+  uint64_t refcount_table_offset;
+  uint32_t refcount_table_clusters;
+  uint32_t nb_snapshots;
+  uint64_t snapshots_offset;
+} __attribute__ ((packed)) TQcow2Header, *pTQcow2Header;
+
+/*
+ * VMDK hosted sparse extent header structure
+ *
+ * See VMware's "Virtual Disk Format 5.0" specs for details.
+ *
+ * Warning: All values are little-endian!
+ */
+#define VMDK_SPARSE_MAGIC 0x564D444B // "KDMV"
+#define VMDK_SPARSE_VERSION 1
+#define VMDK_SPARSE_FLAG_VALID_NEWLINE 0x00000001
+#define VMDK_SECTOR_SIZE 512
+#define VMDK_GRAIN_SIZE (64*1024) // 64 kilobyte
+#define VMDK_GRAIN_SECTORS (VMDK_GRAIN_SIZE/VMDK_SECTOR_SIZE)
+#define VMDK_GTES_PER_GT 512
+#define VMDK_GT_SIZE (VMDK_GTES_PER_GT*sizeof(uint32_t))
+#define VMDK_DESCRIPTOR_OFFSET 1 // In sectors
+#define VMDK_DESCRIPTOR_SECTORS 20
+#define VMDK_MAX_SECTORS 0xFFFFFFFF // Grain table entries are 32bit
+#define VMDK_2GB_MAX_EXTENT_SIZE 0x80000000ULL // twoGbMaxExtent* extents
+typedef struct TVmdkSparseHeader {
+  uint32_t magicNumber;
+  uint32_t version;
+  uint32_t flags;
+  uint64_t capacity;
+  uint64_t grainSize;
+  uint64_t descriptorOffset;
+  uint64_t descriptorSize;
+  uint32_t numGTEsPerGT;
+  uint64_t rgdOffset;
+  uint64_t gdOffset;
+  uint64_t overHead;
+  uint8_t uncleanShutdown;
+  char singleEndLineChar;
+  char nonEndLineChar;
+  char doubleEndLineChar1;
+  char doubleEndLineChar2;
+  uint16_t compressAlgorithm;
+  uint8_t pad[433];
+} __attribute__ ((packed)) TVmdkSparseHeader, *pTVmdkSparseHeader;
+
+/*
+ * MBR partition table entry structure
+ *
+ * Warning: All values are little-endian!
+ */
+#define MBR_SECTOR_SIZE 512
+#define MBR_PARTITION_TABLE_OFFSET 446
+#define MBR_SIGNATURE_OFFSET 510
+#define MBR_SIGNATURE 0xAA55
+#define MBR_TYPE_EMPTY 0x00
+#define MBR_TYPE_EXTENDED_CHS 0x05
+#define MBR_TYPE_EXTENDED_LBA 0x0F
+#define MBR_TYPE_EXTENDED_LINUX 0x85
+#define MBR_TYPE_GPT_PROTECTIVE 0xEE
+#define MBR_MAX_LOGICAL_PARTITIONS 128
+#define MBR_IS_EXTENDED(type) ((type)==MBR_TYPE_EXTENDED_CHS || \
+                               (type)==MBR_TYPE_EXTENDED_LBA || \
+                               (type)==MBR_TYPE_EXTENDED_LINUX)
+typedef struct TMbrPartitionEntry {
+  uint8_t status;
+  uint8_t chs_first[3];
+  uint8_t type;
+  uint8_t chs_last[3];
+  uint32_t lba_first;
+  uint32_t sectors;
+} __attribute__ ((packed)) TMbrPartitionEntry, *pTMbrPartitionEntry;
+
+/*
+ * GPT header and partition entry structures
+ *
+ * Warning: All values are little-endian!
+ */
+#ifdef __LP64__
+  #define GPT_HEADER_SIGNATURE 0x5452415020494645 // "EFI PART"
+#else
+  #define GPT_HEADER_SIGNATURE 0x5452415020494645LL
+#endif
+#define GPT_MAX_ENTRIES 1024
+typedef struct TGptHeader {
+  uint64_t signature;
+  uint32_t revision;
+  uint32_t header_size;
+  uint32_t header_crc32;
+  uint32_t reserved;
+  uint64_t my_lba;
+  uint64_t alternate_lba;
+  uint64_t first_usable_lba;
+  uint64_t last_usable_lba;
+  uint8_t disk_guid[16];
+  uint64_t partition_entry_lba;
+  uint32_t num_partition_entries;
+  uint32_t partition_entry_size;
+  uint32_t partition_entry_array_crc32;
+} __attribute__ ((packed)) TGptHeader, *pTGptHeader;
+
+typedef struct TGptPartitionEntry {
+  uint8_t type_guid[16];
+  uint8_t unique_guid[16];
+  uint64_t first_lba;
+  uint64_t last_lba;
+  uint64_t attributes;
+  uint16_t name[36];
+} __attribute__ ((packed)) TGptPartitionEntry, *pTGptPartitionEntry;
+
+/*
+ * Virtual partition file
+ */
+typedef struct TPartition {
+  /** Path of virtual partition file */
+  char *pPath;
+  /** Partition number */
+  uint32_t Number;
+  /** Offset of partition inside input image */
+  uint64_t Offset;
+  /** Size of partition */
+  uint64_t Size;
+  /** Amount of read requests */
+  uint64_t ReadCount;
+  /** Amount of bytes read */
+  uint64_t ReadBytes;
+} __attribute__ ((packed)) TPartition, *pTPartition;
+
+/*
+ * Fixed inode numbers of virtual files and directories. Virtual images and
+ * partition files follow starting at VIRT_FILE_INO_IMAGES.
+ */
+#define VIRT_FILE_INO_ROOT FUSE_ROOT_ID
+#define VIRT_FILE_INO_INFO 2
+#define VIRT_FILE_INO_CONTROL 3
+#define VIRT_FILE_INO_VMDK_LOCK_DIR 4
+#define VIRT_FILE_INO_VMDK_LOCK_DIR2 5
+#define VIRT_FILE_INO_VMDK_LOCK_FILE 6
+#define VIRT_FILE_INO_IMAGES 7
+// Seconds the kernel may cache attributes of virtual files whose size changes
+// (info, control and VmWare's lock file)
+#define VIRT_FILE_TIMEOUT 1.0
+// Seconds the kernel may cache names of virtual files and attributes of all
+// other virtual files and directories, which never change
+#define VIRT_FILE_STATIC_TIMEOUT 86400.0
+// Limits of --maxio in kB. FUSE requests can't exceed 256 pages.
+#define FUSE_MIN_MAX_IO 4
+#define FUSE_MAX_MAX_IO 1024
+
+/*
+ * Functions implementing access to the data of a virtual file
+ */
+struct TVirtFile;
+typedef struct TVirtFileOps {
+  /** Get file size. Returns TRUE on success */
+  int (*GetSize)(struct TVirtFile *pFile, uint64_t *pSize);
+  /** Read data. Returns read bytes or negated error code */
+  int (*Read)(struct TVirtFile *pFile, char *buf, size_t size, off_t offset);
+  /** Write data. Returns written bytes or negated error code. NULL if the
+      file is read-only. */
+  int (*Write)(struct TVirtFile *pFile,
+               const char *buf,
+               size_t size,
+               off_t offset);
+} TVirtFileOps, *pTVirtFileOps;
+
+/*
+ * Virtual file or directory. FUSE file handles point to these.
+ */
+typedef struct TVirtFile {
+  /** Inode number of parent directory ("0" for the mountpoint) */
+  fuse_ino_t Parent;
+  /** File name or NULL if the file doesn't exist */
+  char *pName;
+  /** File type and permissions */
+  mode_t Mode;
+  /** Data access functions (NULL for directories) */
+  const TVirtFileOps *pOps;
+  /** Virtual image accessed through this file */
+  pTVirtImage pImage;
+  /** Virtual partition accessed through this file */
+  pTPartition pPartition;
+} TVirtFile, *pTVirtFile;
+
+/*
+ * Page cache range to drop, queued for the invalidation thread
+ */
+#define INVAL_QUEUE_SIZE 256 // Max. amount of queued invalidations
+typedef struct TInvalRequest {
+  /** Inode number of virtual file */
+  fuse_ino_t Ino;
+  /** Offset of range to drop */
+  off_t Offset;
+  /** Size of range to drop */
+  off_t Size;
+} TInvalRequest, *pTInvalRequest;
+
+/*
+ * VHDX Binary File structures
+ *
+ * At the time of writing, the specs could be found here:
+ *   https://learn.microsoft.com/en-us/openspecs/windows_protocols/ms-vhdx/
+ *
+ * Warning: All values are little-endian!
+ */
+#ifdef __LP64__
+  #define VHDX_FILE_SIGNATURE 0x656C696678646876 // "vhdxfile"
+  #define VHDX_METADATA_SIGNATURE 0x617461646174656D // "metadata"
+#else
+  #define VHDX_FILE_SIGNATURE 0x656C696678646876LL
+  #define VHDX_METADATA_SIGNATURE 0x617461646174656DLL
+#endif
+#define VHDX_HEADER_SIGNATURE 0x64616568 // "head"
+#define VHDX_REGION_TABLE_SIGNATURE 0x69676572 // "regi"
+#define VHDX_HEADER_VERSION 1
+#define VHDX_ALIGNMENT (1024*1024) // 1 Megabyte
+#define VHDX_HEADER1_OFFSET (64*1024)
+#define VHDX_HEADER2_OFFSET (128*1024)
+#define VHDX_REGION_TABLE1_OFFSET (192*1024)
+#define VHDX_REGION_TABLE2_OFFSET (256*1024)
+#define VHDX_REGION_TABLE_SIZE (64*1024)
+#define VHDX_LOG_OFFSET (1*VHDX_ALIGNMENT)
+#define VHDX_LOG_SIZE (1*VHDX_ALIGNMENT)
+#define VHDX_METADATA_OFFSET (2*VHDX_ALIGNMENT)
+#define VHDX_METADATA_SIZE (1*VHDX_ALIGNMENT)
+#define VHDX_METADATA_ITEMS_OFFSET (64*1024)
+#define VHDX_BAT_OFFSET (3*VHDX_ALIGNMENT)
+#define VHDX_BLOCK_SIZE (1024*1024) // 1 Megabyte
+#define VHDX_LOGICAL_SECTOR_SIZE 512
+#define VHDX_4KN_SECTOR_SIZE 4096
+#define VHDX_PHYSICAL_SECTOR_SIZE 4096
+#ifdef __LP64__
+  #define VHDX_MAX_DISK_SIZE 0x400000000000 // 64 Terabyte
+#else
+  #define VHDX_MAX_DISK_SIZE 0x400000000000LL
+#endif
+#define VHDX_PAYLOAD_BLOCK_ZERO 2
+#define VHDX_PAYLOAD_BLOCK_FULLY_PRESENT 6
+#define VHDX_METADATA_IS_VIRTUAL_DISK 0x00000002
+#define VHDX_METADATA_IS_REQUIRED 0x00000004
+#define VHDX_REGION_REQUIRED 0x00000001
+// GUIDs in their on disk byte order
+#define VHDX_GUID_BAT_REGION { 0x66,0x77,0xC2,0x2D,0x23,0xF6,0x00,0x42, \
+                               0x9D,0x64,0x11,0x5E,0x9B,0xFD,0x4A,0x08 }
+#define VHDX_GUID_METADATA_REGION { 0x06,0xA2,0x7C,0x8B,0x90,0x47,0x9A,0x4B, \
+                                    0xB8,0xFE,0x57,0x5F,0x05,0x0F,0x88,0x6E }
+#define VHDX_GUID_FILE_PARAMETERS { 0x37,0x67,0xA1,0xCA,0x36,0xFA,0x43,0x4D, \
+                                    0xB3,0xB6,0x33,0xF0,0xAA,0x44,0xE7,0x6B }
+#define VHDX_GUID_VIRTUAL_DISK_SIZE { 0x24,0x42,0xA5,0x2F,0x1B,0xCD,0x76,0x48, \
+                                      0xB2,0x11,0x5D,0xBE,0xD8,0x3B,0xF4,0xB8 }
+#define VHDX_GUID_VIRTUAL_DISK_ID { 0xAB,0x12,0xCA,0xBE,0xE6,0xB2,0x23,0x45, \
+                                    0x93,0xEF,0xC3,0x09,0xE0,0x00,0xC7,0x46 }
+#define VHDX_GUID_LOGICAL_SECTOR_SIZE { 0x1D,0xBF,0x41,0x81,0x6F,0xA9,0x09, \
+                                        0x47,0xBA,0x47,0xF2,0x33,0xA8,0xFA, \
+                                        0xAB,0x5F }
+#define VHDX_GUID_PHYSICAL_SECTOR_SIZE { 0xC7,0x48,0xA3,0xCD,0x5D,0x44,0x71, \
+                                         0x44,0x9C,0xC9,0xE9,0x88,0x52,0x51, \
+                                         0xC5,0x56 }
+typedef struct TVhdxFileIdentifier {
+  uint64_t signature;
+  uint16_t creator[256];
+} __attribute__ ((packed)) TVhdxFileIdentifier, *pTVhdxFileIdentifier;
+
+typedef struct TVhdxHeader {
+  uint32_t signature;
+  uint32_t checksum;
+  uint64_t sequence_number;
+  uint8_t file_write_guid[16];
+  uint8_t data_write_guid[16];
+  uint8_t log_guid[16];
+  uint16_t log_version;
+  uint16_t version;
+  uint32_t log_length;
+  uint64_t log_offset;
+  char Reserved[4016];
+} __attribute__ ((packed)) TVhdxHeader, *pTVhdxHeader;
+
+typedef struct TVhdxRegionTableHeader {
+  uint32_t signature;
+  uint32_t checksum;
+  uint32_t entry_count;
+  uint32_t Reserved;
+} __attribute__ ((packed)) TVhdxRegionTableHeader, *pTVhdxRegionTableHeader;
+
+typedef struct TVhdxRegionTableEntry {
+  uint8_t guid[16];
+  uint64_t file_offset;
+  uint32_t length;
+  uint32_t required;
+} __attribute__ ((packed)) TVhdxRegionTableEntry, *pTVhdxRegionTableEntry;
+
+typedef struct TVhdxMetadataTableHeader {
+  uint64_t signature;
+  uint16_t Reserved;
+  uint16_t entry_count;
+  char Reserved2[20];
+} __attribute__ ((packed)) TVhdxMetadataTableHeader,
+                           *pTVhdxMetadataTableHeader;
+
+typedef struct TVhdxMetadataTableEntry {
+  uint8_t item_id[16];
+  uint32_t offset;
+  uint32_t length;
+  uint32_t flags;
+  uint32_t Reserved;
+} __attribute__ ((packed)) TVhdxMetadataTableEntry, *pTVhdxMetadataTableEntry;
+
+/*
+ * Metadata items as placed at VHDX_METADATA_ITEMS_OFFSET in the metadata
+ * region
+ */
+typedef struct TVhdxMetadataItems {
+  uint32_t block_size;
+  uint32_t file_parameter_flags;
+  uint64_t virtual_disk_size;
+  uint8_t virtual_disk_id[16];
+  uint32_t logical_sector_size;
+  uint32_t physical_sector_size;
+} __attribute__ ((packed)) TVhdxMetadataItems, *pTVhdxMetadataItems;
+
 /*
  * Cache file block index array element
  */
@@ -253,6 +738,22 @@ typedef struct TVhdFileHeader {
 #else
   #define CACHE_BLOCK_FREE 0xFFFFFFFFFFFFFFFFLL 
 #endif
+/*
+ * Cache file header page index structure
+ *
+ * Changed parts of generated virtual image headers (like the VDI block map)
+ * are cached in pages of HEADER_PAGE_SIZE bytes. The index is kept sorted by
+ * virtual image type and page number.
+ */
+typedef struct TCacheFileHeaderPage {
+  /** Virtual image type this page belongs to */
+  uint32_t VirtImageType;
+  /** Page number inside virtual image header */
+  uint64_t Page;
+  /** Offset to page data in cache file */
+  uint64_t off_data;
+} __attribute__ ((packed)) TCacheFileHeaderPage, *pTCacheFileHeaderPage;
+
 typedef struct TCacheFileBlockIndex {
   /** Set to 1 if block is assigned (This block has data in cache file) */
   uint32_t Assigned;
@@ -264,12 +765,20 @@ typedef struct TCacheFileBlockIndex {
  * Cache file header structures
  */
 #define CACHE_BLOCK_SIZE (1024*1024) // 1 megabyte
+#define DEFAULT_DATA_ALIGNMENT CACHE_BLOCK_SIZE
+#define MAX_DATA_ALIGNMENT (64*1024*1024) // 64 megabytes
 #ifdef __LP64__
   #define CACHE_FILE_SIGNATURE 0xFFFF746E756F6D78 // "xmount\xFF\xFF"
 #else
   #define CACHE_FILE_SIGNATURE 0xFFFF746E756F6D78LL 
 #endif
-#define CUR_CACHE_FILE_VERSION 0x00000002 // Current cache file version
+#define CUR_CACHE_FILE_VERSION 0x00000003 // Current cache file version
+#define HEADER_PAGE_SIZE 4096 // Granularity of cached virtual image headers
+#define CACHE_BLOCK_UNVERIFIED 0 // Checksum of block not checked yet
+#define CACHE_BLOCK_VERIFIED 1 // Checksum of block is valid
+#define CACHE_BLOCK_CORRUPT 2 // Checksum of block does not match
+#define SNAPSHOT_COPY_ATTEMPTS 3 // Unblocked copies tried before a snapshot
+                                 // blocks writes
 #define HASH_AMOUNT (1024*1024)*10 // Amount of data used to construct a
                                    // "unique" hash for every input image
                                    // (10MByte)
@@ -301,10 +810,59 @@ typedef struct TCacheFileHeader {
   /** Offset to cached VHD header */
   uint64_t pVhdFileHeader;
   
+  /** Set to 1 if CRC32C checksums of cache blocks are present */
+  uint32_t BlockCrcsPresent;
+  /** Offset to the first block checksum (One uint32_t per cache block) */
+  uint64_t pBlockCrcs;
+  /** Offset to header page index */
+  uint64_t pHeaderPageIndex;
+  /** Amount of header page index entries */
+  uint64_t HeaderPageCount;
+  /** Data area alignment of emulated images (0 if written by older
+      versions) */
+  uint64_t DataAlignment;
+  /** Set to 1 while cache blocks are being written. Still set when loading
+      the cache file if xmount wasn't stopped cleanly. */
+  uint32_t CacheFileDirty;
+
   /** Padding until offset 512 to ease further additions */
-  char HeaderPadding[432];
+  char HeaderPadding[392];
 } __attribute__ ((packed)) TCacheFileHeader, *pTCacheFileHeader;
 
+/*
+ * QCOW2 cache file
+ *
+ * Clusters have the size of cache blocks so every cache block is exactly one
+ * QCOW2 data cluster. The xmount cache file header is stored in a cluster
+ * referenced by a QCOW2 header extension and all L2 tables are allocated
+ * when the cache file is created.
+ *
+ * Warning: All QCOW2 values are big-endian!
+ */
+#define QCOW2_CACHE_CLUSTER_BITS 20
+#define QCOW2_CACHE_CLUSTER_SIZE (1<<QCOW2_CACHE_CLUSTER_BITS) // 1 megabyte
+#define QCOW2_CACHE_L2_ENTRIES (QCOW2_CACHE_CLUSTER_SIZE/sizeof(uint64_t))
+#define QCOW2_CACHE_REFCOUNT_ENTRIES \
+  (QCOW2_CACHE_CLUSTER_SIZE/sizeof(uint16_t))
+#define QCOW2_CACHE_REFTABLE_ENTRIES \
+  (QCOW2_CACHE_CLUSTER_SIZE/sizeof(uint64_t))
+#define QCOW2_EXT_END 0x00000000
+#define QCOW2_EXT_BACKING_FORMAT 0xE2792ACA
+#define QCOW2_EXT_XMOUNT 0x786D6E74 // "xmnt"
+#define QCOW2_LOCK_PERM_WRITE 101 // Locked by QEMU while it may write
+#define QCOW2_LOCK_SHARED_WRITE 201 // Locked by QEMU while others mustn't
+#ifdef __LP64__
+  #define QCOW2_OFLAG_COMPRESSED 0x4000000000000000
+  #define QCOW2_OFFSET_MASK 0x00FFFFFFFFFFFE00
+#else
+  #define QCOW2_OFLAG_COMPRESSED 0x4000000000000000LL
+  #define QCOW2_OFFSET_MASK 0x00FFFFFFFFFFFE00LL
+#endif
+typedef struct TQcow2HeaderExtension {
+  uint32_t type;
+  uint32_t length;
+} __attribute__ ((packed)) TQcow2HeaderExtension, *pTQcow2HeaderExtension;
+
 // Old v1 header
 typedef struct TCacheFileHeader_v1 {
   /** Simple signature to identify cache files */
@@ -322,6 +880,342 @@ typedef struct TCacheFileHeader_v1 {
   /** Set to 1 if VMDK file is cached */
 } TCacheFileHeader_v1, *pTCacheFileHeader_v1;
 
+/*
+ * Read cache file structures
+ *
+ * The read cache file holds copies of decoded input image blocks and is
+ * completely independent from the cache file used for virtual write support.
+ * It consists of a header, followed by the slot index and the slot data. Every
+ * slot can hold one input image block of BlockSize bytes.
+ */
+#ifdef __LP64__
+  #define READ_CACHE_FILE_SIGNATURE 0x65686361636D7278 // "xmrcache"
+  #define READ_CACHE_SLOT_FREE 0xFFFFFFFFFFFFFFFF
+#else
+  #define READ_CACHE_FILE_SIGNATURE 0x65686361636D7278LL
+  #define READ_CACHE_SLOT_FREE 0xFFFFFFFFFFFFFFFFLL
+#endif
+#define READ_CACHE_NO_SLOT 0xFFFFFFFF
+#define CUR_READ_CACHE_FILE_VERSION 0x00000001 // Current read cache version
+#define READ_CACHE_DEFAULT_SIZE 4096 // Default read cache size in megabytes
+
+/*
+ * Zero map block states (2 bits per input image block)
+ */
+#define ZERO_MAP_UNKNOWN 0
+#define ZERO_MAP_ZERO 1
+#define ZERO_MAP_DATA 2
+typedef struct TReadCacheFileHeader {
+  /** Simple signature to identify read cache files */
+  uint64_t FileSignature;
+  /** Read cache file version */
+  uint32_t ReadCacheFileVersion;
+  /** Size of one cached block */
+  uint64_t BlockSize;
+  /** Total amount of slots */
+  uint64_t SlotCount;
+  /** Partial MD5 hash of the input image this read cache belongs to */
+  uint64_t InputHashLo;
+  uint64_t InputHashHi;
+  /** Size of the input image this read cache belongs to */
+  uint64_t InputImageSize;
+  /** Offset to the first slot index array element */
+  uint64_t pSlotIndex;
+  /** Offset to the data of the first slot */
+  uint64_t pSlotData;
+  /** Offset to the zero map or 0 if not present */
+  uint64_t pZeroMap;
+  /** Padding until offset 512 to ease further additions */
+  char HeaderPadding[436];
+} __attribute__ ((packed)) TReadCacheFileHeader, *pTReadCacheFileHeader;
+
+typedef struct TReadCacheFileSlot {
+  /** Input image block held by this slot or READ_CACHE_SLOT_FREE */
+  uint64_t Block;
+} __attribute__ ((packed)) TReadCacheFileSlot, *pTReadCacheFileSlot;
+
+/*
+ * Memory cache structures
+ *
+ * The memory cache is the hot tier in front of the cache file and the input
+ * image (and its read cache). Blocks are only promoted into it after having
+ * been accessed MEM_CACHE_PROMOTE_HITS times, which is tracked by a small
+ * table of aging access counters.
+ */
+#define MEM_CACHE_NO_ENTRY 0xFFFFFFFF
+#define MEM_CACHE_PROMOTE_HITS 2 // Accesses needed to promote a block
+#define MEM_CACHE_MAX_HITS 3 // Max. access count kept per entry
+#define MEM_CACHE_COUNTER_MAX 15 // Max. value of an access counter
+typedef struct TMemCacheEntry {
+  /** Data area block held by this entry or READ_CACHE_SLOT_FREE */
+  uint64_t Block;
+  /** Access count, decremented each time the clock hand passes by */
+  uint32_t Hits;
+  /** Next entry in hash chain */
+  uint32_t Next;
+  /** Amount of valid data */
+  uint64_t DataSize;
+  /** Block data */
+  char *pData;
+} TMemCacheEntry, *pTMemCacheEntry;
+
+/*
+ * Stage map file structures
+ *
+ * When staging is enabled, a background thread copies the decoded input image
+ * to a local stage file which is a plain raw image. Which blocks have already
+ * been copied is tracked by a bitmap saved in a separate stage map file
+ * ("<stage file>.map"). It consists of a header followed by the bitmap, one
+ * bit per block of BlockSize bytes.
+ */
+#ifdef __LP64__
+  #define STAGE_MAP_FILE_SIGNATURE 0x70616D6774736D78 // "xmstgmap"
+#else
+  #define STAGE_MAP_FILE_SIGNATURE 0x70616D6774736D78LL
+#endif
+#define CUR_STAGE_MAP_FILE_VERSION 0x00000001 // Current stage map version
+#define STAGE_QUEUE_SIZE 64 // Max. amount of queued demand reads
+#define STAGE_SYNC_BLOCKS 64 // Max. amount of staged blocks per sync
+#define STAGE_SYNC_INTERVAL 1 // Max. seconds between syncs of stage file
+typedef struct TStageMapFileHeader {
+  /** Simple signature to identify stage map files */
+  uint64_t FileSignature;
+  /** Stage map file version */
+  uint32_t StageMapFileVersion;
+  /** Size of one staged block */
+  uint64_t BlockSize;
+  /** Partial MD5 hash of the input image that is staged */
+  uint64_t InputHashLo;
+  uint64_t InputHashHi;
+  /** Size of the input image that is staged */
+  uint64_t InputImageSize;
+  /** Offset to the bitmap */
+  uint64_t pBitmap;
+  /** Padding until offset 512 to ease further additions */
+  char HeaderPadding[460];
+} __attribute__ ((packed)) TStageMapFileHeader, *pTStageMapFileHeader;
+
+/*
+ * NBD protocol structures
+ *
+ * At the time of writing, the specs could be found here:
+ *   https://github.com/NetworkBlockDevice/nbd/blob/master/doc/proto.md
+ *
+ * Only the fixed newstyle handshake is implemented. Every virtual image and
+ * partition file is offered as export named like the file.
+ *
+ * Warning: All values are big-endian!
+ */
+#ifdef __LP64__
+  #define NBD_MAGIC 0x4E42444D41474943 // "NBDMAGIC"
+  #define NBD_OPTS_MAGIC 0x49484156454F5054 // "IHAVEOPT"
+  #define NBD_OPT_REPLY_MAGIC 0x0003E889045565A9
+#else
+  #define NBD_MAGIC 0x4E42444D41474943LL
+  #define NBD_OPTS_MAGIC 0x49484156454F5054LL
+  #define NBD_OPT_REPLY_MAGIC 0x0003E889045565A9LL
+#endif
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC 0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668E33EF
+// Handshake flags
+#define NBD_FLAG_FIXED_NEWSTYLE (1<<0)
+#define NBD_FLAG_NO_ZEROES (1<<1)
+#define NBD_FLAG_C_FIXED_NEWSTYLE NBD_FLAG_FIXED_NEWSTYLE
+#define NBD_FLAG_C_NO_ZEROES NBD_FLAG_NO_ZEROES
+// Transmission flags
+#define NBD_FLAG_HAS_FLAGS (1<<0)
+#define NBD_FLAG_READ_ONLY (1<<1)
+#define NBD_FLAG_SEND_FLUSH (1<<2)
+#define NBD_FLAG_SEND_FUA (1<<3)
+#define NBD_FLAG_CAN_MULTI_CONN (1<<8)
+// Options
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT 2
+#define NBD_OPT_LIST 3
+#define NBD_OPT_INFO 6
+#define NBD_OPT_GO 7
+#define NBD_OPT_STRUCTURED_REPLY 8
+#define NBD_OPT_LIST_META_CONTEXT 9
+#define NBD_OPT_SET_META_CONTEXT 10
+// Option replies
+#define NBD_REP_ACK 1
+#define NBD_REP_SERVER 2
+#define NBD_REP_INFO 3
+#define NBD_REP_META_CONTEXT 4
+#define NBD_REP_ERR_UNSUP 0x80000001
+#define NBD_REP_ERR_INVALID 0x80000003
+#define NBD_REP_ERR_UNKNOWN 0x80000006
+#define NBD_INFO_EXPORT 0
+#define NBD_INFO_BLOCK_SIZE 3
+// Commands
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+#define NBD_CMD_FLUSH 3
+#define NBD_CMD_BLOCK_STATUS 7
+#define NBD_CMD_FLAG_FUA (1<<0)
+#define NBD_CMD_FLAG_REQ_ONE (1<<3)
+// Structured reply chunks
+#define NBD_REPLY_FLAG_DONE (1<<0)
+#define NBD_REPLY_TYPE_NONE 0
+#define NBD_REPLY_TYPE_OFFSET_DATA 1
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR 32769
+// Error values
+#define NBD_EPERM 1
+#define NBD_EIO 5
+#define NBD_EINVAL 22
+#define NBD_ENOSPC 28
+// Block status
+#define NBD_META_CONTEXT_ALLOCATION "base:allocation"
+#define NBD_META_CONTEXT_ALLOCATION_ID 1
+#define NBD_STATE_HOLE (1<<0)
+#define NBD_STATE_ZERO (1<<1)
+// Limits
+#define NBD_MAX_OPTION_SIZE 4096 // Max. size of option data
+#define NBD_MAX_REQUEST_SIZE (32*1024*1024) // Max. size of read / write
+#define NBD_MAX_EXTENTS 1024 // Max. extents per block status reply
+#define NBD_MAX_CONNECTIONS 64 // Max. concurrent client connections
+typedef struct TNbdOptionHeader {
+  /** NBD_OPTS_MAGIC */
+  uint64_t Magic;
+  /** Option (NBD_OPT_*) */
+  uint32_t Option;
+  /** Length of option data */
+  uint32_t Length;
+} __attribute__ ((packed)) TNbdOptionHeader, *pTNbdOptionHeader;
+
+typedef struct TNbdOptionReply {
+  /** NBD_OPT_REPLY_MAGIC */
+  uint64_t Magic;
+  /** Option this is a reply to */
+  uint32_t Option;
+  /** Reply type (NBD_REP_*) */
+  uint32_t Type;
+  /** Length of reply data */
+  uint32_t Length;
+} __attribute__ ((packed)) TNbdOptionReply, *pTNbdOptionReply;
+
+typedef struct TNbdRequest {
+  /** NBD_REQUEST_MAGIC */
+  uint32_t Magic;
+  /** Command flags (NBD_CMD_FLAG_*) */
+  uint16_t Flags;
+  /** Command (NBD_CMD_*) */
+  uint16_t Type;
+  /** Handle to be sent back with the reply */
+  uint64_t Handle;
+  /** Offset inside export */
+  uint64_t Offset;
+  /** Length of request */
+  uint32_t Length;
+} __attribute__ ((packed)) TNbdRequest, *pTNbdRequest;
+
+typedef struct TNbdSimpleReply {
+  /** NBD_SIMPLE_REPLY_MAGIC */
+  uint32_t Magic;
+  /** Error value (NBD_E*) */
+  uint32_t Error;
+  /** Handle of request */
+  uint64_t Handle;
+} __attribute__ ((packed)) TNbdSimpleReply, *pTNbdSimpleReply;
+
+typedef struct TNbdStructuredReply {
+  /** NBD_STRUCTURED_REPLY_MAGIC */
+  uint32_t Magic;
+  /** Reply flags (NBD_REPLY_FLAG_*) */
+  uint16_t Flags;
+  /** Chunk type (NBD_REPLY_TYPE_*) */
+  uint16_t Type;
+  /** Handle of request */
+  uint64_t Handle;
+  /** Length of chunk data */
+  uint32_t Length;
+} __attribute__ ((packed)) TNbdStructuredReply, *pTNbdStructuredReply;
+
+/*
+ * State of a NBD client connection
+ */
+typedef struct TNbdConnection {
+  /** Client socket */
+  int Socket;
+  /** Client requested NBD_FLAG_C_NO_ZEROES */
+  uint32_t NoZeroes;
+  /** Structured replies were negotiated */
+  uint32_t StructuredReplies;
+  /** The base:allocation meta context was selected */
+  uint32_t BlockStatus;
+  /** Exported virtual file */
+  pTVirtFile pExport;
+  /** Size of exported virtual file */
+  uint64_t ExportSize;
+} TNbdConnection, *pTNbdConnection;
+
+/*
+ * ublk structures
+ *
+ * A ublk device is set up through commands sent to the control device. Every
+ * hardware queue then fetches block requests using its own io_uring on the
+ * device's char device (/dev/ublkcN) and commits their results the same way.
+ * Requests are described by an array of ublksrv_io_desc structures shared with
+ * the driver. Commands are io_uring passthrough commands which need 128 byte
+ * SQEs.
+ */
+#define UBLK_MAX_QUEUES 32 // Max. amount of hardware queues
+#ifdef WITH_UBLK
+  #define UBLK_CONTROL_DEVICE "/dev/ublk-control"
+  #define UBLK_DEV_ID_ANY ((uint32_t)-1) // Let driver choose device number
+  #define UBLK_QUEUE_DEPTH 64 // Requests in flight per queue
+  #define UBLK_MAX_IO_SIZE (512*1024) // Max. size of one request
+  #define UBLK_CTRL_RING_DEPTH 4
+  #define UBLK_CHAR_DEVICE_TIMEOUT 5 // Seconds to wait for char device
+  #define UBLK_SQE_SIZE 128
+  // Prefer ioctl encoded commands as legacy ones might be disabled
+  #ifdef UBLK_U_CMD_ADD_DEV
+    #define UBLK_CTRL_CMD(cmd) UBLK_U_CMD_##cmd
+    #define UBLK_IO_CMD(cmd) UBLK_U_IO_##cmd
+  #else
+    #define UBLK_CTRL_CMD(cmd) UBLK_CMD_##cmd
+    #define UBLK_IO_CMD(cmd) UBLK_IO_##cmd
+  #endif
+typedef struct TUblkRing {
+  /** io_uring file descriptor */
+  int Fd;
+  /** Mapped rings and SQEs */
+  char *pSqRing;
+  size_t SqRingSize;
+  char *pCqRing;
+  size_t CqRingSize;
+  char *pSqes;
+  size_t SqesSize;
+  /** Submission ring */
+  uint32_t *pSqTail;
+  uint32_t SqMask;
+  uint32_t *pSqArray;
+  /** Completion ring */
+  uint32_t *pCqHead;
+  uint32_t *pCqTail;
+  uint32_t CqMask;
+  struct io_uring_cqe *pCqes;
+  /** Amount of SQEs not yet submitted */
+  uint32_t Pending;
+} TUblkRing, *pTUblkRing;
+
+typedef struct TUblkQueue {
+  /** Queue number */
+  uint16_t Id;
+  /** Thread serving this queue */
+  pthread_t Thread;
+  /** io_uring of this queue */
+  TUblkRing Ring;
+  /** Request descriptors shared with the driver */
+  struct ublksrv_io_desc *pIoDescs;
+  /** Data buffer of every tag */
+  char **ppBufs;
+} TUblkQueue, *pTUblkQueue;
+#endif
+
 /*
  * Macros to ease debugging and error reporting
  */
@@ -518,4 +1412,53 @@ typedef struct TCacheFileHeader_v1 {
   20120130: * Added LOG_WARNING macro.
   20120507: * Added TVhdFileHeader structure.
   20120511: * Added endianess conversation macros
+  20261019: * Added TReadCacheFileHeader and TReadCacheFileSlot structures and
+              read cache options to TXMountConfData.
+            * Added TMemCacheEntry structure and MemCacheSize option.
+            * Added TStageMapFileHeader structure and pStageFile option.
+            * Added BlockCrcsPresent and pBlockCrcs to TCacheFileHeader.
+            * Added pVirtualControlPath to TXMountConfData.
+            * Added TCacheFileHeaderPage structure and pHeaderPageIndex and
+              HeaderPageCount to TCacheFileHeader.
+            * Added Sparse option, VDI_IMAGE_TYPE_NORMAL, VDI_IMAGE_BLOCK_ZERO,
+              ZERO_MAP_* states and pZeroMap to TReadCacheFileHeader.
+            * Added TVhdDynHeader structure and dynamic VHD defines.
+            * Added TVirtImageType_QCOW2 and TQcow2Header structure.
+            * Added TVirtImageType_VHDX and VHDX structures.
+            * Added TVmdkSparseHeader structure and removed pVirtualVmdkPath
+              from TXMountConfData.
+            * Added TVirtImage structure. TXMountConfData now holds an array
+              of virtual images instead of VirtImageType, pVirtualImagePath
+              and VirtImageSize.
+            * Added MBR and GPT structures, TPartition structure and
+              Partitions option.
+            * Added Alignment option and DEFAULT_DATA_ALIGNMENT.
+            * Added TDdSegment structure and DirectVmdk option.
+            * Added TCacheFormat, CacheFormat option and QCOW2 cache file
+              defines.
+            * Added NBD protocol structures, TNbdConnection structure and
+              pNbdAddress option.
+            * Added ublk defines, TUblkRing and TUblkQueue structures and
+              UblkQueues option.
+            * Switched to FUSE's low-level API. Added VIRT_FILE_INO_* inode
+              numbers and TVirtFile and TVirtFileOps structures.
+            * Replaced pExportPath of TNbdConnection with pExport.
+            * Use FUSE API version 3.12 when building against libfuse 3. Added
+              FuseThreads, FuseIdleThreads, FuseCloneFd, FuseMaxIo and
+              FuseWriteback options.
+            * Added VIRT_FILE_STATIC_TIMEOUT.
+            * Define SEEK_DATA and SEEK_HOLE on Linux if missing.
+            * Added TDdHole structure and DD_HOLE_ALLOC_COUNT.
+            * Added SNAPSHOT_COPY_ATTEMPTS.
+            * Added DataAlignment to TCacheFileHeader.
+            * Added Vhdx4kn option and VHDX_LOGICAL_SECTOR_SIZE and
+              VHDX_4KN_SECTOR_SIZE.
+            * Added TInvalRequest structure and INVAL_QUEUE_SIZE.
+            * Added QCOW2_LOCK_* defines. Define F_OFD_GETLK and F_OFD_SETLK
+              on Linux if missing.
+            * Added VMDK_2GB_MAX_EXTENT_SIZE.
+            * Added STAGE_SYNC_BLOCKS and STAGE_SYNC_INTERVAL.
+            * Bumped CUR_CACHE_FILE_VERSION to 3 as cache files with block
+              checksums must not be written by older versions.
+            * Added CacheFileDirty to TCacheFileHeader.
 */